@@ -55,4 +55,118 @@ typedef struct arp_pkt {
 	ip4_addr	 tpa;
 } __attribute__((__packed__)) arp_pkt;
 
+/*
+ * A table of what we know about the addresses on a segment.  One thread
+ * at a time may change it, while any number look addresses up through
+ * arpt_lookup() without locking.  Storage the table no longer uses is
+ * only freed by arpt_reclaim() once no reader can still see it.  An
+ * entry returned by arpt_insert() is only valid until the next call
+ * which changes the table.
+ *
+ * An entry goes stale if it has not been seen for a while, which clears
+ * its request count, and expires if it has not been seen for longer.
+ * Both deadlines are kept in a timing wheel which arpt_expire() runs.
+ */
+typedef struct arpt arpt;
+
+/* magic value for "never seen" */
+#define ARPT_NEVER	UINT64_MAX
+
+/*
+ * The part of an entry readers see is packed into one word: the
+ * Ethernet address in the low 48 bits, flags above.  A word of zero
+ * marks an unused slot.
+ */
+#define ARPE_ETHER	0x0000ffffffffffffULL
+#define ARPE_CLAIMED	(1ULL << 48)	/* claimed by us */
+#define ARPE_RESERVED	(1ULL << 49)	/* reserved address */
+#define ARPE_LIVE	(1ULL << 62)	/* in use */
+#define ARPE_DEAD	(1ULL << 63)	/* expired */
+
+typedef struct arpe {
+	uint32_t	 addr;		/* address, host byte order */
+	unsigned int	 nreq;		/* requests seen */
+	uint64_t	 first;		/* first seen (ms) */
+	uint64_t	 last;		/* last seen (ms) */
+	uint64_t	 due;		/* next deadline (ms) */
+	uint64_t	 state;		/* Ethernet address and flags */
+} arpe;
+
+static inline uint64_t
+arpe_state(const arpe *ae)
+{
+
+	return (__atomic_load_n(&ae->state, __ATOMIC_ACQUIRE));
+}
+
+static inline void
+arpe_set_state(arpe *ae, uint64_t state)
+{
+
+	__atomic_store_n(&ae->state, state, __ATOMIC_RELEASE);
+}
+
+/*
+ * Readers may also look at an entry's request count and when it was
+ * last seen, so the writer must change them through these.
+ */
+static inline unsigned int
+arpe_nreq(const arpe *ae)
+{
+
+	return (__atomic_load_n(&ae->nreq, __ATOMIC_RELAXED));
+}
+
+static inline void
+arpe_set_nreq(arpe *ae, unsigned int nreq)
+{
+
+	__atomic_store_n(&ae->nreq, nreq, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t
+arpe_last(const arpe *ae)
+{
+
+	return (__atomic_load_n(&ae->last, __ATOMIC_RELAXED));
+}
+
+static inline void
+arpe_set_last(arpe *ae, uint64_t last)
+{
+
+	__atomic_store_n(&ae->last, last, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t
+arpe_pack(const ether_addr *ea)
+{
+
+	return ((uint64_t)ea->o[0] | (uint64_t)ea->o[1] << 8 |
+	    (uint64_t)ea->o[2] << 16 | (uint64_t)ea->o[3] << 24 |
+	    (uint64_t)ea->o[4] << 32 | (uint64_t)ea->o[5] << 40);
+}
+
+static inline void
+arpe_unpack(uint64_t state, ether_addr *ea)
+{
+	unsigned int i;
+
+	for (i = 0; i < 6; ++i)
+		ea->o[i] = state >> (8 * i);
+}
+
+arpt		*arpt_new(uint64_t, uint64_t, void (*)(const arpe *, void *),
+		    void *);
+void		 arpt_destroy(arpt *);
+arpe		*arpt_insert(arpt *, uint32_t, uint64_t);
+int		 arpt_lookup(const arpt *, uint32_t, arpe *);
+int		 arpt_expire(arpt *, uint64_t, unsigned int);
+unsigned long	 arpt_reclaim(arpt *);
+unsigned long	 arpt_count(const arpt *);
+size_t		 arpt_memory(const arpt *);
+#ifdef BUFSIZ /* proxy for "is <stdio.h> included?" */
+void		 arpt_fprint(FILE *, const arpt *, uint64_t);
+#endif
+
 #endif
@@ -0,0 +1,62 @@
+/*-
+ * Copyright (c) 2018 The University of Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef FT_EPOCH_H_INCLUDED
+#define FT_EPOCH_H_INCLUDED
+
+/*
+ * Epoch-based reclamation.  Readers bracket their accesses to a shared
+ * structure with ft_epoch_enter() and ft_epoch_exit() and never block.
+ * A writer which unlinks an object hands it to ft_epoch_retire() and
+ * frees it once ft_epoch_reclaim() says no reader can still see it.
+ * Writers to the same list must be serialized by the caller.
+ */
+
+/* embedded in every object which may be retired */
+typedef struct ft_epoch_entry {
+	struct ft_epoch_entry	*next;
+	uint64_t		 epoch;		/* when it was retired */
+} ft_epoch_entry;
+
+/* objects retired but not yet reclaimed, oldest first */
+typedef struct ft_epoch_list {
+	ft_epoch_entry		*head;
+	ft_epoch_entry		**tail;
+	unsigned long		 n;
+} ft_epoch_list;
+
+void		 ft_epoch_enter(void);
+void		 ft_epoch_exit(void);
+void		 ft_epoch_thread_exit(void);
+void		 ft_epoch_init(ft_epoch_list *);
+void		 ft_epoch_retire(ft_epoch_list *, ft_epoch_entry *);
+ft_epoch_entry	*ft_epoch_reclaim(ft_epoch_list *);
+ft_epoch_entry	*ft_epoch_flush(ft_epoch_list *);
+
+#endif
@@ -121,6 +121,8 @@ typedef struct udp4_hdr {
 const char	*ip4_parse(const char *, ip4_addr *);
 const char	*ip4_parse_range(const char *, ip4_addr *, ip4_addr *);
 uint16_t	 ip4_cksum(uint16_t, const void *, size_t);
+uint16_t	 ip4_cksum_update(uint16_t, uint16_t, uint16_t);
+uint16_t	 ip4_cksum_update32(uint16_t, uint32_t, uint32_t);
 
 typedef struct ip4s_node ip4s_node;
 
@@ -129,6 +131,10 @@ void		 ip4s_destroy(ip4s_node *);
 int		 ip4s_insert(ip4s_node *, uint32_t, uint32_t);
 int		 ip4s_remove(ip4s_node *, uint32_t, uint32_t);
 int		 ip4s_lookup(const ip4s_node *, uint32_t);
+void		 ip4s_lookup_batch(const ip4s_node *, const uint32_t *, int *,
+		    unsigned int);
+unsigned long	 ip4s_ranges(const ip4s_node *, uint32_t *, uint32_t *,
+		    unsigned long);
 unsigned long	 ip4s_count(const ip4s_node *);
 #ifdef BUFSIZ /* proxy for "is <stdio.h> included?" */
 void		 ip4s_fprint(FILE *, const ip4s_node *);
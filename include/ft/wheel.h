@@ -0,0 +1,55 @@
+/*-
+ * Copyright (c) 2018 The University of Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef FT_WHEEL_H_INCLUDED
+#define FT_WHEEL_H_INCLUDED
+
+/*
+ * A hierarchical timing wheel.  Each timer is a key and the time (in
+ * ms) at which it is due; there is no way to cancel one, so users who
+ * need to move a deadline add a new timer and ignore the old one when
+ * it fires.  Running the wheel up to a point in time fires every timer
+ * due by then, doing work in proportion to the number of timers fired
+ * rather than to the time elapsed.  The wheel's clock never runs
+ * backward.
+ */
+typedef struct ft_wheel ft_wheel;
+
+typedef void (*ft_wheel_fire)(uint64_t, uint64_t, uint32_t, void *);
+
+ft_wheel	*ft_wheel_new(void);
+void		 ft_wheel_destroy(ft_wheel *);
+int		 ft_wheel_add(ft_wheel *, uint64_t, uint32_t);
+int		 ft_wheel_run(ft_wheel *, uint64_t, unsigned int,
+		    ft_wheel_fire, void *);
+uint64_t	 ft_wheel_now(const ft_wheel *);
+unsigned long	 ft_wheel_count(const ft_wheel *);
+size_t		 ft_wheel_memory(const ft_wheel *);
+
+#endif
@@ -0,0 +1,432 @@
+/*-
+ * Copyright (c) 2016-2018 The University of Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <ft/arp.h>
+#include <ft/assert.h>
+#include <ft/epoch.h>
+#include <ft/ethernet.h>
+#include <ft/ip4.h>
+#include <ft/log.h>
+#include <ft/wheel.h>
+
+#define U64_SEC_UL(u64)		((unsigned long)((u64) / 1000))
+#define U64_MSEC_UL(u64)	((unsigned long)((u64) % 1000))
+
+/* smallest number of slots */
+#define ARPT_MINSLOTS	64
+
+/*
+ * The entries live in an open-addressed array, found by linear probing
+ * from a hash of their address.  Once a slot has been given an address
+ * it keeps it: an entry which expires is only marked dead, so readers
+ * never see an address change under them, and if the address comes
+ * back it gets its old slot.  Dead slots are cleared out when the
+ * array is rebuilt, which the writer does into a new array so readers
+ * can carry on with the old one.
+ */
+struct arpt_slots {
+	ft_epoch_entry	 ee;		/* must come first */
+	unsigned int	 mask;		/* number of slots - 1 */
+	unsigned int	 shift;		/* 32 - log2(number of slots) */
+	arpe		 slot[];
+};
+
+struct arpt {
+	struct arpt_slots *s;
+	unsigned int	 nlive;		/* live entries */
+	unsigned int	 nused;		/* live and dead entries */
+	uint64_t	 stale;		/* ms before an entry goes stale */
+	uint64_t	 ttl;		/* ms before an entry expires */
+	ft_wheel	*w;		/* deadlines */
+	unsigned int	 nstale;	/* gone stale since last run */
+	unsigned int	 nexp;		/* expired since last run */
+	ft_epoch_list	 limbo;		/* old arrays, not yet freed */
+	void		(*gone)(const arpe *, void *);
+	void		*arg;
+};
+
+static inline unsigned int
+arpt_hash(const struct arpt_slots *s, uint32_t addr)
+{
+
+	return ((addr * 0x9e3779b1U) >> s->shift);
+}
+
+static struct arpt_slots *
+arpt_slots_new(unsigned int n)
+{
+	struct arpt_slots *s;
+	unsigned int shift;
+
+	for (shift = 32; n > 1U << (32 - shift); --shift)
+		/* nothing */ ;
+	if ((s = calloc(1, sizeof *s + n * sizeof s->slot[0])) == NULL)
+		return (NULL);
+	s->mask = n - 1;
+	s->shift = shift;
+	return (s);
+}
+
+/*
+ * Find an address's slot, or the empty slot where it would go.
+ */
+static arpe *
+arpt_probe(const struct arpt_slots *s, uint32_t addr)
+{
+	const arpe *ae;
+	unsigned int i;
+
+	for (i = arpt_hash(s, addr); ; i = (i + 1) & s->mask) {
+		ae = &s->slot[i];
+		if (ae->state == 0 || ae->addr == addr)
+			return ((arpe *)(uintptr_t)ae);
+	}
+}
+
+/*
+ * Move the live entries into a new array with room for at least one
+ * more, dropping the dead ones.  Readers still looking at the old
+ * array can finish what they are doing; it is freed later.
+ */
+static int
+arpt_rebuild(arpt *t)
+{
+	struct arpt_slots *os, *ns;
+	unsigned int i, n;
+
+	for (n = ARPT_MINSLOTS; n / 2 < t->nlive + 1; n *= 2)
+		/* nothing */ ;
+	if ((ns = arpt_slots_new(n)) == NULL)
+		return (-1);
+	os = t->s;
+	for (i = 0; i <= os->mask; ++i)
+		if (os->slot[i].state & ARPE_LIVE)
+			*arpt_probe(ns, os->slot[i].addr) = os->slot[i];
+	ft_debug("rebuilt ARP table: %u live, %u dead, %u -> %u slots",
+	    t->nlive, t->nused - t->nlive, os->mask + 1, n);
+	t->nused = t->nlive;
+	__atomic_store_n(&t->s, ns, __ATOMIC_RELEASE);
+	ft_epoch_retire(&t->limbo, &os->ee);
+	return (0);
+}
+
+/*
+ * Print the entries of a table.
+ */
+void
+arpt_fprint(FILE *f, const arpt *t, uint64_t now)
+{
+	const arpe *ae;
+	unsigned int i;
+	uint64_t state;
+
+	for (i = 0; i <= t->s->mask; ++i) {
+		ae = &t->s->slot[i];
+		if (!((state = ae->state) & ARPE_LIVE))
+			continue;
+		fprintf(f, "%u.%u.%u.%u",
+		    (ae->addr >> 24) & 0xff, (ae->addr >> 16) & 0xff,
+		    (ae->addr >> 8) & 0xff, ae->addr & 0xff);
+		if (ae->nreq > 0) {
+			fprintf(f, " unknown (%u req)\n", ae->nreq);
+			continue;
+		}
+		fprintf(f, " = %02x:%02x:%02x:%02x:%02x:%02x %lu.%03lu s%s\n",
+		    (unsigned int)(state & 0xff),
+		    (unsigned int)(state >> 8 & 0xff),
+		    (unsigned int)(state >> 16 & 0xff),
+		    (unsigned int)(state >> 24 & 0xff),
+		    (unsigned int)(state >> 32 & 0xff),
+		    (unsigned int)(state >> 40 & 0xff),
+		    U64_SEC_UL(now - ae->last),
+		    U64_MSEC_UL(now - ae->last),
+		    (state & ARPE_CLAIMED) ? " !" : "");
+	}
+}
+
+/*
+ * The next deadline of an entry which has just been seen or has just
+ * reached its previous one: when it goes stale if it has not yet, and
+ * when it expires otherwise.
+ */
+static inline uint64_t
+arpt_deadline(const arpt *t, const arpe *ae, uint64_t now)
+{
+
+	if (t->stale > 0 && now < ae->last + t->stale)
+		return (ae->last + t->stale);
+	return (ae->last + t->ttl + 1);
+}
+
+/*
+ * An entry's timer has fired.  It may have been seen since the timer
+ * was set, in which case it gets a new one, and if it has been seen
+ * again since it went stale, it may have a newer timer already, in
+ * which case this one is ignored.
+ */
+static void
+arpt_fire(uint64_t now, uint64_t when, uint32_t addr, void *arg)
+{
+	arpt *t = arg;
+	uint64_t state;
+	arpe *ae;
+
+	ae = arpt_probe(t->s, addr);
+	state = ae->state;
+	if (!(state & ARPE_LIVE) || ae->due != when)
+		return;
+	/* not learned from the network, never expires */
+	if (state & ARPE_RESERVED)
+		return;
+	if (now > ae->last + t->ttl) {
+		if (t->gone != NULL)
+			t->gone(ae, t->arg);
+		arpe_set_state(ae, ARPE_DEAD);
+		t->nlive--;
+		t->nexp++;
+		return;
+	}
+	if (ae->nreq > 0 && t->stale > 0 && now >= ae->last + t->stale) {
+		arpe_set_nreq(ae, 0);
+		t->nstale++;
+	}
+	ae->due = arpt_deadline(t, ae, now);
+	if (ft_wheel_add(t->w, ae->due, addr) != 0) {
+		/* try again next time it is seen */
+		ft_error("failed to schedule ARP table entry: %m");
+		ae->due = ARPT_NEVER;
+	}
+}
+
+/*
+ * Deal with entries which have gone stale or expired by now, doing at
+ * most max units of work.  Returns 1 if there is more to do, and 0 if
+ * it caught up.  The table's clock never runs backward, so an entry is
+ * judged by the latest time it has been passed.
+ */
+int
+arpt_expire(arpt *t, uint64_t now, unsigned int max)
+{
+	int ret;
+
+	t->nstale = t->nexp = 0;
+	ret = ft_wheel_run(t->w, now, max, arpt_fire, t);
+	if (t->nstale > 0 || t->nexp > 0)
+		ft_debug("%u entries went stale, %u expired, %u left%s",
+		    t->nstale, t->nexp, t->nlive, ret ? ", more to do" : "");
+	return (ret);
+}
+
+/*
+ * Free whatever the table no longer uses and no reader can still see.
+ * Returns the number of arrays freed.
+ */
+unsigned long
+arpt_reclaim(arpt *t)
+{
+	ft_epoch_entry *ee;
+	unsigned long n;
+
+	for (n = 0; (ee = ft_epoch_reclaim(&t->limbo)) != NULL; ++n)
+		free(ee);
+	return (n);
+}
+
+/*
+ * Create an empty table whose entries go stale after the first interval
+ * (or never, if it is zero) and expire after the second.  The callback,
+ * if not NULL, is called for each entry as it is removed.
+ */
+arpt *
+arpt_new(uint64_t stale, uint64_t ttl, void (*gone)(const arpe *, void *),
+    void *arg)
+{
+	arpt *t;
+
+	if ((t = calloc(1, sizeof *t)) == NULL)
+		return (NULL);
+	if ((t->s = arpt_slots_new(ARPT_MINSLOTS)) == NULL) {
+		free(t);
+		return (NULL);
+	}
+	if ((t->w = ft_wheel_new()) == NULL) {
+		free(t->s);
+		free(t);
+		return (NULL);
+	}
+	t->stale = stale;
+	t->ttl = ttl;
+	ft_epoch_init(&t->limbo);
+	t->gone = gone;
+	t->arg = arg;
+	return (t);
+}
+
+/*
+ * Destroy a table and everything in it.  There must be no readers left.
+ */
+void
+arpt_destroy(arpt *t)
+{
+	ft_epoch_entry *ee;
+	unsigned int i;
+
+	if (t == NULL)
+		return;
+	if (t->gone != NULL)
+		for (i = 0; i <= t->s->mask; ++i)
+			if (t->s->slot[i].state & ARPE_LIVE)
+				t->gone(&t->s->slot[i], t->arg);
+	free(t->s);
+	while ((ee = ft_epoch_flush(&t->limbo)) != NULL)
+		free(ee);
+	ft_wheel_destroy(t->w);
+	free(t);
+}
+
+/*
+ * Look up an address, adding it if it is not already there, and mark
+ * it as seen now.  Returns NULL if memory runs out; the entry may have
+ * been added all the same, but without a deadline until it is seen
+ * again.
+ */
+arpe *
+arpt_insert(arpt *t, uint32_t addr, uint64_t now)
+{
+	uint64_t due;
+	arpe *ae;
+
+	ae = arpt_probe(t->s, addr);
+	if (!(ae->state & ARPE_LIVE)) {
+		if (ae->state == 0) {
+			/* keep at most three quarters of the slots in use */
+			if ((t->nused + 1) * 4 > (t->s->mask + 1) * 3) {
+				if (arpt_rebuild(t) != 0)
+					return (NULL);
+				ae = arpt_probe(t->s, addr);
+			}
+			ae->addr = addr;
+			t->nused++;
+		}
+		arpe_set_nreq(ae, 0);
+		ae->first = ARPT_NEVER;
+		arpe_set_last(ae, 0);
+		ae->due = ARPT_NEVER;
+		/* publishes the address to readers */
+		arpe_set_state(ae, ARPE_LIVE);
+		t->nlive++;
+		ft_verbose("arp: inserted %u.%u.%u.%u",
+		    (addr >> 24) & 0xff, (addr >> 16) & 0xff,
+		    (addr >> 8) & 0xff, addr & 0xff);
+	} else if (ae->nreq > 0 && t->stale > 0 &&
+	    now >= ae->last + t->stale) {
+		/* went stale, but its timer has not fired yet */
+		arpe_set_nreq(ae, 0);
+	}
+	if (now < ae->first)
+		ae->first = now;
+	if (now > ae->last)
+		arpe_set_last(ae, now);
+	/*
+	 * A timer which fires too early finds the entry's new deadline by
+	 * itself, so only one which would fire too late is replaced.
+	 */
+	if ((due = arpt_deadline(t, ae, ae->last)) < ae->due) {
+		if (ft_wheel_add(t->w, due, addr) != 0)
+			return (NULL);
+		ae->due = due;
+	}
+	return (ae);
+}
+
+/*
+ * Look up an address and, if it is there, fill in a copy of the parts
+ * of its entry readers may see: the address, the request count, when
+ * it was last seen and its state.  Safe to call from any thread at any
+ * time.
+ */
+int
+arpt_lookup(const arpt *t, uint32_t addr, arpe *copy)
+{
+	const struct arpt_slots *s;
+	const arpe *ae;
+	unsigned int i;
+	uint64_t st;
+	int ret;
+
+	ft_epoch_enter();
+	s = __atomic_load_n(&t->s, __ATOMIC_ACQUIRE);
+	for (ret = -1, i = arpt_hash(s, addr); ; i = (i + 1) & s->mask) {
+		ae = &s->slot[i];
+		if ((st = arpe_state(ae)) == 0)
+			break;
+		if (ae->addr == addr) {
+			if (st & ARPE_LIVE) {
+				copy->addr = addr;
+				copy->nreq = arpe_nreq(ae);
+				copy->last = arpe_last(ae);
+				copy->state = st;
+				ret = 0;
+			}
+			break;
+		}
+	}
+	ft_epoch_exit();
+	return (ret);
+}
+
+/*
+ * Number of addresses in the table.
+ */
+unsigned long
+arpt_count(const arpt *t)
+{
+
+	return (t->nlive);
+}
+
+/*
+ * Memory used by the table, not counting arrays waiting to be freed.
+ */
+size_t
+arpt_memory(const arpt *t)
+{
+
+	return (sizeof *t + sizeof *t->s +
+	    (t->s->mask + 1) * sizeof t->s->slot[0] + ft_wheel_memory(t->w));
+}
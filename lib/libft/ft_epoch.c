@@ -0,0 +1,227 @@
+/*-
+ * Copyright (c) 2018 The University of Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <ft/assert.h>
+#include <ft/epoch.h>
+
+/* most threads which may be inside a read-side section at once */
+#define FT_EPOCH_MAXTHREADS	256
+
+#define FT_EPOCH_CACHELINE	64
+
+/*
+ * A reader's slot.  Its epoch is the global epoch it saw on entry, or
+ * zero while it is outside.
+ */
+struct ft_epoch_slot {
+	uint64_t	 epoch;
+	int		 used;
+} __attribute__((__aligned__(FT_EPOCH_CACHELINE)));
+
+static struct ft_epoch_slot ft_epoch_slots[FT_EPOCH_MAXTHREADS];
+static unsigned int ft_epoch_nslots;
+
+/* starts at 1 so that 0 can mean "outside" */
+static uint64_t ft_epoch_global = 1;
+
+static __thread struct ft_epoch_slot *ft_epoch_self;
+static __thread unsigned int ft_epoch_depth;
+
+/*
+ * Find a free slot for the calling thread.
+ */
+static struct ft_epoch_slot *
+ft_epoch_register(void)
+{
+	struct ft_epoch_slot *s;
+	unsigned int k, n;
+	int unused;
+
+	for (k = 0; k < FT_EPOCH_MAXTHREADS; ++k) {
+		s = &ft_epoch_slots[k];
+		unused = 0;
+		if (__atomic_compare_exchange_n(&s->used, &unused, 1, 0,
+		    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+			/* let ft_epoch_advance() know how far to look */
+			n = __atomic_load_n(&ft_epoch_nslots, __ATOMIC_RELAXED);
+			while (n <= k && !__atomic_compare_exchange_n(
+			    &ft_epoch_nslots, &n, k + 1, 0,
+			    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+				/* nothing */ ;
+			return (s);
+		}
+	}
+	ft_abort("more than %d threads in epoch sections",
+	    FT_EPOCH_MAXTHREADS);
+}
+
+/*
+ * Enter a read-side section.  Sections may nest.
+ */
+void
+ft_epoch_enter(void)
+{
+	struct ft_epoch_slot *s;
+
+	if (ft_epoch_depth++ > 0)
+		return;
+	if ((s = ft_epoch_self) == NULL)
+		s = ft_epoch_self = ft_epoch_register();
+	__atomic_store_n(&s->epoch,
+	    __atomic_load_n(&ft_epoch_global, __ATOMIC_RELAXED),
+	    __ATOMIC_RELAXED);
+	/* publish our epoch before reading anything it protects */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/*
+ * Leave a read-side section.
+ */
+void
+ft_epoch_exit(void)
+{
+
+	ft_assert(ft_epoch_depth > 0);
+	if (--ft_epoch_depth > 0)
+		return;
+	__atomic_store_n(&ft_epoch_self->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Give up the calling thread's slot.  Call this before a thread which
+ * has used ft_epoch_enter() exits.
+ */
+void
+ft_epoch_thread_exit(void)
+{
+
+	ft_assert(ft_epoch_depth == 0);
+	if (ft_epoch_self == NULL)
+		return;
+	__atomic_store_n(&ft_epoch_self->used, 0, __ATOMIC_RELEASE);
+	ft_epoch_self = NULL;
+}
+
+/*
+ * Move the global epoch on if every reader inside a section has seen
+ * the current one.
+ */
+static void
+ft_epoch_advance(void)
+{
+	uint64_t e, g;
+	unsigned int k, n;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	g = __atomic_load_n(&ft_epoch_global, __ATOMIC_ACQUIRE);
+	n = __atomic_load_n(&ft_epoch_nslots, __ATOMIC_ACQUIRE);
+	for (k = 0; k < n; ++k) {
+		e = __atomic_load_n(&ft_epoch_slots[k].epoch, __ATOMIC_ACQUIRE);
+		if (e != 0 && e != g)
+			return;
+	}
+	/* someone else may have beaten us to it, which is fine */
+	(void)__atomic_compare_exchange_n(&ft_epoch_global, &g, g + 1, 0,
+	    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+
+void
+ft_epoch_init(ft_epoch_list *l)
+{
+
+	l->head = NULL;
+	l->tail = &l->head;
+	l->n = 0;
+}
+
+/*
+ * Queue an object which has just been unlinked.  A reader which found
+ * it before that entered its section in the current epoch or earlier,
+ * and will have left it once the epoch has moved on twice.
+ */
+void
+ft_epoch_retire(ft_epoch_list *l, ft_epoch_entry *ee)
+{
+
+	/* order the unlinking before reading the epoch */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	ee->epoch = __atomic_load_n(&ft_epoch_global, __ATOMIC_ACQUIRE);
+	ee->next = NULL;
+	*l->tail = ee;
+	l->tail = &ee->next;
+	l->n++;
+}
+
+/*
+ * Return the oldest retired object if no reader can still see it, or
+ * NULL.  Call repeatedly and free what it returns.
+ */
+ft_epoch_entry *
+ft_epoch_reclaim(ft_epoch_list *l)
+{
+	ft_epoch_entry *ee;
+
+	if ((ee = l->head) == NULL)
+		return (NULL);
+	if (ee->epoch + 2 > __atomic_load_n(&ft_epoch_global,
+	    __ATOMIC_ACQUIRE)) {
+		ft_epoch_advance();
+		if (ee->epoch + 2 > __atomic_load_n(&ft_epoch_global,
+		    __ATOMIC_ACQUIRE))
+			return (NULL);
+	}
+	if ((l->head = ee->next) == NULL)
+		l->tail = &l->head;
+	l->n--;
+	return (ee);
+}
+
+/*
+ * Return the oldest retired object regardless of readers, or NULL.  For
+ * use once there are no readers left.
+ */
+ft_epoch_entry *
+ft_epoch_flush(ft_epoch_list *l)
+{
+	ft_epoch_entry *ee;
+
+	if ((ee = l->head) == NULL)
+		return (NULL);
+	if ((l->head = ee->next) == NULL)
+		l->tail = &l->head;
+	l->n--;
+	return (ee);
+}
@@ -34,6 +34,11 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+
+#if HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
 
 #include <ft/ctype.h>
 #include <ft/endian.h>
@@ -105,20 +110,179 @@ ip4_parse_range(const char *line, ip4_addr *first, ip4_addr *last)
 	return (q);
 }
 
+/*
+ * The checksum is a one's complement sum of big-endian 16-bit words.
+ * Summing native-order words instead gives the same result, only
+ * byte-swapped (RFC 1071 section 2), which lets us add up to eight
+ * bytes at a time and convert once at the end.  Each implementation
+ * below adds the data to a 64-bit native-order sum, which is only
+ * folded down to 16 bits by ip4_cksum().
+ */
+static uint64_t
+ip4_sum_generic(const uint8_t *p, size_t len, uint64_t sum)
+{
+	uint64_t q;
+	uint32_t d;
+	uint16_t w;
+
+	for (; len >= 8; p += 8, len -= 8) {
+		memcpy(&q, p, sizeof q);
+		sum += (q & 0xffffffffU) + (q >> 32);
+	}
+	if (len >= 4) {
+		memcpy(&d, p, sizeof d);
+		sum += d;
+		p += 4;
+		len -= 4;
+	}
+	if (len >= 2) {
+		memcpy(&w, p, sizeof w);
+		sum += w;
+		p += 2;
+		len -= 2;
+	}
+	if (len > 0) {
+		/* pad with a zero byte */
+		w = 0;
+		memcpy(&w, p, 1);
+		sum += w;
+	}
+	return (sum);
+}
+
+#if HAVE_X86_SIMD
+/*
+ * Number of vectors we can add up in 32-bit lanes without overflow: each
+ * contributes at most two 16-bit words per lane.
+ */
+#define IP4_SUM_VECS	0x8000
+
+__attribute__((__target__("sse2")))
+static uint64_t
+ip4_sum_sse2(const uint8_t *p, size_t len, uint64_t sum)
+{
+	__m128i acc, v, zero;
+	uint64_t lane[2];
+	unsigned int n;
+
+	zero = _mm_setzero_si128();
+	while (len >= 16) {
+		acc = zero;
+		for (n = 0; n < IP4_SUM_VECS && len >= 16; ++n) {
+			v = _mm_loadu_si128((const __m128i *)p);
+			acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(v, zero));
+			acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(v, zero));
+			p += 16;
+			len -= 16;
+		}
+		acc = _mm_add_epi64(_mm_unpacklo_epi32(acc, zero),
+		    _mm_unpackhi_epi32(acc, zero));
+		_mm_storeu_si128((__m128i *)lane, acc);
+		sum += lane[0] + lane[1];
+	}
+	return (ip4_sum_generic(p, len, sum));
+}
+
+__attribute__((__target__("avx2")))
+static uint64_t
+ip4_sum_avx2(const uint8_t *p, size_t len, uint64_t sum)
+{
+	__m256i acc, v, zero;
+	uint64_t lane[4];
+	unsigned int n;
+
+	zero = _mm256_setzero_si256();
+	while (len >= 32) {
+		acc = zero;
+		for (n = 0; n < IP4_SUM_VECS && len >= 32; ++n) {
+			v = _mm256_loadu_si256((const __m256i *)p);
+			acc = _mm256_add_epi32(acc,
+			    _mm256_unpacklo_epi16(v, zero));
+			acc = _mm256_add_epi32(acc,
+			    _mm256_unpackhi_epi16(v, zero));
+			p += 32;
+			len -= 32;
+		}
+		acc = _mm256_add_epi64(_mm256_unpacklo_epi32(acc, zero),
+		    _mm256_unpackhi_epi32(acc, zero));
+		_mm256_storeu_si256((__m256i *)lane, acc);
+		sum += lane[0] + lane[1] + lane[2] + lane[3];
+	}
+	/* avoid an AVX to SSE transition penalty */
+	_mm256_zeroupper();
+	return (ip4_sum_sse2(p, len, sum));
+}
+#endif
+
+static uint64_t (*ip4_sum)(const uint8_t *, size_t, uint64_t) =
+    ip4_sum_generic;
+
+/*
+ * Pick the best implementation the CPU supports.
+ */
+__attribute__((__constructor__))
+static void
+ip4_sum_select(void)
+{
+
+#if HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		ip4_sum = ip4_sum_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		ip4_sum = ip4_sum_sse2;
+#endif
+}
+
+/*
+ * Below this length, the vector code does not pay for the indirect call.
+ */
+#define IP4_SUM_MINVEC	32
+
 /*
  * IPv4 16-bit checksum
  */
 uint16_t
 ip4_cksum(uint16_t isum, const void *data, size_t len)
 {
-	const uint16_t *w;
-	uint32_t sum;
-
-	for (w = data, sum = isum; len > 1; len -= 2, ++w)
-		sum += be16toh(*w);
-	if (len)
-		sum += *(const uint8_t *)w << 8;
-	while (sum > 0xffff)
-		sum -= 0xffff;
-	return (sum);
+	uint64_t sum;
+
+	sum = htobe16(isum);
+	if (len < IP4_SUM_MINVEC)
+		sum = ip4_sum_generic(data, len, sum);
+	else
+		sum = ip4_sum(data, len, sum);
+	/* fold with end-around carry, then convert */
+	sum = (sum & 0xffffffffU) + (sum >> 32);
+	sum = (sum & 0xffffffffU) + (sum >> 32);
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	return (be16toh((uint16_t)sum));
+}
+
+/*
+ * Update an IPv4 checksum, as stored in a header (but in host order),
+ * to reflect a change in one 16-bit word of the data it covers, without
+ * recomputing it (RFC 1624, eqn. 3: HC' = ~(~HC + ~m + m')).
+ */
+uint16_t
+ip4_cksum_update(uint16_t sum, uint16_t from, uint16_t to)
+{
+	uint32_t s;
+
+	s = (uint16_t)~sum + (uint16_t)~from + (uint32_t)to;
+	s = (s & 0xffff) + (s >> 16);
+	s = (s & 0xffff) + (s >> 16);
+	return (~s & 0xffff);
+}
+
+/*
+ * Same as ip4_cksum_update(), for a 32-bit word.
+ */
+uint16_t
+ip4_cksum_update32(uint16_t sum, uint32_t from, uint32_t to)
+{
+
+	sum = ip4_cksum_update(sum, from >> 16, to >> 16);
+	return (ip4_cksum_update(sum, from & 0xffff, to & 0xffff));
 }
@@ -46,6 +46,11 @@
 #define IP4S_BITS	 4
 #define IP4S_SUBS	 (1U << IP4S_BITS)
 
+/*
+ * How many lookups ip4s_lookup_batch() runs side by side.
+ */
+#define IP4S_BATCH	 64
+
 /*
  * A node in the tree.
  */
@@ -324,6 +329,113 @@ ip4s_lookup(const ip4s_node *n, uint32_t addr)
 	return (0);
 }
 
+/*
+ * Look up a batch of addresses in a tree, setting res[k] to 1 if
+ * addr[k] is present and 0 if it is not.  Rather than finish each walk
+ * before starting the next, we take every walk one level down at a
+ * time and prefetch the nodes they will visit next, so the cache misses
+ * of independent walks overlap instead of adding up.
+ */
+void
+ip4s_lookup_batch(const ip4s_node *root, const uint32_t *addr, int *res,
+    unsigned int n)
+{
+	const ip4s_node *cur[IP4S_BATCH], *sn;
+	uint8_t live[IP4S_BATCH];
+	uint32_t mask, sub;
+	unsigned int i, j, k, nlive;
+
+	for (; n > 0; addr += k, res += k, n -= k) {
+		for (k = 0; k < n && k < IP4S_BATCH; ++k) {
+			cur[k] = root;
+			live[k] = k;
+		}
+		for (nlive = k; nlive > 0; nlive = j) {
+			/* walks still going are compacted as we go */
+			for (i = j = 0; i < nlive; ++i) {
+				sn = cur[live[i]];
+				mask = 0xffffffffLU >> sn->plen;
+				/* within this subtree? */
+				if (addr[live[i]] < sn->addr ||
+				    addr[live[i]] > (sn->addr | mask)) {
+					res[live[i]] = 0;
+					continue;
+				}
+				/* fully covered? */
+				if (sn->coverage == mask + 1LU) {
+					res[live[i]] = 1;
+					continue;
+				}
+				/* descend */
+				sub = (addr[live[i]] >>
+				    (32 - sn->plen - IP4S_BITS)) % IP4S_SUBS;
+				if ((sn = sn->sub[sub]) == NULL) {
+					res[live[i]] = 0;
+					continue;
+				}
+				__builtin_prefetch(sn);
+				cur[live[i]] = sn;
+				live[j++] = live[i];
+			}
+		}
+	}
+}
+
+/*
+ * State for ip4s_ranges().
+ */
+struct ip4s_ranges {
+	uint32_t	*first;		/* first address of each range */
+	uint32_t	*last;		/* last address of each range */
+	unsigned long	 max;		/* size of the above */
+	unsigned long	 n;		/* ranges found so far */
+	uint32_t	 end;		/* last address of the latest range */
+};
+
+static void
+ip4s_ranges_r(const ip4s_node *n, struct ip4s_ranges *r)
+{
+	uint32_t mask;
+	unsigned int i;
+
+	mask = 0xffffffffLU >> n->plen;
+	if (n->coverage == 0)
+		return;
+	if (n->coverage == mask + 1LU) {
+		if (r->n > 0 && r->end + 1 == n->addr) {
+			/* adjacent to the previous range, extend it */
+			if (r->n <= r->max)
+				r->last[r->n - 1] = n->addr | mask;
+		} else {
+			if (r->n < r->max) {
+				r->first[r->n] = n->addr;
+				r->last[r->n] = n->addr | mask;
+			}
+			r->n++;
+		}
+		r->end = n->addr | mask;
+		return;
+	}
+	for (i = 0; i < IP4S_SUBS; ++i)
+		if (n->sub[i] != NULL)
+			ip4s_ranges_r(n->sub[i], r);
+}
+
+/*
+ * Describe a tree as an ascending list of disjoint ranges, merging
+ * adjacent subnets.  Up to max ranges are stored in first[] and last[].
+ * Returns the number of ranges required, which may be more than max.
+ */
+unsigned long
+ip4s_ranges(const ip4s_node *n, uint32_t *first, uint32_t *last,
+    unsigned long max)
+{
+	struct ip4s_ranges r = { first, last, max, 0, 0 };
+
+	ip4s_ranges_r(n, &r);
+	return (r.n);
+}
+
 /*
  * Return the number of addresses in a tree.
  */
@@ -0,0 +1,287 @@
+/*-
+ * Copyright (c) 2018 The University of Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <ft/assert.h>
+#include <ft/wheel.h>
+
+/*
+ * Each level has 64 slots, so a level's occupied slots fit in one word.
+ * Eleven levels cover all 64 bits of time, so no timer is ever too far
+ * in the future to be placed.
+ */
+#define FT_WHEEL_BITS		6
+#define FT_WHEEL_SLOTS		(1U << FT_WHEEL_BITS)
+#define FT_WHEEL_LEVELS		11
+
+/* end of a list */
+#define FT_WHEEL_NIL		UINT32_MAX
+
+/* smallest number of timers allocated at once */
+#define FT_WHEEL_MINTIMERS	64
+
+/*
+ * Timers are kept in one array and linked by index, so the array can be
+ * grown without fixing up any lists.
+ */
+struct ft_wheel_timer {
+	uint64_t	 when;
+	uint32_t	 key;
+	uint32_t	 next;
+};
+
+/*
+ * A timer due at time t sits on the lowest level at which t and the
+ * wheel's clock agree on everything above that level, in the slot given
+ * by t's bits for that level, which is always ahead of the clock's.
+ * When the clock reaches the start of a slot, its timers are moved down
+ * to the levels below, or to the ready list if they are due.
+ */
+struct ft_wheel {
+	uint64_t	 now;
+	struct ft_wheel_timer *timer;
+	uint32_t	 ntimers;	/* allocated */
+	uint32_t	 free;		/* unused timers */
+	unsigned long	 n;		/* pending timers */
+	uint32_t	 ready, ready_tail;
+	uint64_t	 map[FT_WHEEL_LEVELS];
+	uint32_t	 slot[FT_WHEEL_LEVELS][FT_WHEEL_SLOTS];
+};
+
+static inline unsigned int
+ft_wheel_index(uint64_t t, unsigned int level)
+{
+
+	return ((t >> (FT_WHEEL_BITS * level)) & (FT_WHEEL_SLOTS - 1));
+}
+
+/*
+ * Put a timer where it belongs relative to the clock.
+ */
+static void
+ft_wheel_place(ft_wheel *w, uint32_t k)
+{
+	struct ft_wheel_timer *tm = &w->timer[k];
+	unsigned int level, i;
+
+	if (tm->when <= w->now) {
+		tm->next = FT_WHEEL_NIL;
+		if (w->ready == FT_WHEEL_NIL)
+			w->ready = k;
+		else
+			w->timer[w->ready_tail].next = k;
+		w->ready_tail = k;
+		return;
+	}
+	level = (63 - __builtin_clzll(tm->when ^ w->now)) / FT_WHEEL_BITS;
+	i = ft_wheel_index(tm->when, level);
+	tm->next = w->slot[level][i];
+	w->slot[level][i] = k;
+	w->map[level] |= 1ULL << i;
+}
+
+/*
+ * The next time at which a slot starts which has timers in it, or 0 if
+ * the wheel is empty apart from the current slots.  The lowest level
+ * with anything ahead of the clock always has the earliest one.
+ */
+static uint64_t
+ft_wheel_next(const ft_wheel *w)
+{
+	unsigned int level, shift, cur;
+	uint64_t map, base;
+
+	for (level = 0; level < FT_WHEEL_LEVELS; ++level) {
+		shift = FT_WHEEL_BITS * level;
+		cur = ft_wheel_index(w->now, level);
+		if (cur == FT_WHEEL_SLOTS - 1)
+			continue;
+		if ((map = w->map[level] & (~0ULL << (cur + 1))) == 0)
+			continue;
+		/* start of the current slot one level up */
+		shift += FT_WHEEL_BITS;
+		base = shift >= 64 ? 0 : w->now >> shift << shift;
+		return (base | (uint64_t)__builtin_ctzll(map) <<
+		    (shift - FT_WHEEL_BITS));
+	}
+	return (0);
+}
+
+/*
+ * Create an empty wheel.
+ */
+ft_wheel *
+ft_wheel_new(void)
+{
+	ft_wheel *w;
+	unsigned int level, i;
+
+	if ((w = calloc(1, sizeof *w)) == NULL)
+		return (NULL);
+	w->free = w->ready = w->ready_tail = FT_WHEEL_NIL;
+	for (level = 0; level < FT_WHEEL_LEVELS; ++level)
+		for (i = 0; i < FT_WHEEL_SLOTS; ++i)
+			w->slot[level][i] = FT_WHEEL_NIL;
+	return (w);
+}
+
+/*
+ * Destroy a wheel and any timers left in it.
+ */
+void
+ft_wheel_destroy(ft_wheel *w)
+{
+
+	if (w == NULL)
+		return;
+	free(w->timer);
+	free(w);
+}
+
+/*
+ * Add a timer which fires once the clock reaches the given time, or on
+ * the next run if it already has.
+ */
+int
+ft_wheel_add(ft_wheel *w, uint64_t when, uint32_t key)
+{
+	struct ft_wheel_timer *timer;
+	uint32_t k, n;
+
+	if (w->free == FT_WHEEL_NIL) {
+		n = w->ntimers ? w->ntimers * 2 : FT_WHEEL_MINTIMERS;
+		if (n <= w->ntimers || n == FT_WHEEL_NIL)
+			return (-1);
+		if ((timer = realloc(w->timer, n * sizeof *timer)) == NULL)
+			return (-1);
+		w->timer = timer;
+		for (k = n; k > w->ntimers; --k) {
+			timer[k - 1].next = w->free;
+			w->free = k - 1;
+		}
+		w->ntimers = n;
+	}
+	k = w->free;
+	w->free = w->timer[k].next;
+	w->timer[k].when = when;
+	w->timer[k].key = key;
+	ft_wheel_place(w, k);
+	w->n++;
+	return (0);
+}
+
+/*
+ * Advance the clock to the given time, firing every timer due by then.
+ * The callback is passed the clock, the time the timer was due and its
+ * key, and may add new timers.  At most max timers are fired or moved
+ * between levels.  Returns 1 if it had to stop before catching up, in
+ * which case the next run picks up where this one left off, and 0
+ * otherwise.
+ */
+int
+ft_wheel_run(ft_wheel *w, uint64_t now, unsigned int max,
+    ft_wheel_fire fire, void *arg)
+{
+	struct ft_wheel_timer *tm;
+	unsigned int level, i;
+	uint64_t next;
+	uint32_t k;
+
+	for (;;) {
+		/* move down whatever starts now, highest level first */
+		for (level = FT_WHEEL_LEVELS; level-- > 0; ) {
+			i = ft_wheel_index(w->now, level);
+			while ((k = w->slot[level][i]) != FT_WHEEL_NIL) {
+				if (max == 0)
+					return (1);
+				max--;
+				w->slot[level][i] = w->timer[k].next;
+				ft_wheel_place(w, k);
+			}
+			w->map[level] &= ~(1ULL << i);
+		}
+		/* fire whatever is due */
+		while ((k = w->ready) != FT_WHEEL_NIL) {
+			if (max == 0)
+				return (1);
+			max--;
+			tm = &w->timer[k];
+			w->ready = tm->next;
+			tm->next = w->free;
+			w->free = k;
+			w->n--;
+			/* may add to the ready list */
+			fire(w->now, tm->when, tm->key, arg);
+		}
+		if (w->now >= now)
+			return (0);
+		if ((next = ft_wheel_next(w)) == 0 || next > now) {
+			w->now = now;
+			return (0);
+		}
+		w->now = next;
+	}
+}
+
+/*
+ * The wheel's clock.
+ */
+uint64_t
+ft_wheel_now(const ft_wheel *w)
+{
+
+	return (w->now);
+}
+
+/*
+ * Number of timers which have not yet fired.
+ */
+unsigned long
+ft_wheel_count(const ft_wheel *w)
+{
+
+	return (w->n);
+}
+
+/*
+ * Memory used by the wheel.
+ */
+size_t
+ft_wheel_memory(const ft_wheel *w)
+{
+
+	return (sizeof *w + w->ntimers * sizeof w->timer[0]);
+}
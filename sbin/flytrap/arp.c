@@ -34,13 +34,16 @@
 #include <sys/types.h>
 #include <sys/time.h>
 
+#if HAVE_PTHREAD
+#include <pthread.h>
+#endif
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <ft/arp.h>
-#include <ft/assert.h>
 #include <ft/endian.h>
 #include <ft/ethernet.h>
 #include <ft/ip4.h>
@@ -51,9 +54,6 @@
 #include "iface.h"
 #include "packet.h"
 
-/* magic value for "never seen" */
-#define ARP_NEVER	UINT64_MAX
-
 /* min unanswered ARP requests before we claim an address */
 #define ARP_MINREQ	     3
 
@@ -63,254 +63,252 @@
 /* age (in ms) of an entry before it is considered stale */
 #define ARP_STALE	 30000
 
-/* age (in ms) of an entry before it is removed from the tree */
+/* age (in ms) of an entry before it is removed from the table */
 #define ARP_EXPIRE	300000
 
+/* how often (in ms) to update a known address's last-seen time */
+#define ARP_REFRESH	  1000
+
+/* most timers handled per run of the table's timing wheel */
+#define ARP_EXPIRE_WORK	  1024
+
 /*
- * A node in the tree.
+ * An ARP table: one per interface, which the workers share if there
+ * are any.  Changes are serialized by the lock, while lookups take no
+ * lock at all.
  */
-struct arpn {
-	uint32_t	 addr;		/* network address */
-	uint8_t		 plen;		/* prefix length */
-	union {
-		/* leaf node */
-		uint64_t	 first;		/* first seen (ms) */
-		/* inner node */
-		uint64_t	 oldest;	/* oldest child */
-	};
-	union {
-		/* leaf node */
-		uint64_t	 last;		/* last seen (ms) */
-		/* inner node */
-		uint64_t	 newest;	/* newest child */
-	};
-	union {
-		/* leaf node */
-		struct {
-			ether_addr	 ether;		/* Ethernet address */
-			unsigned int	 nreq;		/* requests seen */
-			int		 claimed:1;	/* claimed by us */
-			int		 reserved:1;	/* reserved address */
-		};
-		/* inner node */
-		struct {
-			struct arpn	*sub[16];	/* children */
-		};
-	};
+struct arp_table {
+	struct iface	*i;		/* interface, unless shared */
+	arpt		*t;
+	unsigned long	 nruns;		/* maintenance runs */
+	unsigned long	 nshort;	/* runs which ran out of work */
+	uint64_t	 pause_sum;	/* time spent in them (ns) */
+	uint64_t	 pause_max;
+#if HAVE_PTHREAD
+	pthread_mutex_t	 lock;
+	char		*name;		/* interface name, if shared */
+	unsigned int	 refs;
+	struct arp_table *next;
+#endif
 };
 
-static struct arpn arp_root = { .first = ARP_NEVER };
-static unsigned int narpn, nleaves;
+#if HAVE_PTHREAD
+#define arp_lock(t)	pthread_mutex_lock(&(t)->lock)
+#define arp_unlock(t)	pthread_mutex_unlock(&(t)->lock)
+
+/* tables shared by the workers */
+static struct arp_table *arp_tables;
+static pthread_mutex_t arp_tables_lock = PTHREAD_MUTEX_INITIALIZER;
+#else
+#define arp_lock(t)	(void)(t)
+#define arp_unlock(t)	(void)(t)
+#endif
 
 /*
- * Print the leaf nodes of a tree in order.
+ * An entry is being removed: if we had claimed it, withdraw it from the
+ * fast path.
  */
 static void
-arp_print_tree(FILE *f, struct arpn *n)
+arp_gone(const arpe *ae, void *arg)
 {
-	unsigned int i;
-
-	fprintf(f, "%*s%u.%u.%u.%u",
-	    (int)(n->plen / 2), "",
-	    (n->addr >> 24) & 0xff,
-	    (n->addr >> 16) & 0xff,
-	    (n->addr >> 8) & 0xff,
-	    n->addr & 0xff);
-	if (n->plen < 32) {
-		fprintf(f, "/%u", n->plen);
-		if (n->newest > 0) {
-			fprintf(f, " %lu.%03lu s",
-			    U64_SEC_UL(ft_time - n->newest),
-			    U64_MSEC_UL(ft_time - n->newest));
-		}
-		fprintf(f, "\n");
-		for (i = 0; i < 16; ++i)
-			if (n->sub[i] != NULL)
-				arp_print_tree(f, n->sub[i]);
-	} else if (n->nreq > 0) {
-		fprintf(f, " unknown (%u req)\n", n->nreq);
-	} else {
-		fprintf(f, " = %02x:%02x:%02x:%02x:%02x:%02x %lu.%03lu s%s\n",
-		    n->ether.o[0], n->ether.o[1], n->ether.o[2],
-		    n->ether.o[3], n->ether.o[4], n->ether.o[5],
-		    U64_SEC_UL(ft_time - n->last),
-		    U64_MSEC_UL(ft_time - n->last),
-		    n->claimed ? " !" : "");
-	}
+#if HAVE_XDP_FAST
+	struct arp_table *t = arg;
+
+	if (t->i != NULL && (arpe_state(ae) & ARPE_CLAIMED))
+		iface_fast_claim(t->i, ae->addr, 0);
+#else
+	(void)ae;
+	(void)arg;
+#endif
 }
 
-/*
- * Create a node for the subnet of the specified prefix length which
- * contains the specified address.
- */
-static struct arpn *
-arp_new(uint32_t addr, uint8_t plen)
+static struct arp_table *
+arp_table_new(struct iface *i)
 {
-	struct arpn *n;
+	struct arp_table *t;
 
-	if ((n = calloc(1, sizeof *n)) == NULL)
+	if ((t = calloc(1, sizeof *t)) == NULL)
+		return (NULL);
+	t->i = i;
+	if ((t->t = arpt_new(ARP_STALE, ARP_EXPIRE, arp_gone, t)) == NULL) {
+		free(t);
 		return (NULL);
-	narpn++;
-	n->addr = addr & -(1 << (32 - plen));
-	n->plen = plen;
-	n->first = ARP_NEVER;
-	n->last = 0;
-	ft_debug("created node %u.%u.%u.%u/%u",
-	    (n->addr >> 24) & 0xff, (n->addr >> 16) & 0xff,
-	    (n->addr >> 8) & 0xff, n->addr & 0xff, n->plen);
-	return (n);
+	}
+#if HAVE_PTHREAD
+	pthread_mutex_init(&t->lock, NULL);
+	t->refs = 1;
+#endif
+	return (t);
 }
 
-/*
- * Delete all children of a given node in a tree.
- */
 static void
-arp_delete(struct arpn *n)
+arp_table_free(struct arp_table *t)
 {
-	unsigned int i;
 
-	if (n == NULL)
-		return;
-	if (n->plen == 32)
-		nleaves--;
-	else
-		for (i = 0; i < 16; ++i)
-			if (n->sub[i] != NULL)
-				arp_delete(n->sub[i]);
-	ft_debug("deleted node %u.%u.%u.%u/%u",
-	    (n->addr >> 24) & 0xff, (n->addr >> 16) & 0xff,
-	    (n->addr >> 8) & 0xff, n->addr & 0xff, n->plen);
-	narpn--;
-	free(n);
+	arpt_destroy(t->t);
+#if HAVE_PTHREAD
+	pthread_mutex_destroy(&t->lock);
+	free(t->name);
+#endif
+	free(t);
 }
 
 /*
- * Expire
+ * Create an empty table, or with workers, find the one the others use
+ * for the same interface.
  */
-static void
-arp_expire(struct arpn *n, uint64_t cutoff)
+struct arp_table *
+arp_table_create(struct iface *i)
 {
-	unsigned int i, ndel, nexp;
-
-	if (n == NULL)
-		n = &arp_root;
-	ndel = narpn;
-	nexp = nleaves;
-	ft_debug("expiring in %u.%u.%u.%u/%u "
-	    "oldest %lu.%03lu s newest %lu.%03lu s",
-	    (n->addr >> 24) & 0xff, (n->addr >> 16) & 0xff,
-	    (n->addr >> 8) & 0xff, n->addr & 0xff, n->plen,
-	    U64_SEC_UL(ft_time - n->oldest), U64_MSEC_UL(ft_time - n->oldest),
-	    U64_SEC_UL(ft_time - n->newest), U64_MSEC_UL(ft_time - n->newest));
-	/* reset fences */
-	n->first = ARP_NEVER;
-	n->last = 0;
-	/* iterate over children */
-	for (i = 0; i < 16; ++i) {
-		if (n->sub[i] == NULL)
-			continue;
-		if (n->sub[i]->plen < 32) {
-			/* check descendants first */
-			if (n->sub[i]->oldest < cutoff)
-				arp_expire(n->sub[i], cutoff);
+#if HAVE_PTHREAD
+	struct arp_table *t;
+
+	if (ft_workers > 0) {
+		pthread_mutex_lock(&arp_tables_lock);
+		for (t = arp_tables; t != NULL; t = t->next)
+			if (strcmp(t->name, i->name) == 0)
+				break;
+		if (t != NULL) {
+			t->refs++;
+		} else if ((t = arp_table_new(NULL)) != NULL) {
+			if ((t->name = strdup(i->name)) == NULL) {
+				arp_table_free(t);
+				t = NULL;
+			} else {
+				t->next = arp_tables;
+				arp_tables = t;
+			}
 		}
-		if (n->sub[i]->newest < cutoff) {
-			/* expired or empty */
-			arp_delete(n->sub[i]);
-			n->sub[i] = NULL;
-		}
-		if (n->sub[i] != NULL) {
-			/* update our fences */
-			if (n->sub[i]->newest < n->oldest)
-				n->oldest = n->sub[i]->newest;
-			if (n->sub[i]->newest > n->newest)
-				n->newest = n->sub[i]->newest;
-		}
-	}
-	ndel -= narpn;
-	nexp -= nleaves;
-	if (nexp > 0 || ndel > 0) {
-		ft_debug("expired %u nodes under %u.%u.%u.%u/%u (%u deleted)",
-		    nexp, (n->addr >> 24) & 0xff, (n->addr >> 16) & 0xff,
-		    (n->addr >> 8) & 0xff, n->addr & 0xff, n->plen, ndel);
+		pthread_mutex_unlock(&arp_tables_lock);
+		return (t);
 	}
+#endif
+	return (arp_table_new(i));
 }
 
 /*
- * Periodic maintenance
+ * Destroy a table and everything in it, once nobody uses it any more.
  */
 void
-arp_periodic(struct timeval *tv)
+arp_table_destroy(struct arp_table *t)
+{
+#if HAVE_PTHREAD
+	struct arp_table **tp;
+#endif
+
+	if (t == NULL)
+		return;
+#if HAVE_PTHREAD
+	if (t->name != NULL) {
+		pthread_mutex_lock(&arp_tables_lock);
+		if (--t->refs == 0) {
+			for (tp = &arp_tables; *tp != t; tp = &(*tp)->next)
+				/* nothing */ ;
+			*tp = t->next;
+		}
+		pthread_mutex_unlock(&arp_tables_lock);
+		if (t->refs > 0)
+			return;
+	}
+#endif
+	arp_table_free(t);
+}
+
+static uint64_t
+arp_clock(void)
 {
-	uint64_t now;
+	struct timespec ts;
 
-	now = tv->tv_sec * 1000;
-	arp_expire(NULL, now - ARP_EXPIRE);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
 }
 
 /*
- * Insert an address into a tree.
+ * Periodic maintenance.  Each run does a bounded amount of work, so
+ * the table is never held for long.  Returns 1 if there is more to do
+ * and it should be called again soon, and 0 otherwise.
  */
-static struct arpn *
-arp_insert(struct arpn *n, uint32_t addr)
+int
+arp_periodic(struct arp_table *t)
 {
-	struct arpn *sn, *rn;
-	uint32_t sub;
-	uint8_t splen;
-
-	if (n == NULL)
-		n = &arp_root;
-	if (n->plen == 32) {
-		ft_assert(n->addr == addr);
-		if (ft_time < n->first)
-			n->first = ft_time;
-		if (ft_time > n->last)
-			n->last = ft_time;
-		return (n);
-	}
-	splen = n->plen + 4;
-	sub = (addr >> (32 - splen)) % 16;
-	if ((sn = n->sub[sub]) == NULL) {
-		if ((sn = arp_new(addr, splen)) == NULL)
-			return (NULL);
-		if (sn->plen == 32) {
-			ft_verbose("arp: inserted %u.%u.%u.%u",
-			    (addr >> 24) & 0xff, (addr >> 16) & 0xff,
-			    (addr >> 8) & 0xff, addr & 0xff);
-			nleaves++;
-		}
-		n->sub[sub] = sn;
-	}
-	if ((rn = arp_insert(sn, addr)) == NULL)
-		return (NULL);
-	/* for non-leaf nodes, first / last means oldest / newest */
-	if (sn->newest < n->oldest)
-		n->oldest = sn->newest;
-	if (sn->newest > n->newest)
-		n->newest = sn->newest;
-	return (rn);
+	uint64_t start, pause;
+	int ret;
+
+	arp_lock(t);
+	start = arp_clock();
+	ret = arpt_expire(t->t, ft_time, ARP_EXPIRE_WORK);
+	(void)arpt_reclaim(t->t);
+	pause = arp_clock() - start;
+	t->nruns++;
+	if (ret != 0)
+		t->nshort++;
+	t->pause_sum += pause;
+	if (pause > t->pause_max)
+		t->pause_max = pause;
+	arp_unlock(t);
+	return (ret);
 }
 
 /*
- * ARP registration
+ * Log maintenance statistics since the last report.  Workers sharing
+ * a table all call this, but only the first one to do so after a run
+ * has anything to say.
  */
-int
-arp_register(const ip4_addr *ip4, const ether_addr *ether)
+void
+arp_report(struct arp_table *t)
+{
+	unsigned long nruns, nshort;
+	uint64_t pause_sum, pause_max;
+	const char *name;
+
+	arp_lock(t);
+	nruns = t->nruns;
+	nshort = t->nshort;
+	pause_sum = t->pause_sum;
+	pause_max = t->pause_max;
+	t->nruns = t->nshort = 0;
+	t->pause_sum = t->pause_max = 0;
+	arp_unlock(t);
+	if (nruns == 0)
+		return;
+#if HAVE_PTHREAD
+	name = t->i != NULL ? t->i->name : t->name;
+#else
+	name = t->i->name;
+#endif
+	pause_sum /= nruns;
+	ft_notice("%s: ARP table %lu entries, %lu expiry runs, %lu cut "
+	    "short, pause %lu.%03lu/%lu.%03lu us avg/max", name,
+	    arpt_count(t->t), nruns, nshort,
+	    (unsigned long)(pause_sum / 1000),
+	    (unsigned long)(pause_sum % 1000),
+	    (unsigned long)(pause_max / 1000),
+	    (unsigned long)(pause_max % 1000));
+}
+
+/*
+ * ARP registration, with the table locked
+ */
+static int
+arp_update(struct arp_table *t, const ip4_addr *ip4, const ether_addr *ether)
 {
-	struct arpn *an;
+	ether_addr old;
+	uint64_t state;
+	arpe *ae;
 
-	if ((an = arp_insert(NULL, be32toh(ip4->q))) == NULL)
+	if ((ae = arpt_insert(t->t, be32toh(ip4->q), ft_time)) == NULL)
 		return (-1);
-	if (memcmp(&an->ether, ether, sizeof an->ether) != 0) {
+	state = arpe_state(ae);
+	if ((state & ARPE_ETHER) != arpe_pack(ether)) {
 		/* warn if the ip4_addr moved from one ether_addr to another */
-		if (an->ether.o[0] || an->ether.o[1] || an->ether.o[2] ||
-		    an->ether.o[3] || an->ether.o[4] || an->ether.o[5]) {
+		if (state & ARPE_ETHER) {
+			arpe_unpack(state, &old);
 			ft_verbose("%u.%u.%u.%u moved"
 			    " from %02x:%02x:%02x:%02x:%02x:%02x"
 			    " to %02x:%02x:%02x:%02x:%02x:%02x",
 			    ip4->o[0], ip4->o[1], ip4->o[2], ip4->o[3],
-			    an->ether.o[0], an->ether.o[1], an->ether.o[2],
-			    an->ether.o[3], an->ether.o[4], an->ether.o[5],
+			    old.o[0], old.o[1], old.o[2],
+			    old.o[3], old.o[4], old.o[5],
 			    ether->o[0], ether->o[1], ether->o[2],
 			    ether->o[3], ether->o[4], ether->o[5]);
 		} else {
@@ -320,61 +318,90 @@ arp_register(const ip4_addr *ip4, const ether_addr *ether)
 			    ether->o[0], ether->o[1], ether->o[2],
 			    ether->o[3], ether->o[4], ether->o[5]);
 		}
-		memcpy(&an->ether, ether, sizeof an->ether);
+		arpe_set_state(ae, (state & ~ARPE_ETHER) | arpe_pack(ether));
 	}
-	an->nreq = 0;
+	arpe_set_nreq(ae, 0);
 	return (0);
 }
 
 /*
- * ARP lookup
+ * ARP registration
+ */
+int
+arp_register(struct arp_table *t, const ip4_addr *ip4,
+    const ether_addr *ether)
+{
+	int ret;
+
+	arp_lock(t);
+	ret = arp_update(t, ip4, ether);
+	arp_unlock(t);
+	return (ret);
+}
+
+/*
+ * ARP lookup.  Returns 2 if the address is reserved, 1 if we have
+ * claimed it, 0 if someone else has it, and -1 if it is unknown.  If
+ * ether is not NULL, it receives the address's Ethernet address, and if
+ * last is not NULL, when it was last seen.  Takes no lock, so any
+ * thread may call it at any time.
  */
 int
-arp_lookup(const ip4_addr *ip4, ether_addr *ether)
+arp_lookup(struct arp_table *t, const ip4_addr *ip4, ether_addr *ether,
+    uint64_t *last)
 {
-	struct arpn *an;
-
-	ft_debug("ARP lookup %u.%u.%u.%u",
-	    ip4->o[0], ip4->o[1], ip4->o[2], ip4->o[3]);
-	an = &arp_root;
-	if ((an = an->sub[ip4->o[0] / 16]) == NULL ||
-	    (an = an->sub[ip4->o[0] % 16]) == NULL ||
-	    (an = an->sub[ip4->o[1] / 16]) == NULL ||
-	    (an = an->sub[ip4->o[1] % 16]) == NULL ||
-	    (an = an->sub[ip4->o[2] / 16]) == NULL ||
-	    (an = an->sub[ip4->o[2] % 16]) == NULL ||
-	    (an = an->sub[ip4->o[3] / 16]) == NULL ||
-	    (an = an->sub[ip4->o[3] % 16]) == NULL)
+	arpe ae;
+
+	if (arpt_lookup(t->t, be32toh(ip4->q), &ae) != 0)
 		return (-1);
-	memcpy(ether, &an->ether, sizeof(ether_addr));
-	ft_debug("%u.%u.%u.%u is"
-	    " at %02x:%02x:%02x:%02x:%02x:%02x",
-	    ip4->o[0], ip4->o[1], ip4->o[2], ip4->o[3],
-	    ether->o[0], ether->o[1], ether->o[2],
-	    ether->o[3], ether->o[4], ether->o[5]);
-	return (0);
+	if (ether != NULL)
+		arpe_unpack(ae.state, ether);
+	if (last != NULL)
+		*last = ae.last;
+	if (ae.state & ARPE_RESERVED)
+		return (2);
+	return ((ae.state & ARPE_CLAIMED) ? 1 : 0);
+}
+
+/*
+ * Check without locking whether registering an address would change
+ * anything: it is already known at that Ethernet address, has no
+ * requests outstanding, and was seen recently enough.
+ */
+static int
+arp_current(struct arp_table *t, const ip4_addr *ip4,
+    const ether_addr *ether)
+{
+	arpe ae;
+
+	if (arpt_lookup(t->t, be32toh(ip4->q), &ae) != 0)
+		return (0);
+	return ((ae.state & ARPE_ETHER) == arpe_pack(ether) &&
+	    ae.nreq == 0 && ft_time < ae.last + ARP_REFRESH);
 }
 
 /*
  * Claim an IP address
  */
 static int
-arp_reply(const ether_flow *fl, const arp_pkt *iap, struct arpn *an)
+arp_reply(const flow *fl, const arp_pkt *iap)
 {
-	arp_pkt ap;
-
-	(void)an;
-
-	ap.htype = htobe16(arp_type_ether);
-	ap.ptype = htobe16(arp_type_ip4);
-	ap.hlen = 6;
-	ap.plen = 4;
-	ap.oper = htobe16(arp_oper_is_at);
-	memcpy(&ap.sha, &fl->p->i->ether, sizeof(ether_addr));
-	memcpy(&ap.spa, &iap->tpa, sizeof(ip4_addr));
-	memcpy(&ap.tha, &iap->sha, sizeof(ether_addr));
-	memcpy(&ap.tpa, &iap->spa, sizeof(ip4_addr));
-	if (ethernet_reply(fl, &ap, sizeof ap) != 0)
+	uint8_t *frame;
+	arp_pkt *ap;
+
+	if ((frame = ethernet_reply_frame(fl)) == NULL)
+		return (-1);
+	ap = (arp_pkt *)(frame + sizeof(ether_hdr));
+	ap->htype = htobe16(arp_type_ether);
+	ap->ptype = htobe16(arp_type_ip4);
+	ap->hlen = 6;
+	ap->plen = 4;
+	ap->oper = htobe16(arp_oper_is_at);
+	memcpy(&ap->sha, &fl->p->i->ether, sizeof(ether_addr));
+	memcpy(&ap->spa, &iap->tpa, sizeof(ip4_addr));
+	memcpy(&ap->tha, &iap->sha, sizeof(ether_addr));
+	memcpy(&ap->tpa, &iap->spa, sizeof(ip4_addr));
+	if (ethernet_reply(fl, frame, sizeof *ap) != 0)
 		return (-1);
 	return (0);
 }
@@ -383,16 +410,103 @@ arp_reply(const ether_flow *fl, const arp_pkt *iap, struct arpn *an)
  * Register a reserved address
  */
 int
-arp_reserve(const ip4_addr *addr)
+arp_reserve(struct arp_table *t, const ip4_addr *addr)
 {
-	struct arpn *an;
+	arpe *ae;
 
 	ft_debug("arp: reserving %u.%u.%u.%u",
 	    addr->o[0], addr->o[1], addr->o[2], addr->o[3]);
-	if ((an = arp_insert(NULL, be32toh(addr->q))) == NULL)
+	arp_lock(t);
+	if ((ae = arpt_insert(t->t, be32toh(addr->q), ft_time)) != NULL) {
+		ae->first = 0;
+		arpe_set_last(ae, 0);
+		arpe_set_state(ae, arpe_state(ae) | ARPE_RESERVED);
+	}
+	arp_unlock(t);
+	return (ae != NULL ? 0 : -1);
+}
+
+/*
+ * Account for a request for a claimed address which the XDP fast path
+ * answered: register the sender and keep the address from expiring.
+ */
+void
+arp_fast(struct arp_table *t, const ip4_addr *spa, const ether_addr *sha,
+    const ip4_addr *tpa)
+{
+	arpe *ae;
+
+	arp_lock(t);
+	arp_update(t, spa, sha);
+	if ((ae = arpt_insert(t->t, be32toh(tpa->q), ft_time)) != NULL)
+		arpe_set_nreq(ae, 0);
+	arp_unlock(t);
+}
+
+/*
+ * Handle an ARP request, with the table locked.  Returns 1 if it should
+ * be answered, which the caller does once it has released the lock.
+ */
+static int
+arp_who_has(struct arp_table *t, const flow *fl, const arp_pkt *ap)
+{
+	uint64_t state;
+	arpe *ae;
+
+	/* register sender */
+	arp_update(t, &ap->spa, &ap->sha);
+	/*
+	 * Note that arpt_insert() sets ae->last = ft_time so we don't
+	 * have to, but leaves ae->first untouched.  For new entries,
+	 * this is the magic value ARPT_NEVER.
+	 */
+	if ((ae = arpt_insert(t->t, be32toh(ap->tpa.q), ft_time)) == NULL)
 		return (-1);
-	an->first = an->last = 0;
-	an->reserved = 1;
+	if (ae->first == ARPT_NEVER) {
+		/* new entry */
+		ae->first = ft_time;
+	} else {
+		ft_verbose("%u.%u.%u.%u: last seen %lu.%03lu",
+		    ap->tpa.o[0], ap->tpa.o[1], ap->tpa.o[2],
+		    ap->tpa.o[3], U64_SEC_UL(ae->last),
+		    U64_MSEC_UL(ae->last));
+	}
+	state = arpe_state(ae);
+	if (state & ARPE_RESERVED) {
+		/* ignore */
+		ft_debug("\ttarget address is reserved");
+		arpe_set_nreq(ae, 0);
+	} else if (state & ARPE_CLAIMED) {
+		/* already ours, refresh */
+		ft_debug("refreshing %u.%u.%u.%u", ap->tpa.o[0],
+		    ap->tpa.o[1], ap->tpa.o[2], ap->tpa.o[3]);
+		arpe_set_nreq(ae, 0);
+#if HAVE_XDP_FAST
+		/* the fast path should have answered this */
+		iface_fast_claim(fl->p->i, ae->addr, 1);
+#endif
+		return (1);
+	} else if (ae->nreq == 0) {
+		/* new or stale, start over */
+		arpe_set_nreq(ae, 1);
+		ae->first = ft_time;
+	} else if (ae->nreq >= ARP_MINREQ &&
+	    ft_time - ae->first >= ARP_TIMEOUT) {
+		/* claim new address */
+		ft_verbose("claiming %u.%u.%u.%u nreq = %u in %lu ms",
+		    ap->tpa.o[0], ap->tpa.o[1], ap->tpa.o[2],
+		    ap->tpa.o[3], ae->nreq,
+		    (unsigned long)(ft_time - ae->first));
+		arpe_set_state(ae, (state & ~ARPE_ETHER) |
+		    arpe_pack(&fl->p->i->ether) | ARPE_CLAIMED);
+		arpe_set_nreq(ae, 0);
+#if HAVE_XDP_FAST
+		iface_fast_claim(fl->p->i, ae->addr, 1);
+#endif
+		return (1);
+	} else {
+		arpe_set_nreq(ae, ae->nreq + 1);
+	}
 	return (0);
 }
 
@@ -400,17 +514,21 @@ arp_reserve(const ip4_addr *addr)
  * Analyze a captured ARP packet
  */
 int
-packet_analyze_arp(const ether_flow *fl, const void *data, size_t len)
+packet_analyze_arp(const flow *fl)
 {
+	struct arp_table *t = fl->p->i->arp;
 	const arp_pkt *ap;
-	struct arpn *an;
+	uint64_t last;
+	size_t len;
+	int ret;
 
+	len = fl->p->caplen - fl->l3off;
 	if (len < sizeof(arp_pkt)) {
 		ft_verbose("%lu.%03lu short ARP packet (%zd < %zd)",
 		    FT_TIME_SEC_UL, FT_TIME_MSEC_UL, len, sizeof(arp_pkt));
 		return (-1);
 	}
-	ap = (const arp_pkt *)data;
+	ap = (const arp_pkt *)flow_l3(fl);
 	ft_debug("\tARP htype 0x%04hx ptype 0x%04hx hlen %hd plen %hd",
 	    be16toh(ap->htype), be16toh(ap->ptype), ap->hlen, ap->plen);
 	if (be16toh(ap->htype) != arp_type_ether || ap->hlen != 6 ||
@@ -434,6 +552,7 @@ packet_analyze_arp(const ether_flow *fl, const void *data, size_t len)
 		ft_verbose("\tunknown operation 0x%04x", be16toh(ap->oper));
 		return (0);
 	}
+	ret = 0;
 	switch (be16toh(ap->oper)) {
 	case arp_oper_who_has:
 		/* ARP request */
@@ -441,72 +560,50 @@ packet_analyze_arp(const ether_flow *fl, const void *data, size_t len)
 			ft_debug("\ttarget address is out of bounds");
 			break;
 		}
-		/* register sender */
-		arp_register(&ap->spa, &ap->sha);
 		/*
-		 * Note that arp_insert() sets an->last = ft_time so we
-		 * don't have to, but leaves an->first untouched.  For new
-		 * nodes, this is the magic value ARP_NEVER.
+		 * If we already know the sender and the target is one we
+		 * either answer for or ignore, there is nothing to change
+		 * and no need to lock the table.
 		 */
-		if ((an = arp_insert(NULL, be32toh(ap->tpa.q))) == NULL)
-			return (-1);
-		if (an->first == ARP_NEVER) {
-			/* new entry */
-			an->first = ft_time;
-		} else {
-			ft_verbose("%u.%u.%u.%u: last seen %lu.%03lu",
-			    ap->tpa.o[0], ap->tpa.o[1], ap->tpa.o[2],
-			    ap->tpa.o[3], U64_SEC_UL(an->last),
-			    U64_MSEC_UL(an->last));
-		}
-		if (an->reserved) {
-			/* ignore */
-			ft_debug("\ttarget address is reserved");
-			an->nreq = 0;
-		} else if (an->claimed) {
-			/* already ours, refresh */
-			ft_debug("refreshing %u.%u.%u.%u", ap->tpa.o[0],
-			    ap->tpa.o[1], ap->tpa.o[2], ap->tpa.o[3]);
-			an->nreq = 0;
-			if (arp_reply(fl, ap, an) != 0)
-				return (-1);
-		} else if (an->nreq == 0 || ft_time - an->last >= ARP_STALE) {
-			/* new or stale, start over */
-			an->nreq = 1;
-			an->first = ft_time;
-		} else if (an->nreq >= ARP_MINREQ &&
-		    ft_time - an->first >= ARP_TIMEOUT) {
-			/* claim new address */
-			ft_verbose("claiming %u.%u.%u.%u nreq = %u in %lu ms",
-			    ap->tpa.o[0], ap->tpa.o[1], ap->tpa.o[2],
-			    ap->tpa.o[3], an->nreq,
-			    (unsigned long)(ft_time - an->first));
-			an->ether = fl->p->i->ether;
-			an->claimed = 1;
-			an->nreq = 0;
-			if (arp_reply(fl, ap, an) != 0)
-				return (-1);
-		} else {
-			an->nreq++;
-			an->last = ft_time;
+		if (arp_current(t, &ap->spa, &ap->sha)) {
+			switch (arp_lookup(t, &ap->tpa, NULL, &last)) {
+			case 2:
+				ft_debug("\ttarget address is reserved");
+				goto done;
+			case 1:
+				if (ft_time >= last + ARP_REFRESH)
+					break;
+#if HAVE_XDP_FAST
+				/* the fast path should have answered this */
+				iface_fast_claim(fl->p->i,
+				    be32toh(ap->tpa.q), 1);
+#endif
+				ret = arp_reply(fl, ap);
+				goto done;
+			}
 		}
+		arp_lock(t);
+		ret = arp_who_has(t, fl, ap);
+		arp_unlock(t);
+		if (ret == 1)
+			ret = arp_reply(fl, ap);
 		break;
 	case arp_oper_is_at:
 		/* ARP reply */
-		arp_register(&ap->spa, &ap->sha);
-		arp_register(&ap->tpa, &ap->tha);
+		if (arp_current(t, &ap->spa, &ap->sha) &&
+		    arp_current(t, &ap->tpa, &ap->tha))
+			break;
+		arp_lock(t);
+		arp_update(t, &ap->spa, &ap->sha);
+		arp_update(t, &ap->tpa, &ap->tha);
+		arp_unlock(t);
 		break;
 	}
-	/* run expiry */
-	if (arp_root.oldest < ft_time - ARP_EXPIRE) {
-		arp_expire(&arp_root, ft_time - ARP_EXPIRE);
-		ft_debug("%u nodes / %u leaves in tree", narpn, nleaves);
-	} else if (arp_root.oldest != ARP_NEVER) {
-		ft_debug("%lu.%03lu s until expiry",
-		    (arp_root.oldest + ARP_EXPIRE - ft_time) / 1000,
-		    (arp_root.oldest + ARP_EXPIRE - ft_time) % 1000);
+done:
+	if (FT_LOG_LEVEL_DEBUG >= ft_log_level) {
+		arp_lock(t);
+		arpt_fprint(stderr, t->t, ft_time);
+		arp_unlock(t);
 	}
-	if (FT_LOG_LEVEL_DEBUG >= ft_log_level)
-		arp_print_tree(stderr, &arp_root);
-	return (0);
+	return (ret);
 }
@@ -0,0 +1,400 @@
+/*-
+ * Copyright (c) 2016-2018 The University of Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <ft/ethernet.h>
+#include <ft/ip4.h>
+#include <ft/log.h>
+
+#include "flytrap.h"
+#include "iface.h"
+#include "packet.h"
+
+/* number of batches in the ring (power of two) */
+#define CAPTURE_SLOTS		64
+
+/* maximum number of interfaces and of descriptors to poll */
+#define CAPTURE_MAXIFACE	64
+#define CAPTURE_MAXPOLLFD	256
+
+/* how long to wait (in ms) when the ring is full */
+#define CAPTURE_BACKOFF		1
+
+#define CAPTURE_CACHELINE	64
+
+/*
+ * A batch of packets from one interface.  Copying backends read into
+ * the slot's buffer; the others lend us frames, which are only released
+ * once the analysis thread is done with the batch.
+ */
+typedef struct capture_slot {
+	iface		*i;
+	unsigned int	 n;		/* number of packets */
+	unsigned long	 mark;		/* see iface_rx_mark() */
+	uint8_t		*buf;		/* PACKET_BATCH frames */
+	packet		 p[PACKET_BATCH];
+} capture_slot;
+
+/*
+ * A single-producer, single-consumer ring of batches.  The capture
+ * thread fills slots at the head and, once the analysis thread has
+ * moved the tail past them, releases their frames.  Each index is only
+ * ever written by one side, and they live on separate cache lines.
+ */
+static struct capture {
+	capture_slot	 slot[CAPTURE_SLOTS];
+	uint8_t		*buf;
+	iface		*ifaces[CAPTURE_MAXIFACE];
+	unsigned int	 nifaces;
+	pthread_t	 thread;
+	int		 running;
+	int		 wfd[2];	/* wakes the analysis thread */
+
+	/* capture thread */
+	unsigned long	 head __attribute__((__aligned__(CAPTURE_CACHELINE)));
+	unsigned long	 nreleased;	/* slots released */
+	unsigned long	 nfull;		/* waits for a free slot */
+	int		 eof;		/* 1 when done, -1 on error */
+
+	/* analysis thread */
+	unsigned long	 tail __attribute__((__aligned__(CAPTURE_CACHELINE)));
+	int		 waiting;	/* about to sleep */
+	int		 stop;		/* told to stop */
+	unsigned long	 nbatches;	/* batches analyzed */
+	unsigned long	 npackets;	/* packets analyzed */
+	unsigned long	 occ_sum;	/* ring occupancy at each batch */
+	unsigned int	 occ_max;
+} capture = { .wfd = { -1, -1 } };
+
+static void
+capture_wake(void)
+{
+	char c = 0;
+
+	(void)write(capture.wfd[1], &c, 1);
+}
+
+/*
+ * Release the frames of every batch the analysis thread is done with.
+ */
+static void
+capture_reclaim(void)
+{
+	capture_slot *s;
+	unsigned long tail;
+
+	tail = __atomic_load_n(&capture.tail, __ATOMIC_ACQUIRE);
+	for (; capture.nreleased != tail; capture.nreleased++) {
+		s = &capture.slot[capture.nreleased % CAPTURE_SLOTS];
+		iface_release(s->i, s->mark);
+	}
+}
+
+/*
+ * Hand a filled slot over to the analysis thread, and wake it up if it
+ * is waiting for one.
+ */
+static void
+capture_publish(void)
+{
+
+	__atomic_store_n(&capture.head, capture.head + 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&capture.waiting, __ATOMIC_SEQ_CST))
+		capture_wake();
+}
+
+static void
+capture_finish(int eof)
+{
+
+	__atomic_store_n(&capture.eof, eof, __ATOMIC_RELEASE);
+	capture_wake();
+}
+
+/*
+ * The capture thread: read a batch from each interface in turn into the
+ * next free slot, and wait for more when there is nothing to read.
+ */
+static void *
+capture_thread(void *arg)
+{
+	struct pollfd pfd[CAPTURE_MAXPOLLFD];
+	unsigned int k, neof, npfd, nlive;
+	capture_slot *s;
+	iface *i;
+	int n, more;
+
+	(void)arg;
+	npfd = nlive = 0;
+	for (k = 0; k < capture.nifaces; ++k) {
+		n = iface_pollfd(capture.ifaces[k], pfd + npfd,
+		    CAPTURE_MAXPOLLFD - npfd);
+		if (n >= 0) {
+			npfd += n;
+			nlive++;
+		}
+	}
+	while (!__atomic_load_n(&capture.stop, __ATOMIC_RELAXED)) {
+		capture_reclaim();
+		more = 0;
+		for (neof = k = 0; k < capture.nifaces; ++k) {
+			i = capture.ifaces[k];
+			if (iface_eof(i)) {
+				neof++;
+				continue;
+			}
+			if (capture.head - capture.nreleased == CAPTURE_SLOTS) {
+				__atomic_fetch_add(&capture.nfull, 1,
+				    __ATOMIC_RELAXED);
+				(void)poll(NULL, 0, CAPTURE_BACKOFF);
+				more = 1;
+				break;
+			}
+			s = &capture.slot[capture.head % CAPTURE_SLOTS];
+			i->rxbuf = s->buf;
+			if ((n = iface_next_batch(i, s->p, PACKET_BATCH)) < 0) {
+				ft_error("%s: capture failed: %m", i->name);
+				capture_finish(-1);
+				return (NULL);
+			}
+			if (n == 0) {
+				/* recheck at once if this was the end */
+				if (iface_eof(i))
+					more = 1;
+				continue;
+			}
+			s->i = i;
+			s->n = n;
+			s->mark = iface_rx_mark(i);
+			capture_publish();
+			if (n == PACKET_BATCH || nlive < capture.nifaces)
+				more = 1;
+		}
+		if (neof == capture.nifaces)
+			break;
+		if (!more && poll(pfd, npfd, IFACE_TIMEOUT) < 0 &&
+		    errno != EINTR) {
+			ft_error("capture: poll(): %m");
+			capture_finish(-1);
+			return (NULL);
+		}
+	}
+	capture_finish(1);
+	return (NULL);
+}
+
+/*
+ * Start capturing from the given interfaces on a separate thread.  The
+ * interfaces must already be active, and from now on only the capture
+ * thread reads from them, while the caller analyzes what it reads; see
+ * capture_next().
+ */
+int
+capture_start(iface **ifaces, unsigned int n)
+{
+	sigset_t all, saved;
+	unsigned int k;
+	int serrno;
+
+	if (n > CAPTURE_MAXIFACE) {
+		errno = E2BIG;
+		return (-1);
+	}
+	capture.buf = malloc((size_t)CAPTURE_SLOTS * PACKET_BATCH *
+	    IFACE_SNAPLEN);
+	if (capture.buf == NULL)
+		return (-1);
+	for (k = 0; k < CAPTURE_SLOTS; ++k) {
+		capture.slot[k].buf = capture.buf +
+		    (size_t)k * PACKET_BATCH * IFACE_SNAPLEN;
+	}
+	for (k = 0; k < n; ++k) {
+		capture.ifaces[k] = ifaces[k];
+		ifaces[k]->rxhold = 1;
+	}
+	capture.nifaces = n;
+	if (pipe(capture.wfd) != 0)
+		goto fail;
+	(void)fcntl(capture.wfd[0], F_SETFL, O_NONBLOCK);
+	(void)fcntl(capture.wfd[1], F_SETFL, O_NONBLOCK);
+
+	/* signals are for the main thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &saved);
+	errno = pthread_create(&capture.thread, NULL, capture_thread, NULL);
+	pthread_sigmask(SIG_SETMASK, &saved, NULL);
+	if (errno != 0)
+		goto fail;
+	capture.running = 1;
+	ft_verbose("capture thread started, %u x %u packet ring",
+	    CAPTURE_SLOTS, PACKET_BATCH);
+	return (0);
+fail:
+	serrno = errno;
+	capture_stop();
+	errno = serrno;
+	return (-1);
+}
+
+/*
+ * Stop the capture thread and release everything it holds.  The
+ * interfaces go back to being read directly.
+ */
+void
+capture_stop(void)
+{
+	unsigned int k;
+
+	if (capture.running) {
+		__atomic_store_n(&capture.stop, 1, __ATOMIC_RELAXED);
+		pthread_join(capture.thread, NULL);
+		capture.running = 0;
+	}
+	for (k = 0; k < capture.nifaces; ++k) {
+		capture.ifaces[k]->rxhold = 0;
+		capture.ifaces[k]->rxbuf = capture.ifaces[k]->buf;
+	}
+	capture.nifaces = 0;
+	if (capture.wfd[0] >= 0)
+		close(capture.wfd[0]);
+	if (capture.wfd[1] >= 0)
+		close(capture.wfd[1]);
+	capture.wfd[0] = capture.wfd[1] = -1;
+	free(capture.buf);
+	capture.buf = NULL;
+}
+
+/*
+ * Returns the next batch, with the number of packets in *n, or NULL if
+ * there is none.  The batch remains valid until capture_done().
+ */
+packet *
+capture_next(unsigned int *n)
+{
+	capture_slot *s;
+	unsigned long occ;
+	char buf[64];
+
+	if (capture.waiting) {
+		__atomic_store_n(&capture.waiting, 0, __ATOMIC_RELAXED);
+		while (read(capture.wfd[0], buf, sizeof buf) > 0)
+			/* nothing */ ;
+	}
+	occ = __atomic_load_n(&capture.head, __ATOMIC_ACQUIRE) -
+	    capture.tail;
+	if (occ == 0)
+		return (NULL);
+	capture.nbatches++;
+	capture.occ_sum += occ;
+	if (occ > capture.occ_max)
+		capture.occ_max = occ;
+	s = &capture.slot[capture.tail % CAPTURE_SLOTS];
+	capture.npackets += s->n;
+	*n = s->n;
+	return (s->p);
+}
+
+/*
+ * Hand the current batch back to the capture thread.
+ */
+void
+capture_done(void)
+{
+
+	__atomic_store_n(&capture.tail, capture.tail + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Get ready to wait for a batch.  Returns zero if one arrived in the
+ * meantime, in which case the caller should not wait, and otherwise
+ * fills in a poll descriptor which becomes ready when one does.
+ */
+int
+capture_pollfd(struct pollfd *pfd)
+{
+
+	__atomic_store_n(&capture.waiting, 1, __ATOMIC_SEQ_CST);
+	pfd->fd = capture.wfd[0];
+	pfd->events = POLLIN;
+	if (__atomic_load_n(&capture.head, __ATOMIC_SEQ_CST) != capture.tail ||
+	    __atomic_load_n(&capture.eof, __ATOMIC_ACQUIRE) != 0)
+		return (0);
+	return (1);
+}
+
+/*
+ * Returns 1 if the capture thread has reached the end of its input and
+ * every batch has been analyzed, -1 if it failed, and 0 otherwise.
+ */
+int
+capture_eof(void)
+{
+	int eof;
+
+	eof = __atomic_load_n(&capture.eof, __ATOMIC_ACQUIRE);
+	if (eof > 0 &&
+	    __atomic_load_n(&capture.head, __ATOMIC_ACQUIRE) != capture.tail)
+		return (0);
+	return (eof);
+}
+
+/*
+ * Log ring statistics.
+ */
+void
+capture_report(void)
+{
+	unsigned long nfull;
+
+	if (capture.nbatches == 0)
+		return;
+	nfull = __atomic_load_n(&capture.nfull, __ATOMIC_RELAXED);
+	ft_notice("capture: %lu batches, %lu packets, ring occupancy "
+	    "%lu.%02lu/%u avg/max of %u, %lu waits for a free slot",
+	    capture.nbatches,
+	    capture.npackets, capture.occ_sum / capture.nbatches,
+	    capture.occ_sum * 100 / capture.nbatches % 100,
+	    capture.occ_max, CAPTURE_SLOTS, nfull);
+}
@@ -33,19 +33,614 @@
 
 #include <sys/time.h>
 
+#if HAVE_IO_URING || HAVE_PTHREAD
+#include <errno.h>
+#include <fcntl.h>
+#endif
+#if HAVE_PTHREAD
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#endif
 #include <stdarg.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#if HAVE_IO_URING || HAVE_PTHREAD
+#include <stdlib.h>
+#include <string.h>
+#endif
+#if HAVE_PTHREAD
+#include <time.h>
+#endif
+#if HAVE_IO_URING || HAVE_PTHREAD
+#include <unistd.h>
+#endif
 
 #include <ft/ethernet.h>
 #include <ft/ip4.h>
+#include <ft/log.h>
 
 #include "flytrap.h"
 #include "flow.h"
+#if HAVE_IO_URING
+#include "uring.h"
+#endif
 
 static FILE *csvfile;
 
+/* write from a separate thread, flushing every so many ms */
+unsigned int ft_csv_async;
+
+#if HAVE_IO_URING
+/*
+ * When the main loop uses io_uring, the CSV file is a stdio stream
+ * whose buffer is copied into a chunk and handed to the ring each time
+ * stdio flushes it.  Chunks are written one at a time, in order.
+ */
+#define CSV_NCHUNK	4
+#define CSV_CHUNKSZ	65536
+
+struct csv_uring;
+
+struct csv_chunk {
+	uring_req		 req;
+	struct csv_uring	*cu;
+	size_t			 off;		/* bytes written so far */
+	size_t			 len;		/* bytes in chunk */
+	char			 data[CSV_CHUNKSZ];
+};
+
+struct csv_uring {
+	int			 fd;
+	unsigned int		 head;		/* oldest chunk */
+	unsigned int		 count;		/* chunks in use */
+	struct csv_chunk	 chunk[CSV_NCHUNK];
+};
+
+static void csv_uring_done(uring_req *, int);
+
+static int
+csv_uring_start(struct csv_uring *cu)
+{
+	struct csv_chunk *c;
+
+	c = &cu->chunk[cu->head];
+	if (cu->count == 0 || c->req.pending)
+		return (0);
+	return (uring_write(&c->req, cu->fd, c->data + c->off,
+	    c->len - c->off));
+}
+
+static void
+csv_uring_done(uring_req *req, int res)
+{
+	struct csv_chunk *c = (struct csv_chunk *)req;
+	struct csv_uring *cu = c->cu;
+
+	if (res < 0) {
+		errno = -res;
+		ft_warning("failed to write CSV file: %m");
+		c->off = c->len;
+	} else {
+		c->off += res;
+	}
+	if (c->off == c->len) {
+		c->off = c->len = 0;
+		cu->head = (cu->head + 1) % CSV_NCHUNK;
+		cu->count--;
+	}
+	if (csv_uring_start(cu) != 0)
+		ft_warning("failed to write CSV file: %m");
+}
+
+static ssize_t
+csv_uring_write(void *cookie, const char *buf, size_t size)
+{
+	struct csv_uring *cu = cookie;
+	struct csv_chunk *c;
+	size_t len, left;
+
+	if (!uring_active()) {
+		/* the ring is gone, finish up synchronously */
+		return (write(cu->fd, buf, size));
+	}
+	for (left = size; left > 0; left -= len, buf += len) {
+		c = &cu->chunk[(cu->head + cu->count - 1) % CSV_NCHUNK];
+		if (cu->count == 0 || c->req.pending ||
+		    c->len == CSV_CHUNKSZ) {
+			/* need a fresh chunk */
+			while (cu->count == CSV_NCHUNK)
+				if (uring_submit(-1) < 0)
+					return (-1);
+			c = &cu->chunk[(cu->head + cu->count) % CSV_NCHUNK];
+			cu->count++;
+		}
+		len = CSV_CHUNKSZ - c->len;
+		if (len > left)
+			len = left;
+		memcpy(c->data + c->len, buf, len);
+		c->len += len;
+	}
+	if (csv_uring_start(cu) != 0)
+		return (-1);
+	return (size);
+}
+
+static int
+csv_uring_close(void *cookie)
+{
+	struct csv_uring *cu = cookie;
+	int ret;
+
+	ret = 0;
+	while (cu->count > 0 && uring_active())
+		if ((ret = uring_submit(-1)) < 0)
+			break;
+	if (close(cu->fd) != 0)
+		ret = -1;
+	free(cu);
+	return (ret < 0 ? -1 : 0);
+}
+
+static FILE *
+csv_uring_open(const char *csvfn)
+{
+	cookie_io_functions_t iof = {
+		.write = csv_uring_write,
+		.close = csv_uring_close,
+	};
+	struct csv_uring *cu;
+	unsigned int k;
+	FILE *f;
+
+	if ((cu = calloc(1, sizeof *cu)) == NULL)
+		return (NULL);
+	for (k = 0; k < CSV_NCHUNK; ++k) {
+		cu->chunk[k].req.cb = csv_uring_done;
+		cu->chunk[k].cu = cu;
+	}
+	if ((cu->fd = open(csvfn, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+	    0666)) < 0) {
+		free(cu);
+		return (NULL);
+	}
+	if ((f = fopencookie(cu, "a", iof)) == NULL) {
+		close(cu->fd);
+		free(cu);
+		return (NULL);
+	}
+	setvbuf(f, NULL, _IOFBF, CSV_CHUNKSZ);
+	return (f);
+}
+#endif
+
+#if HAVE_PTHREAD
+/*
+ * With -L, csv_packet4() only copies each record into a bounded queue,
+ * and a writer thread formats the records and writes them out in large
+ * chunks, so that a slow disk never holds up packet analysis.  If the
+ * queue is full, the record is dropped and counted.
+ *
+ * The queue is a ring of fixed-size records, each with a sequence
+ * number which tells producers when the slot is free and the writer
+ * when it has been filled.  Any number of threads may queue records;
+ * only the writer consumes them.
+ */
+#define CSV_QUEUE	32768		/* records (power of two) */
+#define CSV_BUFSZ	262144		/* bytes per write() */
+#define CSV_LINEMAX	128		/* longest possible line */
+#define CSV_INFOLEN	16		/* last column */
+#define CSV_CACHELINE	64
+
+typedef struct csv_rec {
+	unsigned long	 seq;
+	uint64_t	 enq;		/* when queued (us) */
+	struct timeval	 tv;
+	const char	*proto;
+	ip4_addr	 sa, da;
+	uint16_t	 sp, dp;
+	uint32_t	 len;
+	char		 info[CSV_INFOLEN];
+} csv_rec;
+
+static struct csv_writer {
+	csv_rec		*rec;
+	char		*buf;
+	pthread_t	 thread;
+	int		 running;
+	int		 wfd[2];	/* wakes the writer */
+	uint64_t	 period;	/* how often the writer looks (us) */
+	uint64_t	 maxage;	/* write out lines this old (us) */
+	int		 newfd;		/* from csv_open(), or -1 */
+
+	/* producers */
+	unsigned long	 tail __attribute__((__aligned__(CSV_CACHELINE)));
+	unsigned long	 ndropped;	/* records lost to a full queue */
+	unsigned long	 hiwat;		/* highest occupancy */
+
+	/* writer */
+	unsigned long	 head __attribute__((__aligned__(CSV_CACHELINE)));
+	int		 fd;
+	int		 waiting;	/* about to sleep */
+	int		 stop;		/* told to stop */
+	size_t		 buflen;
+	unsigned long	 bufrecs;	/* records in buf */
+	uint64_t	 bufenq;	/* sum of their enq */
+	uint64_t	 bufold;	/* enq of the oldest */
+	unsigned long	 nrecs;		/* records written */
+	unsigned long	 nwrites;	/* write() calls */
+	uint64_t	 lag_sum;	/* time from queue to disk, per record */
+	uint64_t	 lag_max;
+} csvw = { .wfd = { -1, -1 }, .newfd = -1, .fd = -1 };
+
+static uint64_t
+csv_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+static void
+csv_wake(void)
+{
+	char c = 0;
+
+	(void)write(csvw.wfd[1], &c, 1);
+}
+
+/*
+ * Queue a record.  Returns -1 if the queue is full.
+ */
+static int
+csv_enqueue(const struct timeval *tv,
+    const ip4_addr *sa, int sp,
+    const ip4_addr *da, int dp,
+    const char *proto, size_t len, const char *fmt, va_list ap)
+{
+	unsigned long occ, pos, max, seq;
+	csv_rec *r;
+
+	pos = __atomic_load_n(&csvw.tail, __ATOMIC_RELAXED);
+	for (;;) {
+		r = &csvw.rec[pos % CSV_QUEUE];
+		seq = __atomic_load_n(&r->seq, __ATOMIC_ACQUIRE);
+		if (seq == pos) {
+			if (__atomic_compare_exchange_n(&csvw.tail, &pos,
+			    pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if ((long)(seq - pos) < 0) {
+			__atomic_fetch_add(&csvw.ndropped, 1,
+			    __ATOMIC_RELAXED);
+			errno = ENOBUFS;
+			return (-1);
+		} else {
+			pos = __atomic_load_n(&csvw.tail, __ATOMIC_RELAXED);
+		}
+	}
+	r->enq = csv_now();
+	r->tv = *tv;
+	r->proto = proto;
+	r->sa = *sa;
+	r->da = *da;
+	r->sp = sp;
+	r->dp = dp;
+	r->len = len;
+	if (fmt == NULL)
+		r->info[0] = '\0';
+	else if (strchr(fmt, '%') == NULL)
+		strncpy(r->info, fmt, sizeof r->info - 1);
+	else
+		vsnprintf(r->info, sizeof r->info, fmt, ap);
+	r->info[sizeof r->info - 1] = '\0';
+	__atomic_store_n(&r->seq, pos + 1, __ATOMIC_RELEASE);
+
+	/* track the high-water mark, and hurry the writer along */
+	occ = pos + 1 - __atomic_load_n(&csvw.head, __ATOMIC_RELAXED);
+	max = __atomic_load_n(&csvw.hiwat, __ATOMIC_RELAXED);
+	while (occ > max && !__atomic_compare_exchange_n(&csvw.hiwat, &max,
+	    occ, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		/* nothing */ ;
+	if (occ >= CSV_QUEUE / 2 &&
+	    __atomic_exchange_n(&csvw.waiting, 0, __ATOMIC_SEQ_CST))
+		csv_wake();
+	return (0);
+}
+
+/*
+ * Write out whatever the writer has buffered, and switch to a new file
+ * if csv_open() has left us one.
+ */
+static void
+csv_writeout(void)
+{
+	uint64_t now;
+	ssize_t ret;
+	size_t off;
+	int fd;
+
+	for (off = 0; off < csvw.buflen; off += ret) {
+		ret = write(csvw.fd, csvw.buf + off, csvw.buflen - off);
+		if (ret < 0 && errno == EINTR) {
+			ret = 0;
+		} else if (ret < 0) {
+			ft_warning("failed to write CSV file: %m");
+			break;
+		}
+	}
+	if (csvw.bufrecs > 0) {
+		now = csv_now();
+		__atomic_store_n(&csvw.nrecs, csvw.nrecs + csvw.bufrecs,
+		    __ATOMIC_RELAXED);
+		__atomic_store_n(&csvw.nwrites, csvw.nwrites + 1,
+		    __ATOMIC_RELAXED);
+		__atomic_store_n(&csvw.lag_sum,
+		    csvw.lag_sum + csvw.bufrecs * now - csvw.bufenq,
+		    __ATOMIC_RELAXED);
+		if (now - csvw.bufold > csvw.lag_max) {
+			__atomic_store_n(&csvw.lag_max, now - csvw.bufold,
+			    __ATOMIC_RELAXED);
+		}
+	}
+	csvw.buflen = 0;
+	csvw.bufrecs = 0;
+	csvw.bufenq = 0;
+	if ((fd = __atomic_exchange_n(&csvw.newfd, -1,
+	    __ATOMIC_ACQ_REL)) >= 0) {
+		if (csvw.fd != STDOUT_FILENO)
+			close(csvw.fd);
+		csvw.fd = fd;
+	}
+}
+
+/*
+ * Append the decimal representation of a number, padded with zeroes to
+ * at least the given width.
+ */
+static char *
+csv_fmtu(char *p, unsigned long long u, unsigned int width)
+{
+	char digits[24], *q;
+
+	q = digits + sizeof digits;
+	do {
+		*--q = '0' + u % 10;
+		u /= 10;
+	} while (u > 0 || digits + sizeof digits - q < (long)width);
+	while (q < digits + sizeof digits)
+		*p++ = *q++;
+	return (p);
+}
+
+static char *
+csv_fmtip(char *p, const ip4_addr *a)
+{
+	unsigned int k;
+
+	for (k = 0; k < 4; ++k) {
+		p = csv_fmtu(p, a->o[k], 0);
+		*p++ = k < 3 ? '.' : ',';
+	}
+	return (p);
+}
+
+static char *
+csv_fmts(char *p, const char *s, char sep)
+{
+
+	while (*s != '\0')
+		*p++ = *s++;
+	if (sep != '\0')
+		*p++ = sep;
+	return (p);
+}
+
+/*
+ * Format a record into the buffer.  This is the writer's inner loop,
+ * hence no printf().  The result is the same as csv_packet4()'s.
+ */
+static void
+csv_format(const csv_rec *r)
+{
+	char *p;
+
+	p = csvw.buf + csvw.buflen;
+	p = csv_fmtu(p, r->tv.tv_sec, 0);
+	*p++ = '.';
+	p = csv_fmtu(p, r->tv.tv_usec, 6);
+	*p++ = ',';
+	p = csv_fmtip(p, &r->sa);
+	p = csv_fmtu(p, r->sp, 0);
+	*p++ = ',';
+	p = csv_fmtip(p, &r->da);
+	p = csv_fmtu(p, r->dp, 0);
+	*p++ = ',';
+	p = csv_fmts(p, r->proto, ',');
+	p = csv_fmtu(p, r->len, 0);
+	*p++ = ',';
+	p = csv_fmts(p, r->info, '\n');
+	csvw.buflen = p - csvw.buf;
+}
+
+/*
+ * Format every queued record into the buffer, writing it out whenever
+ * it fills up.  Returns the number of records consumed.
+ */
+static unsigned int
+csv_drain(void)
+{
+	unsigned int n;
+	csv_rec *r;
+
+	for (n = 0; ; ++n) {
+		r = &csvw.rec[csvw.head % CSV_QUEUE];
+		if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) !=
+		    csvw.head + 1)
+			break;
+		if (CSV_BUFSZ - csvw.buflen < CSV_LINEMAX)
+			csv_writeout();
+		if (csvw.bufrecs++ == 0)
+			csvw.bufold = r->enq;
+		csvw.bufenq += r->enq;
+		csv_format(r);
+		__atomic_store_n(&r->seq, csvw.head + CSV_QUEUE,
+		    __ATOMIC_RELEASE);
+		__atomic_store_n(&csvw.head, csvw.head + 1, __ATOMIC_RELAXED);
+	}
+	return (n);
+}
+
+/*
+ * The writer thread: drain the queue, write out lines that have been
+ * waiting long enough, and otherwise sleep until the next look.
+ */
+static void *
+csv_writer(void *arg)
+{
+	struct pollfd pfd;
+	char buf[64];
+	csv_rec *r;
+
+	(void)arg;
+	pfd.fd = csvw.wfd[0];
+	pfd.events = POLLIN;
+	for (;;) {
+		if (csv_drain() > 0)
+			continue;
+		if (__atomic_load_n(&csvw.stop, __ATOMIC_ACQUIRE))
+			break;
+		if (csvw.bufrecs > 0 && csv_now() - csvw.bufold >= csvw.maxage)
+			csv_writeout();
+		else if (__atomic_load_n(&csvw.newfd, __ATOMIC_RELAXED) >= 0)
+			csv_writeout();
+		__atomic_store_n(&csvw.waiting, 1, __ATOMIC_SEQ_CST);
+		r = &csvw.rec[csvw.head % CSV_QUEUE];
+		if (__atomic_load_n(&r->seq, __ATOMIC_SEQ_CST) ==
+		    csvw.head + 1) {
+			__atomic_store_n(&csvw.waiting, 0, __ATOMIC_RELAXED);
+			continue;
+		}
+		(void)poll(&pfd, 1, csvw.period / 1000);
+		__atomic_store_n(&csvw.waiting, 0, __ATOMIC_RELAXED);
+		while (read(csvw.wfd[0], buf, sizeof buf) > 0)
+			/* nothing */ ;
+	}
+	csv_writeout();
+	return (NULL);
+}
+
+/*
+ * Stop the writer after it has written out everything queued so far.
+ */
+static void
+csv_writer_stop(void)
+{
+	int fd;
+
+	if (csvw.running) {
+		__atomic_store_n(&csvw.stop, 1, __ATOMIC_RELEASE);
+		csv_wake();
+		pthread_join(csvw.thread, NULL);
+		csvw.running = 0;
+	}
+	if ((fd = __atomic_exchange_n(&csvw.newfd, -1,
+	    __ATOMIC_RELAXED)) >= 0 && fd != STDOUT_FILENO)
+		close(fd);
+	if (csvw.fd >= 0 && csvw.fd != STDOUT_FILENO)
+		close(csvw.fd);
+	csvw.fd = -1;
+	if (csvw.wfd[0] >= 0)
+		close(csvw.wfd[0]);
+	if (csvw.wfd[1] >= 0)
+		close(csvw.wfd[1]);
+	csvw.wfd[0] = csvw.wfd[1] = -1;
+	free(csvw.rec);
+	csvw.rec = NULL;
+	free(csvw.buf);
+	csvw.buf = NULL;
+}
+
+static int
+csv_writer_start(int fd)
+{
+	sigset_t all, saved;
+	unsigned long k;
+	int serrno;
+
+	csvw.rec = calloc(CSV_QUEUE, sizeof *csvw.rec);
+	csvw.buf = malloc(CSV_BUFSZ);
+	if (csvw.rec == NULL || csvw.buf == NULL)
+		goto fail;
+	for (k = 0; k < CSV_QUEUE; ++k)
+		csvw.rec[k].seq = k;
+	csvw.head = csvw.tail = 0;
+	csvw.stop = 0;
+
+	/* look often enough that no line waits much longer than -L */
+	csvw.period = (uint64_t)ft_csv_async * 1000 / 4;
+	if (csvw.period < 1000)
+		csvw.period = 1000;
+	csvw.maxage = (uint64_t)ft_csv_async * 1000;
+	csvw.maxage = csvw.maxage > csvw.period ?
+	    csvw.maxage - csvw.period : 0;
+	if (pipe(csvw.wfd) != 0)
+		goto fail;
+	(void)fcntl(csvw.wfd[0], F_SETFL, O_NONBLOCK);
+	(void)fcntl(csvw.wfd[1], F_SETFL, O_NONBLOCK);
+	csvw.fd = fd;
+
+	/* signals are for the main thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &saved);
+	errno = pthread_create(&csvw.thread, NULL, csv_writer, NULL);
+	pthread_sigmask(SIG_SETMASK, &saved, NULL);
+	if (errno != 0)
+		goto fail;
+	csvw.running = 1;
+	ft_verbose("CSV writer started, %u record queue, flushing every "
+	    "%u ms", CSV_QUEUE, ft_csv_async);
+	return (0);
+fail:
+	serrno = errno;
+	csvw.fd = -1;
+	csv_writer_stop();
+	errno = serrno;
+	return (-1);
+}
+
+/*
+ * Open the CSV file for the writer thread, starting it if necessary.
+ * If it is already running, it switches to the new file once it has
+ * written out what it has buffered for the old one.
+ */
+static int
+csv_writer_open(const char *csvfn)
+{
+	int fd;
+
+	if (csvfn == NULL)
+		fd = STDOUT_FILENO;
+	else if ((fd = open(csvfn, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+	    0666)) < 0)
+		return (-1);
+	if (!csvw.running) {
+		if (csv_writer_start(fd) != 0) {
+			if (fd != STDOUT_FILENO)
+				close(fd);
+			return (-1);
+		}
+		return (0);
+	}
+	if ((fd = __atomic_exchange_n(&csvw.newfd, fd,
+	    __ATOMIC_ACQ_REL)) >= 0 && fd != STDOUT_FILENO)
+		close(fd);
+	csv_wake();
+	return (0);
+}
+#endif
+
 int
 csv_packet4(const struct timeval *tv,
     const ip4_addr *sa, int sp,
@@ -54,7 +649,18 @@ csv_packet4(const struct timeval *tv,
 {
 	va_list ap;
 	FILE *f;
+#if HAVE_PTHREAD
+	int ret;
+#endif
 
+#if HAVE_PTHREAD
+	if (csvw.running) {
+		va_start(ap, fmt);
+		ret = csv_enqueue(tv, sa, sp, da, dp, proto, len, fmt, ap);
+		va_end(ap);
+		return (ret);
+	}
+#endif
 	if ((f = csvfile) == NULL)
 		f = stdout;
 	fprintf(f, "%llu.%06lu,%u.%u.%u.%u,%d,%u.%u.%u.%u,%d,%s,%zu,",
@@ -68,18 +674,45 @@ csv_packet4(const struct timeval *tv,
 		va_end(ap);
 	}
 	fprintf(f, "\n");
-	fflush(f);
 	return (0);
 }
 
+/*
+ * Flush buffered output; called periodically from the main loop.  The
+ * writer thread, if there is one, flushes on its own schedule.
+ */
+int
+csv_flush(void)
+{
+	FILE *f;
+
+#if HAVE_PTHREAD
+	if (csvw.running)
+		return (0);
+#endif
+	if ((f = csvfile) == NULL)
+		f = stdout;
+	return (fflush(f) == 0 ? 0 : -1);
+}
+
 int
 csv_open(const char *csvfn)
 {
 	FILE *nf, *of;
 
+#if HAVE_PTHREAD
+	if (ft_csv_async)
+		return (csv_writer_open(csvfn));
+#endif
 	if (csvfn == NULL)
 		nf = stdout;
-	else if ((nf = fopen(csvfn, "a")) == NULL)
+#if HAVE_IO_URING
+	else if (uring_active())
+		nf = csv_uring_open(csvfn);
+#endif
+	else
+		nf = fopen(csvfn, "a");
+	if (nf == NULL)
 		return (-1);
 	of = csvfile;
 	csvfile = nf;
@@ -87,3 +720,51 @@ csv_open(const char *csvfn)
 		fclose(of);
 	return (0);
 }
+
+/*
+ * Write out everything logged so far and close the CSV file.
+ */
+int
+csv_close(void)
+{
+	FILE *f;
+
+#if HAVE_PTHREAD
+	if (csvw.running) {
+		csv_writer_stop();
+		csv_report();
+	}
+#endif
+	if ((f = csvfile) == NULL)
+		return (0);
+	csvfile = NULL;
+	if (f == stdout)
+		return (fflush(f) == 0 ? 0 : -1);
+	return (fclose(f) == 0 ? 0 : -1);
+}
+
+/*
+ * Log writer statistics.
+ */
+void
+csv_report(void)
+{
+#if HAVE_PTHREAD
+	unsigned long nrecs, nwrites;
+	uint64_t lag_sum, lag_max;
+
+	if (!ft_csv_async)
+		return;
+	nrecs = __atomic_load_n(&csvw.nrecs, __ATOMIC_RELAXED);
+	nwrites = __atomic_load_n(&csvw.nwrites, __ATOMIC_RELAXED);
+	lag_sum = __atomic_load_n(&csvw.lag_sum, __ATOMIC_RELAXED);
+	lag_max = __atomic_load_n(&csvw.lag_max, __ATOMIC_RELAXED);
+	ft_notice("CSV: %lu records in %lu writes, %lu dropped, queue "
+	    "high-water %lu of %u, lag %lu/%lu ms avg/max",
+	    nrecs, nwrites,
+	    __atomic_load_n(&csvw.ndropped, __ATOMIC_RELAXED),
+	    __atomic_load_n(&csvw.hiwat, __ATOMIC_RELAXED), CSV_QUEUE,
+	    nrecs > 0 ? (unsigned long)(lag_sum / nrecs / 1000) : 0UL,
+	    (unsigned long)(lag_max / 1000));
+#endif
+}
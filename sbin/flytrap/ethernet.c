@@ -48,21 +48,21 @@
 #include "iface.h"
 #include "packet.h"
 
+/*
+ * Decode the Ethernet header of a captured packet.
+ */
 int
-packet_analyze_ethernet(const packet *p, const void *data, size_t len)
+ethernet_decode(flow *fl, const packet *p)
 {
-	ether_flow fl;
 	const ether_hdr *eh;
-	int ret;
 
-	if (len < sizeof(ether_hdr)) {
+	if (p->caplen < sizeof(ether_hdr)) {
 		ft_verbose("%lu.%03lu short Ethernet packet (%zd < %zd)",
-		    FT_TIME_SEC_UL, FT_TIME_MSEC_UL, len, sizeof(ether_hdr));
+		    FT_TIME_SEC_UL, FT_TIME_MSEC_UL, p->caplen,
+		    sizeof(ether_hdr));
 		return (-1);
 	}
-	eh = data;
-	data = eh + 1;
-	len -= sizeof *eh;
+	eh = p->data;
 	ft_debug("%lu.%03lu recv type %04x packet "
 	    "from %02x:%02x:%02x:%02x:%02x:%02x "
 	    "to %02x:%02x:%02x:%02x:%02x:%02x "
@@ -72,43 +72,42 @@ packet_analyze_ethernet(const packet *p, const void *data, size_t len)
 	    eh->src.o[3], eh->src.o[4], eh->src.o[5],
 	    eh->dst.o[0], eh->dst.o[1], eh->dst.o[2],
 	    eh->dst.o[3], eh->dst.o[4], eh->dst.o[5],
-	    len);
-	fl.p = p;
-	fl.src = eh->src;
-	fl.dst = eh->dst;
-	fl.type = be16toh(eh->type);
-	fl.len = len;
-	switch (fl.type) {
-	case ether_type_arp:
-		ret = packet_analyze_arp(&fl, data, len);
-		break;
-	case ether_type_ip:
-		ret = packet_analyze_ip4(&fl, data, len);
-		break;
-	default:
-		ret = -1;
-	}
-	return (ret);
+	    p->caplen - sizeof *eh);
+	fl->p = p;
+	fl->esrc = eh->src;
+	fl->edst = eh->dst;
+	fl->etype = be16toh(eh->type);
+	fl->l3off = sizeof *eh;
+	return (0);
+}
+
+/*
+ * Return a frame in which to build a reply to the given flow.
+ */
+uint8_t *
+ethernet_reply_frame(const flow *fl)
+{
+
+	return (iface_reply_frame(fl->p->i));
 }
 
+/*
+ * Queue a complete frame for transmission.
+ */
 int
-ethernet_send(iface *i, ether_type type, const ether_addr *dst,
-    const void *data, size_t len)
+ethernet_transmit(iface *i, uint8_t *frame, size_t len)
 {
 	packet p;
-	ether_hdr *eh;
+	const ether_hdr *eh;
 	int ret;
 
+	eh = (const ether_hdr *)frame;
 	p.i = i;
-	p.len = sizeof *eh + len;
-	if ((eh = malloc(p.len)) == NULL)
-		return (-1);
-	p.data = eh;
-	memcpy(&eh->dst, dst, sizeof eh->dst);
-	memcpy(&eh->src, &i->ether, sizeof eh->src);
-	eh->type = htobe16(type);
-	memcpy(eh + 1, data, len);
-	gettimeofday(&p.ts, NULL);
+	p.ts = ft_rxtime;
+	p.data = frame;
+	p.caplen = p.len = len;
+	p.csum = packet_csum_unknown;
+	p.queue = ft_rxqueue;
 	ft_debug("%lu.%03lu send type %04x packet "
 	    "from %02x:%02x:%02x:%02x:%02x:%02x "
 	    "to %02x:%02x:%02x:%02x:%02x:%02x",
@@ -117,21 +116,36 @@ ethernet_send(iface *i, ether_type type, const ether_addr *dst,
 	    eh->src.o[3], eh->src.o[4], eh->src.o[5],
 	    eh->dst.o[0], eh->dst.o[1], eh->dst.o[2],
 	    eh->dst.o[3], eh->dst.o[4], eh->dst.o[5]);
-	ret = iface_transmit(&p);
-	free(eh);
-	if (ret != 0) {
+	if ((ret = iface_transmit(&p)) != 0) {
 		ft_warning("failed to send type %04x packet "
-		    "to %02x:%02x:%02x:%02x:%02x:%02x",
+		    "to %02x:%02x:%02x:%02x:%02x:%02x", be16toh(eh->type),
 		    eh->dst.o[0], eh->dst.o[1], eh->dst.o[2],
 		    eh->dst.o[3], eh->dst.o[4], eh->dst.o[5]);
 	}
 	return (ret);
 }
 
+/*
+ * Fill in the Ethernet header of a frame whose payload of the given
+ * length is already in place, and queue it for transmission.
+ */
+int
+ethernet_send(iface *i, ether_type type, const ether_addr *dst,
+    uint8_t *frame, size_t len)
+{
+	ether_hdr *eh;
+
+	eh = (ether_hdr *)frame;
+	memcpy(&eh->dst, dst, sizeof eh->dst);
+	memcpy(&eh->src, &i->ether, sizeof eh->src);
+	eh->type = htobe16(type);
+	return (ethernet_transmit(i, frame, sizeof *eh + len));
+}
+
 int
-ethernet_reply(const ether_flow *fl, const void *data, size_t len)
+ethernet_reply(const flow *fl, uint8_t *frame, size_t len)
 {
 
-	return (ethernet_send(fl->p->i, fl->type, &fl->src, data, len));
+	return (ethernet_send(fl->p->i, fl->etype, &fl->esrc, frame, len));
 }
 
@@ -0,0 +1,198 @@
+/*-
+ * Copyright (c) 2016-2018 The University of Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if HAVE_PCAP_PCAP_H
+#include <pcap/pcap.h>
+#elif HAVE_PCAP_H
+#include <pcap.h>
+#endif
+
+#include <ft/arp.h>
+#include <ft/ethernet.h>
+#include <ft/ip4.h>
+#include <ft/log.h>
+
+#include "flytrap.h"
+#include "iface.h"
+
+/*
+ * Maximum number of ranges we test for per address set.  This keeps
+ * every conditional jump within reach, and the whole program well below
+ * the kernel's limit of 4,096 instructions.
+ */
+#define FILTER_MAXRANGES	127
+#define FILTER_MAXINSNS		1024
+
+static void
+filter_stmt(struct bpf_program *fprog, uint16_t code, uint32_t k)
+{
+	struct bpf_insn *insn;
+
+	insn = &fprog->bf_insns[fprog->bf_len++];
+	insn->code = code;
+	insn->jt = insn->jf = 0;
+	insn->k = k;
+}
+
+static void
+filter_jump(struct bpf_program *fprog, uint16_t code, uint32_t k,
+    uint8_t jt, uint8_t jf)
+{
+	struct bpf_insn *insn;
+
+	insn = &fprog->bf_insns[fprog->bf_len++];
+	insn->code = code;
+	insn->jt = jt;
+	insn->jf = jf;
+	insn->k = k;
+}
+
+/*
+ * Generate code which drops the packet unless the address at the given
+ * offset is in the set.  The set is flattened into a sorted list of
+ * ranges, each of which costs two comparisons, and we give up as soon as
+ * we reach one which starts above the address.  If there are too many
+ * ranges, we generate nothing and leave it to packet_analyze().
+ */
+static void
+filter_set(struct bpf_program *fprog, const char *what, unsigned int off,
+    const ip4s_node *set)
+{
+	uint32_t first[FILTER_MAXRANGES], last[FILTER_MAXRANGES];
+	unsigned long i, n;
+
+	n = ip4s_ranges(set, first, last, FILTER_MAXRANGES);
+	if (n > FILTER_MAXRANGES) {
+		ft_verbose("filter: %s set has %lu ranges, "
+		    "not filtering on it", what, n);
+		return;
+	}
+	if (n == 1 && first[0] == 0 && last[0] == 0xffffffffU)
+		return;
+	filter_stmt(fprog, BPF_LD | BPF_W | BPF_ABS, off);
+	for (i = 0; i < n; ++i) {
+		/* below this range: drop */
+		filter_jump(fprog, BPF_JMP | BPF_JGE | BPF_K, first[i],
+		    0, 2 * (n - i) - 1);
+		/* within this range: skip the rest */
+		filter_jump(fprog, BPF_JMP | BPF_JGT | BPF_K, last[i],
+		    0, 2 * (n - i) - 1);
+	}
+	filter_stmt(fprog, BPF_RET | BPF_K, 0);
+}
+
+/*
+ * Generate a filter program which accepts ARP packets and any packet
+ * addressed to us or to the broadcast address.  If we were given source
+ * and / or destination sets, IP packets and ARP requests which fall
+ * outside them are dropped.  The program returns the number of bytes to
+ * capture: fulllen for ICMP echo requests, which we need in their
+ * entirety to reply to, and hdrlen for everything else.  The caller must
+ * release the program with pcap_freecode().
+ */
+int
+filter_compile(struct bpf_program *fprog, const ether_addr *ea,
+    const ip4s_node *src, const ip4s_node *dst,
+    unsigned int hdrlen, unsigned int fulllen)
+{
+	const struct bpf_insn mac[] = {
+		/* our address: check IP */
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 2),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+		    (uint32_t)ea->o[2] << 24 | (uint32_t)ea->o[3] << 16 |
+		    (uint32_t)ea->o[4] << 8 | ea->o[5], 0, 2),
+		BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 0),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+		    (uint32_t)ea->o[0] << 8 | ea->o[1], 5, 0),
+		/* broadcast address: check IP, else drop */
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 2),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0xffffffffU, 0, 2),
+		BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 0),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0xffffU, 1, 0),
+		BPF_STMT(BPF_RET | BPF_K, 0),
+		/* IPv4: check addresses, else accept */
+		BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 12),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ether_type_ip, 1, 0),
+		BPF_STMT(BPF_RET | BPF_K, hdrlen),
+	};
+	const struct bpf_insn echo[] = {
+		/* ICMP, first fragment, echo request: capture it all */
+		BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 23),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ip_proto_icmp, 0, 5),
+		BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 20),
+		BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x1fff, 3, 0),
+		BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 14),
+		BPF_STMT(BPF_LD | BPF_B | BPF_IND, 14),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, icmp_type_echo_request, 1, 0),
+		BPF_STMT(BPF_RET | BPF_K, hdrlen),
+		BPF_STMT(BPF_RET | BPF_K, fulllen),
+	};
+	unsigned int arp;
+
+	fprog->bf_insns = malloc(FILTER_MAXINSNS * sizeof *fprog->bf_insns);
+	if (fprog->bf_insns == NULL)
+		return (-1);
+	fprog->bf_len = 0;
+	/* ARP: skip to the end */
+	filter_stmt(fprog, BPF_LD | BPF_H | BPF_ABS, 12);
+	filter_jump(fprog, BPF_JMP | BPF_JEQ | BPF_K, ether_type_arp, 0, 1);
+	arp = fprog->bf_len;
+	filter_stmt(fprog, BPF_JMP | BPF_JA, 0);
+	memcpy(fprog->bf_insns + fprog->bf_len, mac, sizeof mac);
+	fprog->bf_len += sizeof mac / sizeof mac[0];
+	/* IP source and destination addresses */
+	if (src != NULL)
+		filter_set(fprog, "source", 14 + 12, src);
+	if (dst != NULL)
+		filter_set(fprog, "destination", 14 + 16, dst);
+	memcpy(fprog->bf_insns + fprog->bf_len, echo, sizeof echo);
+	fprog->bf_len += sizeof echo / sizeof echo[0];
+	/* ARP: check target address of requests, else accept */
+	fprog->bf_insns[arp].k = fprog->bf_len - arp - 1;
+	if (dst != NULL) {
+		filter_stmt(fprog, BPF_LD | BPF_H | BPF_ABS, 14 + 6);
+		filter_jump(fprog, BPF_JMP | BPF_JEQ | BPF_K,
+		    arp_oper_who_has, 1, 0);
+		filter_stmt(fprog, BPF_RET | BPF_K, hdrlen);
+		filter_set(fprog, "ARP target", 14 + 24, dst);
+	}
+	filter_stmt(fprog, BPF_RET | BPF_K, hdrlen);
+	return (0);
+}
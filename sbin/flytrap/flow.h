@@ -30,6 +30,8 @@
 #ifndef FLYTRAP_FLOW_H_INCLUDED
 #define FLYTRAP_FLOW_H_INCLUDED
 
+struct arp_table;
+struct tcp4_tmpl;
 struct iface;
 struct packet;
 struct timeval;
@@ -39,47 +41,87 @@ extern ether_addr flytrap_ether_addr;
 
 #define FLYTRAP_TCP4_SEQ 0x18110902U
 
-typedef struct ether_flow {
-	const struct packet	*p;
-	ether_addr		 src;
-	ether_addr		 dst;
-	uint16_t		 type;
-	uint16_t		 len;
-} ether_flow;
-
 extern ip4s_node *src_set;
 extern ip4s_node *dst_set;
 
-typedef struct ip4_flow {
-	const struct ether_flow	*eth;
-	/* pseudo-header */
-	union {
-		uint8_t		 pseudo[12];
-		struct {
-			ip4_addr	 src;
-			ip4_addr	 dst;
-			uint16_t	 proto;
-			uint16_t	 len;
-		} __attribute__((__packed__));
-	};
-	uint16_t	 sum;
-} ip4_flow;
-
-int	 arp_register(const ip4_addr *, const ether_addr *);
-int	 arp_lookup(const ip4_addr *, ether_addr *);
+/*
+ * Everything the handlers, the reply builders and the logging code
+ * need to know about a received packet, decoded once by packet_decode().
+ * Offsets are from the start of the frame; lengths, ports and flags are
+ * in host order, addresses in network order.  Fits in a cache line.
+ */
+typedef struct flow {
+	const struct packet	*p;
+	ether_addr		 esrc;		/* Ethernet source */
+	ether_addr		 edst;		/* Ethernet destination */
+	uint16_t		 etype;		/* Ethernet type */
+	uint16_t		 l3off;		/* offset of network header */
+	uint16_t		 l4off;		/* offset of transport header */
+	uint16_t		 l4len;		/* transport length (per IP) */
+	uint16_t		 l4cap;		/* bytes of it captured */
+	uint16_t		 hlen;		/* transport header length */
+	uint16_t		 dlen;		/* payload length (per IP) */
+	uint16_t		 sum;		/* pseudo-header checksum */
+	ip4_addr		 src;		/* source address */
+	ip4_addr		 dst;		/* destination address */
+	uint8_t			 proto;		/* IP protocol */
+	uint16_t		 sp;		/* source port */
+	uint16_t		 dp;		/* destination port */
+	uint16_t		 tcpfl;		/* TCP flags, NS in bit 8 */
+	uint32_t		 seq;		/* TCP sequence number */
+} flow;
+
+#define flow_l3(fl)	((const uint8_t *)(fl)->p->data + (fl)->l3off)
+#define flow_l4(fl)	((const uint8_t *)(fl)->p->data + (fl)->l4off)
+
+/* true if a flow's transport header and payload were not captured in full */
+#define flow_truncated(fl)	((fl)->l4cap < (fl)->l4len)
 
+struct arp_table *arp_table_create(struct iface *);
+void	 arp_table_destroy(struct arp_table *);
+int	 arp_periodic(struct arp_table *);
+void	 arp_report(struct arp_table *);
+int	 arp_register(struct arp_table *, const ip4_addr *, const ether_addr *);
+int	 arp_lookup(struct arp_table *, const ip4_addr *, ether_addr *,
+    uint64_t *);
+int	 arp_reserve(struct arp_table *, const ip4_addr *);
+void	 arp_fast(struct arp_table *, const ip4_addr *, const ether_addr *,
+    const ip4_addr *);
+
+/*
+ * Replies are built in place, either in a frame obtained from
+ * ethernet_reply_frame() or in the frame they are a reply to, with each
+ * layer writing its header at a fixed offset.
+ */
+#define REPLY_IP4_OFF	(sizeof(ether_hdr))
+#define REPLY_L4_OFF	(REPLY_IP4_OFF + sizeof(ip4_hdr))
+
+uint8_t	*ethernet_reply_frame(const flow *);
+int	 ethernet_transmit(struct iface *, uint8_t *, size_t);
 int	 ethernet_send(struct iface *, ether_type, const ether_addr *,
-    const void *, size_t);
-int	 ethernet_reply(const struct ether_flow *, const void *, size_t);
+    uint8_t *, size_t);
+int	 ethernet_reply(const flow *, uint8_t *, size_t);
+
+int	 flow_cksum_needed(const flow *);
+int	 ip4_reply(const flow *, ip_proto, uint8_t *, size_t);
+
+struct tcp4_tmpl *tcp4_tmpl_create(const struct iface *);
+void	 tcp4_tmpl_destroy(struct tcp4_tmpl *);
+void	 tcp4_fast(const struct timeval *, const ip4_addr *, uint16_t,
+    const ip4_addr *, uint16_t, unsigned int);
 
-int	 ip4_reply(const ip4_flow *, ip_proto, const void *, size_t);
+int	 packet_decode(const struct packet *, flow *);
+int	 ethernet_decode(flow *, const struct packet *);
+int	 ip4_decode(flow *);
+int	 icmp4_decode(flow *);
+int	 udp4_decode(flow *);
+int	 tcp4_decode(flow *);
 
-int	 packet_analyze_ethernet(const struct packet *, const void *, size_t);
-int	 packet_analyze_arp(const struct ether_flow *, const void *, size_t);
-int	 packet_analyze_ip4(const struct ether_flow *, const void *, size_t);
-int	 packet_analyze_icmp4(const struct ip4_flow *, const void *, size_t);
-int	 packet_analyze_udp4(const struct ip4_flow *, const void *, size_t);
-int	 packet_analyze_tcp4(const struct ip4_flow *, const void *, size_t);
+int	 packet_analyze_arp(const flow *);
+int	 packet_analyze_ip4(const flow *);
+int	 packet_analyze_icmp4(const flow *);
+int	 packet_analyze_udp4(const flow *);
+int	 packet_analyze_tcp4(const flow *);
 
 int	 csv_packet4(const struct timeval *,
     const ip4_addr *, int, const ip4_addr *, int,
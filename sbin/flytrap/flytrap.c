@@ -31,13 +31,34 @@
 #include "config.h"
 #endif
 
+#include <sys/types.h>
+#include <sys/time.h>
+#if HAVE_SYS_TIMERFD_H
+#include <sys/timerfd.h>
+#endif
+
 #include <errno.h>
+#include <poll.h>
+#if HAVE_SCHED_SETAFFINITY
+#include <sched.h>
+#endif
 #include <signal.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
 
+#include <ft/ethernet.h>
+#include <ft/ip4.h>
 #include <ft/log.h>
 
 #include "flytrap.h"
+#include "flow.h"
+#include "iface.h"
+#include "packet.h"
+#if HAVE_IO_URING
+#include "uring.h"
+#endif
 
 int ft_dryrun;
 int ft_logout;
@@ -48,7 +69,51 @@ int ft_logout;
 
 const char *ft_csvfile = FT_CSVFILE;
 
+/* CPUs to run on, or for the workers to run on, one each */
+int ft_cpus[FT_MAXCPUS];
+unsigned int ft_ncpus;
+
+/* NUMA nodes for the workers to run on */
+int ft_nodes[FT_MAXNODES];
+unsigned int ft_nnodes;
+
+/* number of worker threads, or 0 to run everything in one */
+unsigned int ft_workers = 0;
+
+/* capture on a separate thread */
+int ft_capture_thread = 0;
+
+/* maintenance schedule (in ms) */
+#define FT_TICK			1000
+#define FT_EXPIRE_INTERVAL	1000
+#define FT_FLUSH_INTERVAL	1000
+#define FT_STATS_INTERVAL	300000
+
+/* maximum number of interfaces and of descriptors to poll */
+#define FT_MAXIFACE		64
+#define FT_MAXPOLLFD		1024
+
+/* maximum number of batches to analyze between other tasks */
+#define FT_MAXBATCHES		16
+
+/* size of the io_uring submission queue */
+#define FT_URING_ENTRIES	1024
+
+/*
+ * Main loop state for each interface
+ */
+struct flytrap_iface {
+	struct iface	*i;
+	unsigned int	 pfd;		/* first descriptor in poll set */
+	int		 npfd;		/* number of descriptors, or -1 */
+	int		 ready;		/* may have packets waiting */
+};
+
 static sig_atomic_t sighup;
+static sig_atomic_t sigterm;
+
+/* tells the workers to stop */
+static int stopping;
 
 static void
 signal_handler(int sig)
@@ -58,41 +123,631 @@ signal_handler(int sig)
 	case SIGHUP:
 		sighup++;
 		break;
+	case SIGINT:
+	case SIGTERM:
+		sigterm++;
+		break;
 	}
 }
 
-int
-flytrap(const char *iname)
+/*
+ * Bind ourselves to the requested CPUs, if any.
+ */
+static int
+flytrap_pin(void)
 {
-	struct iface *i;
-	struct packet *p;
+#if HAVE_SCHED_SETAFFINITY
+	cpu_set_t cpus;
+	unsigned int k;
 
-	if (csv_open(ft_csvfile) != 0) {
-		ft_error("failed to open CSV file: %m");
+	if (ft_ncpus == 0)
+		return (0);
+	CPU_ZERO(&cpus);
+	for (k = 0; k < ft_ncpus; ++k)
+		CPU_SET(ft_cpus[k], &cpus);
+	if (sched_setaffinity(0, sizeof cpus, &cpus) != 0) {
+		ft_error("failed to bind to CPU %d: %m", ft_cpus[0]);
+		return (-1);
+	}
+	if (ft_ncpus == 1)
+		ft_verbose("bound to CPU %d", ft_cpus[0]);
+	else
+		ft_verbose("bound to %u CPUs", ft_ncpus);
+	return (0);
+#else
+	if (ft_ncpus == 0)
+		return (0);
+	ft_error("CPU binding not supported");
+	return (-1);
+#endif
+}
+
+/*
+ * Milliseconds since an arbitrary point in time.
+ */
+static uint64_t
+flytrap_clock(clockid_t clk)
+{
+	struct timespec ts;
+
+	clock_gettime(clk, &ts);
+	return ((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+/*
+ * Run whatever periodic tasks are due.  The schedule follows ft_time,
+ * which is normally driven by packet timestamps, so it works the same
+ * in replay as live.
+ */
+static void
+flytrap_maintenance(struct flytrap_iface *fis, unsigned int nfi)
+{
+	static __thread uint64_t expire_due, flush_due, stats_due;
+	unsigned int k;
+	int more;
+
+	if (stats_due == 0)
+		stats_due = ft_time + FT_STATS_INTERVAL;
+	if (ft_time >= expire_due) {
+		for (more = 0, k = 0; k < nfi; ++k)
+			more |= arp_periodic(fis[k].i->arp);
+		/* if expiry fell behind, catch up a little at a time */
+		expire_due = more ? ft_time : ft_time + FT_EXPIRE_INTERVAL;
+	}
+	if (ft_time >= flush_due) {
+		if (csv_flush() != 0)
+			ft_warning("failed to flush CSV file: %m");
+		flush_due = ft_time + FT_FLUSH_INTERVAL;
+	}
+	if (ft_time >= stats_due) {
+		for (k = 0; k < nfi; ++k) {
+			iface_report(fis[k].i);
+			arp_report(fis[k].i->arp);
+		}
+		/* with workers, the main thread reports the rest */
+		if (ft_workers == 0)
+			csv_report();
+#if HAVE_PTHREAD
+		if (ft_capture_thread)
+			capture_report();
+#endif
+		stats_due = ft_time + FT_STATS_INTERVAL;
+	}
+}
+
+/*
+ * Set up a timer which fires every FT_TICK ms.  Returns -1 if timerfd
+ * is not available, in which case the main loop uses a poll timeout.
+ */
+static int
+flytrap_timer(void)
+{
+#if HAVE_SYS_TIMERFD_H
+	struct itimerspec its;
+	int tfd;
+
+	if ((tfd = timerfd_create(CLOCK_MONOTONIC,
+	    TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+		ft_warning("failed to create timer: %m");
+		return (-1);
+	}
+	its.it_interval.tv_sec = FT_TICK / 1000;
+	its.it_interval.tv_nsec = FT_TICK % 1000 * 1000000;
+	its.it_value = its.it_interval;
+	if (timerfd_settime(tfd, 0, &its, NULL) != 0) {
+		ft_warning("failed to set timer: %m");
+		close(tfd);
 		return (-1);
 	}
-	signal(SIGHUP, signal_handler); 
-	if ((i = iface_open(iname)) == NULL)
+	return (tfd);
+#else
+	return (-1);
+#endif
+}
+
+#if HAVE_IO_URING
+/*
+ * With io_uring, each descriptor has a one-shot poll outstanding, which
+ * is re-armed once it fires.  A single system call submits the polls
+ * along with any queued replies and CSV output, and waits.
+ */
+struct flytrap_poll {
+	uring_req	 req;
+	short		 revents;
+};
+
+static struct flytrap_poll flytrap_polls[FT_MAXPOLLFD];
+
+static void
+flytrap_poll_done(uring_req *req, int res)
+{
+	struct flytrap_poll *fp = (struct flytrap_poll *)req;
+
+	fp->revents = res < 0 ? POLLERR : res;
+}
+
+static int
+flytrap_uring_poll(struct pollfd *pfd, unsigned int nfds, int timeout)
+{
+	struct flytrap_poll *fp;
+	unsigned int k;
+	int n;
+
+	for (n = 0, k = 0; k < nfds; ++k) {
+		fp = &flytrap_polls[k];
+		if ((pfd[k].revents = fp->revents) != 0)
+			n++;
+		fp->revents = 0;
+		if (!fp->req.pending) {
+			fp->req.cb = flytrap_poll_done;
+			if (uring_poll(&fp->req, pfd[k].fd, pfd[k].events) != 0)
+				return (-1);
+		}
+	}
+	/* don't wait if something fired while we were busy */
+	if (uring_submit(n > 0 ? 0 : timeout) < 0)
+		return (-1);
+	for (k = 0; k < nfds; ++k) {
+		fp = &flytrap_polls[k];
+		if (fp->revents != 0 && pfd[k].revents == 0)
+			n++;
+		pfd[k].revents |= fp->revents;
+		fp->revents = 0;
+	}
+	return (n);
+}
+#endif
+
+/*
+ * Wait for any of the descriptors to become ready.
+ */
+static int
+flytrap_poll(struct pollfd *pfd, unsigned int nfds, int timeout)
+{
+
+#if HAVE_IO_URING
+	if (uring_active())
+		return (flytrap_uring_poll(pfd, nfds, timeout));
+#endif
+	return (poll(pfd, nfds, timeout));
+}
+
+/*
+ * Open and activate an interface and give it an ARP table.
+ */
+static int
+flytrap_open(struct flytrap_iface *fi, const char *iname)
+{
+
+	if ((fi->i = iface_open(iname)) == NULL)
 		return (-1);
-	if (iface_activate(i) != 0)
+	if ((fi->i->arp = arp_table_create(fi->i)) == NULL) {
+		ft_error("%s: failed to create ARP table: %m", fi->i->name);
 		goto fail;
-	for (;;) {
+	}
+	if ((fi->i->tcp4 = tcp4_tmpl_create(fi->i)) == NULL) {
+		ft_error("%s: failed to create reply template: %m",
+		    fi->i->name);
+		goto fail;
+	}
+	if (iface_activate(fi->i) != 0)
+		goto fail;
+	return (0);
+fail:
+	tcp4_tmpl_destroy(fi->i->tcp4);
+	arp_table_destroy(fi->i->arp);
+	iface_close(fi->i);
+	fi->i = NULL;
+	return (-1);
+}
+
+static void
+flytrap_close(struct flytrap_iface *fi)
+{
+
+	tcp4_tmpl_destroy(fi->i->tcp4);
+	arp_report(fi->i->arp);
+	arp_table_destroy(fi->i->arp);
+	iface_close(fi->i);
+	fi->i = NULL;
+}
+
+#if HAVE_PTHREAD
+/*
+ * Main loop when capturing on a separate thread: analyze whatever the
+ * capture thread has read, and wait for more.
+ */
+static int
+flytrap_threaded(struct flytrap_iface *fis, unsigned int nfi, int tfd)
+{
+	struct iface *ifaces[FT_MAXIFACE];
+	struct pollfd pfd[FT_MAXPOLLFD];
+	uint64_t now, tick_due, expirations;
+	unsigned int k, n, nb, npfd, nlive;
+	packet *p;
+	int eof, timeout;
+
+	for (k = nlive = 0; k < nfi; ++k) {
+		ifaces[k] = fis[k].i;
+		if (fis[k].npfd >= 0)
+			nlive++;
+	}
+	if (capture_start(ifaces, nfi) != 0) {
+		ft_error("failed to start capture thread: %m");
+		return (-1);
+	}
+
+	/* the capture ring goes first, then events, then the timer */
+	npfd = 1;
+	for (k = 0; k < nfi; ++k) {
+		npfd += iface_event_pollfd(fis[k].i, pfd + npfd,
+		    FT_MAXPOLLFD - 1 - npfd);
+	}
+	if (tfd >= 0) {
+		pfd[npfd].fd = tfd;
+		pfd[npfd].events = POLLIN;
+	}
+	tick_due = flytrap_clock(CLOCK_MONOTONIC) + FT_TICK;
+	eof = 0;
+	while (!sigterm && (eof = capture_eof()) == 0) {
 		if (sighup) {
 			sighup--;
 			if (csv_open(ft_csvfile) != 0)
 				ft_warning("failed to reopen CSV file: %m");
 		}
-		if ((p = iface_next(i)) == NULL) {
-			if (errno == EAGAIN)
+		for (k = 0; k < nfi; ++k)
+			iface_events(fis[k].i);
+		for (nb = 0; nb < FT_MAXBATCHES; ++nb) {
+			if ((p = capture_next(&n)) == NULL)
+				break;
+			packet_analyze(p, n);
+			iface_flush(p[0].i);
+			capture_done();
+			/* as often as the main loop would */
+			flytrap_maintenance(fis, nfi);
+		}
+		if (nb > 0 || !capture_pollfd(&pfd[0])) {
+#if HAVE_IO_URING
+			if (uring_active() && uring_submit(0) < 0) {
+				ft_error("io_uring: %m");
+				eof = -1;
+				break;
+			}
+#endif
+			continue;
+		}
+		if (tfd >= 0)
+			timeout = -1;
+		else if ((now = flytrap_clock(CLOCK_MONOTONIC)) < tick_due)
+			timeout = tick_due - now;
+		else
+			timeout = 0;
+		if (flytrap_poll(pfd, npfd + (tfd >= 0), timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			ft_error("poll(): %m");
+			eof = -1;
+			break;
+		}
+		if (tfd >= 0) {
+			if (!(pfd[npfd].revents & POLLIN) ||
+			    read(tfd, &expirations, sizeof expirations) < 0)
+				continue;
+		} else {
+			if ((now = flytrap_clock(CLOCK_MONOTONIC)) < tick_due)
 				continue;
-			goto fail;
+			tick_due = now + FT_TICK;
+		}
+		/* replayed traffic keeps its own time */
+		if (nlive == 0)
+			continue;
+		if ((now = flytrap_clock(CLOCK_REALTIME)) > ft_time)
+			ft_time = now;
+		flytrap_maintenance(fis, nfi);
+	}
+	capture_stop();
+	capture_report();
+	return (eof < 0 ? -1 : 0);
+}
+#endif
+
+/*
+ * Returns non-zero if the loop should stop.  Only the main thread sees
+ * signals; it tells the workers.
+ */
+static int
+flytrap_stopped(int wk)
+{
+
+	if (wk >= 0)
+		return (__atomic_load_n(&stopping, __ATOMIC_RELAXED));
+	return (sigterm != 0);
+}
+
+/*
+ * Open the interfaces and process their traffic until told to stop or,
+ * when replaying, until there is no more.  A worker runs this on its
+ * own interfaces, with its number in wk; otherwise wk is -1.
+ */
+static int
+flytrap_run(unsigned int niface, char *const *inames, int wk)
+{
+	struct flytrap_iface fis[FT_MAXIFACE], *fi;
+	struct pollfd pfd[FT_MAXPOLLFD];
+	packet pkts[PACKET_BATCH];
+	uint64_t now, tick_due, expirations;
+	unsigned int k, nfi, npfd, nlive, nidle, nleft;
+	int more, n, ret, tfd, timeout;
+
+	ret = -1;
+	tfd = -1;
+
+	/*
+	 * Open each interface and append its descriptors to the poll
+	 * set.  Interfaces which can not be polled (replay) are always
+	 * ready; those which have nothing to poll are checked regularly.
+	 */
+	npfd = nlive = 0;
+	for (nfi = 0; nfi < niface; ++nfi) {
+		fi = &fis[nfi];
+		if (flytrap_open(fi, inames[nfi]) != 0)
+			goto done;
+		if (wk >= 0 && fi->i->type != iface_type_tpacket) {
+			ft_error("%s: workers require a tpacket interface",
+			    fi->i->name);
+			flytrap_close(fi);
+			goto done;
+		}
+		fi->pfd = npfd;
+		fi->npfd = iface_pollfd(fi->i, pfd + npfd,
+		    FT_MAXPOLLFD - 1 - npfd);
+		fi->ready = 1;
+		if (fi->npfd >= 0) {
+			npfd += fi->npfd;
+			nlive++;
 		}
-		packet_analyze(p);
-		packet_drop(p);
 	}
+
+	/* the timer goes last */
+	if (nlive > 0 && (tfd = flytrap_timer()) >= 0) {
+		pfd[npfd].fd = tfd;
+		pfd[npfd].events = POLLIN;
+	}
+	tick_due = flytrap_clock(CLOCK_MONOTONIC) + FT_TICK;
+#if HAVE_PTHREAD
+	if (ft_capture_thread && wk < 0) {
+		ret = flytrap_threaded(fis, nfi, tfd);
+		goto done;
+	}
+#endif
+	nleft = nfi;
+	while (!flytrap_stopped(wk) && nleft > 0) {
+		if (sighup && wk < 0) {
+			sighup--;
+			if (csv_open(ft_csvfile) != 0)
+				ft_warning("failed to reopen CSV file: %m");
+		}
+
+		/* read one batch from every interface that may have one */
+		more = 0;
+		nidle = 0;
+		for (k = 0; k < nfi; ++k) {
+			fi = &fis[k];
+			if (iface_eof(fi->i))
+				continue;
+			if (!fi->ready) {
+				nidle++;
+				continue;
+			}
+			if ((n = iface_next_batch(fi->i, pkts, PACKET_BATCH)) < 0)
+				goto done;
+			if (n > 0) {
+				packet_analyze(pkts, n);
+				/* send replies to the whole batch at once */
+				iface_flush(fi->i);
+#if HAVE_PTHREAD
+				if (wk >= 0)
+					worker_account(wk, n);
+#endif
+			}
+			if (iface_eof(fi->i)) {
+				nleft--;
+				continue;
+			}
+			/* keep going while there is more to read */
+			fi->ready = n == PACKET_BATCH || fi->npfd <= 0 ||
+			    ft_busy_poll;
+			if (n == PACKET_BATCH || fi->npfd < 0)
+				more = 1;
+			else if (fi->npfd > 0)
+				nidle++;
+		}
+		flytrap_maintenance(fis, nfi);
+		if (nlive == 0 || (more && nidle == 0)) {
+#if HAVE_IO_URING
+			/* push out what this round queued */
+			if (uring_active() && uring_submit(0) < 0) {
+				ft_error("io_uring: %m");
+				goto done;
+			}
+#endif
+			continue;
+		}
+
+		/*
+		 * Wait for a packet, the timer or a signal.  If another
+		 * interface still has work, just check without waiting.
+		 */
+		if (more || ft_busy_poll)
+			timeout = 0;
+		else if (tfd >= 0)
+			timeout = -1;
+		else if ((now = flytrap_clock(CLOCK_MONOTONIC)) < tick_due)
+			timeout = tick_due - now;
+		else
+			timeout = 0;
+		/* some interfaces have nothing to poll, so check back */
+		if (npfd < nlive && (timeout < 0 || timeout > IFACE_TIMEOUT))
+			timeout = IFACE_TIMEOUT;
+		if (flytrap_poll(pfd, npfd + (tfd >= 0), timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			ft_error("poll(): %m");
+			goto done;
+		}
+		for (k = 0; k < nfi; ++k) {
+			fi = &fis[k];
+			for (n = 0; n < fi->npfd && !fi->ready; ++n)
+				if (pfd[fi->pfd + n].revents != 0)
+					fi->ready = 1;
+		}
+
+		/* timer tick: catch up with the clock if idle */
+		if (tfd >= 0) {
+			if (!(pfd[npfd].revents & POLLIN) ||
+			    read(tfd, &expirations, sizeof expirations) < 0)
+				continue;
+		} else {
+			if ((now = flytrap_clock(CLOCK_MONOTONIC)) < tick_due)
+				continue;
+			tick_due = now + FT_TICK;
+		}
+		if ((now = flytrap_clock(CLOCK_REALTIME)) > ft_time)
+			ft_time = now;
+		flytrap_maintenance(fis, nfi);
+	}
+	ret = 0;
+done:
+	if (tfd >= 0)
+		close(tfd);
+	for (k = 0; k < nfi; ++k)
+		flytrap_close(&fis[k]);
+	return (ret);
+}
+
+#if HAVE_PTHREAD
+static unsigned int worker_niface;
+static char *const *worker_inames;
+
+static int
+flytrap_worker(unsigned int wk)
+{
+
+	return (flytrap_run(worker_niface, worker_inames, wk));
+}
+
+/*
+ * Run the workers, each of which opens every interface for itself and
+ * joins it to a fanout group, so that the kernel spreads the traffic
+ * across them by destination address.  The main thread only handles
+ * signals and reports.
+ */
+static int
+flytrap_workers(unsigned int niface, char *const *inames)
+{
+	uint64_t now, stats_due;
+	int ret;
+
+	worker_niface = niface;
+	worker_inames = inames;
+	if (worker_start(ft_workers, flytrap_worker) != 0) {
+		ft_error("failed to start workers: %m");
+		__atomic_store_n(&stopping, 1, __ATOMIC_RELAXED);
+		(void)worker_join();
+		return (-1);
+	}
+	stats_due = flytrap_clock(CLOCK_MONOTONIC) + FT_STATS_INTERVAL;
+	while (!sigterm && worker_running() > 0) {
+		if (sighup) {
+			sighup--;
+			if (csv_open(ft_csvfile) != 0)
+				ft_warning("failed to reopen CSV file: %m");
+		}
+		(void)poll(NULL, 0, FT_TICK);
+		if ((now = flytrap_clock(CLOCK_MONOTONIC)) >= stats_due) {
+			worker_report();
+			csv_report();
+			stats_due = now + FT_STATS_INTERVAL;
+		}
+	}
+	__atomic_store_n(&stopping, 1, __ATOMIC_RELAXED);
+	ret = worker_join();
+	worker_report();
+	return (ret);
+}
+#endif
+
+int
+flytrap(unsigned int niface, char *const *inames)
+{
+	int ret;
+
+	if (niface == 0 || niface > FT_MAXIFACE) {
+		ft_error("between 1 and %d interfaces required", FT_MAXIFACE);
+		return (-1);
+	}
+#if HAVE_PTHREAD
+	if (ft_workers > 0) {
+		/* these all assume a single analysis thread */
+		if (ft_capture_thread) {
+			ft_warning("-T has no effect with workers");
+			ft_capture_thread = 0;
+		}
+		if (ft_xdp_fast) {
+			ft_warning("the XDP fast path is not available "
+			    "with workers");
+			ft_xdp_fast = 0;
+		}
+		if (!ft_csv_async) {
+			ft_verbose("workers log through the CSV writer");
+			ft_csv_async = FT_FLUSH_INTERVAL;
+		}
+	}
+#else
+	if (ft_workers > 0) {
+		ft_warning("threads not supported, running a single worker");
+		ft_workers = 0;
+	}
+	if (ft_capture_thread)
+		ft_warning("threads not supported, capturing in the main loop");
+	if (ft_csv_async) {
+		ft_warning("threads not supported, writing CSV file directly");
+		ft_csv_async = 0;
+	}
+#endif
+#if HAVE_IO_URING
+	/* the ring belongs to one thread */
+	if (ft_workers == 0 && uring_init(FT_URING_ENTRIES) != 0)
+		ft_warning("io_uring not available, using poll(): %m");
+#endif
+	if (csv_open(ft_csvfile) != 0) {
+		ft_error("failed to open CSV file: %m");
+		goto fail;
+	}
+	/* workers bind themselves */
+	if (ft_workers == 0 && flytrap_pin() != 0)
+		goto fail;
+	signal(SIGHUP, signal_handler);
+	signal(SIGINT, signal_handler);
+	signal(SIGTERM, signal_handler);
+#if HAVE_PTHREAD
+	if (ft_workers > 0)
+		ret = flytrap_workers(niface, inames);
+	else
+#endif
+		ret = flytrap_run(niface, inames, -1);
+	csv_close();
 	signal(SIGHUP, SIG_DFL);
-	return (0);
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+#if HAVE_IO_URING
+	uring_fini();
+#endif
+	return (ret);
 fail:
-	iface_close(i);
+	csv_close();
+#if HAVE_IO_URING
+	uring_fini();
+#endif
 	return (-1);
 }
@@ -32,24 +32,78 @@
 
 struct iface;
 struct packet;
+struct pollfd;
 
 extern int ft_dryrun;
 extern int ft_logout;
 extern const char *ft_csvfile;
+extern unsigned int ft_csv_async;
+extern unsigned int ft_ring_nblk;
+extern unsigned int ft_ring_blksz;
+extern unsigned int ft_tap_nqueue;
+extern double ft_replay_speed;
+extern const char *ft_replay_out;
+extern unsigned int ft_busy_poll;
+extern int ft_hdronly;
+extern int ft_qdisc_bypass;
+extern int ft_trust_csum;
+extern int ft_xdp_fast;
+extern int ft_cpus[];
+extern unsigned int ft_ncpus;
+extern int ft_nodes[];
+extern unsigned int ft_nnodes;
+extern int ft_capture_thread;
+extern unsigned int ft_workers;
+
+/* limits for -c, -N and -W */
+#define FT_MAXCPUS	1024
+#define FT_MAXNODES	64
+#define FT_MAXWORKERS	64
+
+/* limit for -q, see MAX_TAP_QUEUES in the kernel */
+#define TAP_MAXQUEUES	256
 
 /* main loop */
-int		 flytrap(const char *);
+int		 flytrap(unsigned int, char *const *);
 
 /* traffic logging */
 int		 csv_open(const char *);
+int		 csv_flush(void);
+int		 csv_close(void);
+void		 csv_report(void);
 
 /* interfaces and packets */
 struct iface	*iface_open(const char *);
 int		 iface_activate(struct iface *);
 void		 iface_close(struct iface *);
-struct packet	*iface_next(struct iface *);
+int		 iface_next_batch(struct iface *, struct packet *, unsigned int);
+unsigned long	 iface_rx_mark(const struct iface *);
+void		 iface_release(struct iface *, unsigned long);
+int		 iface_pollfd(struct iface *, struct pollfd *, unsigned int);
+void		 iface_events(struct iface *);
+int		 iface_event_pollfd(struct iface *, struct pollfd *,
+		    unsigned int);
+int		 iface_eof(const struct iface *);
+void		*iface_reply_frame(struct iface *);
 int		 iface_transmit(const struct packet *);
-int		 packet_analyze(struct packet *);
-void		 packet_drop(struct packet *);
+int		 iface_flush(struct iface *);
+void		 iface_report(const struct iface *);
+int		 packet_analyze(struct packet *, unsigned int);
+
+/* capture thread */
+int		 capture_start(struct iface **, unsigned int);
+void		 capture_stop(void);
+struct packet	*capture_next(unsigned int *);
+void		 capture_done(void);
+int		 capture_pollfd(struct pollfd *);
+int		 capture_eof(void);
+void		 capture_report(void);
+
+/* worker threads */
+int		 worker_start(unsigned int, int (*)(unsigned int));
+int		 worker_running(void);
+int		 worker_join(void);
+void		 worker_account(unsigned int, unsigned int);
+void		 worker_report(void);
 
 #endif
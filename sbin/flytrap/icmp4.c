@@ -67,58 +67,75 @@ csv_icmp4(const struct timeval *ts, const ip4_addr *sa, const ip4_addr *da,
 }
 
 /*
- * Reply to an echo request
+ * Reply to an echo request.  The request frame is turned into the
+ * reply; only if the request carried IP options, which we do not echo,
+ * is it first copied into a fresh frame.
  */
 static int
-icmp4_reply(const ip4_flow *fl, uint16_t id, uint16_t seq,
-    const void *payload, size_t payloadlen)
+icmp4_reply(const flow *fl)
 {
+	uint8_t *frame;
 	icmp_hdr *ih;
-	size_t len;
-	int ret;
+	uint16_t tc;
 
-	len = sizeof(icmp_hdr) + payloadlen;
-	if ((ih = calloc(1, len)) == NULL)
-		return (-1);
-	ih->type = htobe16(icmp_type_echo_reply);
-	ih->code = htobe16(0);
-	ih->hdata = htobe32(id << 16 | seq);
-	memcpy(ih->data, payload, payloadlen);
-	ih->sum = htobe16(~ip4_cksum(0, ih, len));
+	frame = fl->p->data;
+	if (fl->l4off != REPLY_L4_OFF) {
+		if ((frame = ethernet_reply_frame(fl)) == NULL)
+			return (-1);
+		memcpy(frame + REPLY_L4_OFF, flow_l4(fl), fl->l4len);
+	}
+	ih = (icmp_hdr *)(frame + REPLY_L4_OFF);
+	tc = ih->type << 8 | ih->code;
+	ih->type = icmp_type_echo_reply;
+	ih->code = 0;
+	ih->sum = htobe16(ip4_cksum_update(be16toh(ih->sum), tc,
+	    ih->type << 8 | ih->code));
 	ft_verbose("< icmp4 %u.%u to %u.%u.%u.%u id 0x%04x seq 0x%04x",
 	    ih->type, ih->code, fl->src.o[0], fl->src.o[1],
-	    fl->src.o[2], fl->src.o[3], id, seq);
+	    fl->src.o[2], fl->src.o[3], be32toh(ih->hdata) >> 16,
+	    be32toh(ih->hdata) & 0xffff);
 	if (ft_logout)
-		csv_icmp4(&fl->eth->p->ts, &fl->dst, &fl->src, ih, len);
-	ret = ip4_reply(fl, ip_proto_icmp, ih, len);
-	free(ih);
-	return (ret);
+		csv_icmp4(&fl->p->ts, &fl->dst, &fl->src, ih, fl->l4len);
+	return (ip4_reply(fl, ip_proto_icmp, frame, fl->l4len));
+}
+
+/*
+ * Decode the ICMP header of a captured packet.
+ */
+int
+icmp4_decode(flow *fl)
+{
+
+	if (fl->l4cap < sizeof(icmp_hdr)) {
+		ft_verbose("%lu.%03lu short ICMP packet (%zd < %zd)",
+		    FT_TIME_SEC_UL, FT_TIME_MSEC_UL, (size_t)fl->l4cap,
+		    sizeof(icmp_hdr));
+		return (-1);
+	}
+	fl->hlen = sizeof(icmp_hdr);
+	fl->dlen = fl->l4len - sizeof(icmp_hdr);
+	fl->sp = fl->dp = 0;
+	return (0);
 }
 
 /*
  * Analyze a captured ICMP packet
  */
 int
-packet_analyze_icmp4(const ip4_flow *fl, const void *data, size_t len)
+packet_analyze_icmp4(const flow *fl)
 {
 	const icmp_hdr *ih;
 	uint16_t id, seq, sum;
 	int ret;
 
-	ih = data;
-	if (len < sizeof *ih) {
-		ft_verbose("%lu.%03lu short ICMP packet (%zd < %zd)",
-		    FT_TIME_SEC_UL, FT_TIME_MSEC_UL, len, sizeof *ih);
-		return (-1);
-	}
-	if ((sum = ~ip4_cksum(0, data, len)) != 0) {
+	ih = (const icmp_hdr *)flow_l4(fl);
+	if (flow_cksum_needed(fl) &&
+	    (sum = ~ip4_cksum(0, ih, fl->l4cap)) != 0) {
 		ft_verbose("%lu.%03lu invalid ICMP checksum 0x%04hx",
 		    FT_TIME_SEC_UL, FT_TIME_MSEC_UL, sum);
 		return (-1);
 	}
-	data = ih + 1;
-	len -= sizeof *ih;
-	csv_icmp4(&fl->eth->p->ts, &fl->src, &fl->dst, ih, len);
+	csv_icmp4(&fl->p->ts, &fl->src, &fl->dst, ih, fl->dlen);
 	switch (ih->type) {
 	case icmp_type_echo_request:
 		id = be32toh(ih->hdata) >> 16;
@@ -126,7 +143,14 @@ packet_analyze_icmp4(const ip4_flow *fl, const void *data, size_t len)
 		ft_verbose("> icmp4 %u.%u from %u.%u.%u.%u id 0x%04x seq 0x%04x",
 		    ih->type, ih->code, fl->src.o[0], fl->src.o[1],
 		    fl->src.o[2], fl->src.o[3], id, seq);
-		ret = icmp4_reply(fl, id, seq, ih->data, len);
+		if (flow_truncated(fl)) {
+			/* can't echo what we don't have */
+			ft_verbose("%lu.%03lu truncated echo request",
+			    FT_TIME_SEC_UL, FT_TIME_MSEC_UL);
+			ret = 0;
+			break;
+		}
+		ret = icmp4_reply(fl);
 		break;
 	default:
 		ret = 0;
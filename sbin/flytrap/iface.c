@@ -32,12 +32,15 @@
 #endif
 
 #include <sys/types.h>
+#include <sys/socket.h>
 #include <sys/time.h>
 
 #include <errno.h>
+#include <poll.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #if HAVE_PCAP_PCAP_H
 #include <pcap/pcap.h>
@@ -50,7 +53,6 @@
 #include <ft/ethernet.h>
 #include <ft/ip4.h>
 #include <ft/log.h>
-#include <ft/string.h>
 #include <ft/strlcpy.h>
 
 #include "flytrap.h"
@@ -60,54 +62,139 @@
 
 ether_addr	 flytrap_ether_addr = { FLYTRAP_ETHER_ADDR };
 
+/* receive ring geometry */
+unsigned int	 ft_ring_nblk = 64;
+unsigned int	 ft_ring_blksz = 256 * 1024;
+
+/* number of TAP queues */
+unsigned int	 ft_tap_nqueue = 1;
+
+/* replay speed (0 for as fast as possible) and output file */
+double		 ft_replay_speed = 0.0;
+const char	*ft_replay_out = NULL;
+
+/* capture headers only */
+int		 ft_hdronly = 0;
+
+/* busy polling time (in us), or 0 to block */
+unsigned int	 ft_busy_poll = 0;
+
+/* bypass the queueing discipline when transmitting */
+int		 ft_qdisc_bypass = 0;
+
+/* trust the kernel's checksum status instead of verifying */
+int		 ft_trust_csum = 0;
+
+/* answer ARP requests and SYNs for claimed addresses in XDP */
+int		 ft_xdp_fast = 0;
+
+static const struct {
+	const char	*prefix;
+	size_t		 len;
+	iface_type	 type;
+} iface_types[] = {
+	{ "pcap:",	 5,	iface_type_pcap },
+	{ "tpacket:",	 8,	iface_type_tpacket },
+	{ "xdp:",	 4,	iface_type_xdp },
+	{ "tap:",	 4,	iface_type_tap },
+	{ "file:",	 5,	iface_type_file },
+};
+
 /*
- * Prepare to use the named interface, but do not start capturing yet.
- * Annoyingly, there is no way to tell at this point whether the interface
- * exists and whether we are permitted to use it.
+ * Split an interface specification of the form [type:]name into its
+ * components.  The type defaults to pcap.
+ */
+static const char *
+iface_parse(const char *spec, iface_type *type)
+{
+	unsigned int n;
+
+	for (n = 0; n < sizeof iface_types / sizeof iface_types[0]; ++n) {
+		if (strncmp(spec, iface_types[n].prefix,
+		    iface_types[n].len) == 0) {
+			*type = iface_types[n].type;
+			return (spec + iface_types[n].len);
+		}
+	}
+	*type = iface_type_pcap;
+	return (spec);
+}
+
+/*
+ * Prepare a pcap handle for the interface.
  *
  * TODO: pcap_findalldevs()
  */
-iface *
-iface_open(const char *name)
+static int
+iface_pcap_open(iface *i)
 {
 	char pceb[PCAP_ERRBUF_SIZE];
-	iface *i;
 
 	*pceb = '\0';
-	if ((i = calloc(1, sizeof *i)) == NULL)
-		return (NULL);
-	if (strlcpy(i->name, name, sizeof i->name) >= sizeof i->name)
-		goto fail;
-	memcpy(&i->ether, &flytrap_ether_addr, sizeof(ether_addr));
 #if HAVE_PCAP_PCAP_H
 	if ((i->pch = pcap_create(i->name, pceb)) == NULL ||
 	    pcap_set_promisc(i->pch, 1) != 0 ||
-	    pcap_set_snaplen(i->pch, 2048) != 0 ||
-	    pcap_set_timeout(i->pch, 100) != 0)
+	    pcap_set_snaplen(i->pch, IFACE_SNAPLEN) != 0 ||
+	    pcap_set_timeout(i->pch, IFACE_TIMEOUT) != 0)
 		goto fail;
 #else
-	if ((i->pch = pcap_open_live(i->name, 2048, 1, 100, pceb)) == NULL)
+	if ((i->pch = pcap_open_live(i->name, IFACE_SNAPLEN, 1,
+	    IFACE_TIMEOUT, pceb)) == NULL)
 		goto fail;
 #endif
-	ft_verbose("%s: interface opened", i->name);
-	return (i);
+	return (0);
 fail:
 	if (*pceb)
 		ft_error("failed to open %s: %s", i->name, pceb);
 	if (i->pch != NULL)
 		pcap_close(i->pch);
-	free(i);
-	return (NULL);
+	i->pch = NULL;
+	return (-1);
 }
 
+/*
+ * Ask the kernel to busy poll the device queue when we read from the
+ * socket.  SO_PREFER_BUSY_POLL and SO_BUSY_POLL_BUDGET are not available
+ * on older kernels; failing to set them is not fatal.
+ */
 int
-iface_activate(iface *i)
+iface_busy_poll(iface *i, int fd)
 {
-	struct bpf_program fprog;
-	string *fstr;
-	const char *fsz;
+#ifdef SO_BUSY_POLL
+	int opt;
+
+	opt = ft_busy_poll;
+	if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &opt, sizeof opt) != 0) {
+		ft_error("%s: failed to enable busy polling: %m", i->name);
+		return (-1);
+	}
+#ifdef SO_PREFER_BUSY_POLL
+	opt = 1;
+	if (setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL,
+	    &opt, sizeof opt) != 0)
+		ft_verbose("%s: failed to prefer busy polling: %m", i->name);
+#endif
+#ifdef SO_BUSY_POLL_BUDGET
+	opt = PACKET_BATCH;
+	if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL_BUDGET,
+	    &opt, sizeof opt) != 0)
+		ft_verbose("%s: failed to set busy poll budget: %m", i->name);
+#endif
+	ft_verbose("%s: busy polling for %u us", i->name, ft_busy_poll);
+	return (0);
+#else
+	(void)fd;
+	ft_error("%s: busy polling not supported", i->name);
+	errno = ENOSYS;
+	return (-1);
+#endif
+}
+
+static int
+iface_pcap_activate(iface *i)
+{
+	char pceb[PCAP_ERRBUF_SIZE];
 
-	/* activate interface */
 #if HAVE_PCAP_PCAP_H
 	if (pcap_activate(i->pch) != 0) {
 		ft_error("%s: failed to activate: %s",
@@ -120,7 +207,6 @@ iface_activate(iface *i)
 		    i->name, pcap_geterr(i->pch));
 		return (-1);
 	}
-	ft_verbose("%s: interface activated", i->name);
 
 	/* we only understand Ethernet */
 	if (pcap_datalink(i->pch) != DLT_EN10MB) {
@@ -128,31 +214,254 @@ iface_activate(iface *i)
 		return (-1);
 	}
 
-	/* compose and compile filter program */
-	fstr = string_new();
-	string_printf(fstr,
-	    "arp"
-	    " or ether dst %02x:%02x:%02x:%02x:%02x:%02x"
-	    " or ether dst ff:ff:ff:ff:ff:ff",
-	    i->ether.o[0], i->ether.o[1], i->ether.o[2],
-	    i->ether.o[3], i->ether.o[4], i->ether.o[5]);
-	fsz = string_buf(fstr);
-	if (pcap_compile(i->pch, &fprog, fsz, 1, 0xffffffffU) != 0) {
-		ft_error("%s: failed to compile filter: %s",
-		    i->name, pcap_geterr(i->pch));
+	/* the main loop does the waiting */
+	if (pcap_setnonblock(i->pch, 1, pceb) != 0) {
+		ft_error("%s: failed to set non-blocking mode: %s",
+		    i->name, pceb);
 		return (-1);
 	}
-	string_delete(fstr);
+	if (ft_busy_poll &&
+	    iface_busy_poll(i, pcap_get_selectable_fd(i->pch)) != 0)
+		return (-1);
+	return (0);
+}
+
+struct iface_pcap_batch {
+	iface		*i;
+	packet		*p;
+	unsigned int	 k;
+};
 
-	/* install filter program */
-	if (pcap_setfilter(i->pch, &fprog) != 0) {
-		ft_error("%s: failed to install filter: %s",
+/*
+ * The data pcap hands us is only valid until the callback returns, so
+ * copy it into the interface's batch buffer.
+ */
+static void
+iface_pcap_handler(u_char *user, const struct pcap_pkthdr *ph,
+    const u_char *pd)
+{
+	struct iface_pcap_batch *pb = (struct iface_pcap_batch *)user;
+	uint8_t *buf;
+	packet *p;
+
+	if (ph->caplen > IFACE_SNAPLEN)
+		return;
+	buf = pb->i->rxbuf + (size_t)pb->k * IFACE_SNAPLEN;
+	memcpy(buf, pd, ph->caplen);
+	p = &pb->p[pb->k++];
+	p->i = pb->i;
+	p->ts = ph->ts;
+	p->data = buf;
+	p->caplen = ph->caplen;
+	p->len = ph->len;
+	p->csum = packet_csum_unknown;
+	p->queue = 0;
+}
+
+int
+iface_pcap_next_batch(iface *i, packet *p, unsigned int n)
+{
+	struct iface_pcap_batch pb;
+	int pcr;
+
+	pb.i = i;
+	pb.p = p;
+	pb.k = 0;
+	pcr = pcap_dispatch(i->pch, n, iface_pcap_handler, (u_char *)&pb);
+	if (pcr < 0) {
+		ft_error("%s: failed to read packet: %s",
 		    i->name, pcap_geterr(i->pch));
-		pcap_freecode(&fprog);
+		errno = EIO; /* XXX */
+		return (-1);
+	}
+	/* for a capture file, nothing at all means we reached the end */
+	if (pcr == 0 && i->type == iface_type_file)
+		i->eof = 1;
+	return (pb.k);
+}
+
+/*
+ * Generate our filter program from the current source and destination
+ * sets, so traffic we would ignore anyway never leaves the kernel.  In
+ * header-only mode, everything except ICMP echo requests is truncated,
+ * but only for backends which report the original length of a truncated
+ * frame.
+ */
+static int
+iface_compile(iface *i, struct bpf_program *fprog)
+{
+	unsigned int hdrlen;
+
+	hdrlen = IFACE_SNAPLEN;
+	if (ft_hdronly && (i->type == iface_type_pcap ||
+	    i->type == iface_type_tpacket || i->type == iface_type_file))
+		hdrlen = IFACE_HDRLEN;
+	if (filter_compile(fprog, &i->ether, src_set, dst_set,
+	    hdrlen, IFACE_SNAPLEN) != 0) {
+		ft_error("%s: failed to compile filter: %m", i->name);
 		return (-1);
 	}
+	ft_verbose("%s: filter compiled (%u instructions), capturing up to "
+	    "%u bytes (%u for echo requests)", i->name, fprog->bf_len,
+	    hdrlen, IFACE_SNAPLEN);
+	return (0);
+}
+
+/*
+ * Prepare to use the named interface, but do not start capturing yet.
+ * Annoyingly, there is no way to tell at this point whether the interface
+ * exists and whether we are permitted to use it.
+ */
+iface *
+iface_open(const char *spec)
+{
+	const char *name;
+	iface *i;
+
+	if ((i = calloc(1, sizeof *i)) == NULL)
+		return (NULL);
+	i->fd = -1;
+	name = iface_parse(spec, &i->type);
+	if (strlcpy(i->name, name, sizeof i->name) >= sizeof i->name)
+		goto fail;
+	memcpy(&i->ether, &flytrap_ether_addr, sizeof(ether_addr));
+	if ((i->buf = malloc((size_t)PACKET_BATCH * IFACE_SNAPLEN)) == NULL ||
+	    (i->txq.buf = malloc((size_t)IFACE_TXQLEN * IFACE_SNAPLEN)) == NULL)
+		goto fail;
+	i->rxbuf = i->buf;
+	if (ft_xdp_fast) {
+#if HAVE_XDP_FAST
+		/* before the backend, which may want to include it */
+		if (i->type == iface_type_file || i->type == iface_type_tap)
+			ft_warning("%s: XDP fast path not applicable", i->name);
+		else if (iface_fast_open(i) != 0)
+			ft_warning("%s: XDP fast path unavailable (%m)",
+			    i->name);
+#else
+		ft_warning("%s: XDP fast path not supported", i->name);
+#endif
+	}
+	switch (i->type) {
+	case iface_type_file:
+		if (iface_file_open(i) != 0)
+			goto fail;
+		break;
+	case iface_type_tap:
+#if HAVE_LINUX_IF_TUN_H
+		if (iface_tap_open(i) == 0)
+			break;
+		ft_error("%s: failed to attach to TAP device: %m", i->name);
+#else
+		ft_error("%s: TAP devices not supported", i->name);
+#endif
+		goto fail;
+	case iface_type_tpacket:
+#if HAVE_DECL_TPACKET_V3
+		if (iface_tpacket_open(i) == 0)
+			break;
+#else
+		errno = ENOSYS;
+#endif
+		ft_warning("%s: memory-mapped capture unavailable (%m), "
+		    "falling back to pcap", i->name);
+		i->type = iface_type_pcap;
+		/* fall through */
+	case iface_type_xdp:
+#if HAVE_XDP
+		if (i->type == iface_type_xdp) {
+			if (iface_xdp_open(i) == 0)
+				break;
+			ft_warning("%s: XDP unavailable (%m), "
+			    "falling back to pcap", i->name);
+			i->type = iface_type_pcap;
+		}
+#else
+		if (i->type == iface_type_xdp) {
+			ft_warning("%s: XDP not supported, "
+			    "falling back to pcap", i->name);
+			i->type = iface_type_pcap;
+		}
+#endif
+		/* fall through */
+	case iface_type_pcap:
+		if (iface_pcap_open(i) != 0)
+			goto fail;
+		break;
+	}
+	ft_verbose("%s: interface opened", i->name);
+	return (i);
+fail:
+#if HAVE_XDP_FAST
+	iface_fast_close(i);
+#endif
+	free(i->txq.buf);
+	free(i->buf);
+	free(i);
+	return (NULL);
+}
+
+int
+iface_activate(iface *i)
+{
+	struct bpf_program fprog;
+	int ret;
+
+	/* activate interface */
+	if (i->type == iface_type_pcap && iface_pcap_activate(i) != 0)
+		return (-1);
+
+	/* compile and install filter program */
+	if (iface_compile(i, &fprog) != 0)
+		return (-1);
+	switch (i->type) {
+#if HAVE_XDP
+	case iface_type_xdp:
+		if ((ret = iface_xdp_activate(i, &fprog)) == 0)
+			break;
+		ft_warning("%s: failed to set up XDP, falling back to pcap",
+		    i->name);
+		iface_xdp_close(i);
+		i->type = iface_type_pcap;
+		if ((ret = iface_pcap_open(i)) != 0 ||
+		    (ret = iface_pcap_activate(i)) != 0)
+			break;
+#endif
+		/* fall through */
+	case iface_type_pcap:
+	case iface_type_file:
+		if ((ret = pcap_setfilter(i->pch, &fprog)) != 0) {
+			ft_error("%s: failed to install filter: %s",
+			    i->name, pcap_geterr(i->pch));
+		}
+		break;
+#if HAVE_DECL_TPACKET_V3
+	case iface_type_tpacket:
+		ret = iface_tpacket_activate(i, &fprog);
+		break;
+#endif
+#if HAVE_LINUX_IF_TUN_H
+	case iface_type_tap:
+		ret = iface_tap_activate(i, &fprog);
+		break;
+#endif
+	default:
+		ret = -1;
+	}
 	pcap_freecode(&fprog);
-	ft_verbose("%s: filter installed: \"%s\"", i->name, fsz);
+	if (ret != 0)
+		return (-1);
+	ft_verbose("%s: interface activated", i->name);
+
+#if HAVE_XDP_FAST
+	/* the XDP backend already has it */
+	if (i->fast != NULL && i->type != iface_type_xdp) {
+		if (iface_fast_attach(i) != 0) {
+			ft_warning("%s: failed to attach XDP fast path: %m",
+			    i->name);
+			iface_fast_close(i);
+		}
+	}
+#endif
 
 	/* done */
 	return (0);
@@ -162,46 +471,493 @@ void
 iface_close(iface *i)
 {
 
-	pcap_close(i->pch);
+	iface_flush(i);
+	iface_report(i);
+	switch (i->type) {
+	case iface_type_pcap:
+		pcap_close(i->pch);
+		break;
+	case iface_type_file:
+		iface_file_close(i);
+		break;
+#if HAVE_DECL_TPACKET_V3
+	case iface_type_tpacket:
+		iface_tpacket_close(i);
+		break;
+#endif
+#if HAVE_XDP
+	case iface_type_xdp:
+		iface_xdp_close(i);
+		break;
+#endif
+#if HAVE_LINUX_IF_TUN_H
+	case iface_type_tap:
+		iface_tap_close(i);
+		break;
+#endif
+	default:
+		break;
+	}
+#if HAVE_XDP_FAST
+	iface_fast_close(i);
+#endif
+	free(i->txq.buf);
+	free(i->buf);
 	free(i);
 }
 
-packet *
-iface_next(iface *i)
+/*
+ * Returns a mark which iface_release() can later be given to release
+ * every frame returned so far.
+ */
+unsigned long
+iface_rx_mark(const iface *i)
 {
-	struct pcap_pkthdr *ph;
-	const uint8_t *pd;
-	packet *p;
-	int pcr;
 
-	if ((pcr = pcap_next_ex(i->pch, &ph, &pd)) < 0) {
-		ft_error("%s: failed to read packet: %s",
-		    i->name, pcap_geterr(i->pch));
-		errno = EIO; /* XXX */
-		return (NULL);
-	} else if (pcr == 0) {
-		errno = EAGAIN;
-		return (NULL);
-	} else if (ph->len > ph->caplen) {
-		errno = ENOSPC;
-		return (NULL);
+	switch (i->type) {
+#if HAVE_DECL_TPACKET_V3
+	case iface_type_tpacket:
+		return (iface_tpacket_mark(i));
+#endif
+#if HAVE_XDP
+	case iface_type_xdp:
+		return (iface_xdp_mark(i));
+#endif
+	default:
+		return (0);
+	}
+}
+
+/*
+ * Release frames which the backend lent us without copying, up to a
+ * mark previously obtained from iface_rx_mark().  This is normally done
+ * at the start of each batch, but not if the interface was told to hold
+ * on to them, in which case the caller must do it.  Copying backends
+ * read into rxbuf, which the caller must then also manage.
+ */
+void
+iface_release(iface *i, unsigned long mark)
+{
+
+	switch (i->type) {
+#if HAVE_DECL_TPACKET_V3
+	case iface_type_tpacket:
+		iface_tpacket_release(i, mark);
+		break;
+#endif
+#if HAVE_XDP
+	case iface_type_xdp:
+		iface_xdp_release(i, mark);
+		break;
+#endif
+	default:
+		break;
 	}
-	if ((p = calloc(1, sizeof *p)) == NULL) {
-		errno = ENOMEM;
+}
+
+/*
+ * Catch up with whatever happened on the interface without us seeing
+ * any packets, which is only the case with the XDP fast path.
+ */
+void
+iface_events(iface *i)
+{
+
+#if HAVE_XDP_FAST
+	if (i->fast != NULL)
+		iface_fast_poll(i);
+#endif
+}
+
+/*
+ * Fill in up to n poll descriptors to wait on for iface_events().
+ */
+int
+iface_event_pollfd(iface *i, struct pollfd *pfd, unsigned int n)
+{
+
+#if HAVE_XDP_FAST
+	if (i->fast != NULL)
+		return (iface_fast_pollfd(i, pfd, n));
+#endif
+	return (0);
+}
+
+/*
+ * Fill the caller's array with up to n packets.  The packets remain
+ * valid until the next call for the same interface, unless it was told
+ * to hold on to them; see iface_release().  Returns the number of
+ * packets, which is zero if nothing was waiting, or -1 on error.  Apart
+ * from replay, this never blocks; see iface_pollfd().
+ */
+int
+iface_next_batch(iface *i, packet *p, unsigned int n)
+{
+
+	if (!i->rxhold) {
+		iface_release(i, iface_rx_mark(i));
+		iface_events(i);
+	}
+	if (n > PACKET_BATCH)
+		n = PACKET_BATCH;
+	switch (i->type) {
+	case iface_type_pcap:
+		return (iface_pcap_next_batch(i, p, n));
+	case iface_type_file:
+		return (iface_file_next_batch(i, p, n));
+#if HAVE_DECL_TPACKET_V3
+	case iface_type_tpacket:
+		return (iface_tpacket_next_batch(i, p, n));
+#endif
+#if HAVE_XDP
+	case iface_type_xdp:
+		return (iface_xdp_next_batch(i, p, n));
+#endif
+#if HAVE_LINUX_IF_TUN_H
+	case iface_type_tap:
+		return (iface_tap_next_batch(i, p, n));
+#endif
+	default:
+		errno = ENXIO;
+		return (-1);
+	}
+}
+
+static int
+iface_rx_pollfd(iface *i, struct pollfd *pfd, unsigned int n)
+{
+	int fd;
+
+	switch (i->type) {
+	case iface_type_pcap:
+		if (n < 1 || (fd = pcap_get_selectable_fd(i->pch)) < 0)
+			return (0);
+		pfd[0].fd = fd;
+		pfd[0].events = POLLIN;
+		return (1);
+	case iface_type_file:
+		return (-1);
+#if HAVE_DECL_TPACKET_V3
+	case iface_type_tpacket:
+		return (iface_tpacket_pollfd(i, pfd, n));
+#endif
+#if HAVE_XDP
+	case iface_type_xdp:
+		return (iface_xdp_pollfd(i, pfd, n));
+#endif
+#if HAVE_LINUX_IF_TUN_H
+	case iface_type_tap:
+		return (iface_tap_pollfd(i, pfd, n));
+#endif
+	default:
+		return (0);
+	}
+}
+
+/*
+ * Fill in up to n poll descriptors to wait on for packets to arrive.
+ * Returns the number of descriptors, which may be zero if the caller
+ * has no choice but to poll with a timeout, or -1 if the interface
+ * never needs to be waited for, as is the case with replay.
+ */
+int
+iface_pollfd(iface *i, struct pollfd *pfd, unsigned int n)
+{
+	int ret;
+
+	ret = iface_rx_pollfd(i, pfd, n);
+	/* events too, unless we have to poll with a timeout anyway */
+	if (!i->rxhold && ret > 0)
+		ret += iface_event_pollfd(i, pfd + ret, n - ret);
+	return (ret);
+}
+
+/*
+ * Returns non-zero if the interface has reached the end of its input.
+ */
+int
+iface_eof(const iface *i)
+{
+
+	return (i->eof);
+}
+
+/*
+ * Record the time elapsed between receiving a packet and sending a reply
+ * to it.  Both times are in microseconds.
+ */
+static void
+iface_latency(iface *i, uint64_t now, const struct timeval *rxts)
+{
+	iface_stats *st = &i->stats;
+	uint64_t lat;
+	unsigned int b;
+
+	lat = now - ((uint64_t)rxts->tv_sec * 1000000 + rxts->tv_usec);
+	if ((int64_t)lat < 0)
+		return;
+	if (st->nlatency == 0 || lat < st->lat_min)
+		st->lat_min = lat;
+	if (lat > st->lat_max)
+		st->lat_max = lat;
+	st->lat_sum += lat;
+	st->nlatency++;
+	for (b = 0; b < IFACE_LATENCY_BUCKETS - 1 && lat >= 1ULL << b; ++b)
+		/* nothing */ ;
+	st->lat_hist[b]++;
+}
+
+/*
+ * Copy a frame into the next slot in the transmit queue.
+ */
+int
+iface_txq_copy(iface *i, const void *data, size_t len)
+{
+	iface_txq *q = &i->txq;
+	uint8_t *slot;
+
+	if (len > IFACE_SNAPLEN) {
+		errno = EMSGSIZE;
+		return (-1);
+	}
+	slot = q->buf + (size_t)q->n * IFACE_SNAPLEN;
+	if (data != slot) {
+		memcpy(slot, data, len);
+		i->stats.ntxcopy++;
+	}
+	q->len[q->n] = len;
+	return (0);
+}
+
+/*
+ * Return a buffer of IFACE_SNAPLEN bytes in which to build the next
+ * reply: the transmit queue slot it will occupy, so that it can be
+ * queued without being copied.  The queue is flushed first if full.
+ */
+void *
+iface_reply_frame(iface *i)
+{
+	iface_txq *q = &i->txq;
+
+	if (q->n == IFACE_TXQLEN && iface_flush(i) < 0)
 		return (NULL);
+	return (q->buf + (size_t)q->n * IFACE_SNAPLEN);
+}
+
+/*
+ * Send every frame in the transmit queue through a packet socket with a
+ * single system call.  Returns the number of frames sent.
+ */
+int
+iface_txq_sendmmsg(iface *i, int fd)
+{
+	iface_txq *q = &i->txq;
+	unsigned int k;
+#if HAVE_SENDMMSG
+	struct mmsghdr msgs[IFACE_TXQLEN];
+	struct iovec iov[IFACE_TXQLEN];
+	int n;
+
+	memset(msgs, 0, q->n * sizeof *msgs);
+	for (k = 0; k < q->n; ++k) {
+		iov[k].iov_base = q->buf + (size_t)k * IFACE_SNAPLEN;
+		iov[k].iov_len = q->len[k];
+		msgs[k].msg_hdr.msg_iov = &iov[k];
+		msgs[k].msg_hdr.msg_iovlen = 1;
 	}
-	p->i = i;
-	p->ts = ph->ts;
-	p->data = pd;
-	p->len = ph->caplen;
-	return (p);
+	for (k = 0; k < q->n; k += n)
+		if ((n = sendmmsg(fd, msgs + k, q->n - k, MSG_DONTWAIT)) <= 0)
+			break;
+#else
+	for (k = 0; k < q->n; ++k)
+		if (send(fd, q->buf + (size_t)k * IFACE_SNAPLEN, q->len[k],
+		    MSG_DONTWAIT) != (ssize_t)q->len[k])
+			break;
+#endif
+	if (k < q->n)
+		ft_debug("%s: failed to send %u frames: %m", i->name, q->n - k);
+	return (k);
+}
+
+/*
+ * Flush the pcap transmit queue.  On Linux, the capture descriptor is a
+ * packet socket bound to the interface, so we can bypass pcap_inject()
+ * and send the whole queue at once.
+ */
+static int
+iface_pcap_flush(iface *i)
+{
+	iface_txq *q = &i->txq;
+	unsigned int k;
+#if defined(__linux__)
+	int fd;
+
+	if ((fd = pcap_get_selectable_fd(i->pch)) >= 0)
+		return (iface_txq_sendmmsg(i, fd));
+#endif
+	for (k = 0; k < q->n; ++k)
+		if (pcap_inject(i->pch, q->buf + (size_t)k * IFACE_SNAPLEN,
+		    q->len[k]) != (int)q->len[k])
+			break;
+	return (k);
 }
 
+/*
+ * Queue a reply for transmission.  The frame is copied unless it was
+ * built in the buffer returned by iface_reply_frame(), so the caller may
+ * reuse its own buffer immediately.  Nothing is actually sent until the
+ * queue is flushed, which happens once per batch or whenever it fills.
+ */
 int
 iface_transmit(const packet *p)
 {
+	iface *i = p->i;
+	int ret;
 
-	if (!ft_dryrun && pcap_inject(p->i->pch, p->data, p->len) != (int)p->len)
+	if (ft_dryrun)
+		return (0);
+	/* packet timestamps are not comparable to the clock */
+	if (i->type == iface_type_file)
+		return (iface_file_transmit(i, p->data, p->caplen));
+	if (i->txq.n == IFACE_TXQLEN && iface_flush(i) < 0)
+		return (-1);
+	switch (i->type) {
+	case iface_type_pcap:
+		ret = iface_txq_copy(i, p->data, p->caplen);
+		break;
+#if HAVE_DECL_TPACKET_V3
+	case iface_type_tpacket:
+		ret = iface_tpacket_transmit(i, p->data, p->caplen);
+		break;
+#endif
+#if HAVE_XDP
+	case iface_type_xdp:
+		ret = iface_xdp_transmit(i, p->data, p->caplen);
+		break;
+#endif
+#if HAVE_LINUX_IF_TUN_H
+	case iface_type_tap:
+		ret = iface_tap_transmit(i, p->data, p->caplen, p->queue);
+		break;
+#endif
+	default:
+		return (-1);
+	}
+	if (ret != 0) {
+		i->stats.ntxdrop++;
 		return (-1);
+	}
+	i->txq.rxts[i->txq.n++] = ft_rxtime;
 	return (0);
 }
+
+/*
+ * Send all queued replies.  Returns the number sent, or -1 if the
+ * backend failed outright.
+ */
+int
+iface_flush(iface *i)
+{
+	iface_stats *st = &i->stats;
+	iface_txq *q = &i->txq;
+	struct timespec now;
+	uint64_t usec;
+	unsigned int b, k;
+	int n;
+
+	if (q->n == 0)
+		return (0);
+	switch (i->type) {
+	case iface_type_pcap:
+		n = iface_pcap_flush(i);
+		break;
+#if HAVE_DECL_TPACKET_V3
+	case iface_type_tpacket:
+		n = iface_tpacket_flush(i);
+		break;
+#endif
+#if HAVE_XDP
+	case iface_type_xdp:
+		n = iface_xdp_flush(i);
+		break;
+#endif
+#if HAVE_LINUX_IF_TUN_H
+	case iface_type_tap:
+		n = iface_tap_flush(i);
+		break;
+#endif
+	default:
+		n = -1;
+		break;
+	}
+	st->nflush++;
+	if (q->n > st->flush_max)
+		st->flush_max = q->n;
+	for (b = 0; b < IFACE_FLUSH_BUCKETS - 1 && q->n >= 2U << b; ++b)
+		/* nothing */ ;
+	st->flush_hist[b]++;
+	k = n < 0 ? 0 : n;
+	st->nreplies += k;
+	st->ntxdrop += q->n - k;
+	clock_gettime(CLOCK_REALTIME, &now);
+	usec = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+	while (k-- > 0)
+		iface_latency(i, usec, &q->rxts[k]);
+	q->n = 0;
+	return (n);
+}
+
+/*
+ * Log reply statistics, including a histogram of reply latency.
+ */
+void
+iface_report(const iface *i)
+{
+	const iface_stats *st = &i->stats;
+	unsigned int b;
+
+#if HAVE_XDP_FAST
+	if (i->fast != NULL)
+		iface_fast_report(i);
+#endif
+	if (st->ncsum_sw + st->ncsum_valid + st->ncsum_partial > 0) {
+		ft_notice("%s: %lu checksums verified, %lu validated by the "
+		    "kernel, %lu not yet filled in", i->name, st->ncsum_sw,
+		    st->ncsum_valid, st->ncsum_partial);
+	}
+	if (st->nflush > 0) {
+		ft_notice("%s: %lu flushes, %lu.%02lu/%u avg/max frames "
+		    "per flush, %lu dropped, %lu copied", i->name,
+		    st->nflush, st->nreplies / st->nflush,
+		    st->nreplies * 100 / st->nflush % 100,
+		    st->flush_max, st->ntxdrop, st->ntxcopy);
+		for (b = 0; b < IFACE_FLUSH_BUCKETS; ++b) {
+			if (st->flush_hist[b] == 0)
+				continue;
+			if (b == IFACE_FLUSH_BUCKETS - 1) {
+				ft_notice("%s:   >= %u frames: %lu", i->name,
+				    1U << b, st->flush_hist[b]);
+			} else {
+				ft_notice("%s:    < %u frames: %lu", i->name,
+				    2U << b, st->flush_hist[b]);
+			}
+		}
+	}
+	if (st->nlatency == 0)
+		return;
+	ft_notice("%s: %lu replies, latency min/avg/max %lu/%lu/%lu us",
+	    i->name, st->nreplies, (unsigned long)st->lat_min,
+	    (unsigned long)(st->lat_sum / st->nlatency),
+	    (unsigned long)st->lat_max);
+	for (b = 0; b < IFACE_LATENCY_BUCKETS; ++b) {
+		if (st->lat_hist[b] == 0)
+			continue;
+		if (b == IFACE_LATENCY_BUCKETS - 1) {
+			ft_notice("%s:   >= %lu us: %lu", i->name,
+			    1UL << (b - 1), st->lat_hist[b]);
+		} else {
+			ft_notice("%s:    < %lu us: %lu", i->name,
+			    1UL << b, st->lat_hist[b]);
+		}
+	}
+}
@@ -30,12 +30,175 @@
 #ifndef FLYTRAP_IFACE_H_INCLUDED
 #define FLYTRAP_IFACE_H_INCLUDED
 
+struct bpf_program;
+struct iface_fast;
+struct iface_file;
+struct iface_tap;
+struct iface_xdp;
+struct ip4s_node;
+struct packet;
 struct pcap;
+struct pollfd;
+
+/* capture length */
+#define IFACE_SNAPLEN	2048
+
+/* capture length in header-only mode: Ethernet, IP and TCP with options */
+#define IFACE_HDRLEN	(14 + 60 + 60)
+
+/* read timeout (in ms) */
+#define IFACE_TIMEOUT	100
+
+/* number of latency histogram buckets (powers of two, in us) */
+#define IFACE_LATENCY_BUCKETS	24
+
+/* maximum number of replies queued before they are flushed */
+#define IFACE_TXQLEN	64
+
+/* number of flush size histogram buckets (powers of two) */
+#define IFACE_FLUSH_BUCKETS	7
+
+typedef enum iface_type {
+	iface_type_pcap,
+	iface_type_tpacket,
+	iface_type_xdp,
+	iface_type_tap,
+	iface_type_file,
+} iface_type;
+
+/*
+ * Memory-mapped block-based receive ring
+ */
+typedef struct iface_ring {
+	uint8_t		*map;		/* mapped ring */
+	size_t		 maplen;	/* size of mapping */
+	unsigned int	 blksz;		/* block size */
+	unsigned int	 nblk;		/* number of blocks */
+	unsigned int	 blk;		/* current block */
+	void		*cur;		/* current block if held */
+	uint8_t		*frame;		/* next frame in current block */
+	unsigned int	 nleft;		/* frames left in current block */
+	unsigned int	 nheld;		/* consumed blocks not yet returned */
+	unsigned long	 npassed;	/* blocks consumed so far */
+} iface_ring;
+
+/*
+ * Memory-mapped frame-based transmit ring
+ */
+typedef struct iface_txring {
+	uint8_t		*map;		/* first block, or NULL if no ring */
+	unsigned int	 blksz;		/* block size */
+	unsigned int	 framesz;	/* frame size */
+	unsigned int	 nframe;	/* number of frames */
+	unsigned int	 cur;		/* next frame to fill */
+} iface_txring;
+
+/*
+ * Replies waiting to be sent.  Replies are built in the queue's buffer,
+ * in the slot they will occupy.  Backends which transmit through a ring
+ * of their own copy frames there directly; the others leave them where
+ * they are.  Either way, they all go out together when the queue is
+ * flushed.
+ */
+typedef struct iface_txq {
+	unsigned int	 n;		/* frames queued */
+	struct timeval	 rxts[IFACE_TXQLEN]; /* arrival of what prompted it */
+	size_t		 len[IFACE_TXQLEN]; /* length of queued frame */
+	uint8_t		*buf;		/* queued frames */
+} iface_txq;
+
+/*
+ * Reply and checksum statistics
+ */
+typedef struct iface_stats {
+	unsigned long	 nreplies;	/* replies sent */
+	unsigned long	 nlatency;	/* replies with known latency */
+	uint64_t	 lat_min;	/* minimum latency (us) */
+	uint64_t	 lat_max;	/* maximum latency (us) */
+	uint64_t	 lat_sum;	/* total latency (us) */
+	unsigned long	 lat_hist[IFACE_LATENCY_BUCKETS];
+	unsigned long	 ntxdrop;	/* replies we failed to send */
+	unsigned long	 ntxcopy;	/* reply frames copied */
+	unsigned long	 nflush;	/* transmit queue flushes */
+	unsigned int	 flush_max;	/* largest flush */
+	unsigned long	 flush_hist[IFACE_FLUSH_BUCKETS];
+	unsigned long	 ncsum_sw;	/* checksums verified in software */
+	unsigned long	 ncsum_valid;	/* left to the kernel or NIC */
+	unsigned long	 ncsum_partial;	/* not yet filled in */
+} iface_stats;
 
 typedef struct iface {
-	char		 name[64];
+	char		 name[256];
+	iface_type	 type;
 	struct pcap	*pch;
+	int		 fd;
+	iface_ring	 rx;
+	iface_txring	 txr;
+	struct iface_xdp *xdp;
+	struct iface_tap *tap;
+	struct iface_file *file;
+	struct iface_fast *fast;	/* XDP fast path */
+	int		 eof;		/* no more input */
+	iface_txq	 txq;
+	iface_stats	 stats;
+	uint8_t		*buf;		/* batch buffer for copying backends */
+	uint8_t		*rxbuf;		/* where the next batch goes */
+	int		 rxhold;	/* hold frames until iface_release() */
 	ether_addr	 ether;
+	struct arp_table *arp;		/* addresses seen on this segment */
+	struct tcp4_tmpl *tcp4;		/* TCP reply template */
 } iface;
 
+int		 filter_compile(struct bpf_program *, const ether_addr *,
+		    const struct ip4s_node *, const struct ip4s_node *,
+		    unsigned int, unsigned int);
+
+int		 iface_busy_poll(iface *, int);
+int		 iface_pcap_next_batch(iface *, struct packet *, unsigned int);
+int		 iface_packet_bind(iface *, int, const struct bpf_program *);
+int		 iface_txq_copy(iface *, const void *, size_t);
+int		 iface_txq_sendmmsg(iface *, int);
+
+int		 iface_file_open(iface *);
+void		 iface_file_close(iface *);
+int		 iface_file_next_batch(iface *, struct packet *, unsigned int);
+int		 iface_file_transmit(iface *, const void *, size_t);
+
+int		 iface_tpacket_open(iface *);
+int		 iface_tpacket_activate(iface *, const struct bpf_program *);
+void		 iface_tpacket_close(iface *);
+int		 iface_tpacket_next_batch(iface *, struct packet *,
+		    unsigned int);
+unsigned long	 iface_tpacket_mark(const iface *);
+void		 iface_tpacket_release(iface *, unsigned long);
+int		 iface_tpacket_pollfd(iface *, struct pollfd *, unsigned int);
+int		 iface_tpacket_transmit(iface *, const void *, size_t);
+int		 iface_tpacket_flush(iface *);
+
+int		 iface_xdp_open(iface *);
+int		 iface_xdp_activate(iface *, const struct bpf_program *);
+void		 iface_xdp_close(iface *);
+int		 iface_xdp_next_batch(iface *, struct packet *, unsigned int);
+unsigned long	 iface_xdp_mark(const iface *);
+void		 iface_xdp_release(iface *, unsigned long);
+int		 iface_xdp_pollfd(iface *, struct pollfd *, unsigned int);
+int		 iface_xdp_transmit(iface *, const void *, size_t);
+int		 iface_xdp_flush(iface *);
+
+int		 iface_fast_open(iface *);
+int		 iface_fast_attach(iface *);
+void		 iface_fast_close(iface *);
+int		 iface_fast_claim(iface *, uint32_t, int);
+void		 iface_fast_poll(iface *);
+int		 iface_fast_pollfd(iface *, struct pollfd *, unsigned int);
+void		 iface_fast_report(const iface *);
+
+int		 iface_tap_open(iface *);
+int		 iface_tap_activate(iface *, const struct bpf_program *);
+void		 iface_tap_close(iface *);
+int		 iface_tap_next_batch(iface *, struct packet *, unsigned int);
+int		 iface_tap_pollfd(iface *, struct pollfd *, unsigned int);
+int		 iface_tap_transmit(iface *, const void *, size_t, unsigned int);
+int		 iface_tap_flush(iface *);
+
 #endif
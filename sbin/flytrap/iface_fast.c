@@ -0,0 +1,761 @@
+/*-
+ * Copyright (c) 2016-2018 The University of Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+
+#include <linux/bpf.h>
+
+#include <errno.h>
+#include <net/if.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <ft/arp.h>
+#include <ft/endian.h>
+#include <ft/ethernet.h>
+#include <ft/ip4.h>
+#include <ft/log.h>
+
+#include "flytrap.h"
+#include "flow.h"
+#include "iface.h"
+#include "packet.h"
+#include "xdp.h"
+
+/* maximum number of claimed addresses the fast path knows about */
+#define FAST_MAXCLAIM		65536
+
+/* size of the event ring buffer (power of two, multiple of page size) */
+#define FAST_RINGSZ		(256 * 1024)
+
+/* stack layout: lookup key, event */
+#define FAST_KEY		(-4)
+#define FAST_EV			(-32)
+#define FAST_EV_OFF(f)							\
+	(FAST_EV + (int)offsetof(struct xdp_fast_event, f))
+
+/* most source ranges the program checks before leaving TCP alone */
+#define FAST_MAXRANGES		16
+
+/* how far the assembler can keep track of jumps */
+#define FAST_MAXLABELS		32
+#define FAST_MAXFIXUPS		96
+
+struct iface_fast {
+	int		 claimfd;	/* claimed addresses */
+	int		 ringfd;	/* events */
+	int		 statfd;	/* counters */
+	int		 progfd;	/* program, unless part of another */
+	int		 linkfd;	/* attachment of the above */
+	unsigned long	*consumer;	/* consumer position (ours) */
+	unsigned long	*producer;	/* producer position (kernel's) */
+	uint8_t		*data;		/* ring data, mapped twice */
+	size_t		 pagesz;
+};
+
+/*
+ * A minimal assembler: instructions are emitted in order, and jumps to
+ * labels which have not been bound yet are fixed up at the end.
+ */
+typedef struct fast_asm {
+	struct bpf_insn	*insns;
+	unsigned int	 n;		/* instructions emitted */
+	unsigned int	 max;		/* room for this many */
+	int		 label[FAST_MAXLABELS];
+	unsigned int	 nlabel;
+	struct {
+		unsigned int	 insn;
+		unsigned int	 label;
+	}		 fixup[FAST_MAXFIXUPS];
+	unsigned int	 nfixup;
+} fast_asm;
+
+#define E(fa, insn)		fast_emit((fa), (struct bpf_insn)insn)
+#define J(fa, insn, l)		fast_jump((fa), (struct bpf_insn)insn, (l))
+
+static void
+fast_emit(fast_asm *fa, struct bpf_insn insn)
+{
+
+	if (fa->n < fa->max)
+		fa->insns[fa->n] = insn;
+	fa->n++;
+}
+
+static unsigned int
+fast_label(fast_asm *fa)
+{
+
+	fa->label[fa->nlabel] = -1;
+	return (fa->nlabel++);
+}
+
+static void
+fast_bind(fast_asm *fa, unsigned int l)
+{
+
+	fa->label[l] = fa->n;
+}
+
+static void
+fast_jump(fast_asm *fa, struct bpf_insn insn, unsigned int l)
+{
+
+	fa->fixup[fa->nfixup].insn = fa->n;
+	fa->fixup[fa->nfixup].label = l;
+	fa->nfixup++;
+	fast_emit(fa, insn);
+}
+
+static void
+fast_ld_map(fast_asm *fa, int reg, int fd)
+{
+	const struct bpf_insn insns[] = { XDP_LD_MAP_FD(reg, fd) };
+
+	fast_emit(fa, insns[0]);
+	fast_emit(fa, insns[1]);
+}
+
+/*
+ * r0 = fold(csum_diff(NULL, 0, r7 + off, len, seed)): the one's
+ * complement sum of len bytes of the frame, in host order.
+ */
+static void
+fast_csum(fast_asm *fa, int off, int len, uint32_t seed)
+{
+
+	E(fa, XDP_MOV64_IMM(BPF_REG_1, 0));
+	E(fa, XDP_MOV64_IMM(BPF_REG_2, 0));
+	E(fa, XDP_MOV64_REG(BPF_REG_3, BPF_REG_7));
+	E(fa, XDP_ADD64_IMM(BPF_REG_3, off));
+	E(fa, XDP_MOV64_IMM(BPF_REG_4, len));
+	E(fa, XDP_MOV64_IMM(BPF_REG_5, (int32_t)seed));
+	E(fa, XDP_CALL(BPF_FUNC_csum_diff));
+}
+
+static void
+fast_fold(fast_asm *fa)
+{
+
+	E(fa, XDP_MOV32_REG(BPF_REG_0, BPF_REG_0));
+	E(fa, XDP_MOV64_REG(BPF_REG_1, BPF_REG_0));
+	E(fa, XDP_ALU64_IMM(BPF_RSH, BPF_REG_1, 16));
+	E(fa, XDP_ALU64_IMM(BPF_AND, BPF_REG_0, 0xffff));
+	E(fa, XDP_ALU64_REG(BPF_ADD, BPF_REG_0, BPF_REG_1));
+	E(fa, XDP_MOV64_REG(BPF_REG_1, BPF_REG_0));
+	E(fa, XDP_ALU64_IMM(BPF_RSH, BPF_REG_1, 16));
+	E(fa, XDP_ALU64_REG(BPF_ADD, BPF_REG_0, BPF_REG_1));
+	E(fa, XDP_ALU64_IMM(BPF_AND, BPF_REG_0, 0xffff));
+}
+
+/*
+ * r0 = map_lookup_elem(fd, &key), with the key taken from r2.
+ */
+static void
+fast_lookup(fast_asm *fa, int fd)
+{
+
+	E(fa, XDP_STX(BPF_W, BPF_REG_10, BPF_REG_2, FAST_KEY));
+	fast_ld_map(fa, BPF_REG_1, fd);
+	E(fa, XDP_MOV64_REG(BPF_REG_2, BPF_REG_10));
+	E(fa, XDP_ADD64_IMM(BPF_REG_2, FAST_KEY));
+	E(fa, XDP_CALL(BPF_FUNC_map_lookup_elem));
+}
+
+/*
+ * Increment the counter whose index is in r2.
+ */
+static void
+fast_count(fast_asm *fa, int fd)
+{
+	unsigned int done;
+
+	done = fast_label(fa);
+	fast_lookup(fa, fd);
+	J(fa, XDP_JMP_IMM(BPF_JEQ, BPF_REG_0, 0, 0), done);
+	E(fa, XDP_MOV64_IMM(BPF_REG_1, 1));
+	E(fa, XDP_XADD64(BPF_REG_0, BPF_REG_1, 0));
+	fast_bind(fa, done);
+}
+
+/*
+ * Leave TCP packets from outside the source set to user space, in the
+ * same way as filter_set().  Returns -1 if the set is too large for the
+ * program to bother.
+ */
+static int
+fast_src_set(fast_asm *fa, unsigned int pass)
+{
+	uint32_t first[FAST_MAXRANGES], last[FAST_MAXRANGES];
+	unsigned long k, n;
+	unsigned int in;
+
+	if (src_set == NULL)
+		return (0);
+	n = ip4s_ranges(src_set, first, last, FAST_MAXRANGES);
+	if (n > FAST_MAXRANGES)
+		return (-1);
+	if (n == 1 && first[0] == 0 && last[0] == 0xffffffffU)
+		return (0);
+	in = fast_label(fa);
+	E(fa, XDP_LDX(BPF_W, BPF_REG_2, BPF_REG_7, 26));
+	E(fa, XDP_TO_BE(BPF_REG_2, 32));
+	for (k = 0; k < n; ++k) {
+		J(fa, XDP_JMP32_IMM(BPF_JLT, BPF_REG_2, (int32_t)first[k], 0),
+		    pass);
+		J(fa, XDP_JMP32_IMM(BPF_JLE, BPF_REG_2, (int32_t)last[k], 0),
+		    in);
+	}
+	J(fa, XDP_JA(0), pass);
+	fast_bind(fa, in);
+	return (0);
+}
+
+/*
+ * Build the fast path: answer ARP requests for, and TCP SYNs to,
+ * addresses we have claimed, by turning the frame around in place and
+ * sending it back out, and tell user space about it.  Anything else
+ * falls through to whatever follows, with the context in r1, as on
+ * entry.  Returns the number of instructions, or 0 if they would not
+ * fit.
+ *
+ * The replies are the same as those built by arp_reply() and
+ * tcp4_reply(), except that any padding is left in place.  Requests
+ * with IP options, fragments, payload or bad checksums are left for
+ * user space to deal with.
+ */
+unsigned int
+iface_fast_prog(const iface *i, struct bpf_insn *insns, unsigned int max)
+{
+	static const uint8_t arp_req[8] = { 0, 1, 8, 0, 6, 4, 0, 1 };
+	static const uint8_t syn_ihl_len[4] = { 0x45, 0, 0, 40 };
+	static const uint8_t ip4_ttl[2] = { 64, ip_proto_tcp };
+	static const uint8_t tcp4_off[2] = { 5 << 4, TCP4_SYN | TCP4_ACK };
+	const struct iface_fast *f = i->fast;
+	unsigned int pass, drop, arp, tcpsum, out, tx, next, k;
+	uint32_t mac_lo, arp_lo, arp_hi, ihl_len;
+	uint16_t mac_hi, ttl_proto, off_fl;
+	fast_asm fa;
+	int hl;
+
+	memset(&fa, 0, sizeof fa);
+	fa.insns = insns;
+	fa.max = max;
+	pass = fast_label(&fa);
+	drop = fast_label(&fa);
+	arp = fast_label(&fa);
+	tcpsum = fast_label(&fa);
+	out = fast_label(&fa);
+	tx = fast_label(&fa);
+	memcpy(&mac_lo, &i->ether.o[0], sizeof mac_lo);
+	memcpy(&mac_hi, &i->ether.o[4], sizeof mac_hi);
+	memcpy(&arp_lo, arp_req, sizeof arp_lo);
+	memcpy(&arp_hi, arp_req + 4, sizeof arp_hi);
+	memcpy(&ihl_len, syn_ihl_len, sizeof ihl_len);
+	memcpy(&ttl_proto, ip4_ttl, sizeof ttl_proto);
+	memcpy(&off_fl, tcp4_off, sizeof off_fl);
+
+	/* r6 = ctx, r7 = data, r8 = data_end */
+	E(&fa, XDP_MOV64_REG(BPF_REG_6, BPF_REG_1));
+	E(&fa, XDP_LDX(BPF_W, BPF_REG_7, BPF_REG_6, 0));
+	E(&fa, XDP_LDX(BPF_W, BPF_REG_8, BPF_REG_6, 4));
+	E(&fa, XDP_MOV64_REG(BPF_REG_2, BPF_REG_7));
+	E(&fa, XDP_ADD64_IMM(BPF_REG_2, 14 + 28));
+	J(&fa, XDP_JGT_REG(BPF_REG_2, BPF_REG_8, 0), pass);
+	E(&fa, XDP_LDX(BPF_H, BPF_REG_2, BPF_REG_7, 12));
+	J(&fa, XDP_JMP_IMM(BPF_JEQ, BPF_REG_2, htobe16(ether_type_arp), 0),
+	    arp);
+	J(&fa, XDP_JMP_IMM(BPF_JNE, BPF_REG_2, htobe16(ether_type_ip), 0),
+	    pass);
+	if (fast_src_set(&fa, pass) != 0) {
+		ft_verbose("%s: source set too large, "
+		    "leaving TCP to user space", i->name);
+		J(&fa, XDP_JA(0), pass);
+	}
+
+	/*
+	 * TCP: to us, no IP options, not a fragment, SYN without ACK, no
+	 * payload, to a claimed address.  r9 = TCP header length.
+	 */
+	E(&fa, XDP_MOV64_REG(BPF_REG_2, BPF_REG_7));
+	E(&fa, XDP_ADD64_IMM(BPF_REG_2, 14 + 20 + 20));
+	J(&fa, XDP_JGT_REG(BPF_REG_2, BPF_REG_8, 0), pass);
+	E(&fa, XDP_LDX(BPF_W, BPF_REG_2, BPF_REG_7, 0));
+	J(&fa, XDP_JNE32_IMM(BPF_REG_2, (int32_t)mac_lo, 0), pass);
+	E(&fa, XDP_LDX(BPF_H, BPF_REG_2, BPF_REG_7, 4));
+	J(&fa, XDP_JMP_IMM(BPF_JNE, BPF_REG_2, mac_hi, 0), pass);
+	E(&fa, XDP_LDX(BPF_B, BPF_REG_2, BPF_REG_7, 14));
+	J(&fa, XDP_JMP_IMM(BPF_JNE, BPF_REG_2, 0x45, 0), pass);
+	E(&fa, XDP_LDX(BPF_H, BPF_REG_2, BPF_REG_7, 20));
+	E(&fa, XDP_ALU64_IMM(BPF_AND, BPF_REG_2, htobe16(0x3fff)));
+	J(&fa, XDP_JMP_IMM(BPF_JNE, BPF_REG_2, 0, 0), pass);
+	E(&fa, XDP_LDX(BPF_B, BPF_REG_2, BPF_REG_7, 23));
+	J(&fa, XDP_JMP_IMM(BPF_JNE, BPF_REG_2, ip_proto_tcp, 0), pass);
+	E(&fa, XDP_LDX(BPF_B, BPF_REG_2, BPF_REG_7, 47));
+	E(&fa, XDP_ALU64_IMM(BPF_AND, BPF_REG_2, TCP4_SYN | TCP4_ACK));
+	J(&fa, XDP_JMP_IMM(BPF_JNE, BPF_REG_2, TCP4_SYN, 0), pass);
+	E(&fa, XDP_LDX(BPF_B, BPF_REG_9, BPF_REG_7, 46));
+	E(&fa, XDP_ALU64_IMM(BPF_RSH, BPF_REG_9, 4));
+	E(&fa, XDP_ALU64_IMM(BPF_LSH, BPF_REG_9, 2));
+	J(&fa, XDP_JMP_IMM(BPF_JLT, BPF_REG_9, 20, 0), pass);
+	E(&fa, XDP_LDX(BPF_H, BPF_REG_2, BPF_REG_7, 16));
+	E(&fa, XDP_TO_BE(BPF_REG_2, 16));
+	E(&fa, XDP_MOV64_REG(BPF_REG_3, BPF_REG_9));
+	E(&fa, XDP_ADD64_IMM(BPF_REG_3, 20));
+	J(&fa, XDP_JMP_REG(BPF_JNE, BPF_REG_2, BPF_REG_3, 0), pass);
+	E(&fa, XDP_LDX(BPF_W, BPF_REG_2, BPF_REG_7, 30));
+	fast_lookup(&fa, f->claimfd);
+	J(&fa, XDP_JMP_IMM(BPF_JEQ, BPF_REG_0, 0, 0), pass);
+
+	/* IP and TCP checksums, one length at a time for the verifier */
+	fast_csum(&fa, 14, 20, 0);
+	fast_fold(&fa);
+	J(&fa, XDP_JMP_IMM(BPF_JNE, BPF_REG_0, 0xffff, 0), pass);
+	for (hl = 20; hl <= 60; hl += 4) {
+		next = fast_label(&fa);
+		J(&fa, XDP_JMP_IMM(BPF_JNE, BPF_REG_9, hl, 0), next);
+		E(&fa, XDP_MOV64_REG(BPF_REG_2, BPF_REG_7));
+		E(&fa, XDP_ADD64_IMM(BPF_REG_2, 14 + 20 + hl));
+		J(&fa, XDP_JGT_REG(BPF_REG_2, BPF_REG_8, 0), pass);
+		fast_csum(&fa, 14 + 12, 8 + hl,
+		    htobe16(ip_proto_tcp) + htobe16(hl));
+		J(&fa, XDP_JA(0), tcpsum);
+		fast_bind(&fa, next);
+	}
+	J(&fa, XDP_JA(0), pass);
+	fast_bind(&fa, tcpsum);
+	fast_fold(&fa);
+	J(&fa, XDP_JMP_IMM(BPF_JNE, BPF_REG_0, 0xffff, 0), pass);
+
+	/* what user space needs to know */
+	E(&fa, XDP_ST(BPF_W, BPF_REG_10, FAST_EV_OFF(type), XDP_FAST_SYN));
+	E(&fa, XDP_LDX(BPF_W, BPF_REG_2, BPF_REG_7, 26));
+	E(&fa, XDP_STX(BPF_W, BPF_REG_10, BPF_REG_2, FAST_EV_OFF(src)));
+	E(&fa, XDP_LDX(BPF_W, BPF_REG_2, BPF_REG_7, 30));
+	E(&fa, XDP_STX(BPF_W, BPF_REG_10, BPF_REG_2, FAST_EV_OFF(dst)));
+	E(&fa, XDP_LDX(BPF_H, BPF_REG_2, BPF_REG_7, 34));
+	E(&fa, XDP_STX(BPF_H, BPF_REG_10, BPF_REG_2, FAST_EV_OFF(sp)));
+	E(&fa, XDP_LDX(BPF_H, BPF_REG_2, BPF_REG_7, 36));
+	E(&fa, XDP_STX(BPF_H, BPF_REG_10, BPF_REG_2, FAST_EV_OFF(dp)));
+	E(&fa, XDP_LDX(BPF_W, BPF_REG_2, BPF_REG_7, 38));
+	E(&fa, XDP_STX(BPF_W, BPF_REG_10, BPF_REG_2, FAST_EV_OFF(seq)));
+	E(&fa, XDP_LDX(BPF_W, BPF_REG_2, BPF_REG_7, 6));
+	E(&fa, XDP_STX(BPF_W, BPF_REG_10, BPF_REG_2, FAST_EV_OFF(ether)));
+	E(&fa, XDP_LDX(BPF_H, BPF_REG_2, BPF_REG_7, 10));
+	E(&fa, XDP_STX(BPF_H, BPF_REG_10, BPF_REG_2, FAST_EV_OFF(ether) + 4));
+	E(&fa, XDP_LDX(BPF_B, BPF_REG_2, BPF_REG_7, 46));
+	E(&fa, XDP_ALU64_IMM(BPF_AND, BPF_REG_2, 1));
+	E(&fa, XDP_ALU64_IMM(BPF_LSH, BPF_REG_2, 8));
+	E(&fa, XDP_LDX(BPF_B, BPF_REG_3, BPF_REG_7, 47));
+	E(&fa, XDP_ALU64_REG(BPF_OR, BPF_REG_2, BPF_REG_3));
+	E(&fa, XDP_STX(BPF_H, BPF_REG_10, BPF_REG_2, FAST_EV_OFF(tcpfl)));
+
+	/* SYN/ACK: swap everything around, fill in the rest */
+	E(&fa, XDP_LDX(BPF_W, BPF_REG_2, BPF_REG_10, FAST_EV_OFF(ether)));
+	E(&fa, XDP_STX(BPF_W, BPF_REG_7, BPF_REG_2, 0));
+	E(&fa, XDP_LDX(BPF_H, BPF_REG_2, BPF_REG_10, FAST_EV_OFF(ether) + 4));
+	E(&fa, XDP_STX(BPF_H, BPF_REG_7, BPF_REG_2, 4));
+	E(&fa, XDP_ST(BPF_W, BPF_REG_7, 6, (int32_t)mac_lo));
+	E(&fa, XDP_ST(BPF_H, BPF_REG_7, 10, mac_hi));
+	E(&fa, XDP_ST(BPF_W, BPF_REG_7, 14, (int32_t)ihl_len));
+	E(&fa, XDP_ST(BPF_W, BPF_REG_7, 18, 0));
+	E(&fa, XDP_ST(BPF_H, BPF_REG_7, 22, ttl_proto));
+	E(&fa, XDP_ST(BPF_H, BPF_REG_7, 24, 0));
+	E(&fa, XDP_LDX(BPF_W, BPF_REG_2, BPF_REG_10, FAST_EV_OFF(dst)));
+	E(&fa, XDP_STX(BPF_W, BPF_REG_7, BPF_REG_2, 26));
+	E(&fa, XDP_LDX(BPF_W, BPF_REG_2, BPF_REG_10, FAST_EV_OFF(src)));
+	E(&fa, XDP_STX(BPF_W, BPF_REG_7, BPF_REG_2, 30));
+	E(&fa, XDP_LDX(BPF_H, BPF_REG_2, BPF_REG_10, FAST_EV_OFF(dp)));
+	E(&fa, XDP_STX(BPF_H, BPF_REG_7, BPF_REG_2, 34));
+	E(&fa, XDP_LDX(BPF_H, BPF_REG_2, BPF_REG_10, FAST_EV_OFF(sp)));
+	E(&fa, XDP_STX(BPF_H, BPF_REG_7, BPF_REG_2, 36));
+	E(&fa, XDP_ST(BPF_W, BPF_REG_7, 38, (int32_t)htobe32(FLYTRAP_TCP4_SEQ)));
+	E(&fa, XDP_LDX(BPF_W, BPF_REG_2, BPF_REG_10, FAST_EV_OFF(seq)));
+	E(&fa, XDP_TO_BE(BPF_REG_2, 32));
+	E(&fa, XDP_ADD64_IMM(BPF_REG_2, 1));
+	E(&fa, XDP_TO_BE(BPF_REG_2, 32));
+	E(&fa, XDP_STX(BPF_W, BPF_REG_7, BPF_REG_2, 42));
+	E(&fa, XDP_ST(BPF_H, BPF_REG_7, 46, off_fl));
+	E(&fa, XDP_ST(BPF_W, BPF_REG_7, 48, 0));
+	E(&fa, XDP_ST(BPF_W, BPF_REG_7, 50, 0));
+	fast_csum(&fa, 14, 20, 0);
+	fast_fold(&fa);
+	E(&fa, XDP_ALU64_IMM(BPF_XOR, BPF_REG_0, 0xffff));
+	E(&fa, XDP_STX(BPF_H, BPF_REG_7, BPF_REG_0, 24));
+	fast_csum(&fa, 14 + 12, 8 + 20,
+	    htobe16(ip_proto_tcp) + htobe16(20));
+	fast_fold(&fa);
+	E(&fa, XDP_ALU64_IMM(BPF_XOR, BPF_REG_0, 0xffff));
+	E(&fa, XDP_STX(BPF_H, BPF_REG_7, BPF_REG_0, 50));
+	/* drop the options */
+	J(&fa, XDP_JMP_IMM(BPF_JEQ, BPF_REG_9, 20, 0), out);
+	E(&fa, XDP_MOV64_REG(BPF_REG_1, BPF_REG_6));
+	E(&fa, XDP_MOV64_IMM(BPF_REG_2, 20));
+	E(&fa, XDP_ALU64_REG(BPF_SUB, BPF_REG_2, BPF_REG_9));
+	E(&fa, XDP_CALL(BPF_FUNC_xdp_adjust_tail));
+	J(&fa, XDP_JMP_IMM(BPF_JNE, BPF_REG_0, 0, 0), drop);
+	J(&fa, XDP_JA(0), out);
+
+	/*
+	 * ARP: a request for a claimed address.  The padding is left in
+	 * place so the frame is turned around without changing size.
+	 */
+	fast_bind(&fa, arp);
+	E(&fa, XDP_LDX(BPF_W, BPF_REG_2, BPF_REG_7, 14));
+	J(&fa, XDP_JNE32_IMM(BPF_REG_2, (int32_t)arp_lo, 0), pass);
+	E(&fa, XDP_LDX(BPF_W, BPF_REG_2, BPF_REG_7, 18));
+	J(&fa, XDP_JNE32_IMM(BPF_REG_2, (int32_t)arp_hi, 0), pass);
+	E(&fa, XDP_LDX(BPF_W, BPF_REG_2, BPF_REG_7, 38));
+	fast_lookup(&fa, f->claimfd);
+	J(&fa, XDP_JMP_IMM(BPF_JEQ, BPF_REG_0, 0, 0), pass);
+	E(&fa, XDP_ST(BPF_W, BPF_REG_10, FAST_EV_OFF(type), XDP_FAST_ARP));
+	E(&fa, XDP_LDX(BPF_W, BPF_REG_2, BPF_REG_7, 28));
+	E(&fa, XDP_STX(BPF_W, BPF_REG_10, BPF_REG_2, FAST_EV_OFF(src)));
+	E(&fa, XDP_LDX(BPF_W, BPF_REG_2, BPF_REG_7, 38));
+	E(&fa, XDP_STX(BPF_W, BPF_REG_10, BPF_REG_2, FAST_EV_OFF(dst)));
+	E(&fa, XDP_ST(BPF_W, BPF_REG_10, FAST_EV_OFF(sp), 0));
+	E(&fa, XDP_ST(BPF_W, BPF_REG_10, FAST_EV_OFF(seq), 0));
+	E(&fa, XDP_LDX(BPF_W, BPF_REG_2, BPF_REG_7, 22));
+	E(&fa, XDP_STX(BPF_W, BPF_REG_10, BPF_REG_2, FAST_EV_OFF(ether)));
+	E(&fa, XDP_LDX(BPF_H, BPF_REG_2, BPF_REG_7, 26));
+	E(&fa, XDP_STX(BPF_H, BPF_REG_10, BPF_REG_2, FAST_EV_OFF(ether) + 4));
+	E(&fa, XDP_ST(BPF_H, BPF_REG_10, FAST_EV_OFF(tcpfl), 0));
+	/* is-at: same as arp_reply() */
+	E(&fa, XDP_LDX(BPF_W, BPF_REG_2, BPF_REG_7, 6));
+	E(&fa, XDP_STX(BPF_W, BPF_REG_7, BPF_REG_2, 0));
+	E(&fa, XDP_LDX(BPF_H, BPF_REG_2, BPF_REG_7, 10));
+	E(&fa, XDP_STX(BPF_H, BPF_REG_7, BPF_REG_2, 4));
+	E(&fa, XDP_ST(BPF_W, BPF_REG_7, 6, (int32_t)mac_lo));
+	E(&fa, XDP_ST(BPF_H, BPF_REG_7, 10, mac_hi));
+	E(&fa, XDP_ST(BPF_H, BPF_REG_7, 20, htobe16(arp_oper_is_at)));
+	E(&fa, XDP_ST(BPF_W, BPF_REG_7, 22, (int32_t)mac_lo));
+	E(&fa, XDP_ST(BPF_H, BPF_REG_7, 26, mac_hi));
+	E(&fa, XDP_LDX(BPF_W, BPF_REG_2, BPF_REG_10, FAST_EV_OFF(dst)));
+	E(&fa, XDP_STX(BPF_W, BPF_REG_7, BPF_REG_2, 28));
+	E(&fa, XDP_LDX(BPF_W, BPF_REG_2, BPF_REG_10, FAST_EV_OFF(ether)));
+	E(&fa, XDP_STX(BPF_W, BPF_REG_7, BPF_REG_2, 32));
+	E(&fa, XDP_LDX(BPF_H, BPF_REG_2, BPF_REG_10, FAST_EV_OFF(ether) + 4));
+	E(&fa, XDP_STX(BPF_H, BPF_REG_7, BPF_REG_2, 36));
+	E(&fa, XDP_LDX(BPF_W, BPF_REG_2, BPF_REG_10, FAST_EV_OFF(src)));
+	E(&fa, XDP_STX(BPF_W, BPF_REG_7, BPF_REG_2, 38));
+
+	/* report and count it, then send it */
+	fast_bind(&fa, out);
+	fast_ld_map(&fa, BPF_REG_1, f->ringfd);
+	E(&fa, XDP_MOV64_REG(BPF_REG_2, BPF_REG_10));
+	E(&fa, XDP_ADD64_IMM(BPF_REG_2, FAST_EV));
+	E(&fa, XDP_MOV64_IMM(BPF_REG_3, sizeof(struct xdp_fast_event)));
+	E(&fa, XDP_MOV64_IMM(BPF_REG_4, 0));
+	E(&fa, XDP_CALL(BPF_FUNC_ringbuf_output));
+	E(&fa, XDP_MOV64_REG(BPF_REG_9, BPF_REG_0));
+	E(&fa, XDP_LDX(BPF_W, BPF_REG_2, BPF_REG_10, FAST_EV_OFF(type)));
+	fast_count(&fa, f->statfd);
+	J(&fa, XDP_JMP_IMM(BPF_JEQ, BPF_REG_9, 0, 0), tx);
+	E(&fa, XDP_MOV64_IMM(BPF_REG_2, XDP_FAST_LOST));
+	fast_count(&fa, f->statfd);
+	fast_bind(&fa, tx);
+	E(&fa, XDP_MOV64_IMM(BPF_REG_0, XDP_TX));
+	E(&fa, XDP_EXIT());
+	fast_bind(&fa, drop);
+	E(&fa, XDP_MOV64_IMM(BPF_REG_0, XDP_DROP));
+	E(&fa, XDP_EXIT());
+	fast_bind(&fa, pass);
+	E(&fa, XDP_MOV64_REG(BPF_REG_1, BPF_REG_6));
+
+	if (fa.n > fa.max)
+		return (0);
+	for (k = 0; k < fa.nfixup; ++k) {
+		insns[fa.fixup[k].insn].off =
+		    fa.label[fa.fixup[k].label] - fa.fixup[k].insn - 1;
+	}
+	return (fa.n);
+}
+
+static int
+fast_map_create(int type, unsigned int ksz, unsigned int vsz,
+    unsigned int max)
+{
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof attr);
+	attr.map_type = type;
+	attr.key_size = ksz;
+	attr.value_size = vsz;
+	attr.max_entries = max;
+	return (xdp_sys_bpf(BPF_MAP_CREATE, &attr));
+}
+
+/*
+ * Create the maps the fast path uses and map the event ring.  The
+ * program itself is generated later, either as part of the XDP
+ * backend's or on its own by iface_fast_attach().
+ */
+int
+iface_fast_open(iface *i)
+{
+	struct iface_fast *f;
+	void *p;
+	int serrno;
+
+	if ((f = calloc(1, sizeof *f)) == NULL)
+		return (-1);
+	i->fast = f;
+	f->claimfd = f->ringfd = f->statfd = f->progfd = f->linkfd = -1;
+	f->pagesz = sysconf(_SC_PAGESIZE);
+	if ((f->claimfd = fast_map_create(BPF_MAP_TYPE_HASH,
+	    sizeof(uint32_t), sizeof(uint8_t), FAST_MAXCLAIM)) < 0 ||
+	    (f->ringfd = fast_map_create(BPF_MAP_TYPE_RINGBUF,
+	    0, 0, FAST_RINGSZ)) < 0 ||
+	    (f->statfd = fast_map_create(BPF_MAP_TYPE_ARRAY,
+	    sizeof(uint32_t), sizeof(uint64_t), XDP_FAST_NSTATS)) < 0)
+		goto fail;
+	p = mmap(NULL, f->pagesz, PROT_READ | PROT_WRITE, MAP_SHARED,
+	    f->ringfd, 0);
+	if (p == MAP_FAILED)
+		goto fail;
+	f->consumer = p;
+	/* the data follows the producer page, mapped twice in a row */
+	p = mmap(NULL, f->pagesz + 2 * FAST_RINGSZ, PROT_READ, MAP_SHARED,
+	    f->ringfd, f->pagesz);
+	if (p == MAP_FAILED)
+		goto fail;
+	f->producer = p;
+	f->data = (uint8_t *)p + f->pagesz;
+	ft_verbose("%s: XDP fast path ready", i->name);
+	return (0);
+fail:
+	serrno = errno;
+	iface_fast_close(i);
+	errno = serrno;
+	return (-1);
+}
+
+/*
+ * Generate and attach the fast path on its own, for backends other than
+ * XDP, which pass everything it does not answer on to the stack.
+ */
+int
+iface_fast_attach(iface *i)
+{
+	struct iface_fast *f = i->fast;
+	struct bpf_insn insns[XDP_MAXINSNS];
+	const struct bpf_insn tail[] = {
+		XDP_MOV64_IMM(BPF_REG_0, XDP_PASS),
+		XDP_EXIT(),
+	};
+	unsigned int ifindex, n;
+
+	if ((ifindex = if_nametoindex(i->name)) == 0)
+		return (-1);
+	n = iface_fast_prog(i, insns, XDP_MAXINSNS - 2);
+	if (n == 0) {
+		errno = E2BIG;
+		return (-1);
+	}
+	memcpy(insns + n, tail, sizeof tail);
+	n += sizeof tail / sizeof tail[0];
+	if ((f->progfd = xdp_load_insns(i, insns, n)) < 0 ||
+	    (f->linkfd = xdp_attach_prog(i, ifindex, f->progfd)) < 0)
+		return (-1);
+	return (0);
+}
+
+void
+iface_fast_close(iface *i)
+{
+	struct iface_fast *f = i->fast;
+
+	if (f == NULL)
+		return;
+	if (f->linkfd >= 0)
+		close(f->linkfd);
+	if (f->progfd >= 0)
+		close(f->progfd);
+	if (f->producer != NULL)
+		munmap(f->producer, f->pagesz + 2 * FAST_RINGSZ);
+	if (f->consumer != NULL)
+		munmap(f->consumer, f->pagesz);
+	if (f->statfd >= 0)
+		close(f->statfd);
+	if (f->ringfd >= 0)
+		close(f->ringfd);
+	if (f->claimfd >= 0)
+		close(f->claimfd);
+	free(f);
+	i->fast = NULL;
+}
+
+/*
+ * Tell the fast path that we have claimed, or no longer claim, an
+ * address, which is in host order.
+ */
+int
+iface_fast_claim(iface *i, uint32_t addr, int claimed)
+{
+	union bpf_attr attr;
+	uint32_t key;
+	uint8_t val;
+
+	if (i->fast == NULL)
+		return (0);
+	key = htobe32(addr);
+	val = 1;
+	memset(&attr, 0, sizeof attr);
+	attr.map_fd = i->fast->claimfd;
+	attr.key = (uintptr_t)&key;
+	if (claimed) {
+		attr.value = (uintptr_t)&val;
+		if (xdp_sys_bpf(BPF_MAP_UPDATE_ELEM, &attr) != 0) {
+			ft_warning("%s: failed to add %u.%u.%u.%u "
+			    "to the fast path: %m", i->name,
+			    (addr >> 24) & 0xff, (addr >> 16) & 0xff,
+			    (addr >> 8) & 0xff, addr & 0xff);
+			return (-1);
+		}
+	} else {
+		if (xdp_sys_bpf(BPF_MAP_DELETE_ELEM, &attr) != 0 &&
+		    errno != ENOENT)
+			return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Account for something the fast path answered, as if we had.
+ */
+static void
+fast_event(iface *i, const struct timeval *tv,
+    const struct xdp_fast_event *ev)
+{
+
+	switch (ev->type) {
+	case XDP_FAST_ARP:
+		ft_debug("%s: fast path: %u.%u.%u.%u is-at us", i->name,
+		    ev->dst.o[0], ev->dst.o[1], ev->dst.o[2], ev->dst.o[3]);
+		arp_fast(i->arp, &ev->src, &ev->ether, &ev->dst);
+		break;
+	case XDP_FAST_SYN:
+		ft_debug("%s: fast path: SYN/ACK to %u.%u.%u.%u port %hu",
+		    i->name, ev->src.o[0], ev->src.o[1], ev->src.o[2],
+		    ev->src.o[3], (unsigned short)be16toh(ev->sp));
+		tcp4_fast(tv, &ev->src, be16toh(ev->sp),
+		    &ev->dst, be16toh(ev->dp), ev->tcpfl);
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+ * Process whatever events the fast path has posted since we last
+ * looked.
+ */
+void
+iface_fast_poll(iface *i)
+{
+	struct iface_fast *f = i->fast;
+	struct xdp_fast_event ev;
+	unsigned long cons, prod;
+	struct timeval tv;
+	uint32_t *hdr, len;
+	uint64_t now;
+
+	cons = __atomic_load_n(f->consumer, __ATOMIC_RELAXED);
+	prod = __atomic_load_n(f->producer, __ATOMIC_ACQUIRE);
+	if (cons == prod)
+		return;
+	/* the clock normally follows packets, but there are none */
+	gettimeofday(&tv, NULL);
+	now = (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+	if (now > ft_time)
+		ft_time = now;
+	while (cons < prod) {
+		hdr = (uint32_t *)(f->data + cons % FAST_RINGSZ);
+		len = __atomic_load_n(hdr, __ATOMIC_ACQUIRE);
+		if (len & BPF_RINGBUF_BUSY_BIT)
+			break;
+		if (!(len & BPF_RINGBUF_DISCARD_BIT) && len >= sizeof ev) {
+			memcpy(&ev, (uint8_t *)hdr + BPF_RINGBUF_HDR_SZ,
+			    sizeof ev);
+			fast_event(i, &tv, &ev);
+		}
+		len &= ~(BPF_RINGBUF_BUSY_BIT | BPF_RINGBUF_DISCARD_BIT);
+		cons += (BPF_RINGBUF_HDR_SZ + len + 7) & ~7UL;
+		__atomic_store_n(f->consumer, cons, __ATOMIC_RELEASE);
+	}
+}
+
+/*
+ * The event ring becomes readable when the program posts to it.
+ */
+int
+iface_fast_pollfd(iface *i, struct pollfd *pfd, unsigned int n)
+{
+
+	if (n < 1)
+		return (0);
+	pfd[0].fd = i->fast->ringfd;
+	pfd[0].events = POLLIN;
+	return (1);
+}
+
+/*
+ * Log fast path statistics.
+ */
+void
+iface_fast_report(const iface *i)
+{
+	union bpf_attr attr;
+	uint64_t st[XDP_FAST_NSTATS];
+	uint32_t key;
+
+	for (key = 0; key < XDP_FAST_NSTATS; ++key) {
+		st[key] = 0;
+		memset(&attr, 0, sizeof attr);
+		attr.map_fd = i->fast->statfd;
+		attr.key = (uintptr_t)&key;
+		attr.value = (uintptr_t)&st[key];
+		(void)xdp_sys_bpf(BPF_MAP_LOOKUP_ELEM, &attr);
+	}
+	if (st[XDP_FAST_ARP] + st[XDP_FAST_SYN] == 0)
+		return;
+	ft_notice("%s: fast path: %lu ARP replies, %lu SYN/ACKs, "
+	    "%lu events lost", i->name, (unsigned long)st[XDP_FAST_ARP],
+	    (unsigned long)st[XDP_FAST_SYN], (unsigned long)st[XDP_FAST_LOST]);
+}
@@ -0,0 +1,213 @@
+/*-
+ * Copyright (c) 2016-2018 The University of Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if HAVE_PCAP_PCAP_H
+#include <pcap/pcap.h>
+#elif HAVE_PCAP_H
+#include <pcap.h>
+#endif
+
+#include <ft/ethernet.h>
+#include <ft/log.h>
+
+#include "flytrap.h"
+#include "iface.h"
+#include "packet.h"
+
+struct iface_file {
+	pcap_dumper_t	*dumper;	/* where replies go, if anywhere */
+	int		 started;
+	struct timespec	 start;		/* wall clock time of first packet */
+	struct timeval	 t0;		/* timestamp of first packet */
+	unsigned long	 npkts;
+	unsigned long	 nbytes;
+	unsigned long	 nreplies;
+};
+
+/*
+ * Open a capture file for replay, and the file replies are written to
+ * if one was specified.
+ */
+int
+iface_file_open(iface *i)
+{
+	char pceb[PCAP_ERRBUF_SIZE];
+	struct iface_file *f;
+
+	if ((f = calloc(1, sizeof *f)) == NULL)
+		return (-1);
+	i->file = f;
+	*pceb = '\0';
+	if ((i->pch = pcap_open_offline(i->name, pceb)) == NULL) {
+		ft_error("failed to open %s: %s", i->name, pceb);
+		goto fail;
+	}
+	if (pcap_datalink(i->pch) != DLT_EN10MB) {
+		ft_error("%s: not an Ethernet capture", i->name);
+		goto fail;
+	}
+	if (ft_replay_out != NULL &&
+	    (f->dumper = pcap_dump_open(i->pch, ft_replay_out)) == NULL) {
+		ft_error("failed to open %s: %s",
+		    ft_replay_out, pcap_geterr(i->pch));
+		goto fail;
+	}
+	return (0);
+fail:
+	if (i->pch != NULL)
+		pcap_close(i->pch);
+	i->pch = NULL;
+	free(f);
+	i->file = NULL;
+	errno = EINVAL;
+	return (-1);
+}
+
+/*
+ * Report throughput and clean up.
+ */
+void
+iface_file_close(iface *i)
+{
+	struct iface_file *f = i->file;
+	struct timespec end;
+	double elapsed;
+
+	if (f == NULL)
+		return;
+	if (f->started) {
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		elapsed = (end.tv_sec - f->start.tv_sec) +
+		    (end.tv_nsec - f->start.tv_nsec) / 1e9;
+		if (elapsed <= 0.0)
+			elapsed = 1e-9;
+		ft_notice("%s: %lu packets, %lu bytes in %.3f s "
+		    "(%.0f pps, %.1f Mbps), %lu replies", i->name,
+		    f->npkts, f->nbytes, elapsed, f->npkts / elapsed,
+		    f->nbytes * 8 / elapsed / 1e6, f->nreplies);
+	}
+	if (f->dumper != NULL)
+		pcap_dump_close(f->dumper);
+	pcap_close(i->pch);
+	free(f);
+	i->file = NULL;
+}
+
+/*
+ * Wait until it is time to process a packet with the given timestamp,
+ * relative to the first.
+ */
+static void
+iface_file_pace(struct iface_file *f, const struct timeval *ts)
+{
+	struct timespec due;
+	double offset;
+
+	offset = ((ts->tv_sec - f->t0.tv_sec) +
+	    (ts->tv_usec - f->t0.tv_usec) / 1e6) / ft_replay_speed;
+	if (offset <= 0.0)
+		return;
+	due.tv_sec = f->start.tv_sec + (time_t)offset;
+	due.tv_nsec = f->start.tv_nsec +
+	    (long)((offset - (time_t)offset) * 1e9);
+	if (due.tv_nsec >= 1000000000L) {
+		due.tv_sec++;
+		due.tv_nsec -= 1000000000L;
+	}
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+	    &due, NULL) == EINTR)
+		/* nothing */ ;
+}
+
+/*
+ * Read the next batch of packets from the file.  When pacing, packets
+ * are read one at a time and not returned before they are due.  Sets
+ * the end-of-file flag and returns zero once the file is exhausted.
+ */
+int
+iface_file_next_batch(iface *i, packet *p, unsigned int n)
+{
+	struct iface_file *f = i->file;
+	unsigned int k;
+	int ret;
+
+	if (!f->started) {
+		clock_gettime(CLOCK_MONOTONIC, &f->start);
+		f->started = 1;
+	}
+	if (ft_replay_speed > 0.0)
+		n = 1;
+	do {
+		if ((ret = iface_pcap_next_batch(i, p, n)) < 0)
+			return (-1);
+	} while (ret == 0 && !i->eof);
+	for (k = 0; k < (unsigned int)ret; ++k) {
+		if (f->npkts + k == 0)
+			f->t0 = p[k].ts;
+		f->nbytes += p[k].len;
+	}
+	f->npkts += ret;
+	if (ft_replay_speed > 0.0 && ret > 0)
+		iface_file_pace(f, &p[0].ts);
+	return (ret);
+}
+
+/*
+ * Write a reply to the output file, if there is one, timestamped with
+ * the time of the packet that prompted it.
+ */
+int
+iface_file_transmit(iface *i, const void *data, size_t len)
+{
+	struct iface_file *f = i->file;
+	struct pcap_pkthdr ph;
+
+	f->nreplies++;
+	if (f->dumper == NULL)
+		return (0);
+	memset(&ph, 0, sizeof ph);
+	ph.ts = ft_rxtime;
+	ph.caplen = ph.len = len;
+	pcap_dump((u_char *)f->dumper, &ph, data);
+	return (0);
+}
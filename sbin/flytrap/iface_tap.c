@@ -0,0 +1,288 @@
+/*-
+ * Copyright (c) 2016-2018 The University of Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <net/if.h>
+
+#include <linux/filter.h>
+#include <linux/if_tun.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if HAVE_PCAP_PCAP_H
+#include <pcap/pcap.h>
+#elif HAVE_PCAP_H
+#include <pcap.h>
+#endif
+
+#include <ft/ethernet.h>
+#include <ft/log.h>
+#include <ft/strlcpy.h>
+
+#include "flytrap.h"
+#include "iface.h"
+#include "packet.h"
+#if HAVE_IO_URING
+#include "uring.h"
+#endif
+
+struct iface_tap {
+	unsigned int	 nq;		/* number of queues */
+	unsigned int	 cur;		/* queue we last read from */
+	unsigned int	 txq;		/* queue the replies are for */
+	int		 fd[TAP_MAXQUEUES];
+	unsigned long	 nrx[TAP_MAXQUEUES];
+	unsigned long	 ntx[TAP_MAXQUEUES];
+};
+
+/*
+ * Attach to the named TAP device, creating it if it does not already
+ * exist, with one file descriptor per queue.  Frames are read and
+ * written without the packet information header.
+ */
+int
+iface_tap_open(iface *i)
+{
+	struct iface_tap *t;
+	struct ifreq ifr;
+	unsigned int q;
+	int serrno;
+
+	if (ft_tap_nqueue == 0 || ft_tap_nqueue > TAP_MAXQUEUES) {
+		errno = EINVAL;
+		return (-1);
+	}
+	if ((t = calloc(1, sizeof *t)) == NULL)
+		return (-1);
+	i->tap = t;
+	for (q = 0; q < ft_tap_nqueue; ++q) {
+		memset(&ifr, 0, sizeof ifr);
+		if (strlcpy(ifr.ifr_name, i->name, sizeof ifr.ifr_name) >=
+		    sizeof ifr.ifr_name) {
+			errno = ENAMETOOLONG;
+			goto fail;
+		}
+		ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+		if (ft_tap_nqueue > 1)
+			ifr.ifr_flags |= IFF_MULTI_QUEUE;
+		if ((t->fd[q] = open("/dev/net/tun", O_RDWR | O_NONBLOCK)) < 0)
+			goto fail;
+		t->nq++;
+		if (ioctl(t->fd[q], TUNSETIFF, &ifr) != 0)
+			goto fail;
+	}
+	ft_verbose("%s: attached to TAP device with %u queue%s",
+	    i->name, t->nq, t->nq == 1 ? "" : "s");
+	return (0);
+fail:
+	serrno = errno;
+	iface_tap_close(i);
+	errno = serrno;
+	return (-1);
+}
+
+/*
+ * Install our filter program and bring the device up if it is not
+ * already.  The kernel applies the filter to every queue.
+ */
+int
+iface_tap_activate(iface *i, const struct bpf_program *fprog)
+{
+	struct iface_tap *t = i->tap;
+	struct sock_fprog sfp;
+	struct ifreq ifr;
+	int sd;
+
+	sfp.len = fprog->bf_len;
+	sfp.filter = (struct sock_filter *)fprog->bf_insns;
+	if (ioctl(t->fd[0], TUNATTACHFILTER, &sfp) != 0) {
+		ft_error("%s: failed to install filter: %m", i->name);
+		return (-1);
+	}
+	if ((sd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+		ft_error("%s: failed to bring interface up: %m", i->name);
+		return (-1);
+	}
+	memset(&ifr, 0, sizeof ifr);
+	(void)strlcpy(ifr.ifr_name, i->name, sizeof ifr.ifr_name);
+	if (ioctl(sd, SIOCGIFFLAGS, &ifr) != 0)
+		goto fail;
+	if (!(ifr.ifr_flags & IFF_UP)) {
+		ifr.ifr_flags |= IFF_UP;
+		if (ioctl(sd, SIOCSIFFLAGS, &ifr) != 0)
+			goto fail;
+	}
+	close(sd);
+	return (0);
+fail:
+	ft_error("%s: failed to bring interface up: %m", i->name);
+	close(sd);
+	return (-1);
+}
+
+void
+iface_tap_close(iface *i)
+{
+	struct iface_tap *t = i->tap;
+	unsigned int q;
+
+	if (t == NULL)
+		return;
+	for (q = 0; q < t->nq; ++q) {
+		ft_verbose("%s: queue %u: %lu packets received, %lu sent",
+		    i->name, q, t->nrx[q], t->ntx[q]);
+		close(t->fd[q]);
+	}
+	free(t);
+	i->tap = NULL;
+}
+
+/*
+ * Read up to n frames from a single queue into the interface's batch
+ * buffer.  Queues are serviced in turn, and replies to the batch go out
+ * on the queue it came from.  Returns the number of packets, which is
+ * zero if nothing was waiting.
+ */
+int
+iface_tap_next_batch(iface *i, packet *p, unsigned int n)
+{
+	struct iface_tap *t = i->tap;
+	struct timeval now;
+	unsigned int j, k, q;
+	uint8_t *buf;
+	ssize_t rlen;
+
+	for (k = 0, j = 1; k == 0 && j <= t->nq; ++j) {
+		q = (t->cur + j) % t->nq;
+		while (k < n) {
+			buf = i->rxbuf + (size_t)k * IFACE_SNAPLEN;
+			if ((rlen = read(t->fd[q], buf, IFACE_SNAPLEN)) < 0) {
+				if (errno == EAGAIN || errno == EINTR)
+					break;
+				ft_error("%s: failed to read packet: %m",
+				    i->name);
+				errno = EIO;
+				return (-1);
+			}
+			p[k].data = buf;
+			p[k].caplen = p[k].len = rlen;
+			p[k].csum = packet_csum_unknown;
+			k++;
+		}
+		if (k > 0)
+			t->cur = q;
+	}
+	if (k == 0)
+		return (0);
+	t->nrx[t->cur] += k;
+	gettimeofday(&now, NULL);
+	for (j = 0; j < k; ++j) {
+		p[j].i = i;
+		p[j].ts = now;
+		p[j].queue = t->cur;
+	}
+	return (k);
+}
+
+int
+iface_tap_pollfd(iface *i, struct pollfd *pfd, unsigned int n)
+{
+	struct iface_tap *t = i->tap;
+	unsigned int q;
+
+	for (q = 0; q < t->nq && q < n; ++q) {
+		pfd[q].fd = t->fd[q];
+		pfd[q].events = POLLIN;
+	}
+	return (q);
+}
+
+/*
+ * Queue a reply to a packet which came in on the given queue.  The
+ * capture thread may already be reading from another, so it is the
+ * packet, not t->cur, which says where the reply goes.
+ */
+int
+iface_tap_transmit(iface *i, const void *data, size_t len,
+    unsigned int queue)
+{
+	struct iface_tap *t = i->tap;
+
+	if (queue >= t->nq)
+		queue = 0;
+	if (queue != t->txq && i->txq.n > 0 && iface_flush(i) < 0)
+		return (-1);
+	t->txq = queue;
+	return (iface_txq_copy(i, data, len));
+}
+
+/*
+ * Write out the transmit queue on the queue the replies in it are for.
+ * TAP devices have no way to take more than one frame at a time, but
+ * with io_uring the writes are at least submitted together.
+ */
+int
+iface_tap_flush(iface *i)
+{
+	struct iface_tap *t = i->tap;
+	iface_txq *q = &i->txq;
+	const uint8_t *buf;
+	unsigned int k;
+
+	for (k = 0; k < q->n; ++k) {
+		buf = q->buf + (size_t)k * IFACE_SNAPLEN;
+#if HAVE_IO_URING
+		if (uring_active()) {
+			if (uring_send(t->fd[t->txq], buf, q->len[k]) != 0)
+				break;
+			i->stats.ntxcopy++;
+			continue;
+		}
+#endif
+		if (write(t->fd[t->txq], buf, q->len[k]) != (ssize_t)q->len[k])
+			break;
+	}
+	t->ntx[t->txq] += k;
+	return (k);
+}
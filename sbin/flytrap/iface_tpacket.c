@@ -0,0 +1,500 @@
+/*-
+ * Copyright (c) 2016-2018 The University of Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <netinet/in.h>
+
+#include <linux/filter.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if HAVE_PCAP_PCAP_H
+#include <pcap/pcap.h>
+#elif HAVE_PCAP_H
+#include <pcap.h>
+#endif
+
+#include <ft/arp.h>
+#include <ft/ethernet.h>
+#include <ft/log.h>
+#include <ft/strlcpy.h>
+
+#include "flytrap.h"
+#include "iface.h"
+#include "packet.h"
+#if HAVE_IO_URING
+#include "uring.h"
+#endif
+
+#define TPACKET_BLOCK(r, n) \
+	((struct tpacket_block_desc *)((r)->map + (size_t)(n) * (r)->blksz))
+
+/* transmit ring geometry */
+#define TPACKET_TX_BLKSZ	(64 * 1024)
+#define TPACKET_TX_NBLK		4
+
+/* offset of the frame within a transmit ring slot */
+#define TPACKET_TX_OFFSET	(TPACKET3_HDRLEN - sizeof(struct sockaddr_ll))
+
+#define TPACKET_TX_FRAME(t, n)						\
+	((struct tpacket3_hdr *)((t)->map +				\
+	    (size_t)((n) / ((t)->blksz / (t)->framesz)) * (t)->blksz +	\
+	    (size_t)((n) % ((t)->blksz / (t)->framesz)) * (t)->framesz))
+
+/*
+ * Create a packet socket and map a TPACKET_V3 receive ring with the
+ * requested geometry, followed by a small transmit ring if the kernel
+ * supports one.  The socket is not bound to the interface until
+ * iface_tpacket_activate() is called, so nothing is captured yet.
+ */
+int
+iface_tpacket_open(iface *i)
+{
+	struct tpacket_req3 req, treq;
+	iface_ring *r = &i->rx;
+	iface_txring *t = &i->txr;
+	size_t rxlen;
+	long pgsz;
+	int serrno, ver;
+
+	pgsz = sysconf(_SC_PAGESIZE);
+	if (ft_ring_blksz < (unsigned long)pgsz ||
+	    ft_ring_blksz % pgsz != 0 || ft_ring_nblk == 0) {
+		errno = EINVAL;
+		return (-1);
+	}
+	if ((i->fd = socket(AF_PACKET, SOCK_RAW, 0)) < 0)
+		return (-1);
+	ver = TPACKET_V3;
+	if (setsockopt(i->fd, SOL_PACKET, PACKET_VERSION,
+	    &ver, sizeof ver) != 0)
+		goto fail;
+	memset(&req, 0, sizeof req);
+	req.tp_block_size = ft_ring_blksz;
+	req.tp_block_nr = ft_ring_nblk;
+	req.tp_frame_size = TPACKET_ALIGN(TPACKET3_HDRLEN + IFACE_SNAPLEN);
+	req.tp_frame_nr = req.tp_block_size / req.tp_frame_size *
+	    req.tp_block_nr;
+	/* when busy polling, retire partially filled blocks as soon as we can */
+	req.tp_retire_blk_tov = ft_busy_poll ? 1 : IFACE_TIMEOUT;
+	if (setsockopt(i->fd, SOL_PACKET, PACKET_RX_RING,
+	    &req, sizeof req) != 0)
+		goto fail;
+	memset(&treq, 0, sizeof treq);
+	treq.tp_block_size = TPACKET_TX_BLKSZ;
+	treq.tp_block_nr = TPACKET_TX_NBLK;
+	treq.tp_frame_size = req.tp_frame_size;
+	treq.tp_frame_nr = treq.tp_block_size / treq.tp_frame_size *
+	    treq.tp_block_nr;
+	if (setsockopt(i->fd, SOL_PACKET, PACKET_TX_RING,
+	    &treq, sizeof treq) != 0) {
+		ft_verbose("%s: no transmit ring: %m", i->name);
+		memset(&treq, 0, sizeof treq);
+	}
+	memset(r, 0, sizeof *r);
+	r->blksz = req.tp_block_size;
+	r->nblk = req.tp_block_nr;
+	rxlen = (size_t)r->blksz * r->nblk;
+	r->maplen = rxlen + (size_t)treq.tp_block_size * treq.tp_block_nr;
+	r->map = mmap(NULL, r->maplen, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_LOCKED, i->fd, 0);
+	if (r->map == MAP_FAILED) {
+		/* retry without locking */
+		r->map = mmap(NULL, r->maplen, PROT_READ | PROT_WRITE,
+		    MAP_SHARED, i->fd, 0);
+	}
+	if (r->map == MAP_FAILED) {
+		r->map = NULL;
+		goto fail;
+	}
+	ft_verbose("%s: mapped %u x %u byte receive ring",
+	    i->name, r->nblk, r->blksz);
+	memset(t, 0, sizeof *t);
+	if (treq.tp_frame_nr > 0) {
+		t->map = r->map + rxlen;
+		t->blksz = treq.tp_block_size;
+		t->framesz = treq.tp_frame_size;
+		t->nframe = treq.tp_frame_nr;
+		ft_verbose("%s: mapped %u frame transmit ring",
+		    i->name, t->nframe);
+	}
+	return (0);
+fail:
+	serrno = errno;
+	close(i->fd);
+	i->fd = -1;
+	errno = serrno;
+	return (-1);
+}
+
+/*
+ * Attach our filter program to a packet socket, enter promiscuous mode
+ * and bind the socket to the interface.  Returns the interface index.
+ */
+int
+iface_packet_bind(iface *i, int fd, const struct bpf_program *fprog)
+{
+	struct sock_fprog sfp;
+	struct packet_mreq mr;
+	struct sockaddr_ll sll;
+	struct ifreq ifr;
+
+	memset(&ifr, 0, sizeof ifr);
+	if (strlcpy(ifr.ifr_name, i->name, sizeof ifr.ifr_name) >=
+	    sizeof ifr.ifr_name || ioctl(fd, SIOCGIFINDEX, &ifr) != 0) {
+		ft_error("%s: failed to look up interface: %m", i->name);
+		return (-1);
+	}
+	memset(&sll, 0, sizeof sll);
+	sll.sll_family = AF_PACKET;
+	sll.sll_protocol = htons(ETH_P_ALL);
+	sll.sll_ifindex = ifr.ifr_ifindex;
+
+	/* we only understand Ethernet */
+	if (ioctl(fd, SIOCGIFHWADDR, &ifr) != 0 ||
+	    ifr.ifr_hwaddr.sa_family != ARPHRD_ETHER) {
+		ft_error("%s: not an Ethernet interface", i->name);
+		return (-1);
+	}
+
+	/* filter before binding so we never see unfiltered traffic */
+	sfp.len = fprog->bf_len;
+	sfp.filter = (struct sock_filter *)fprog->bf_insns;
+	if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER,
+	    &sfp, sizeof sfp) != 0) {
+		ft_error("%s: failed to install filter: %m", i->name);
+		return (-1);
+	}
+	memset(&mr, 0, sizeof mr);
+	mr.mr_ifindex = sll.sll_ifindex;
+	mr.mr_type = PACKET_MR_PROMISC;
+	if (setsockopt(fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP,
+	    &mr, sizeof mr) != 0) {
+		ft_error("%s: failed to enter promiscuous mode: %m", i->name);
+		return (-1);
+	}
+	if (bind(fd, (struct sockaddr *)&sll, sizeof sll) != 0) {
+		ft_error("%s: failed to bind: %m", i->name);
+		return (-1);
+	}
+	return (sll.sll_ifindex);
+}
+
+#if HAVE_DECL_PACKET_FANOUT_CBPF
+/*
+ * Spreads traffic across the workers by the address it concerns: the
+ * destination of IP packets, the target of ARP requests and the sender
+ * of ARP replies, which is what the claimed address is in each case.
+ * Everything about one address then reaches the same worker.  The
+ * kernel takes the result modulo the number of sockets in the group.
+ */
+static struct sock_filter fanout_insns[] = {
+	BPF_STMT(BPF_LD | BPF_H | BPF_ABS, SKF_AD_OFF + SKF_AD_PROTOCOL),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ether_type_ip, 0, 2),
+	BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 16),
+	BPF_JUMP(BPF_JMP | BPF_JA, 7, 0, 0),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ether_type_arp, 1, 0),
+	BPF_STMT(BPF_RET | BPF_K, 0),
+	BPF_STMT(BPF_LD | BPF_H | BPF_ABS, SKF_NET_OFF + 6),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, arp_oper_is_at, 0, 2),
+	BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 14),
+	BPF_JUMP(BPF_JMP | BPF_JA, 1, 0, 0),
+	BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 24),
+	BPF_STMT(BPF_ALU | BPF_MUL | BPF_K, 0x9e3779b1),
+	BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 16),
+	BPF_STMT(BPF_RET | BPF_A, 0),
+};
+
+/*
+ * Join the fanout group which every worker's socket for this interface
+ * belongs to.
+ */
+static int
+iface_tpacket_fanout(iface *i, int ifindex)
+{
+	struct sock_fprog sfp;
+	int val;
+
+	val = ((getpid() ^ ifindex) & 0xffff) | PACKET_FANOUT_CBPF << 16;
+	if (setsockopt(i->fd, SOL_PACKET, PACKET_FANOUT,
+	    &val, sizeof val) != 0) {
+		ft_error("%s: failed to join fanout group: %m", i->name);
+		return (-1);
+	}
+	sfp.len = sizeof fanout_insns / sizeof fanout_insns[0];
+	sfp.filter = fanout_insns;
+	if (setsockopt(i->fd, SOL_PACKET, PACKET_FANOUT_DATA,
+	    &sfp, sizeof sfp) != 0) {
+		ft_error("%s: failed to set fanout program: %m", i->name);
+		return (-1);
+	}
+	return (0);
+}
+#endif
+
+int
+iface_tpacket_activate(iface *i, const struct bpf_program *fprog)
+{
+	int ifindex;
+
+	if ((ifindex = iface_packet_bind(i, i->fd, fprog)) < 0)
+		return (-1);
+	if (ft_workers > 0) {
+#if HAVE_DECL_PACKET_FANOUT_CBPF
+		if (iface_tpacket_fanout(i, ifindex) != 0)
+			return (-1);
+#else
+		ft_error("%s: packet fanout not supported", i->name);
+		return (-1);
+#endif
+	}
+	if (ft_busy_poll && iface_busy_poll(i, i->fd) != 0)
+		return (-1);
+	if (ft_qdisc_bypass) {
+#ifdef PACKET_QDISC_BYPASS
+		int one = 1;
+
+		if (setsockopt(i->fd, SOL_PACKET, PACKET_QDISC_BYPASS,
+		    &one, sizeof one) != 0) {
+			ft_error("%s: failed to bypass queueing discipline: %m",
+			    i->name);
+			return (-1);
+		}
+		ft_verbose("%s: bypassing queueing discipline", i->name);
+#else
+		ft_error("%s: queueing discipline bypass not supported",
+		    i->name);
+		return (-1);
+#endif
+	}
+	return (0);
+}
+
+void
+iface_tpacket_close(iface *i)
+{
+	struct tpacket_stats_v3 st;
+	socklen_t stlen;
+
+	stlen = sizeof st;
+	if (getsockopt(i->fd, SOL_PACKET, PACKET_STATISTICS,
+	    &st, &stlen) == 0) {
+		ft_verbose("%s: %u packets received, %u dropped",
+		    i->name, st.tp_packets, st.tp_drops);
+	}
+	if (i->rx.map != NULL)
+		munmap(i->rx.map, i->rx.maplen);
+	close(i->fd);
+}
+
+/*
+ * The number of blocks consumed so far.  Every frame returned up to
+ * this point lies in one of them or in the current block.
+ */
+unsigned long
+iface_tpacket_mark(const iface *i)
+{
+
+	return (i->rx.npassed);
+}
+
+/*
+ * Hand consumed blocks back to the kernel, oldest first, until only
+ * those consumed after the given mark are left.
+ */
+void
+iface_tpacket_release(iface *i, unsigned long mark)
+{
+	struct tpacket_block_desc *bd;
+	iface_ring *r = &i->rx;
+
+	for (; r->nheld > 0 && r->npassed - r->nheld < mark; r->nheld--) {
+		bd = TPACKET_BLOCK(r, (r->blk + r->nblk - r->nheld) % r->nblk);
+		__atomic_store_n(&bd->hdr.bh1.block_status,
+		    TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+	}
+}
+
+/*
+ * Fill the caller's array with up to n frames from the receive ring.
+ * Frames are not copied; the packets point directly into the ring.  A
+ * block is handed back to the kernel only once every frame in it has
+ * been consumed and the batch that consumed it has been processed; see
+ * iface_release().  Returns the number of packets, which is zero if
+ * nothing was waiting.
+ */
+int
+iface_tpacket_next_batch(iface *i, packet *p, unsigned int n)
+{
+	struct tpacket_block_desc *bd;
+	struct tpacket3_hdr *th;
+	iface_ring *r = &i->rx;
+	unsigned int k;
+
+	for (k = 0; k < n; ) {
+		if (r->nleft > 0) {
+			th = (struct tpacket3_hdr *)r->frame;
+			r->frame += th->tp_next_offset;
+			r->nleft--;
+			p[k].i = i;
+			p[k].ts.tv_sec = th->tp_sec;
+			p[k].ts.tv_usec = th->tp_nsec / 1000;
+			p[k].data = (uint8_t *)th + th->tp_mac;
+			p[k].caplen = th->tp_snaplen;
+			p[k].len = th->tp_len;
+			p[k].csum = packet_csum_unknown;
+			p[k].queue = 0;
+#ifdef TP_STATUS_CSUM_VALID
+			if (th->tp_status & TP_STATUS_CSUM_VALID)
+				p[k].csum = packet_csum_valid;
+#endif
+			if (th->tp_status & TP_STATUS_CSUMNOTREADY)
+				p[k].csum = packet_csum_partial;
+			k++;
+			continue;
+		}
+		if (r->cur != NULL) {
+			/* done with this block, but hold on to it for now */
+			r->cur = NULL;
+			r->blk = (r->blk + 1) % r->nblk;
+			r->npassed++;
+			r->nheld++;
+		}
+		/* every block is held, so the next one is still ours */
+		if (r->nheld == r->nblk)
+			break;
+		bd = TPACKET_BLOCK(r, r->blk);
+		if (!(__atomic_load_n(&bd->hdr.bh1.block_status,
+		    __ATOMIC_ACQUIRE) & TP_STATUS_USER))
+			break;
+		r->cur = bd;
+		r->frame = (uint8_t *)bd + bd->hdr.bh1.offset_to_first_pkt;
+		r->nleft = bd->hdr.bh1.num_pkts;
+	}
+	return (k);
+}
+
+int
+iface_tpacket_pollfd(iface *i, struct pollfd *pfd, unsigned int n)
+{
+
+	if (n < 1)
+		return (0);
+	pfd[0].fd = i->fd;
+	pfd[0].events = POLLIN;
+	return (1);
+}
+
+/*
+ * Place a frame in the next slot of the transmit ring, or in the
+ * transmit queue if there is no ring.
+ */
+int
+iface_tpacket_transmit(iface *i, const void *data, size_t len)
+{
+	iface_txring *t = &i->txr;
+	struct tpacket3_hdr *th;
+	uint32_t status;
+
+	if (t->map == NULL)
+		return (iface_txq_copy(i, data, len));
+	if (len > t->framesz - TPACKET_TX_OFFSET) {
+		errno = EMSGSIZE;
+		return (-1);
+	}
+	th = TPACKET_TX_FRAME(t, t->cur);
+	status = __atomic_load_n(&th->tp_status, __ATOMIC_ACQUIRE);
+	if (status & TP_STATUS_WRONG_FORMAT) {
+		/* the kernel rejected the last frame sent from this slot */
+		ft_debug("%s: transmit ring frame %u rejected",
+		    i->name, t->cur);
+	} else if (status != TP_STATUS_AVAILABLE) {
+		/* the ring has wrapped around to a frame still in flight */
+		errno = ENOBUFS;
+		return (-1);
+	}
+	memcpy((uint8_t *)th + TPACKET_TX_OFFSET, data, len);
+	i->stats.ntxcopy++;
+	th->tp_next_offset = 0;
+	th->tp_len = len;
+	th->tp_snaplen = len;
+	__atomic_store_n(&th->tp_status, TP_STATUS_SEND_REQUEST,
+	    __ATOMIC_RELEASE);
+	t->cur = (t->cur + 1) % t->nframe;
+	return (0);
+}
+
+/*
+ * Send everything in the transmit ring, or queue, with one system call.
+ */
+int
+iface_tpacket_flush(iface *i)
+{
+	iface_txq *q = &i->txq;
+
+	if (i->txr.map != NULL) {
+		if (send(i->fd, NULL, 0, MSG_DONTWAIT) < 0) {
+			ft_debug("%s: failed to flush transmit ring: %m",
+			    i->name);
+			return (-1);
+		}
+		return (q->n);
+	}
+#if HAVE_IO_URING
+	if (uring_active()) {
+		unsigned int k;
+
+		for (k = 0; k < q->n; ++k)
+			if (uring_send(i->fd, q->buf + (size_t)k * IFACE_SNAPLEN,
+			    q->len[k]) != 0)
+				break;
+		i->stats.ntxcopy += k;
+		return (k);
+	}
+#endif
+	return (iface_txq_sendmmsg(i, i->fd));
+}
@@ -0,0 +1,670 @@
+/*-
+ * Copyright (c) 2016-2018 The University of Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <ft/ethernet.h>
+#include <ft/ip4.h>
+#include <ft/log.h>
+
+#include "flytrap.h"
+#include "iface.h"
+#include "packet.h"
+#include "xdp.h"
+
+#ifndef SOL_XDP
+#define SOL_XDP			283
+#endif
+
+/* UMEM geometry: half the frames are used for receiving, half for sending */
+#define XDP_FRAME_SIZE		2048
+#define XDP_RING_SIZE		2048
+#define XDP_NFRAMES		(2 * XDP_RING_SIZE)
+
+/* how often (in batches) to check the packet socket while the ring is busy */
+#define XDP_SFD_INTERVAL	4
+
+/* maximum number of wakeups per transmit queue flush */
+#define XDP_FLUSH_KICKS		16
+
+/*
+ * Single-producer, single-consumer ring shared with the kernel
+ */
+typedef struct xdp_ring {
+	uint32_t	*producer;
+	uint32_t	*consumer;
+	uint32_t	*flags;
+	void		*desc;
+	void		*map;
+	size_t		 maplen;
+} xdp_ring;
+
+struct iface_xdp {
+	int		 fd;		/* AF_XDP socket */
+	int		 sfd;		/* packet socket for everything else */
+	int		 mapfd;		/* socket map */
+	int		 progfd;	/* XDP program */
+	int		 linkfd;	/* XDP link */
+	uint8_t		*umem;
+	size_t		 umemlen;
+	xdp_ring	 fq, cq, rx, tx;
+	unsigned int	 nheld;		/* frames held by the caller */
+	unsigned long	 nrecv;		/* frames received so far */
+	uint64_t	 held[XDP_RING_SIZE];
+	unsigned int	 turn;
+	unsigned int	 ntxfree;
+	uint64_t	 txfree[XDP_RING_SIZE];
+};
+
+#define XDP_ADDR_DESC(r)	((uint64_t *)(r)->desc)
+#define XDP_XDP_DESC(r)		((struct xdp_desc *)(r)->desc)
+
+int
+xdp_sys_bpf(int cmd, union bpf_attr *attr)
+{
+
+	return (syscall(__NR_bpf, cmd, attr, sizeof *attr));
+}
+
+/*
+ * Load an XDP program.  If the verifier rejects it, try again to get
+ * its reasons, which are only of interest when debugging.
+ */
+int
+xdp_load_insns(const iface *i, const struct bpf_insn *insns, unsigned int n)
+{
+	static char log[65536];
+	union bpf_attr attr;
+	int fd, serrno;
+
+	memset(&attr, 0, sizeof attr);
+	attr.prog_type = BPF_PROG_TYPE_XDP;
+	attr.insns = (uintptr_t)insns;
+	attr.insn_cnt = n;
+	attr.license = (uintptr_t)"BSD";
+	if ((fd = xdp_sys_bpf(BPF_PROG_LOAD, &attr)) >= 0 ||
+	    ft_log_level > FT_LOG_LEVEL_DEBUG)
+		return (fd);
+	serrno = errno;
+	attr.log_buf = (uintptr_t)log;
+	attr.log_size = sizeof log;
+	attr.log_level = 1;
+	if (xdp_sys_bpf(BPF_PROG_LOAD, &attr) < 0)
+		ft_debug("%s: XDP program rejected:\n%s", i->name, log);
+	errno = serrno;
+	return (-1);
+}
+
+/*
+ * Load a program which redirects frames addressed to the given Ethernet
+ * address into the socket map and passes everything else to the stack.
+ * The address is split into a 32-bit and a 16-bit half in host order, as
+ * that is how the program loads them.  If the fast path is enabled, it
+ * goes first, and only what it does not answer gets this far.
+ */
+static int
+xdp_load_prog(const iface *i, int mapfd, uint32_t mac_lo, uint16_t mac_hi)
+{
+	const struct bpf_insn prog[] = {
+		/* r2 = data, r3 = data_end */
+		XDP_LDX(BPF_W, BPF_REG_2, BPF_REG_1, 0),
+		XDP_LDX(BPF_W, BPF_REG_3, BPF_REG_1, 4),
+		/* pass if shorter than an Ethernet header */
+		XDP_MOV64_REG(BPF_REG_4, BPF_REG_2),
+		XDP_ADD64_IMM(BPF_REG_4, sizeof(ether_hdr)),
+		XDP_JGT_REG(BPF_REG_4, BPF_REG_3, 10),
+		/* pass unless addressed to us */
+		XDP_LDX(BPF_W, BPF_REG_5, BPF_REG_2, 0),
+		XDP_JNE32_IMM(BPF_REG_5, (int32_t)mac_lo, 8),
+		XDP_LDX(BPF_H, BPF_REG_5, BPF_REG_2, 4),
+		XDP_JNE32_IMM(BPF_REG_5, mac_hi, 6),
+		/* redirect to the socket bound to this queue, if any */
+		XDP_LDX(BPF_W, BPF_REG_2, BPF_REG_1, 16),
+		XDP_LD_MAP_FD(BPF_REG_1, mapfd),
+		XDP_MOV64_IMM(BPF_REG_3, XDP_PASS),
+		XDP_CALL(BPF_FUNC_redirect_map),
+		XDP_EXIT(),
+		/* pass */
+		XDP_MOV64_IMM(BPF_REG_0, XDP_PASS),
+		XDP_EXIT(),
+	};
+	struct bpf_insn insns[XDP_MAXINSNS];
+	unsigned int n;
+
+	n = 0;
+#if HAVE_XDP_FAST
+	if (i->fast != NULL)
+		n = iface_fast_prog(i, insns,
+		    XDP_MAXINSNS - sizeof prog / sizeof prog[0]);
+#endif
+	memcpy(insns + n, prog, sizeof prog);
+	n += sizeof prog / sizeof prog[0];
+	return (xdp_load_insns(i, insns, n));
+}
+
+/*
+ * Create the socket map and load the program.
+ */
+static int
+xdp_load(iface *i)
+{
+	struct iface_xdp *x = i->xdp;
+	union bpf_attr attr;
+	uint32_t mac_lo;
+	uint16_t mac_hi;
+
+	memset(&attr, 0, sizeof attr);
+	attr.map_type = BPF_MAP_TYPE_XSKMAP;
+	attr.key_size = sizeof(uint32_t);
+	attr.value_size = sizeof(uint32_t);
+	attr.max_entries = 1;
+	if ((x->mapfd = xdp_sys_bpf(BPF_MAP_CREATE, &attr)) < 0)
+		return (-1);
+	memcpy(&mac_lo, &i->ether.o[0], sizeof mac_lo);
+	memcpy(&mac_hi, &i->ether.o[4], sizeof mac_hi);
+	x->progfd = xdp_load_prog(i, x->mapfd, mac_lo, mac_hi);
+#if HAVE_XDP_FAST
+	if (x->progfd < 0 && i->fast != NULL) {
+		/* try again without it */
+		ft_warning("%s: XDP fast path rejected (%m)", i->name);
+		iface_fast_close(i);
+		x->progfd = xdp_load_prog(i, x->mapfd, mac_lo, mac_hi);
+	}
+#endif
+	if (x->progfd < 0)
+		return (-1);
+	return (0);
+}
+
+/*
+ * Attach a program to the interface, preferring native mode but falling
+ * back to generic (SKB) mode.  Returns a link descriptor; the program is
+ * detached automatically when it is closed.
+ */
+int
+xdp_attach_prog(const iface *i, int ifindex, int progfd)
+{
+	static const struct {
+		uint32_t	 flags;
+		const char	*name;
+	} modes[] = {
+		{ XDP_FLAGS_DRV_MODE, "native" },
+		{ XDP_FLAGS_SKB_MODE, "generic" },
+	};
+	union bpf_attr attr;
+	unsigned int n;
+	int fd;
+
+	for (n = 0; n < sizeof modes / sizeof modes[0]; ++n) {
+		memset(&attr, 0, sizeof attr);
+		attr.link_create.prog_fd = progfd;
+		attr.link_create.target_ifindex = ifindex;
+		attr.link_create.attach_type = BPF_XDP;
+		attr.link_create.flags = modes[n].flags;
+		if ((fd = xdp_sys_bpf(BPF_LINK_CREATE, &attr)) >= 0) {
+			ft_verbose("%s: XDP program attached in %s mode",
+			    i->name, modes[n].name);
+			return (fd);
+		}
+	}
+	return (-1);
+}
+
+static int
+xdp_map_ring(int fd, xdp_ring *r, const struct xdp_ring_offset *off,
+    size_t descsz, off_t pgoff)
+{
+
+	r->maplen = off->desc + XDP_RING_SIZE * descsz;
+	r->map = mmap(NULL, r->maplen, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, fd, pgoff);
+	if (r->map == MAP_FAILED) {
+		r->map = NULL;
+		return (-1);
+	}
+	r->producer = (uint32_t *)((uint8_t *)r->map + off->producer);
+	r->consumer = (uint32_t *)((uint8_t *)r->map + off->consumer);
+	r->flags = (uint32_t *)((uint8_t *)r->map + off->flags);
+	r->desc = (uint8_t *)r->map + off->desc;
+	return (0);
+}
+
+static void
+xdp_unmap_ring(xdp_ring *r)
+{
+
+	if (r->map != NULL)
+		munmap(r->map, r->maplen);
+	r->map = NULL;
+}
+
+/*
+ * Hand a frame to the kernel for receiving into.  The fill ring is
+ * large enough to hold every receive frame, so it never overflows.
+ */
+static void
+xdp_fill(struct iface_xdp *x, uint64_t addr)
+{
+	uint32_t prod;
+
+	prod = *x->fq.producer;
+	XDP_ADDR_DESC(&x->fq)[prod % XDP_RING_SIZE] = addr;
+	__atomic_store_n(x->fq.producer, prod + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Reclaim transmit frames the kernel is done with.
+ */
+static void
+xdp_complete(struct iface_xdp *x)
+{
+	uint32_t cons, prod;
+
+	cons = *x->cq.consumer;
+	prod = __atomic_load_n(x->cq.producer, __ATOMIC_ACQUIRE);
+	while (cons != prod) {
+		x->txfree[x->ntxfree++] =
+		    XDP_ADDR_DESC(&x->cq)[cons++ % XDP_RING_SIZE];
+	}
+	__atomic_store_n(x->cq.consumer, cons, __ATOMIC_RELEASE);
+}
+
+/*
+ * Wake the kernel up if it is waiting for us.
+ */
+static void
+xdp_kick(struct iface_xdp *x)
+{
+
+	if (__atomic_load_n(x->tx.flags, __ATOMIC_RELAXED) &
+	    XDP_RING_NEED_WAKEUP)
+		(void)sendto(x->fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+}
+
+/*
+ * Create the AF_XDP socket, register and map its UMEM and rings, and
+ * load the XDP program.  Nothing is attached to the interface yet.
+ */
+int
+iface_xdp_open(iface *i)
+{
+	struct xdp_mmap_offsets off;
+	struct xdp_umem_reg mr;
+	struct iface_xdp *x;
+	socklen_t optlen;
+	unsigned int n;
+	int serrno, size;
+
+	if ((x = calloc(1, sizeof *x)) == NULL)
+		return (-1);
+	i->xdp = x;
+	x->fd = x->sfd = x->mapfd = x->progfd = x->linkfd = -1;
+	if ((x->fd = socket(AF_XDP, SOCK_RAW, 0)) < 0)
+		goto fail;
+	x->umemlen = (size_t)XDP_NFRAMES * XDP_FRAME_SIZE;
+	x->umem = mmap(NULL, x->umemlen, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (x->umem == MAP_FAILED) {
+		x->umem = NULL;
+		goto fail;
+	}
+	memset(&mr, 0, sizeof mr);
+	mr.addr = (uintptr_t)x->umem;
+	mr.len = x->umemlen;
+	mr.chunk_size = XDP_FRAME_SIZE;
+	size = XDP_RING_SIZE;
+	if (setsockopt(x->fd, SOL_XDP, XDP_UMEM_REG, &mr, sizeof mr) != 0 ||
+	    setsockopt(x->fd, SOL_XDP, XDP_UMEM_FILL_RING,
+		&size, sizeof size) != 0 ||
+	    setsockopt(x->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING,
+		&size, sizeof size) != 0 ||
+	    setsockopt(x->fd, SOL_XDP, XDP_RX_RING, &size, sizeof size) != 0 ||
+	    setsockopt(x->fd, SOL_XDP, XDP_TX_RING, &size, sizeof size) != 0)
+		goto fail;
+	optlen = sizeof off;
+	if (getsockopt(x->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) != 0 ||
+	    xdp_map_ring(x->fd, &x->rx, &off.rx,
+		sizeof(struct xdp_desc), XDP_PGOFF_RX_RING) != 0 ||
+	    xdp_map_ring(x->fd, &x->tx, &off.tx,
+		sizeof(struct xdp_desc), XDP_PGOFF_TX_RING) != 0 ||
+	    xdp_map_ring(x->fd, &x->fq, &off.fr,
+		sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING) != 0 ||
+	    xdp_map_ring(x->fd, &x->cq, &off.cr,
+		sizeof(uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING) != 0)
+		goto fail;
+
+	/* first half of the frames for receiving, second for sending */
+	for (n = 0; n < XDP_RING_SIZE; ++n)
+		xdp_fill(x, (uint64_t)n * XDP_FRAME_SIZE);
+	for (n = XDP_NFRAMES; n > XDP_RING_SIZE; --n)
+		x->txfree[x->ntxfree++] = (uint64_t)(n - 1) * XDP_FRAME_SIZE;
+
+	if (xdp_load(i) != 0)
+		goto fail;
+	ft_verbose("%s: mapped %u x %u byte UMEM", i->name,
+	    XDP_NFRAMES, XDP_FRAME_SIZE);
+	return (0);
+fail:
+	serrno = errno;
+	iface_xdp_close(i);
+	errno = serrno;
+	return (-1);
+}
+
+/*
+ * Set up the packet socket which receives ARP and broadcast traffic,
+ * bind the AF_XDP socket to the first queue and attach the program.
+ */
+int
+iface_xdp_activate(iface *i, const struct bpf_program *fprog)
+{
+	struct iface_xdp *x = i->xdp;
+	struct sockaddr_xdp sxdp;
+	union bpf_attr attr;
+	uint32_t key, val;
+	int ifindex;
+
+	if ((x->sfd = socket(AF_PACKET, SOCK_RAW, 0)) < 0) {
+		ft_error("%s: failed to create packet socket: %m", i->name);
+		return (-1);
+	}
+	if ((ifindex = iface_packet_bind(i, x->sfd, fprog)) < 0)
+		return (-1);
+	memset(&sxdp, 0, sizeof sxdp);
+	sxdp.sxdp_family = AF_XDP;
+	sxdp.sxdp_ifindex = ifindex;
+	sxdp.sxdp_queue_id = 0;
+	sxdp.sxdp_flags = XDP_USE_NEED_WAKEUP | XDP_ZEROCOPY;
+	if (bind(x->fd, (struct sockaddr *)&sxdp, sizeof sxdp) != 0) {
+		sxdp.sxdp_flags = XDP_USE_NEED_WAKEUP | XDP_COPY;
+		if (bind(x->fd, (struct sockaddr *)&sxdp, sizeof sxdp) != 0) {
+			ft_error("%s: failed to bind XDP socket: %m", i->name);
+			return (-1);
+		}
+	}
+	ft_verbose("%s: XDP socket bound in %s mode", i->name,
+	    (sxdp.sxdp_flags & XDP_COPY) ? "copy" : "zero-copy");
+	if (ft_busy_poll && (iface_busy_poll(i, x->fd) != 0 ||
+	    iface_busy_poll(i, x->sfd) != 0))
+		return (-1);
+	memset(&attr, 0, sizeof attr);
+	key = 0;
+	val = x->fd;
+	attr.map_fd = x->mapfd;
+	attr.key = (uintptr_t)&key;
+	attr.value = (uintptr_t)&val;
+	if (xdp_sys_bpf(BPF_MAP_UPDATE_ELEM, &attr) != 0) {
+		ft_error("%s: failed to register XDP socket: %m", i->name);
+		return (-1);
+	}
+	if ((x->linkfd = xdp_attach_prog(i, ifindex, x->progfd)) < 0) {
+		ft_error("%s: failed to attach XDP program: %m", i->name);
+		return (-1);
+	}
+	return (0);
+}
+
+void
+iface_xdp_close(iface *i)
+{
+	struct iface_xdp *x = i->xdp;
+	struct xdp_statistics st;
+	socklen_t stlen;
+
+	if (x == NULL)
+		return;
+	stlen = sizeof st;
+	if (x->linkfd >= 0 && getsockopt(x->fd, SOL_XDP, XDP_STATISTICS,
+	    &st, &stlen) == 0) {
+		ft_verbose("%s: %llu packets dropped, %llu invalid", i->name,
+		    (unsigned long long)st.rx_dropped,
+		    (unsigned long long)st.rx_invalid_descs);
+	}
+	if (x->linkfd >= 0)
+		close(x->linkfd);
+	if (x->progfd >= 0)
+		close(x->progfd);
+	if (x->mapfd >= 0)
+		close(x->mapfd);
+	xdp_unmap_ring(&x->rx);
+	xdp_unmap_ring(&x->tx);
+	xdp_unmap_ring(&x->fq);
+	xdp_unmap_ring(&x->cq);
+	if (x->fd >= 0)
+		close(x->fd);
+	if (x->sfd >= 0)
+		close(x->sfd);
+	if (x->umem != NULL)
+		munmap(x->umem, x->umemlen);
+	free(x);
+	i->xdp = NULL;
+}
+
+/*
+ * Read whatever is waiting on the packet socket into the interface's
+ * batch buffer.  Returns the number of packets read.
+ */
+static int
+xdp_recv_sfd(iface *i, packet *p, unsigned int n)
+{
+	struct iface_xdp *x = i->xdp;
+	uint8_t *buf;
+	unsigned int k;
+	ssize_t rlen;
+
+	for (k = 0; k < n; ) {
+		buf = i->rxbuf + (size_t)k * IFACE_SNAPLEN;
+		rlen = recv(x->sfd, buf, IFACE_SNAPLEN, MSG_DONTWAIT | MSG_TRUNC);
+		if (rlen < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK ||
+			    errno == EINTR)
+				break;
+			ft_error("%s: failed to read packet: %m", i->name);
+			errno = EIO;
+			return (-1);
+		}
+		if (rlen == 0 || rlen > IFACE_SNAPLEN)
+			continue;
+		p[k].data = buf;
+		p[k].caplen = p[k].len = rlen;
+		p[k].csum = packet_csum_unknown;
+		p[k].queue = 0;
+		k++;
+	}
+	return (k);
+}
+
+unsigned long
+iface_xdp_mark(const iface *i)
+{
+
+	return (i->xdp->nrecv);
+}
+
+/*
+ * Hand frames received up to the given mark back to the kernel.
+ */
+void
+iface_xdp_release(iface *i, unsigned long mark)
+{
+	struct iface_xdp *x = i->xdp;
+
+	if (x->nheld == 0 || x->nrecv - x->nheld >= mark)
+		return;
+	for (; x->nheld > 0 && x->nrecv - x->nheld < mark; x->nheld--)
+		xdp_fill(x, x->held[(x->nrecv - x->nheld) % XDP_RING_SIZE]);
+	if (__atomic_load_n(x->fq.flags, __ATOMIC_RELAXED) &
+	    XDP_RING_NEED_WAKEUP)
+		(void)recvfrom(x->fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+}
+
+/*
+ * Fill the caller's array with up to n frames, from the receive ring
+ * and from the packet socket.  Frames from the ring are not copied,
+ * and are held until they are released; see iface_release().  Returns
+ * the number of packets, which is zero if nothing was waiting.
+ */
+int
+iface_xdp_next_batch(iface *i, packet *p, unsigned int n)
+{
+	struct iface_xdp *x = i->xdp;
+	struct xdp_desc *d;
+	struct timeval now;
+	uint32_t cons, prod;
+	unsigned int k;
+	int ret;
+
+	if (n > PACKET_BATCH)
+		n = PACKET_BATCH;
+	cons = *x->rx.consumer;
+	prod = __atomic_load_n(x->rx.producer, __ATOMIC_ACQUIRE);
+	k = 0;
+	if (cons == prod || ++x->turn >= XDP_SFD_INTERVAL) {
+		x->turn = 0;
+		if ((ret = xdp_recv_sfd(i, p, n)) < 0)
+			return (-1);
+		k = ret;
+	}
+	for (; k < n && cons != prod; ++k, ++cons) {
+		d = &XDP_XDP_DESC(&x->rx)[cons % XDP_RING_SIZE];
+		x->held[x->nrecv++ % XDP_RING_SIZE] = d->addr;
+		x->nheld++;
+		p[k].data = x->umem + d->addr;
+		p[k].caplen = p[k].len = d->len;
+		p[k].csum = packet_csum_unknown;
+		p[k].queue = 0;
+	}
+	__atomic_store_n(x->rx.consumer, cons, __ATOMIC_RELEASE);
+	if (k == 0) {
+		/* when busy polling, drive the device queue ourselves */
+		if (ft_busy_poll)
+			(void)recvfrom(x->fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+		return (0);
+	}
+
+	/* no timestamps from the ring, so one will have to do */
+	gettimeofday(&now, NULL);
+	for (n = 0; n < k; ++n) {
+		p[n].i = i;
+		p[n].ts = now;
+	}
+	return (k);
+}
+
+int
+iface_xdp_pollfd(iface *i, struct pollfd *pfd, unsigned int n)
+{
+	struct iface_xdp *x = i->xdp;
+
+	if (n < 2)
+		return (0);
+	pfd[0].fd = x->fd;
+	pfd[1].fd = x->sfd;
+	pfd[0].events = pfd[1].events = POLLIN;
+	return (2);
+}
+
+/*
+ * Copy a frame into a free UMEM frame and place it on the transmit ring.
+ * The kernel is not told about it until the queue is flushed.
+ */
+int
+iface_xdp_transmit(iface *i, const void *data, size_t len)
+{
+	struct iface_xdp *x = i->xdp;
+	struct xdp_desc *d;
+	uint64_t addr;
+	uint32_t prod;
+
+	if (len > XDP_FRAME_SIZE) {
+		errno = EMSGSIZE;
+		return (-1);
+	}
+	xdp_complete(x);
+	if (x->ntxfree == 0) {
+		xdp_kick(x);
+		xdp_complete(x);
+		if (x->ntxfree == 0) {
+			errno = ENOBUFS;
+			return (-1);
+		}
+	}
+	addr = x->txfree[--x->ntxfree];
+	memcpy(x->umem + addr, data, len);
+	i->stats.ntxcopy++;
+	prod = *x->tx.producer;
+	d = &XDP_XDP_DESC(&x->tx)[prod % XDP_RING_SIZE];
+	d->addr = addr;
+	d->len = len;
+	d->options = 0;
+	__atomic_store_n(x->tx.producer, prod + 1, __ATOMIC_RELEASE);
+	return (0);
+}
+
+/*
+ * Frames are already on the transmit ring; wake the kernel up to send
+ * them.  In copy mode, the kernel only sends a limited number of frames
+ * per wakeup, so keep at it until the ring is empty.
+ */
+int
+iface_xdp_flush(iface *i)
+{
+	struct iface_xdp *x = i->xdp;
+	unsigned int n;
+
+	for (n = 0; n < XDP_FLUSH_KICKS; ++n) {
+		if (__atomic_load_n(x->tx.consumer, __ATOMIC_ACQUIRE) ==
+		    *x->tx.producer ||
+		    !(__atomic_load_n(x->tx.flags, __ATOMIC_RELAXED) &
+		    XDP_RING_NEED_WAKEUP))
+			break;
+		(void)sendto(x->fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+		xdp_complete(x);
+	}
+	return (i->txq.n);
+}
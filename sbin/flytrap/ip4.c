@@ -54,66 +54,106 @@
 #include "packet.h"
 
 /*
- * Analyze a captured IP packet
+ * Decide whether to verify the checksum of a flow's transport header
+ * and payload.  We can't if they were truncated, and with -k, we won't
+ * if the kernel says it has already done so, or that the packet was
+ * sent from this host and does not have a checksum yet.
  */
 int
-packet_analyze_ip4(const ether_flow *ethfl, const void *data, size_t len)
+flow_cksum_needed(const flow *fl)
 {
-	ip4_flow fl;
+	const packet *p = fl->p;
+	iface_stats *st = &p->i->stats;
+
+	if (flow_truncated(fl))
+		return (0);
+	if (ft_trust_csum && p->csum == packet_csum_valid) {
+		st->ncsum_valid++;
+		return (0);
+	}
+	if (ft_trust_csum && p->csum == packet_csum_partial) {
+		st->ncsum_partial++;
+		return (0);
+	}
+	st->ncsum_sw++;
+	return (1);
+}
+
+/*
+ * Decode the IP header of a captured packet and compute the checksum
+ * of the pseudo-header.
+ */
+int
+ip4_decode(flow *fl)
+{
+	struct {
+		ip4_addr	 src;
+		ip4_addr	 dst;
+		uint16_t	 proto;
+		uint16_t	 len;
+	} __attribute__((__packed__)) ph;
+	const packet *p = fl->p;
 	const ip4_hdr *ih;
-	size_t ihl;
-	int ret;
+	size_t len, ihl, iplen;
+	int trunc;
 
+	len = p->caplen - fl->l3off;
 	if (len < sizeof(ip4_hdr)) {
 		ft_verbose("%lu.%03lu short IP packet (%zd < %zd)",
 		    FT_TIME_SEC_UL, FT_TIME_MSEC_UL, len, sizeof(ip4_hdr));
 		return (-1);
 	}
-	ih = data;
+	ih = (const ip4_hdr *)flow_l3(fl);
 	ihl = ip4_hdr_ihl(ih) * 4;
-	if (ihl < 20 || len < ihl || len < be16toh(ih->len)) {
+	iplen = be16toh(ih->len);
+	/* a short packet is only malformed if it was not truncated */
+	trunc = p->caplen < p->len;
+	if (ihl < 20 || len < ihl || iplen < ihl || (len < iplen && !trunc)) {
 		ft_verbose("%lu.%03lu malformed IP header "
 		    "(plen %zd len %zd ihl %zd)",
 		    FT_TIME_SEC_UL, FT_TIME_MSEC_UL,
-		    len, be16toh(ih->len), ihl);
+		    len, iplen, ihl);
 		return (-1);
 	}
-	len = be16toh(ih->len);
+	if (len > iplen)
+		len = iplen;
 	ft_debug("\tIP version %d proto %d len %zu"
 	    " from %u.%u.%u.%u to %u.%u.%u.%u",
-	    ip4_hdr_ver(ih), ih->proto, len,
+	    ip4_hdr_ver(ih), ih->proto, iplen,
 	    ih->srcip.o[0], ih->srcip.o[1], ih->srcip.o[2], ih->srcip.o[3],
 	    ih->dstip.o[0], ih->dstip.o[1], ih->dstip.o[2], ih->dstip.o[3]);
-	if (src_set != NULL && !ip4s_lookup(src_set, be32toh(ih->srcip.q))) {
-		ft_debug("\tsource address is out of bounds");
-		return (0);
-	}
-	if (dst_set != NULL && !ip4s_lookup(dst_set, be32toh(ih->dstip.q))) {
-		ft_debug("\tdestination address is out of bounds");
-		return (0);
-	}
-	data = (const uint8_t *)data + ihl;
-	len -= ihl;
-	fl.eth = ethfl;
-	fl.src = ih->srcip;
-	fl.dst = ih->dstip;
-	fl.proto = htobe16(ih->proto);
-	fl.len = htobe16(len);
-	ft_debug("0x%02x%02x 0x%02x%02x 0x%02x%02x"
-	    " 0x%02x%02x 0x%02x%02x 0x%02x%02x",
-	    fl.pseudo[0], fl.pseudo[1], fl.pseudo[2], fl.pseudo[3],
-	    fl.pseudo[4], fl.pseudo[5], fl.pseudo[6], fl.pseudo[7],
-	    fl.pseudo[8], fl.pseudo[9], fl.pseudo[10], fl.pseudo[11]);
-	fl.sum = ip4_cksum(0, &fl.pseudo, sizeof fl.pseudo);
-	switch (ih->proto) {
+	fl->src = ih->srcip;
+	fl->dst = ih->dstip;
+	fl->proto = ih->proto;
+	fl->l4off = fl->l3off + ihl;
+	fl->l4len = iplen - ihl;
+	fl->l4cap = len - ihl;
+	ph.src = ih->srcip;
+	ph.dst = ih->dstip;
+	ph.proto = htobe16(ih->proto);
+	ph.len = htobe16(fl->l4len);
+	fl->sum = ip4_cksum(0, &ph, sizeof ph);
+	return (0);
+}
+
+/*
+ * Analyze a captured IP packet whose addresses have already been
+ * checked against src_set and dst_set.
+ */
+int
+packet_analyze_ip4(const flow *fl)
+{
+	int ret;
+
+	switch (fl->proto) {
 	case ip_proto_icmp:
-		ret = packet_analyze_icmp4(&fl, data, len);
+		ret = packet_analyze_icmp4(fl);
 		break;
 	case ip_proto_tcp:
-		ret = packet_analyze_tcp4(&fl, data, len);
+		ret = packet_analyze_tcp4(fl);
 		break;
 	case ip_proto_udp:
-		ret = packet_analyze_udp4(&fl, data, len);
+		ret = packet_analyze_udp4(fl);
 		break;
 	default:
 		ret = -1;
@@ -121,20 +161,28 @@ packet_analyze_ip4(const ether_flow *ethfl, const void *data, size_t len)
 	return (ret);
 }
 
+/*
+ * Checksum of a reply header with zero length, protocol and addresses,
+ * to which those are added as they are filled in.
+ */
+#define IP4_REPLY_CKSUM	((uint16_t)~(0x4500 + 0x4000))
+
+/*
+ * Fill in the IP header of a reply frame whose payload of the given
+ * length is already in place, and send it.
+ */
 int
-ip4_reply(const ip4_flow *fl, ip_proto proto,
-    const void *data, size_t len)
+ip4_reply(const flow *fl, ip_proto proto, uint8_t *frame, size_t len)
 {
 	ip4_hdr *ih;
 	size_t iplen;
-	int ret;
+	uint16_t sum;
 
 	ft_debug("ip4 proto %d to %02x:%02x:%02x:%02x:%02x:%02x", proto,
-	    fl->eth->dst.o[0], fl->eth->dst.o[1], fl->eth->dst.o[2],
-	    fl->eth->dst.o[3], fl->eth->dst.o[4], fl->eth->dst.o[5]);
+	    fl->edst.o[0], fl->edst.o[1], fl->edst.o[2],
+	    fl->edst.o[3], fl->edst.o[4], fl->edst.o[5]);
+	ih = (ip4_hdr *)(frame + REPLY_IP4_OFF);
 	iplen = sizeof *ih + len;
-	if ((ih = calloc(1, iplen)) == NULL)
-		return (-1);
 	ih->ver_ihl = 0x45;
 	ih->dscp_ecn = 0x00;
 	ih->len = htobe16(iplen);
@@ -144,9 +192,10 @@ ip4_reply(const ip4_flow *fl, ip_proto proto,
 	ih->proto = proto;
 	ih->srcip = fl->dst;
 	ih->dstip = fl->src;
-	ih->sum = htobe16(~ip4_cksum(0, ih, sizeof *ih));
-	memcpy(ih + 1, data, len);
-	ret = ethernet_reply(fl->eth, ih, iplen);
-	free(ih);
-	return (ret);
+	sum = ip4_cksum_update(IP4_REPLY_CKSUM, 0, iplen);
+	sum = ip4_cksum_update(sum, 0, proto);
+	sum = ip4_cksum_update32(sum, 0, be32toh(fl->dst.q));
+	sum = ip4_cksum_update32(sum, 0, be32toh(fl->src.q));
+	ih->sum = htobe16(sum);
+	return (ethernet_reply(fl, frame, iplen));
 }
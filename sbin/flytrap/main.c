@@ -32,12 +32,15 @@
 #endif
 
 #include <errno.h>
+#include <limits.h>
+#include <math.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include <ft/ctype.h>
 #include <ft/endian.h>
 #include <ft/ethernet.h>
 #include <ft/ip4.h>
@@ -106,6 +109,121 @@ set_ether_addr(const char *addr)
 	return (0);
 }
 
+/*
+ * Parse a positive number with an optional k or m suffix.
+ */
+static int
+parse_size(const char *str, unsigned int *size)
+{
+	unsigned long n;
+
+	for (n = 0; is_digit(*str); ++str) {
+		n = n * 10 + *str - '0';
+		if (n > UINT_MAX)
+			return (-1);
+	}
+	switch (*str) {
+	case 'k':
+		n *= 1024;
+		str++;
+		break;
+	case 'm':
+		n *= 1024 * 1024;
+		str++;
+		break;
+	}
+	if (*str != '\0' || n == 0 || n > UINT_MAX)
+		return (-1);
+	*size = n;
+	return (0);
+}
+
+/*
+ * Parse a positive decimal number no greater than max.
+ */
+static int
+parse_number(const char *str, unsigned int max, unsigned int *num)
+{
+	unsigned long n;
+
+	if (!is_digit(*str))
+		return (-1);
+	for (n = 0; is_digit(*str); ++str) {
+		n = n * 10 + *str - '0';
+		if (n > max)
+			return (-1);
+	}
+	if (*str != '\0' || n == 0)
+		return (-1);
+	*num = n;
+	return (0);
+}
+
+/*
+ * Parse a number less than max.
+ */
+static const char *
+parse_index(const char *str, unsigned int max, unsigned int *idx)
+{
+	unsigned long n;
+
+	if (!is_digit(*str))
+		return (NULL);
+	for (n = 0; is_digit(*str); ++str) {
+		n = n * 10 + *str - '0';
+		if (n >= max)
+			return (NULL);
+	}
+	*idx = n;
+	return (str);
+}
+
+/*
+ * Parse a list of CPU or node numbers and ranges, e.g. 0,2-5, each less
+ * than max.
+ */
+static int
+parse_list(const char *str, int *list, unsigned int max, unsigned int *n)
+{
+	unsigned int first, last;
+
+	for (*n = 0; ; ++str) {
+		if ((str = parse_index(str, max, &first)) == NULL)
+			return (-1);
+		last = first;
+		if (*str == '-' &&
+		    (str = parse_index(str + 1, max, &last)) == NULL)
+			return (-1);
+		if (last < first)
+			return (-1);
+		for (; first <= last; ++first) {
+			if (*n == max)
+				return (-1);
+			list[(*n)++] = first;
+		}
+		if (*str != ',')
+			break;
+	}
+	return (*str == '\0' ? 0 : -1);
+}
+
+/*
+ * Parse a non-negative decimal number.
+ */
+static int
+parse_speed(const char *str, double *speed)
+{
+	char *end;
+	double d;
+
+	errno = 0;
+	d = strtod(str, &end);
+	if (errno != 0 || end == str || *end != '\0' || !isfinite(d) || d < 0)
+		return (-1);
+	*speed = d;
+	return (0);
+}
+
 static void
 daemonize(void)
 {
@@ -131,23 +249,37 @@ usage(void)
 {
 
 	fprintf(stderr, "usage: "
-	    "flytrap [-dfnov] [-p pidfile] [-t csvfile] [-e addr] "
+	    "flytrap [-dfFHknoQTv] [-p pidfile] [-t csvfile] [-e addr] "
+	    "[-L msec] [-b blocks] [-B blocksize] [-c cpus] [-y usec] "
+	    "[-q queues] [-s speed] [-w file] [-N nodes] [-W workers] "
 	    "[-Ii addr|range|subnet] [-Xx addr|range|subnet] "
-	    "iface\n");
+	    "[type:]iface ...\n");
 	exit(1);
 }
 
 int
 main(int argc, char *argv[])
 {
-	const char *ifname;
-	int opt, ret;
+	int nfile, opt, ret, k;
 
-	ifname = NULL;
 	ft_log_level = FT_LOG_LEVEL_NOTICE;
 	ft_log_init("flytrap", NULL);
-	while ((opt = getopt(argc, argv, "de:fhI:i:nop:t:vX:x:")) != -1) {
+	while ((opt = getopt(argc, argv,
+	    "B:b:c:de:fFHhI:i:knL:N:op:Qq:s:Tt:vW:w:X:x:y:")) != -1) {
 		switch (opt) {
+		case 'B':
+			if (parse_size(optarg, &ft_ring_blksz) != 0)
+				usage();
+			break;
+		case 'b':
+			if (parse_number(optarg, UINT_MAX, &ft_ring_nblk) != 0)
+				usage();
+			break;
+		case 'c':
+			if (parse_list(optarg, ft_cpus, FT_MAXCPUS,
+			    &ft_ncpus) != 0)
+				usage();
+			break;
 		case 'd':
 			if (ft_log_level > FT_LOG_LEVEL_DEBUG)
 				ft_log_level = FT_LOG_LEVEL_DEBUG;
@@ -155,6 +287,12 @@ main(int argc, char *argv[])
 		case 'f':
 			ft_foreground = 1;
 			break;
+		case 'F':
+			ft_xdp_fast = 1;
+			break;
+		case 'H':
+			ft_hdronly = 1;
+			break;
 		case 'I':
 			if (include_range(&src_set, optarg) != 0)
 				usage();
@@ -167,22 +305,57 @@ main(int argc, char *argv[])
 			if (include_range(&dst_set, optarg) != 0)
 				usage();
 			break;
+		case 'k':
+			ft_trust_csum = 1;
+			break;
+		case 'L':
+			if (parse_number(optarg, UINT_MAX, &ft_csv_async) != 0)
+				usage();
+			break;
 		case 'n':
 			ft_dryrun = 1;
 			break;
+		case 'N':
+			if (parse_list(optarg, ft_nodes, FT_MAXNODES,
+			    &ft_nnodes) != 0)
+				usage();
+			break;
 		case 'o':
 			ft_logout = 1;
 			break;
 		case 'p':
 			ft_pidfile = optarg;
 			break;
+		case 'Q':
+			ft_qdisc_bypass = 1;
+			break;
+		case 'q':
+			if (parse_number(optarg, TAP_MAXQUEUES,
+			    &ft_tap_nqueue) != 0)
+				usage();
+			break;
+		case 's':
+			if (parse_speed(optarg, &ft_replay_speed) != 0)
+				usage();
+			break;
 		case 't':
 			ft_csvfile = optarg;
 			break;
+		case 'T':
+			ft_capture_thread = 1;
+			break;
 		case 'v':
 			if (ft_log_level > FT_LOG_LEVEL_VERBOSE)
 				ft_log_level = FT_LOG_LEVEL_VERBOSE;
 			break;
+		case 'W':
+			if (parse_number(optarg, FT_MAXWORKERS,
+			    &ft_workers) != 0)
+				usage();
+			break;
+		case 'w':
+			ft_replay_out = optarg;
+			break;
 		case 'X':
 			if (exclude_range(&src_set, optarg) != 0)
 				usage();
@@ -191,6 +364,10 @@ main(int argc, char *argv[])
 			if (exclude_range(&dst_set, optarg) != 0)
 				usage();
 			break;
+		case 'y':
+			if (parse_number(optarg, INT_MAX, &ft_busy_poll) != 0)
+				usage();
+			break;
 		default:
 			usage();
 		}
@@ -199,15 +376,21 @@ main(int argc, char *argv[])
 	argc -= optind;
 	argv += optind;
 
-	if (argc != 1)
+	if (argc < 1)
 		usage();
-	ifname = *argv;
+	if (ft_replay_out != NULL) {
+		for (nfile = 0, k = 0; k < argc; ++k)
+			if (strncmp(argv[k], "file:", 5) == 0)
+				nfile++;
+		if (nfile > 1)
+			ft_fatal("only one file may be replayed with -w");
+	}
 
 	if (!ft_foreground) {
 		daemonize();
 		ft_log_init("flytrap", "syslog:");
 	}
-	ret = flytrap(ifname);
+	ret = flytrap(argc, argv);
 	ft_log_exit();
 
 	exit(ret == 0 ? 0 : 1);
@@ -37,28 +37,142 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#include <ft/endian.h>
 #include <ft/ethernet.h>
 #include <ft/ip4.h>
+#include <ft/log.h>
 
 #include "flytrap.h"
 #include "flow.h"
 #include "packet.h"
 
-uint64_t ft_time;
+__thread uint64_t ft_time;
+__thread struct timeval ft_rxtime;
+__thread unsigned int ft_rxqueue;
 
-int
-packet_analyze(packet *p)
+/*
+ * Set the clock to a packet's arrival time, and note which queue it
+ * came in on so that replies can go out the same way.
+ */
+static inline void
+packet_clock(const packet *p)
 {
-	int ret;
 
+	ft_rxtime = p->ts;
+	ft_rxqueue = p->queue;
 	ft_time = p->ts.tv_sec * 1000 + p->ts.tv_usec / 1000;
-	ret = packet_analyze_ethernet(p, p->data, p->len);
-	return (ret);
 }
 
-void
-packet_drop(packet *p)
+/*
+ * Prefetch the part of a frame which holds the Ethernet, IP and TCP or
+ * UDP headers.  It may straddle two cache lines.
+ */
+static inline void
+packet_prefetch(const packet *p)
+{
+	const uint8_t *d = p->data;
+
+	__builtin_prefetch(d);
+	__builtin_prefetch(d + sizeof(ether_hdr) + sizeof(ip4_hdr) +
+	    sizeof(tcp4_hdr) - 1);
+}
+
+/*
+ * Decode a packet's headers into a flow descriptor, in a single pass.
+ * Fields which do not apply to the packet's protocols are left as they
+ * were.
+ */
+int
+packet_decode(const packet *p, flow *fl)
 {
 
-	free(p);
+	if (ethernet_decode(fl, p) != 0)
+		return (-1);
+	if (fl->etype != ether_type_ip)
+		return (0);
+	if (ip4_decode(fl) != 0)
+		return (-1);
+	switch (fl->proto) {
+	case ip_proto_icmp:
+		return (icmp4_decode(fl));
+	case ip_proto_tcp:
+		return (tcp4_decode(fl));
+	case ip_proto_udp:
+		return (udp4_decode(fl));
+	default:
+		return (0);
+	}
+}
+
+/*
+ * Analyze a batch of packets in three stages, each of which runs over
+ * the entire batch before the next starts, so that the memory accesses
+ * made for one packet overlap with the work done on the others:
+ *
+ * 1. Decode the headers, prefetching frames a few packets ahead.
+ * 2. Check IP source and destination addresses against src_set and
+ *    dst_set, walking the trees for all packets side by side.
+ * 3. Hand each packet to its protocol handler, in order.
+ */
+int
+packet_analyze(packet *p, unsigned int n)
+{
+	flow fl[PACKET_BATCH];
+	unsigned int ip[PACKET_BATCH];
+	uint32_t addr[PACKET_BATCH];
+	int ok[PACKET_BATCH], srcin[PACKET_BATCH], dstin[PACKET_BATCH];
+	unsigned int j, k, nip;
+
+	if (n > PACKET_BATCH)
+		n = PACKET_BATCH;
+
+	/* stage 1: decode */
+	for (k = 0; k < n && k < PACKET_PREFETCH; ++k)
+		packet_prefetch(&p[k]);
+	for (nip = k = 0; k < n; ++k) {
+		if (k + PACKET_PREFETCH < n)
+			packet_prefetch(&p[k + PACKET_PREFETCH]);
+		packet_clock(&p[k]);
+		ok[k] = packet_decode(&p[k], &fl[k]) == 0;
+		if (ok[k] && fl[k].etype == ether_type_ip)
+			ip[nip++] = k;
+	}
+
+	/* stage 2: look up addresses */
+	for (j = 0; j < nip; ++j)
+		srcin[j] = dstin[j] = 1;
+	if (src_set != NULL && nip > 0) {
+		for (j = 0; j < nip; ++j)
+			addr[j] = be32toh(fl[ip[j]].src.q);
+		ip4s_lookup_batch(src_set, addr, srcin, nip);
+	}
+	if (dst_set != NULL && nip > 0) {
+		for (j = 0; j < nip; ++j)
+			addr[j] = be32toh(fl[ip[j]].dst.q);
+		ip4s_lookup_batch(dst_set, addr, dstin, nip);
+	}
+
+	/* stage 3: dispatch */
+	for (j = k = 0; k < n; ++k) {
+		if (!ok[k])
+			continue;
+		packet_clock(&p[k]);
+		switch (fl[k].etype) {
+		case ether_type_arp:
+			(void)packet_analyze_arp(&fl[k]);
+			break;
+		case ether_type_ip:
+			if (!srcin[j]) {
+				ft_debug("\tsource address is out of bounds");
+			} else if (!dstin[j]) {
+				ft_debug("\tdestination address "
+				    "is out of bounds");
+			} else {
+				(void)packet_analyze_ip4(&fl[k]);
+			}
+			j++;
+			break;
+		}
+	}
+	return (0);
 }
@@ -32,14 +32,32 @@
 
 struct iface;
 
+/* maximum number of packets per batch */
+#define PACKET_BATCH		64
+
+/* how many packets ahead to prefetch while analyzing a batch */
+#define PACKET_PREFETCH		4
+
+/* checksum status reported by the capture backend */
+typedef enum packet_csum {
+	packet_csum_unknown = 0,	/* not checked */
+	packet_csum_valid,		/* checked by the kernel or NIC */
+	packet_csum_partial,		/* sent from this host, not yet filled in */
+} packet_csum;
+
 typedef struct packet {
 	struct iface	*i;
 	struct timeval	 ts;
-	const void	*data;
-	size_t		 len;
+	void		*data;		/* may be rewritten to reply */
+	size_t		 caplen;	/* captured length */
+	size_t		 len;		/* length on the wire */
+	packet_csum	 csum;		/* transport checksum status */
+	unsigned int	 queue;		/* receive queue */
 } packet;
 
-extern uint64_t ft_time;
+extern __thread uint64_t ft_time;
+extern __thread struct timeval ft_rxtime;
+extern __thread unsigned int ft_rxqueue;
 #define U64_SEC_UL(u64)		((unsigned long)((u64) / 1000))
 #define U64_MSEC_UL(u64)	((unsigned long)((u64) % 1000))
 #define FT_TIME_SEC_UL		U64_SEC_UL(ft_time)
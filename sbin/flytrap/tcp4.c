@@ -52,99 +52,136 @@
  * Log a TCP packet.
  */
 static int
-csv_tcp4(const struct timeval *ts, const ip4_addr *sa, const ip4_addr *da,
-    const tcp4_hdr *th, size_t len)
+csv_tcp4(const struct timeval *ts, const ip4_addr *sa, uint16_t sp,
+    const ip4_addr *da, uint16_t dp, unsigned int tcpfl, size_t len)
 {
 	char flags[] = "NCEUAPRSF";
 	unsigned int bit, mask;
 	int ret;
 
-	if (!tcp4_hdr_ns(th))
-		flags[0] = '-';
-	for (bit = 1, mask = 0x80; mask > 0; ++bit, mask >>= 1)
-		if (!(th->fl & mask))
+	for (bit = 0, mask = 0x100; mask > 0; ++bit, mask >>= 1)
+		if (!(tcpfl & mask))
 			flags[bit] = '-';
-	ret = csv_packet4(ts, sa, be16toh(th->sp), da, be16toh(th->dp),
-	    "TCP", len, flags);
+	ret = csv_packet4(ts, sa, sp, da, dp, "TCP", len, flags);
 	return (ret);
 }
 
 /*
- * Reply to a TCP packet.
+ * Reply template: a complete frame with everything but the destination
+ * hardware address, IP addresses, ports, acknowledgement number and
+ * flags filled in, and with checksums computed as if those were zero.
  */
-static int
-tcp4_reply(const ip4_flow *fl, tcp4_hdr *th)
+struct tcp4_tmpl {
+	uint8_t		 frame[REPLY_L4_OFF + sizeof(tcp4_hdr)];
+};
+
+/*
+ * Build the reply template for an interface.
+ */
+struct tcp4_tmpl *
+tcp4_tmpl_create(const iface *i)
 {
-	uint16_t len, sum;
+	struct tcp4_tmpl *t;
+	ether_hdr *eh;
+	ip4_hdr *ih;
+	tcp4_hdr *th;
+	uint16_t pseudo[2], sum;
 
-	/* compute pseudo-header checksum, then packet checksum */
-	sum = ip4_cksum(0, &fl->dst, sizeof fl->dst);
-	sum = ip4_cksum(sum, &fl->src, sizeof fl->src);
-	sum = ip4_cksum(sum, &fl->proto, sizeof fl->proto);
-	len = htobe16(sizeof *th);
-	sum = ip4_cksum(sum, &len, sizeof len);
+	if ((t = calloc(1, sizeof *t)) == NULL)
+		return (NULL);
+	eh = (ether_hdr *)t->frame;
+	ih = (ip4_hdr *)(t->frame + REPLY_IP4_OFF);
+	th = (tcp4_hdr *)(t->frame + REPLY_L4_OFF);
+	memcpy(&eh->src, &i->ether, sizeof eh->src);
+	eh->type = htobe16(ether_type_ip);
+	ih->ver_ihl = 0x45;
+	ih->len = htobe16(sizeof *ih + sizeof *th);
+	ih->ttl = 0x40;
+	ih->proto = ip_proto_tcp;
+	ih->sum = htobe16(~ip4_cksum(0, ih, sizeof *ih));
+	th->seq = htobe32(FLYTRAP_TCP4_SEQ);
+	th->off_ns = (sizeof *th / 4U) << 4;
+	pseudo[0] = htobe16(ip_proto_tcp);
+	pseudo[1] = htobe16(sizeof *th);
+	sum = ip4_cksum(0, pseudo, sizeof pseudo);
 	th->sum = htobe16(~ip4_cksum(sum, th, sizeof *th));
+	return (t);
+}
 
-	/* log and send packet */
-	ft_debug("< tcp4 port %hu to %hu seq %lu ack %lu win %hu len %zu",
-	    (unsigned short)be16toh(th->sp), (unsigned short)be16toh(th->dp),
-	    (unsigned long)be32toh(th->seq), (unsigned long)be32toh(th->ack),
-	    (unsigned short)be16toh(th->win), len);
-	if (ft_logout)
-		csv_tcp4(&fl->eth->p->ts, &fl->dst, &fl->src, th, 0);
-	return (ip4_reply(fl, ip_proto_tcp, th, sizeof *th));
+void
+tcp4_tmpl_destroy(struct tcp4_tmpl *t)
+{
+
+	free(t);
 }
 
 /*
- * Reply to a TCP packet with an RST.
+ * Reply to a TCP packet: copy the interface's template, patch in what
+ * differs, and update the checksums to match (RFC 1624).
  */
 static int
-tcp4_go_away(const ip4_flow *fl, const tcp4_hdr *ith, size_t ilen)
+tcp4_reply(const flow *fl, uint8_t flags, uint32_t ack)
 {
-	tcp4_hdr oth;
+	const struct tcp4_tmpl *t = fl->p->i->tcp4;
+	uint8_t *frame;
+	ether_hdr *eh;
+	ip4_hdr *ih;
+	tcp4_hdr *th;
+	uint16_t asum, sum;
 
-	(void)ilen;
+	if ((frame = ethernet_reply_frame(fl)) == NULL)
+		return (-1);
+	memcpy(frame, t->frame, sizeof t->frame);
+	eh = (ether_hdr *)frame;
+	ih = (ip4_hdr *)(frame + REPLY_IP4_OFF);
+	th = (tcp4_hdr *)(frame + REPLY_L4_OFF);
+	memcpy(&eh->dst, &fl->esrc, sizeof eh->dst);
+	ih->srcip = fl->dst;
+	ih->dstip = fl->src;
+	th->sp = htobe16(fl->dp);
+	th->dp = htobe16(fl->sp);
+	th->ack = htobe32(ack);
+	th->fl = flags;
 
-	/* fill in header */
-	oth.sp = ith->dp;
-	oth.dp = ith->sp;
-	oth.seq = htobe32(FLYTRAP_TCP4_SEQ);
-	oth.ack = ith->seq;
-	oth.off_ns = (sizeof oth / 4U) << 4;
-	oth.fl = TCP4_RST;
-	oth.win = htobe16(0);
-	oth.sum = htobe16(0);
-	oth.urg = htobe16(0);
+	/* the addresses count towards both checksums */
+	asum = ip4_cksum(0, &ih->srcip, 2 * sizeof(ip4_addr));
+	ih->sum = htobe16(ip4_cksum_update(be16toh(ih->sum), 0, asum));
+	sum = ip4_cksum_update(be16toh(th->sum), 0, asum);
+	sum = ip4_cksum_update(sum, 0, fl->dp);
+	sum = ip4_cksum_update(sum, 0, fl->sp);
+	sum = ip4_cksum_update32(sum, 0, ack);
+	sum = ip4_cksum_update(sum, th->off_ns << 8, th->off_ns << 8 | flags);
+	th->sum = htobe16(sum);
 
-	/* send packet */
-	return (tcp4_reply(fl, &oth));
+	/* log and send packet */
+	ft_debug("< tcp4 port %hu to %hu seq %lu ack %lu win %hu",
+	    (unsigned short)fl->dp, (unsigned short)fl->sp,
+	    (unsigned long)FLYTRAP_TCP4_SEQ, (unsigned long)ack,
+	    (unsigned short)be16toh(th->win));
+	if (ft_logout)
+		csv_tcp4(&fl->p->ts, &fl->dst, fl->dp, &fl->src, fl->sp,
+		    flags, 0);
+	return (ethernet_transmit(fl->p->i, frame, sizeof t->frame));
 }
 
 /*
- * Reply to a SYN packet with a SYN/ACK with a very small window size.
+ * Reply to a TCP packet with an RST.
  */
 static int
-tcp4_hello(const ip4_flow *fl, const tcp4_hdr *ith, size_t ilen)
+tcp4_go_away(const flow *fl)
 {
-	tcp4_hdr oth;
-	uint32_t ack;
 
-	(void)ilen;
+	return (tcp4_reply(fl, TCP4_RST, fl->seq));
+}
 
-	/* fill in header */
-	oth.sp = ith->dp;
-	oth.dp = ith->sp;
-	oth.seq = htobe32(FLYTRAP_TCP4_SEQ);
-	ack = be32toh(ith->seq) + 1;
-	oth.ack = htobe32(ack);
-	oth.off_ns = (sizeof oth / 4U) << 4;
-	oth.fl = TCP4_SYN | TCP4_ACK;
-	oth.win = htobe16(0);
-	oth.sum = htobe16(0);
-	oth.urg = htobe16(0);
+/*
+ * Reply to a SYN packet with a SYN/ACK with a very small window size.
+ */
+static int
+tcp4_hello(const flow *fl)
+{
 
-	/* send packet */
-	return (tcp4_reply(fl, &oth));
+	return (tcp4_reply(fl, TCP4_SYN | TCP4_ACK, fl->seq + 1));
 }
 
 /*
@@ -152,88 +189,90 @@ tcp4_hello(const ip4_flow *fl, const tcp4_hdr *ith, size_t ilen)
  * informs the peer that we don't have any free buffer space.
  */
 static int
-tcp4_please_hold(const ip4_flow *fl, const tcp4_hdr *ith, size_t ilen)
+tcp4_please_hold(const flow *fl)
 {
-	tcp4_hdr oth;
-
-	(void)ilen;
 
-	/* fill in header */
-	oth.sp = ith->dp;
-	oth.dp = ith->sp;
-	oth.seq = htobe32(FLYTRAP_TCP4_SEQ);
-	oth.ack = ith->seq;
-	oth.off_ns = (sizeof oth / 4U) << 4;
-	oth.fl = (ith->fl & TCP4_SYN) | TCP4_ACK;
-	oth.win = htobe16(0);
-	oth.sum = htobe16(0);
-	oth.urg = htobe16(0);
-
-	/* send packet */
-	return (tcp4_reply(fl, &oth));
+	return (tcp4_reply(fl, (fl->tcpfl & TCP4_SYN) | TCP4_ACK, fl->seq));
 }
 
 /*
  * Reply to a FIN packet with a FIN/ACK.
  */
 static int
-tcp4_goodbye(const ip4_flow *fl, const tcp4_hdr *ith, size_t ilen)
+tcp4_goodbye(const flow *fl)
 {
-	tcp4_hdr oth;
 
-	(void)ilen;
+	return (tcp4_reply(fl, TCP4_FIN | TCP4_ACK, fl->seq));
+}
+
+/*
+ * Decode the TCP header of a captured packet.
+ */
+int
+tcp4_decode(flow *fl)
+{
+	const tcp4_hdr *th;
+	size_t thlen;
+
+	th = (const tcp4_hdr *)flow_l4(fl);
+	thlen = fl->l4cap >= sizeof *th ?
+	    (tcp4_hdr_off(th) * 4U) : sizeof *th;
+	if (fl->l4cap < thlen) {
+		ft_verbose("%lu.%03lu short TCP packet (%zd < %zd)",
+		    FT_TIME_SEC_UL, FT_TIME_MSEC_UL, (size_t)fl->l4cap, thlen);
+		return (-1);
+	}
+	fl->hlen = thlen;
+	fl->dlen = fl->l4len - thlen;
+	fl->sp = be16toh(th->sp);
+	fl->dp = be16toh(th->dp);
+	fl->tcpfl = tcp4_hdr_ns(th) << 8 | th->fl;
+	fl->seq = be32toh(th->seq);
+	return (0);
+}
 
-	/* fill in packet */
-	oth.sp = ith->dp;
-	oth.dp = ith->sp;
-	oth.seq = htobe32(FLYTRAP_TCP4_SEQ);
-	oth.ack = ith->seq;
-	oth.off_ns = (sizeof oth / 4U) << 4;
-	oth.fl = TCP4_FIN | TCP4_ACK;
-	oth.win = htobe16(0);
-	oth.sum = htobe16(0);
-	oth.urg = htobe16(0);
+/*
+ * Log a SYN which the XDP fast path answered, and its answer.
+ */
+void
+tcp4_fast(const struct timeval *ts, const ip4_addr *sa, uint16_t sp,
+    const ip4_addr *da, uint16_t dp, unsigned int tcpfl)
+{
 
-	/* send packet */
-	return (tcp4_reply(fl, &oth));
+	csv_tcp4(ts, sa, sp, da, dp, tcpfl, 0);
+	if (ft_logout)
+		csv_tcp4(ts, da, dp, sa, sp, TCP4_SYN | TCP4_ACK, 0);
 }
 
 /*
  * Analyze a captured TCP packet
  */
 int
-packet_analyze_tcp4(const ip4_flow *fl, const void *data, size_t len)
+packet_analyze_tcp4(const flow *fl)
 {
 	const tcp4_hdr *th;
-	size_t thlen;
 	uint16_t sum;
 	int ret;
 
-	th = data;
-	thlen = len >= sizeof *th ? (tcp4_hdr_off(th) * 4U) : sizeof *th;
-	if (len < thlen) {
-		ft_verbose("%lu.%03lu short TCP packet (%zd < %zd)",
-		    FT_TIME_SEC_UL, FT_TIME_MSEC_UL, len, thlen);
-		return (-1);
-	}
-	if ((sum = ~ip4_cksum(fl->sum, data, len)) != 0) {
+	th = (const tcp4_hdr *)flow_l4(fl);
+	if (flow_cksum_needed(fl) &&
+	    (sum = ~ip4_cksum(fl->sum, th, fl->l4cap)) != 0) {
 		ft_verbose("%lu.%03lu invalid TCP checksum 0x%04hx",
 		    FT_TIME_SEC_UL, FT_TIME_MSEC_UL, sum);
 		return (-1);
 	}
-	data = (const uint8_t *)data + thlen;
-	len -= thlen;
 	ft_debug("> tcp4 port %hu to %hu seq %lu ack %lu win %hu len %zu",
-	    (unsigned short)be16toh(th->sp), (unsigned short)be16toh(th->dp),
-	    (unsigned long)be32toh(th->seq), (unsigned long)be32toh(th->ack),
-	    (unsigned short)be16toh(th->win), len);
-	csv_tcp4(&fl->eth->p->ts, &fl->src, &fl->dst, th, len);
-	if (th->fl & TCP4_SYN) {
-		if (th->fl & TCP4_ACK)
-			ret = tcp4_go_away(fl, th, len);
+	    (unsigned short)fl->sp, (unsigned short)fl->dp,
+	    (unsigned long)fl->seq, (unsigned long)be32toh(th->ack),
+	    (unsigned short)be16toh(th->win), (size_t)fl->dlen);
+	csv_tcp4(&fl->p->ts, &fl->src, fl->sp, &fl->dst, fl->dp,
+	    fl->tcpfl, fl->dlen);
+	if (fl->tcpfl & TCP4_SYN) {
+		if (fl->tcpfl & TCP4_ACK)
+			ret = tcp4_go_away(fl);
 		else
-			ret = tcp4_hello(fl, th, len);
-	} else if (th->fl & TCP4_FIN) {
+			ret = tcp4_hello(fl);
+	} else if (fl->tcpfl & TCP4_FIN) {
 		/* closing connection */
 		/*
 		 * This is disabled for now, as I haven't found a way to
@@ -242,12 +281,12 @@ packet_analyze_tcp4(const ip4_flow *fl, const void *data, size_t len)
 		 * clever way to represent state with a minimal amount of
 		 * resources and without exposing ourselves to a DoS.
 		 */
-		ret = 0 && tcp4_goodbye(fl, th, len);
-	} else if (th->fl & TCP4_RST) {
+		ret = 0 && tcp4_goodbye(fl);
+	} else if (fl->tcpfl & TCP4_RST) {
 		/* ignore packet */
 		ret = 0;
-	} else if (len > 0) {
-		ret = tcp4_please_hold(fl, th, len);
+	} else if (fl->dlen > 0) {
+		ret = tcp4_please_hold(fl);
 	} else {
 		/* ignore packet */
 		ret = 0;
@@ -47,32 +47,47 @@
 #include "packet.h"
 
 /*
- * Analyze a captured UDP packet
+ * Decode the UDP header of a captured packet.
  */
 int
-packet_analyze_udp4(const ip4_flow *fl, const void *data, size_t len)
+udp4_decode(flow *fl)
 {
 	const udp4_hdr *uh;
-	uint16_t sum;
 
-	uh = data;
-	if (len < sizeof *uh) {
+	if (fl->l4cap < sizeof *uh) {
 		ft_verbose("%lu.%03lu short UDP packet (%zd < %zd)",
-		    FT_TIME_SEC_UL, FT_TIME_MSEC_UL, len, sizeof *uh);
+		    FT_TIME_SEC_UL, FT_TIME_MSEC_UL, (size_t)fl->l4cap,
+		    sizeof *uh);
 		return (-1);
 	}
-	if (uh->sum != 0 &&
-	    (sum = ~ip4_cksum(fl->sum, data, len)) != 0) {
+	uh = (const udp4_hdr *)flow_l4(fl);
+	fl->hlen = sizeof *uh;
+	fl->dlen = fl->l4len - sizeof *uh;
+	fl->sp = be16toh(uh->sp);
+	fl->dp = be16toh(uh->dp);
+	return (0);
+}
+
+/*
+ * Analyze a captured UDP packet
+ */
+int
+packet_analyze_udp4(const flow *fl)
+{
+	const udp4_hdr *uh;
+	uint16_t sum;
+
+	uh = (const udp4_hdr *)flow_l4(fl);
+	if (uh->sum != 0 && flow_cksum_needed(fl) &&
+	    (sum = ~ip4_cksum(fl->sum, uh, fl->l4cap)) != 0) {
 		ft_verbose("%lu.%03lu invalid UDP checksum 0x%04hx",
-		    FT_TIME_SEC_UL, FT_TIME_MSEC_UL, len, sum);
+		    FT_TIME_SEC_UL, FT_TIME_MSEC_UL, sum);
 		return (-1);
 	}
-	data = uh + 1;
-	len -= sizeof *uh;
 	ft_debug("> udp4 port %hu to %hu len %zu",
-	    (unsigned short)be16toh(uh->sp), (unsigned short)be16toh(uh->dp),
-	    len);
-	csv_packet4(&fl->eth->p->ts, &fl->src, be16toh(uh->sp),
-	    &fl->dst, be16toh(uh->dp), "UDP", len, "");
+	    (unsigned short)fl->sp, (unsigned short)fl->dp,
+	    (size_t)fl->dlen);
+	csv_packet4(&fl->p->ts, &fl->src, fl->sp, &fl->dst, fl->dp,
+	    "UDP", fl->dlen, "");
 	return (0);
 }
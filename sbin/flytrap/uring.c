@@ -0,0 +1,386 @@
+/*-
+ * Copyright (c) 2016-2018 The University of Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <linux/io_uring.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <ft/log.h>
+
+#include "uring.h"
+
+/* number and size of transmit buffers */
+#define URING_NBUF		256
+#define URING_BUFSZ		2048
+
+/*
+ * A transmit buffer, owned by the ring until the write completes.
+ */
+struct uring_buf {
+	uring_req		 req;
+	struct uring_buf	*next;
+	uint8_t			 data[URING_BUFSZ];
+};
+
+static struct uring {
+	int			 fd;
+	void			*ring;
+	size_t			 ringsz;
+	/* submission queue */
+	unsigned int		*sq_tail;
+	unsigned int		*sq_head;
+	unsigned int		 sq_mask;
+	unsigned int		 sq_entries;
+	unsigned int		*sq_array;
+	struct io_uring_sqe	*sqes;
+	size_t			 sqesz;
+	unsigned int		 tail;		/* next free SQE */
+	unsigned int		 nqueued;	/* not yet submitted */
+	/* completion queue */
+	unsigned int		*cq_head;
+	unsigned int		*cq_tail;
+	unsigned int		 cq_mask;
+	struct io_uring_cqe	*cqes;
+	/* outstanding writes */
+	unsigned int		 nwrite;
+	struct uring_buf	*bufs;
+	struct uring_buf	*freebufs;
+	unsigned long		 nsendfail;
+} uring = { .fd = -1 };
+
+static int
+sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+
+	return (syscall(__NR_io_uring_setup, entries, p));
+}
+
+static int
+sys_io_uring_enter(unsigned int nsubmit, unsigned int nwait,
+    unsigned int flags, const struct io_uring_getevents_arg *arg)
+{
+
+	return (syscall(__NR_io_uring_enter, uring.fd, nsubmit, nwait,
+	    flags, arg, sizeof *arg));
+}
+
+static void
+uring_buf_done(uring_req *req, int res)
+{
+	struct uring_buf *b = (struct uring_buf *)req;
+
+	if (res < 0) {
+		errno = -res;
+		ft_debug("io_uring: send failed: %m");
+		uring.nsendfail++;
+	}
+	b->next = uring.freebufs;
+	uring.freebufs = b;
+}
+
+/*
+ * Set up a ring with room for the given number of submissions.  The
+ * kernel must support a single mapping for both queues and wait
+ * timeouts (Linux 5.11 or newer).
+ */
+int
+uring_init(unsigned int entries)
+{
+	struct io_uring_params p;
+	size_t sqsz, cqsz;
+	unsigned int k;
+	int serrno;
+
+	memset(&p, 0, sizeof p);
+	if ((uring.fd = sys_io_uring_setup(entries, &p)) < 0)
+		return (-1);
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+	    !(p.features & IORING_FEAT_EXT_ARG)) {
+		errno = ENOSYS;
+		goto fail;
+	}
+	sqsz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	cqsz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	uring.ringsz = sqsz > cqsz ? sqsz : cqsz;
+	if ((uring.ring = mmap(NULL, uring.ringsz, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQ_RING)) ==
+	    MAP_FAILED) {
+		uring.ring = NULL;
+		goto fail;
+	}
+	uring.sqesz = p.sq_entries * sizeof(struct io_uring_sqe);
+	if ((uring.sqes = mmap(NULL, uring.sqesz, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQES)) ==
+	    MAP_FAILED) {
+		uring.sqes = NULL;
+		goto fail;
+	}
+	uring.sq_head = (unsigned int *)((char *)uring.ring + p.sq_off.head);
+	uring.sq_tail = (unsigned int *)((char *)uring.ring + p.sq_off.tail);
+	uring.sq_mask = *(unsigned int *)((char *)uring.ring +
+	    p.sq_off.ring_mask);
+	uring.sq_entries = p.sq_entries;
+	uring.sq_array = (unsigned int *)((char *)uring.ring +
+	    p.sq_off.array);
+	uring.tail = *uring.sq_tail;
+	uring.cq_head = (unsigned int *)((char *)uring.ring + p.cq_off.head);
+	uring.cq_tail = (unsigned int *)((char *)uring.ring + p.cq_off.tail);
+	uring.cq_mask = *(unsigned int *)((char *)uring.ring +
+	    p.cq_off.ring_mask);
+	uring.cqes = (struct io_uring_cqe *)((char *)uring.ring +
+	    p.cq_off.cqes);
+	if ((uring.bufs = calloc(URING_NBUF, sizeof *uring.bufs)) == NULL)
+		goto fail;
+	for (k = 0; k < URING_NBUF; ++k) {
+		uring.bufs[k].req.cb = uring_buf_done;
+		uring.bufs[k].next = uring.freebufs;
+		uring.freebufs = &uring.bufs[k];
+	}
+	ft_verbose("io_uring: %u submission / %u completion entries",
+	    p.sq_entries, p.cq_entries);
+	return (0);
+fail:
+	serrno = errno;
+	uring_fini();
+	errno = serrno;
+	return (-1);
+}
+
+/*
+ * Wait for outstanding writes, then tear down the ring.  Anything else
+ * still in flight, such as polls, is cancelled.
+ */
+void
+uring_fini(void)
+{
+
+	if (uring.fd < 0)
+		return;
+	if (uring.sqes != NULL && uring_drain() != 0)
+		ft_warning("io_uring: failed to complete writes: %m");
+	if (uring.nsendfail > 0)
+		ft_verbose("io_uring: %lu sends failed", uring.nsendfail);
+	free(uring.bufs);
+	if (uring.sqes != NULL)
+		munmap(uring.sqes, uring.sqesz);
+	if (uring.ring != NULL)
+		munmap(uring.ring, uring.ringsz);
+	close(uring.fd);
+	memset(&uring, 0, sizeof uring);
+	uring.fd = -1;
+}
+
+int
+uring_active(void)
+{
+
+	return (uring.fd >= 0);
+}
+
+/*
+ * Push queued submissions to the kernel and optionally wait for at
+ * least one completion: indefinitely if the timeout (in ms) is
+ * negative, not at all if it is zero.
+ */
+static int
+uring_enter(int timeout)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned int flags;
+	int ret;
+
+	__atomic_store_n(uring.sq_tail, uring.tail, __ATOMIC_RELEASE);
+	memset(&arg, 0, sizeof arg);
+	flags = IORING_ENTER_EXT_ARG;
+	if (timeout != 0)
+		flags |= IORING_ENTER_GETEVENTS;
+	if (timeout > 0) {
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = timeout % 1000 * 1000000;
+		arg.ts = (uintptr_t)&ts;
+	}
+	ret = sys_io_uring_enter(uring.nqueued, timeout != 0, flags, &arg);
+	if (ret < 0) {
+		/* timed out, interrupted or completion queue full */
+		if (errno == ETIME || errno == EINTR || errno == EBUSY ||
+		    errno == EAGAIN)
+			return (0);
+		return (-1);
+	}
+	uring.nqueued -= ret;
+	return (ret);
+}
+
+/*
+ * Get a free submission queue entry, flushing the queue if it is full.
+ */
+static struct io_uring_sqe *
+uring_sqe(uring_req *req, int op, int fd)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int idx;
+
+	if (uring.tail - __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE) >=
+	    uring.sq_entries) {
+		if (uring_enter(0) < 0)
+			return (NULL);
+		if (uring.tail - __atomic_load_n(uring.sq_head,
+		    __ATOMIC_ACQUIRE) >= uring.sq_entries) {
+			errno = EBUSY;
+			return (NULL);
+		}
+	}
+	idx = uring.tail & uring.sq_mask;
+	sqe = &uring.sqes[idx];
+	memset(sqe, 0, sizeof *sqe);
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->user_data = (uintptr_t)req;
+	uring.sq_array[idx] = idx;
+	uring.tail++;
+	uring.nqueued++;
+	req->pending = op + 1;
+	return (sqe);
+}
+
+/*
+ * Wait for the descriptor to become ready.  The callback receives the
+ * resulting poll mask.
+ */
+int
+uring_poll(uring_req *req, int fd, unsigned int events)
+{
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = uring_sqe(req, IORING_OP_POLL_ADD, fd)) == NULL)
+		return (-1);
+	sqe->poll32_events = events;
+	return (0);
+}
+
+/*
+ * Write from a buffer which the caller must leave untouched until the
+ * callback is invoked.
+ */
+int
+uring_write(uring_req *req, int fd, const void *data, size_t len)
+{
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = uring_sqe(req, IORING_OP_WRITE, fd)) == NULL)
+		return (-1);
+	sqe->addr = (uintptr_t)data;
+	sqe->len = len;
+	sqe->off = (uint64_t)-1;
+	uring.nwrite++;
+	return (0);
+}
+
+/*
+ * Copy a frame into a transmit buffer and queue it for writing.  If
+ * every buffer is in use, wait for one to become available.
+ */
+int
+uring_send(int fd, const void *data, size_t len)
+{
+	struct uring_buf *b;
+
+	if (len > URING_BUFSZ) {
+		errno = EMSGSIZE;
+		return (-1);
+	}
+	while ((b = uring.freebufs) == NULL)
+		if (uring_submit(-1) < 0)
+			return (-1);
+	memcpy(b->data, data, len);
+	if (uring_write(&b->req, fd, b->data, len) != 0)
+		return (-1);
+	uring.freebufs = b->next;
+	return (0);
+}
+
+/*
+ * Submit whatever is queued, wait as described for uring_enter(), and
+ * run the callbacks for everything that has completed.  Returns the
+ * number of completions.
+ */
+int
+uring_submit(int timeout)
+{
+	struct io_uring_cqe *cqe;
+	unsigned int head;
+	uring_req *req;
+	int n, res;
+
+	if ((uring.nqueued > 0 || timeout != 0) && uring_enter(timeout) < 0)
+		return (-1);
+	head = *uring.cq_head;
+	for (n = 0; head != __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+	     ++n) {
+		cqe = &uring.cqes[head & uring.cq_mask];
+		req = (uring_req *)(uintptr_t)cqe->user_data;
+		res = cqe->res;
+		/* release the entry before the callback can re-enter */
+		__atomic_store_n(uring.cq_head, ++head, __ATOMIC_RELEASE);
+		if (req->pending == IORING_OP_WRITE + 1)
+			uring.nwrite--;
+		req->pending = 0;
+		if (req->cb != NULL)
+			req->cb(req, res);
+		head = *uring.cq_head;
+	}
+	return (n);
+}
+
+/*
+ * Wait until every outstanding write has completed.
+ */
+int
+uring_drain(void)
+{
+
+	while (uring.nwrite > 0 || uring.nqueued > 0)
+		if (uring_submit(uring.nwrite > 0 ? -1 : 0) < 0)
+			return (-1);
+	return (0);
+}
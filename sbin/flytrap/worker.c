@@ -0,0 +1,313 @@
+/*-
+ * Copyright (c) 2016-2018 The University of Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#if HAVE_LINUX_MEMPOLICY_H
+#include <sys/syscall.h>
+#endif
+
+#if HAVE_LINUX_MEMPOLICY_H
+#include <linux/mempolicy.h>
+#endif
+
+#include <errno.h>
+#include <pthread.h>
+#if HAVE_SCHED_SETAFFINITY
+#include <sched.h>
+#endif
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <ft/log.h>
+
+#include "flytrap.h"
+
+#define WORKER_CACHELINE	64
+
+/*
+ * A worker thread.  The counters are only written by the worker itself
+ * and are read by the main thread for its reports.
+ */
+typedef struct worker {
+	unsigned int	 id;
+	int		 cpu;		/* CPU to run on, or -1 */
+	int		 node;		/* NUMA node to run on, or -1 */
+	pthread_t	 thread;
+	int		 started;
+	int		 done;		/* 1 when finished, -1 on error */
+	unsigned long	 npackets;
+	unsigned long	 nbatches;
+} __attribute__((__aligned__(WORKER_CACHELINE))) worker;
+
+static worker workers[FT_MAXWORKERS];
+static unsigned int nworkers;
+static int (*worker_fn)(unsigned int);
+
+#if HAVE_SCHED_SETAFFINITY
+/*
+ * Read the list of CPUs which belong to a NUMA node.
+ */
+static int
+worker_node_cpus(int node, cpu_set_t *cpus)
+{
+	char fn[64], buf[1024], *p, *e;
+	unsigned long first, last;
+	FILE *f;
+
+	snprintf(fn, sizeof fn, "/sys/devices/system/node/node%d/cpulist",
+	    node);
+	if ((f = fopen(fn, "r")) == NULL)
+		return (-1);
+	p = fgets(buf, sizeof buf, f);
+	fclose(f);
+	if (p == NULL) {
+		errno = EINVAL;
+		return (-1);
+	}
+	CPU_ZERO(cpus);
+	while (*p >= '0' && *p <= '9') {
+		first = last = strtoul(p, &e, 10);
+		if (*e == '-')
+			last = strtoul(e + 1, &e, 10);
+		for (; first <= last && first < CPU_SETSIZE; ++first)
+			CPU_SET(first, cpus);
+		p = *e == ',' ? e + 1 : e;
+	}
+	return (0);
+}
+#endif
+
+/*
+ * Bind the calling thread to its CPU and / or NUMA node.  Memory it
+ * allocates from now on, including its capture ring, comes from that
+ * node if possible.
+ */
+static int
+worker_pin(const worker *w)
+{
+#if HAVE_SCHED_SETAFFINITY
+	cpu_set_t cpus;
+
+	if (w->cpu >= 0) {
+		CPU_ZERO(&cpus);
+		CPU_SET(w->cpu, &cpus);
+	} else if (w->node >= 0) {
+		if (worker_node_cpus(w->node, &cpus) != 0) {
+			ft_error("worker %u: failed to look up node %d: %m",
+			    w->id, w->node);
+			return (-1);
+		}
+	}
+	if ((w->cpu >= 0 || w->node >= 0) &&
+	    sched_setaffinity(0, sizeof cpus, &cpus) != 0) {
+		ft_error("worker %u: failed to bind to CPU: %m", w->id);
+		return (-1);
+	}
+#else
+	if (w->cpu >= 0 || w->node >= 0) {
+		ft_error("CPU binding not supported");
+		return (-1);
+	}
+#endif
+	if (w->node >= 0) {
+#if HAVE_LINUX_MEMPOLICY_H
+		unsigned long mask[FT_MAXNODES / (8 * sizeof(unsigned long))];
+
+		memset(mask, 0, sizeof mask);
+		mask[w->node / (8 * sizeof *mask)] |=
+		    1UL << w->node % (8 * sizeof *mask);
+		if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask,
+		    FT_MAXNODES + 1) != 0) {
+			ft_warning("worker %u: failed to set memory policy: "
+			    "%m", w->id);
+		}
+#else
+		ft_warning("worker %u: NUMA memory policy not supported",
+		    w->id);
+#endif
+	}
+	return (0);
+}
+
+static void *
+worker_thread(void *arg)
+{
+	worker *w = arg;
+	int ret;
+
+	if (worker_pin(w) != 0)
+		ret = -1;
+	else
+		ret = worker_fn(w->id);
+	__atomic_store_n(&w->done, ret == 0 ? 1 : -1, __ATOMIC_RELEASE);
+	return (NULL);
+}
+
+/*
+ * Start n workers, each of which runs fn with its number.  Worker k is
+ * bound to the k-th of the CPUs given with -c, or failing that, to the
+ * k-th of the NUMA nodes given with -N, wrapping around if there are
+ * fewer than n.
+ */
+int
+worker_start(unsigned int n, int (*fn)(unsigned int))
+{
+	sigset_t all, saved;
+	unsigned int k;
+	worker *w;
+
+	if (n > FT_MAXWORKERS) {
+		errno = E2BIG;
+		return (-1);
+	}
+	worker_fn = fn;
+	memset(workers, 0, sizeof workers);
+
+	/* signals are for the main thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &saved);
+	for (nworkers = 0; nworkers < n; ++nworkers) {
+		k = nworkers;
+		w = &workers[k];
+		w->id = k;
+		w->cpu = ft_ncpus > 0 ? ft_cpus[k % ft_ncpus] : -1;
+		w->node = ft_nnodes > 0 ? ft_nodes[k % ft_nnodes] : -1;
+		if ((errno = pthread_create(&w->thread, NULL, worker_thread,
+		    w)) != 0)
+			break;
+		w->started = 1;
+		if (w->cpu >= 0 && w->node >= 0) {
+			ft_verbose("worker %u started on CPU %d, node %d",
+			    k, w->cpu, w->node);
+		} else if (w->cpu >= 0) {
+			ft_verbose("worker %u started on CPU %d", k, w->cpu);
+		} else if (w->node >= 0) {
+			ft_verbose("worker %u started on node %d", k, w->node);
+		} else {
+			ft_verbose("worker %u started", k);
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, &saved, NULL);
+	return (nworkers == n ? 0 : -1);
+}
+
+/*
+ * Returns the number of workers still running, or -1 if any of them
+ * failed.
+ */
+int
+worker_running(void)
+{
+	unsigned int k;
+	int done, n;
+
+	for (n = 0, k = 0; k < nworkers; ++k) {
+		done = __atomic_load_n(&workers[k].done, __ATOMIC_ACQUIRE);
+		if (done < 0)
+			return (-1);
+		if (done == 0)
+			n++;
+	}
+	return (n);
+}
+
+/*
+ * Wait for every worker to finish.  Returns -1 if any of them failed.
+ */
+int
+worker_join(void)
+{
+	unsigned int k;
+	int ret;
+
+	for (ret = 0, k = 0; k < nworkers; ++k) {
+		if (!workers[k].started)
+			continue;
+		pthread_join(workers[k].thread, NULL);
+		workers[k].started = 0;
+		if (workers[k].done < 0)
+			ret = -1;
+	}
+	return (ret);
+}
+
+/*
+ * Count a batch analyzed by a worker.
+ */
+void
+worker_account(unsigned int k, unsigned int n)
+{
+	worker *w = &workers[k];
+
+	__atomic_store_n(&w->npackets, w->npackets + n, __ATOMIC_RELAXED);
+	__atomic_store_n(&w->nbatches, w->nbatches + 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Log each worker's share of the load, and how far the busiest one is
+ * from the average.
+ */
+void
+worker_report(void)
+{
+	unsigned long npackets[FT_MAXWORKERS], nbatches, total, max, skew;
+	unsigned int k;
+
+	if (nworkers == 0)
+		return;
+	for (total = max = 0, k = 0; k < nworkers; ++k) {
+		npackets[k] = __atomic_load_n(&workers[k].npackets,
+		    __ATOMIC_RELAXED);
+		total += npackets[k];
+		if (npackets[k] > max)
+			max = npackets[k];
+	}
+	if (total == 0)
+		return;
+	for (k = 0; k < nworkers; ++k) {
+		nbatches = __atomic_load_n(&workers[k].nbatches,
+		    __ATOMIC_RELAXED);
+		ft_notice("worker %u: %lu packets in %lu batches, "
+		    "%lu.%lu%% of the load", k, npackets[k], nbatches,
+		    npackets[k] * 100 / total,
+		    npackets[k] * 1000 / total % 10);
+	}
+	/* busiest worker relative to an even split, in hundredths */
+	skew = max * nworkers * 100 / total;
+	ft_notice("workers: %lu packets, load skew %lu.%02lu "
+	    "(busiest / average)", total, skew / 100, skew % 100);
+}
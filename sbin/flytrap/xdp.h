@@ -0,0 +1,107 @@
+/*-
+ * Copyright (c) 2016 The University of Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef FLYTRAP_XDP_H_INCLUDED
+#define FLYTRAP_XDP_H_INCLUDED
+
+/*
+ * eBPF instruction encoding
+ */
+#define XDP_INSN(c, d, s, o, i)						\
+	{ .code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i) }
+#define XDP_LDX(sz, d, s, o)						\
+	XDP_INSN(BPF_LDX | BPF_MEM | (sz), (d), (s), (o), 0)
+#define XDP_STX(sz, d, s, o)						\
+	XDP_INSN(BPF_STX | BPF_MEM | (sz), (d), (s), (o), 0)
+#define XDP_ST(sz, d, o, i)						\
+	XDP_INSN(BPF_ST | BPF_MEM | (sz), (d), 0, (o), (i))
+#define XDP_XADD64(d, s, o)						\
+	XDP_INSN(BPF_STX | BPF_XADD | BPF_DW, (d), (s), (o), 0)
+#define XDP_ALU64_IMM(op, d, i)						\
+	XDP_INSN(BPF_ALU64 | (op) | BPF_K, (d), 0, 0, (i))
+#define XDP_ALU64_REG(op, d, s)						\
+	XDP_INSN(BPF_ALU64 | (op) | BPF_X, (d), (s), 0, 0)
+#define XDP_MOV64_REG(d, s)	XDP_ALU64_REG(BPF_MOV, (d), (s))
+#define XDP_MOV64_IMM(d, i)	XDP_ALU64_IMM(BPF_MOV, (d), (i))
+#define XDP_ADD64_IMM(d, i)	XDP_ALU64_IMM(BPF_ADD, (d), (i))
+#define XDP_MOV32_REG(d, s)						\
+	XDP_INSN(BPF_ALU | BPF_MOV | BPF_X, (d), (s), 0, 0)
+#define XDP_TO_BE(d, bits)						\
+	XDP_INSN(BPF_ALU | BPF_END | BPF_TO_BE, (d), 0, 0, (bits))
+#define XDP_JMP_IMM(op, d, i, o)					\
+	XDP_INSN(BPF_JMP | (op) | BPF_K, (d), 0, (o), (i))
+#define XDP_JMP_REG(op, d, s, o)					\
+	XDP_INSN(BPF_JMP | (op) | BPF_X, (d), (s), (o), 0)
+#define XDP_JGT_REG(d, s, o)	XDP_JMP_REG(BPF_JGT, (d), (s), (o))
+#define XDP_JMP32_IMM(op, d, i, o)					\
+	XDP_INSN(BPF_JMP32 | (op) | BPF_K, (d), 0, (o), (i))
+#define XDP_JNE32_IMM(d, i, o)	XDP_JMP32_IMM(BPF_JNE, (d), (i), (o))
+#define XDP_JA(o)							\
+	XDP_INSN(BPF_JMP | BPF_JA, 0, 0, (o), 0)
+#define XDP_LD_MAP_FD(d, fd)						\
+	XDP_INSN(BPF_LD | BPF_DW | BPF_IMM, (d), BPF_PSEUDO_MAP_FD, 0, (fd)), \
+	XDP_INSN(0, 0, 0, 0, 0)
+#define XDP_CALL(f)							\
+	XDP_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, (f))
+#define XDP_EXIT()							\
+	XDP_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+
+/* maximum length of the programs we generate */
+#define XDP_MAXINSNS		512
+
+/*
+ * Fast path events, passed from the XDP program to user space through a
+ * ring buffer for each frame it answers.  Addresses, ports and the
+ * sequence number are in network order.
+ */
+#define XDP_FAST_ARP		0	/* answered an ARP request */
+#define XDP_FAST_SYN		1	/* answered a TCP SYN */
+#define XDP_FAST_LOST		2	/* ring buffer was full */
+#define XDP_FAST_NSTATS		3
+
+struct xdp_fast_event {
+	uint32_t	 type;		/* XDP_FAST_ARP or XDP_FAST_SYN */
+	ip4_addr	 src;		/* ARP sender or IP source */
+	ip4_addr	 dst;		/* ARP target or IP destination */
+	uint16_t	 sp;		/* TCP source port */
+	uint16_t	 dp;		/* TCP destination port */
+	uint32_t	 seq;		/* TCP sequence number */
+	ether_addr	 ether;		/* Ethernet source */
+	uint16_t	 tcpfl;		/* TCP flags, NS in bit 8 */
+};
+
+int		 xdp_sys_bpf(int, union bpf_attr *);
+int		 xdp_load_insns(const iface *, const struct bpf_insn *,
+		    unsigned int);
+int		 xdp_attach_prog(const iface *, int, int);
+
+unsigned int	 iface_fast_prog(const iface *, struct bpf_insn *,
+		    unsigned int);
+
+#endif
@@ -0,0 +1,156 @@
+/*-
+ * Copyright (c) 2018 The University of Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * ARP table expiry pauses.  A scan fills the table within a second,
+ * then the whole lot expires at once five minutes later.  Expiry runs
+ * once a second of table time, and again right away for as long as it
+ * has work left over, as flytrap does, with and without a limit on the
+ * work done per run.  The worst pause is the smallest of a few tries,
+ * to keep the scheduler out of it.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <ft/arp.h>
+#include <ft/log.h>
+
+/* the intervals flytrap uses */
+#define B_STALE		30000
+#define B_EXPIRE	300000
+#define B_INTERVAL	1000
+#define B_TRIES		3
+
+static const unsigned int b_nentries[] = { 4096, 65536, 262144 };
+static const unsigned int b_max[] = { ~0U, 4096, 1024, 256 };
+
+static double
+b_elapsed(const struct timespec *t0, const struct timespec *t1)
+{
+
+	return ((t1->tv_sec - t0->tv_sec) * 1e9 +
+	    (t1->tv_nsec - t0->tv_nsec));
+}
+
+/*
+ * A table with n entries in 10.0.0.0/8, all seen within one interval.
+ */
+static arpt *
+b_fill(unsigned int n)
+{
+	unsigned int k;
+	arpt *t;
+
+	if ((t = arpt_new(B_STALE, B_EXPIRE, NULL, NULL)) == NULL)
+		return (NULL);
+	for (k = 0; k < n; ++k) {
+		if (arpt_insert(t, 0x0a000000U |
+		    ((k * 2654435761U) & 0xffffff),
+		    (uint64_t)k * B_INTERVAL / n) == NULL) {
+			arpt_destroy(t);
+			return (NULL);
+		}
+	}
+	return (t);
+}
+
+/*
+ * Fill a table, then run expiry until it is empty.  Returns the longest
+ * run in ns, or -1 on failure.
+ */
+static double
+b_try(unsigned int n, unsigned int max, unsigned long *nruns, double *total)
+{
+	struct timespec t0, t1;
+	double ns, worst;
+	uint64_t now;
+	arpt *t;
+	int more;
+
+	if ((t = b_fill(n)) == NULL)
+		return (-1);
+	*nruns = 0;
+	*total = worst = 0;
+	for (now = B_INTERVAL; arpt_count(t) > 0; now += B_INTERVAL) {
+		do {
+			clock_gettime(CLOCK_MONOTONIC, &t0);
+			more = arpt_expire(t, now, max);
+			clock_gettime(CLOCK_MONOTONIC, &t1);
+			ns = b_elapsed(&t0, &t1);
+			*total += ns;
+			if (ns > worst)
+				worst = ns;
+			(*nruns)++;
+		} while (more);
+	}
+	arpt_destroy(t);
+	if (now > B_EXPIRE + 3 * B_INTERVAL) {
+		fprintf(stderr, "expired late\n");
+		return (-1);
+	}
+	return (worst);
+}
+
+int
+main(void)
+{
+	unsigned long nruns;
+	double total, worst, best;
+	unsigned int i, j, r;
+
+	ft_log_level = FT_LOG_LEVEL_ERROR;
+	printf("%8s %8s %8s %12s %14s\n", "entries", "work",
+	    "runs", "total ms", "worst us");
+	for (i = 0; i < sizeof b_nentries / sizeof b_nentries[0]; ++i) {
+		for (j = 0; j < sizeof b_max / sizeof b_max[0]; ++j) {
+			for (best = 0, r = 0; r < B_TRIES; ++r) {
+				worst = b_try(b_nentries[i], b_max[j],
+				    &nruns, &total);
+				if (worst < 0)
+					return (1);
+				if (r == 0 || worst < best)
+					best = worst;
+			}
+			if (b_max[j] == ~0U)
+				printf("%8u %8s", b_nentries[i], "-");
+			else
+				printf("%8u %8u", b_nentries[i], b_max[j]);
+			printf(" %8lu %12.2f %14.1f\n", nruns, total / 1e6,
+			    best / 1e3);
+		}
+	}
+	return (0);
+}
@@ -0,0 +1,234 @@
+/*-
+ * Copyright (c) 2018 The University of Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * ARP table lookups from several reader threads at once, while a writer
+ * keeps inserting entries in the upper half of the address space, one
+ * /4 at a time, and expiring them once it has moved on.
+ * Readers take no lock, so their throughput should grow with their
+ * number as long as there are cores to run them on.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <ft/arp.h>
+#include <ft/epoch.h>
+#include <ft/log.h>
+
+#define B_MAXREADERS	16
+#define B_RUNTIME_MS	250
+#define B_STABLE	0x0a000000U	/* 10.0.0.0/16, never changes */
+#define B_BLOCK		4096		/* churn inserts per /4 */
+#define B_WINDOW	(2 * B_BLOCK)	/* churn entries live this long */
+#define B_FOREVER	(UINT64_MAX / 2)	/* stable entries' timestamp */
+
+static const unsigned int b_nreaders[] = { 1, 2, 4, 8, 16 };
+
+static arpt *b_table;
+static int b_stop;
+static int b_bad;
+
+struct b_reader {
+	pthread_t	 thread;
+	unsigned int	 seed;
+	unsigned long	 nlookup;
+	unsigned long	 nfound;
+} __attribute__((__aligned__(64)));
+
+static struct b_reader b_readers[B_MAXREADERS];
+
+struct b_writer {
+	pthread_t	 thread;
+	unsigned long	 ninsert;
+	unsigned long	 nfreed;
+};
+
+static struct b_writer b_writer;
+
+/*
+ * The Ethernet address each entry gets, so readers can tell if they
+ * see anything they should not.
+ */
+static uint64_t
+b_state(uint32_t addr)
+{
+	ether_addr ea;
+
+	ea.o[0] = 0x02;
+	ea.o[1] = 0x00;
+	ea.o[2] = addr >> 24;
+	ea.o[3] = addr >> 16;
+	ea.o[4] = addr >> 8;
+	ea.o[5] = addr;
+	return (arpe_pack(&ea));
+}
+
+static uint32_t
+b_churn(unsigned int block, unsigned int n)
+{
+
+	return ((8 + block % 8) << 28 | (n & 0xffff));
+}
+
+static void *
+b_read(void *arg)
+{
+	struct b_reader *r = arg;
+	uint32_t addr;
+	uint64_t state;
+	arpe copy;
+	unsigned int k;
+
+	while (!__atomic_load_n(&b_stop, __ATOMIC_RELAXED)) {
+		for (k = 0; k < 1024; ++k) {
+			r->seed = r->seed * 1103515245 + 12345;
+			if ((r->seed >> 16) & 1)
+				addr = b_churn(r->seed >> 17, r->seed);
+			else
+				addr = B_STABLE | (r->seed & 0xffff);
+			if (arpt_lookup(b_table, addr, &copy) == 0) {
+				/* new entries start out blank */
+				state = copy.state & ARPE_ETHER;
+				if (state != 0 && state != b_state(addr))
+					__atomic_store_n(&b_bad, 1,
+					    __ATOMIC_RELAXED);
+				r->nfound++;
+			}
+		}
+		r->nlookup += k;
+	}
+	ft_epoch_thread_exit();
+	return (NULL);
+}
+
+static void *
+b_write(void *arg)
+{
+	struct b_writer *w = arg;
+	uint64_t now;
+	uint32_t addr;
+	arpe *ae;
+
+	for (now = B_WINDOW; !__atomic_load_n(&b_stop, __ATOMIC_RELAXED);
+	     ++now) {
+		addr = b_churn(now / B_BLOCK, now * 40503);
+		if ((ae = arpt_insert(b_table, addr, now)) == NULL)
+			abort();
+		arpe_set_state(ae, arpe_state(ae) | b_state(addr));
+		w->ninsert++;
+		if (now % 1024 == 0) {
+			(void)arpt_expire(b_table, now, ~0U);
+			w->nfreed += arpt_reclaim(b_table);
+		}
+	}
+	return (NULL);
+}
+
+static double
+b_elapsed(const struct timespec *t0, const struct timespec *t1)
+{
+
+	return ((t1->tv_sec - t0->tv_sec) * 1e9 +
+	    (t1->tv_nsec - t0->tv_nsec));
+}
+
+int
+main(void)
+{
+	struct timespec t0, t1, ts;
+	unsigned long nlookup, nfound;
+	double ns, rate, base;
+	unsigned int i, k, n;
+	uint32_t addr;
+	arpe *ae;
+
+	ft_log_level = FT_LOG_LEVEL_ERROR;
+	if ((b_table = arpt_new(0, B_WINDOW, NULL, NULL)) == NULL)
+		return (1);
+	for (addr = B_STABLE; addr < B_STABLE + 0x10000; ++addr) {
+		if ((ae = arpt_insert(b_table, addr, B_FOREVER)) == NULL)
+			return (1);
+		arpe_set_state(ae, arpe_state(ae) | b_state(addr));
+	}
+	printf("%7s %12s %12s %8s %8s %12s %10s\n", "readers", "Mlookup/s",
+	    "per reader", "scaling", "found", "writer ins", "freed");
+	base = 0;
+	for (i = 0; i < sizeof b_nreaders / sizeof b_nreaders[0]; ++i) {
+		n = b_nreaders[i];
+		b_stop = 0;
+		b_writer.ninsert = b_writer.nfreed = 0;
+		if (pthread_create(&b_writer.thread, NULL, b_write,
+		    &b_writer) != 0)
+			return (1);
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for (k = 0; k < n; ++k) {
+			b_readers[k].seed = k + 1;
+			b_readers[k].nlookup = b_readers[k].nfound = 0;
+			if (pthread_create(&b_readers[k].thread, NULL, b_read,
+			    &b_readers[k]) != 0)
+				return (1);
+		}
+		ts.tv_sec = B_RUNTIME_MS / 1000;
+		ts.tv_nsec = B_RUNTIME_MS % 1000 * 1000000L;
+		nanosleep(&ts, NULL);
+		__atomic_store_n(&b_stop, 1, __ATOMIC_RELAXED);
+		nlookup = nfound = 0;
+		for (k = 0; k < n; ++k) {
+			pthread_join(b_readers[k].thread, NULL);
+			nlookup += b_readers[k].nlookup;
+			nfound += b_readers[k].nfound;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		pthread_join(b_writer.thread, NULL);
+		ns = b_elapsed(&t0, &t1);
+		rate = nlookup / ns * 1e3;
+		if (base == 0)
+			base = rate;
+		printf("%7u %12.2f %12.2f %7.2fx %7.1f%% %12lu %10lu\n",
+		    n, rate, rate / n, rate / base,
+		    nlookup ? 100.0 * nfound / nlookup : 0.0,
+		    b_writer.ninsert, b_writer.nfreed);
+		if (b_bad) {
+			fprintf(stderr, "readers saw inconsistent entries\n");
+			return (1);
+		}
+	}
+	printf("%ld CPUs online\n", sysconf(_SC_NPROCESSORS_ONLN));
+	arpt_destroy(b_table);
+	return (0);
+}
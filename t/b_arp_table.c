@@ -0,0 +1,256 @@
+/*-
+ * Copyright (c) 2018 The University of Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * ARP table memory footprint and lookup cost, comparing the hash table
+ * with the 16-ary tree it replaced, which is reproduced here, for
+ * address sets of various shapes.  Memory does not include allocator
+ * overhead, which only makes the tree, with its many small nodes, look
+ * better than it is.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <ft/arp.h>
+#include <ft/epoch.h>
+#include <ft/log.h>
+
+#define B_NADDR		65536
+#define B_NLOOKUP	(4UL * 1024 * 1024)
+
+/* the intervals flytrap uses */
+#define B_STALE		30000
+#define B_EXPIRE	300000
+
+/*
+ * The tree, as it was: one node per /4, /8, ... /32, each with sixteen
+ * child pointers, leaves included.
+ */
+struct b_arpn {
+	ft_epoch_entry	 ee;
+	uint8_t		 plen;
+	union {
+		arpe		 e;
+		struct {
+			uint32_t	 addr;
+			uint64_t	 oldest;
+			uint64_t	 newest;
+			struct b_arpn	*sub[16];
+		};
+	};
+};
+
+static unsigned long b_nnodes;
+
+static struct b_arpn *
+b_tree_insert(struct b_arpn *n, uint32_t addr, uint64_t now)
+{
+	struct b_arpn *sn;
+	unsigned int sub;
+
+	while (n->plen < 32) {
+		sub = (addr >> (28 - n->plen)) % 16;
+		if ((sn = n->sub[sub]) == NULL) {
+			if ((sn = calloc(1, sizeof *sn)) == NULL)
+				abort();
+			b_nnodes++;
+			sn->plen = n->plen + 4;
+			if (sn->plen == 32) {
+				sn->e.addr = addr;
+				sn->e.first = ARPT_NEVER;
+			} else {
+				sn->addr = addr & -(1 << (32 - sn->plen));
+				sn->oldest = ARPT_NEVER;
+			}
+			__atomic_store_n(&n->sub[sub], sn, __ATOMIC_RELEASE);
+		}
+		if (now > n->newest)
+			n->newest = now;
+		n = sn;
+	}
+	if (now < n->e.first)
+		n->e.first = now;
+	if (now > n->e.last)
+		n->e.last = now;
+	return (n);
+}
+
+static int
+b_tree_lookup(const struct b_arpn *n, uint32_t addr, arpe *copy)
+{
+	int shift;
+
+	ft_epoch_enter();
+	for (shift = 28; shift >= 0 && n != NULL; shift -= 4)
+		n = __atomic_load_n(&n->sub[(addr >> shift) % 16],
+		    __ATOMIC_ACQUIRE);
+	if (n != NULL) {
+		copy->addr = addr;
+		copy->nreq = arpe_nreq(&n->e);
+		copy->last = arpe_last(&n->e);
+		copy->state = arpe_state(&n->e);
+	}
+	ft_epoch_exit();
+	return (n != NULL ? 0 : -1);
+}
+
+static void
+b_tree_free(struct b_arpn *n)
+{
+	unsigned int i;
+
+	if (n->plen < 32)
+		for (i = 0; i < 16; ++i)
+			if (n->sub[i] != NULL)
+				b_tree_free(n->sub[i]);
+	free(n);
+}
+
+static const struct {
+	const char	*name;
+	uint32_t	 base;
+	uint32_t	 mask;
+	unsigned int	 n;
+} b_sets[] = {
+	{ "full /24",		0x0a000000U, 0x000000ffU, 256 },
+	{ "full /20",		0x0a000000U, 0x00000fffU, 4096 },
+	{ "full /16",		0x0a000000U, 0x0000ffffU, 65536 },
+	{ "64k in a /8",	0x0a000000U, 0x00ffffffU, 65536 },
+};
+
+static uint32_t b_addr[B_NADDR];
+static uint32_t b_miss[B_NADDR];
+
+static double
+b_elapsed(const struct timespec *t0, const struct timespec *t1)
+{
+
+	return ((t1->tv_sec - t0->tv_sec) * 1e9 +
+	    (t1->tv_nsec - t0->tv_nsec));
+}
+
+int
+main(void)
+{
+	struct timespec t0, t1;
+	double tins, hins, thit, hhit, tmiss, hmiss;
+	struct b_arpn *root;
+	unsigned long k;
+	arpe copy;
+	unsigned int i, n;
+	size_t tmem, hmem;
+	volatile int sink;
+	arpt *t;
+	int sum;
+
+	ft_log_level = FT_LOG_LEVEL_ERROR;
+	printf("%-12s %7s %10s %10s %7s %7s %7s %7s %7s %7s\n", "",
+	    "", "tree", "hash", "insert", "ns", "hit", "ns", "miss", "ns");
+	printf("%-12s %7s %10s %10s %7s %7s %7s %7s %7s %7s\n", "set",
+	    "entries", "bytes", "bytes", "tree", "hash", "tree", "hash",
+	    "tree", "hash");
+	for (i = 0; i < sizeof b_sets / sizeof b_sets[0]; ++i) {
+		n = b_sets[i].n;
+		for (k = 0; k < n; ++k) {
+			if (b_sets[i].mask + 1 == n)
+				b_addr[k] = b_sets[i].base | k;
+			else
+				b_addr[k] = b_sets[i].base |
+				    (random() & b_sets[i].mask);
+			/* 11.0.0.0/8 is never in the table */
+			b_miss[k] = 0x0b000000U | (random() & 0x00ffffffU);
+		}
+
+		if ((root = calloc(1, sizeof *root)) == NULL)
+			return (1);
+		b_nnodes = 1;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for (k = 0; k < n; ++k)
+			b_tree_insert(root, b_addr[k], k);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		tins = b_elapsed(&t0, &t1) / n;
+		tmem = b_nnodes * sizeof *root;
+
+		if ((t = arpt_new(B_STALE, B_EXPIRE, NULL, NULL)) == NULL)
+			return (1);
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for (k = 0; k < n; ++k)
+			if (arpt_insert(t, b_addr[k], k) == NULL)
+				return (1);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		hins = b_elapsed(&t0, &t1) / n;
+		(void)arpt_reclaim(t);
+		hmem = arpt_memory(t);
+
+		sum = 0;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for (k = 0; k < B_NLOOKUP; ++k)
+			sum += b_tree_lookup(root, b_addr[k % n], &copy);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		thit = b_elapsed(&t0, &t1) / B_NLOOKUP;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for (k = 0; k < B_NLOOKUP; ++k)
+			sum += arpt_lookup(t, b_addr[k % n], &copy);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		hhit = b_elapsed(&t0, &t1) / B_NLOOKUP;
+		if (sum != 0) {
+			fprintf(stderr, "lookup failed\n");
+			return (1);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for (k = 0; k < B_NLOOKUP; ++k)
+			sum += b_tree_lookup(root, b_miss[k % n], &copy);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		tmiss = b_elapsed(&t0, &t1) / B_NLOOKUP;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for (k = 0; k < B_NLOOKUP; ++k)
+			sum += arpt_lookup(t, b_miss[k % n], &copy);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		hmiss = b_elapsed(&t0, &t1) / B_NLOOKUP;
+		sink = sum;
+		if (sink != -2 * (int)B_NLOOKUP) {
+			fprintf(stderr, "lookup succeeded\n");
+			return (1);
+		}
+
+		printf("%-12s %7lu %10zu %10zu %7.1f %7.1f %7.1f %7.1f "
+		    "%7.1f %7.1f\n", b_sets[i].name, arpt_count(t),
+		    tmem, hmem, tins, hins, thit, hhit, tmiss, hmiss);
+		b_tree_free(root);
+		arpt_destroy(t);
+	}
+	return (0);
+}
@@ -0,0 +1,118 @@
+/*-
+ * Copyright (c) 2016-2018 The University of Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Checksum throughput for typical packet sizes, comparing ip4_cksum()
+ * with a plain one-word-at-a-time loop.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <ft/ip4.h>
+
+#define B_BUFLEN	2048
+#define B_BYTES		(256UL * 1024 * 1024)
+
+static const size_t b_sizes[] = {
+	20, 40, 64, 128, 256, 512, 576, 1024, 1280, 1500,
+};
+
+static uint8_t b_buf[B_BUFLEN];
+
+static uint16_t
+b_ip4_cksum_ref(uint16_t isum, const void *data, size_t len)
+{
+	const uint8_t *p;
+	uint32_t sum;
+
+	for (p = data, sum = isum; len > 1; len -= 2, p += 2)
+		sum += p[0] << 8 | p[1];
+	if (len)
+		sum += p[0] << 8;
+	while (sum > 0xffff)
+		sum -= 0xffff;
+	return (sum);
+}
+
+/*
+ * Time a checksum function over enough iterations to process a fixed
+ * amount of data, and return the time per call in nanoseconds.
+ */
+static double
+b_run(uint16_t (*f)(uint16_t, const void *, size_t), size_t len,
+    volatile uint16_t *sink)
+{
+	struct timespec t0, t1;
+	unsigned long k, n;
+	uint16_t sum;
+
+	n = B_BYTES / len;
+	sum = 0;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (k = 0; k < n; ++k)
+		sum += f(sum, b_buf + (k & 1), len);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	*sink = sum;
+	return (((t1.tv_sec - t0.tv_sec) * 1e9 +
+	    (t1.tv_nsec - t0.tv_nsec)) / n);
+}
+
+int
+main(void)
+{
+	volatile uint16_t sink;
+	double tref, tnew;
+	unsigned int i;
+	size_t len;
+
+	for (len = 0; len < B_BUFLEN; ++len)
+		b_buf[len] = random();
+	printf("%6s %12s %12s %8s %10s\n",
+	    "bytes", "ref ns", "ip4_cksum ns", "speedup", "GB/s");
+	for (i = 0; i < sizeof b_sizes / sizeof b_sizes[0]; ++i) {
+		len = b_sizes[i];
+		if (b_ip4_cksum_ref(0, b_buf, len) != ip4_cksum(0, b_buf, len)) {
+			fprintf(stderr, "checksum mismatch at %zu bytes\n", len);
+			return (1);
+		}
+		tref = b_run(b_ip4_cksum_ref, len, &sink);
+		tnew = b_run(ip4_cksum, len, &sink);
+		printf("%6zu %12.1f %12.1f %7.1fx %10.2f\n",
+		    len, tref, tnew, tref / tnew, len / tnew);
+	}
+	return (0);
+}
@@ -0,0 +1,117 @@
+/*-
+ * Copyright (c) 2018 The University of Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Address set lookup throughput, comparing one ip4s_lookup() per
+ * address with ip4s_lookup_batch() over a packet batch's worth of
+ * addresses, for sets of increasing fragmentation.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <ft/ip4.h>
+
+#define B_BATCH		64
+#define B_NADDR		(1U << 20)
+#define B_NLOOKUP	(16UL * 1024 * 1024)
+
+/* number of /28 holes punched into a /8 */
+static const unsigned int b_holes[] = {
+	0, 16, 256, 4096, 65536,
+};
+
+static uint32_t b_addr[B_NADDR];
+static int b_res[B_NADDR];
+
+static double
+b_elapsed(const struct timespec *t0, const struct timespec *t1)
+{
+
+	return ((t1->tv_sec - t0->tv_sec) * 1e9 +
+	    (t1->tv_nsec - t0->tv_nsec));
+}
+
+int
+main(void)
+{
+	struct timespec t0, t1;
+	volatile int sink;
+	double tone, tbatch;
+	unsigned long k, n;
+	unsigned int i, j;
+	ip4s_node *set;
+	uint32_t a;
+	int sum;
+
+	for (k = 0; k < B_NADDR; ++k)
+		b_addr[k] = 0x0a000000U | (random() & 0x00ffffffU);
+	printf("%6s %8s %12s %12s %8s\n",
+	    "holes", "present", "single ns", "batch ns", "speedup");
+	for (i = 0; i < sizeof b_holes / sizeof b_holes[0]; ++i) {
+		if ((set = ip4s_new()) == NULL ||
+		    ip4s_insert(set, 0x0a000000U, 0x0affffffU) != 0)
+			return (1);
+		for (j = 0; j < b_holes[i]; ++j) {
+			a = 0x0a000000U | (random() & 0x00fffff0U);
+			if (ip4s_remove(set, a, a + 15) != 0)
+				return (1);
+		}
+		n = B_NLOOKUP;
+		sum = 0;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for (k = 0; k < n; ++k)
+			sum += ip4s_lookup(set, b_addr[k % B_NADDR]);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		tone = b_elapsed(&t0, &t1) / n;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for (k = 0; k < n; k += B_BATCH)
+			ip4s_lookup_batch(set, b_addr + k % B_NADDR,
+			    b_res + k % B_NADDR, B_BATCH);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		tbatch = b_elapsed(&t0, &t1) / n;
+		for (k = 0; k < B_NADDR; ++k) {
+			if (b_res[k] != ip4s_lookup(set, b_addr[k])) {
+				fprintf(stderr, "lookup mismatch\n");
+				return (1);
+			}
+		}
+		sink = sum;
+		printf("%6u %7.1f%% %12.1f %12.1f %7.1fx\n", b_holes[i],
+		    100.0 * sink / n, tone, tbatch, tone / tbatch);
+		ip4s_destroy(set);
+	}
+	return (0);
+}
@@ -0,0 +1,353 @@
+/*-
+ * Copyright (c) 2018 The University of Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <cryb/test.h>
+
+#include <ft/arp.h>
+#include <ft/log.h>
+
+/* deadlines used by most cases */
+#define T_ARPT_STALE		 30000
+#define T_ARPT_TTL		300000
+
+/* entries in the rebuild case, enough for several rebuilds */
+#define T_ARPT_MANY		  1000
+
+/*
+ * The table hashes addresses the way this does, and starts out with 64
+ * slots.  The cases below use it to find addresses which collide; if
+ * the table changes, they still pass, but test less.
+ */
+#define T_ARPT_SLOT(addr)	(((uint32_t)(addr) * 0x9e3779b1U) >> 26)
+
+static unsigned int t_arpt_ngone;
+
+static void
+t_arpt_gone(const arpe *ae CRYB_UNUSED, void *arg CRYB_UNUSED)
+{
+
+	t_arpt_ngone++;
+}
+
+/*
+ * Fill in n addresses, starting at base, which all hash to the given
+ * slot of a fresh table.
+ */
+static void
+t_arpt_cluster(uint32_t base, unsigned int slot, uint32_t *addr,
+    unsigned int n)
+{
+	unsigned int k;
+
+	for (k = 0; k < n; ++base)
+		if (T_ARPT_SLOT(base) == slot)
+			addr[k++] = base;
+}
+
+/*
+ * A made-up Ethernet address for each IP address, so entries can be
+ * told apart.
+ */
+static uint64_t
+t_arpt_ether(uint32_t addr)
+{
+
+	return (0x020000000000ULL | addr);
+}
+
+/*
+ * Check that an address is in the table with the given Ethernet
+ * address.
+ */
+static int
+t_arpt_found(const arpt *t, uint32_t addr, uint64_t ether)
+{
+	arpe copy;
+
+	if (arpt_lookup(t, addr, &copy) != 0) {
+		t_printv("%08x not found\n", addr);
+		return (0);
+	}
+	return (t_compare_ul(addr, copy.addr) &
+	    t_compare_ul(ether, copy.state & ARPE_ETHER));
+}
+
+/*
+ * Insert an address and give it its Ethernet address.
+ */
+static int
+t_arpt_insert(arpt *t, uint32_t addr, uint64_t now)
+{
+	arpe *ae;
+
+	if ((ae = arpt_insert(t, addr, now)) == NULL)
+		return (0);
+	arpe_set_state(ae, arpe_state(ae) | t_arpt_ether(addr));
+	return (1);
+}
+
+/*
+ * Addresses which hash to the same slot, including the last one so the
+ * probe wraps around, are all found, and one which shares the slot but
+ * was never added is not.
+ */
+static int
+t_arpt_collide(char **desc CRYB_UNUSED, void *arg CRYB_UNUSED)
+{
+	uint32_t addr[9], other[4];
+	unsigned int k;
+	arpe copy;
+	arpt *t;
+	int ret;
+
+	if ((t = arpt_new(T_ARPT_STALE, T_ARPT_TTL, NULL, NULL)) == NULL)
+		return (0);
+	t_arpt_cluster(0x0a000000, 63, addr, 9);
+	t_arpt_cluster(0x0a000000, 0, other, 4);
+	ret = 1;
+	for (k = 0; k < 8; ++k)
+		ret &= t_arpt_insert(t, addr[k], 1000);
+	for (k = 0; k < 4; ++k)
+		ret &= t_arpt_insert(t, other[k], 1000);
+	ret &= t_compare_ul(12, arpt_count(t));
+	for (k = 0; k < 8; ++k)
+		ret &= t_arpt_found(t, addr[k], t_arpt_ether(addr[k]));
+	for (k = 0; k < 4; ++k)
+		ret &= t_arpt_found(t, other[k], t_arpt_ether(other[k]));
+	ret &= t_compare_i(-1, arpt_lookup(t, addr[8], &copy));
+	/* inserting again finds the existing entry */
+	ret &= t_arpt_insert(t, addr[7], 2000);
+	ret &= t_compare_ul(12, arpt_count(t));
+	arpt_destroy(t);
+	return (ret);
+}
+
+/*
+ * An expired entry leaves a dead slot which later probes pass over, and
+ * which the address gets back, blank, if it returns.
+ */
+static int
+t_arpt_reinsert(char **desc CRYB_UNUSED, void *arg CRYB_UNUSED)
+{
+	uint32_t addr[3];
+	arpe copy, *ae;
+	arpt *t;
+	int ret;
+
+	t_arpt_ngone = 0;
+	if ((t = arpt_new(0, 1000, t_arpt_gone, NULL)) == NULL)
+		return (0);
+	t_arpt_cluster(0x0a000000, 63, addr, 3);
+	ret = t_arpt_insert(t, addr[0], 0);
+	ret &= t_arpt_insert(t, addr[1], 500);
+	ret &= t_arpt_insert(t, addr[2], 500);
+	/* only the first has gone unseen for longer than its lifetime */
+	ret &= t_compare_i(0, arpt_expire(t, 1001, ~0U));
+	ret &= t_compare_ul(1, t_arpt_ngone);
+	ret &= t_compare_ul(2, arpt_count(t));
+	ret &= t_compare_i(-1, arpt_lookup(t, addr[0], &copy));
+	ret &= t_arpt_found(t, addr[1], t_arpt_ether(addr[1]));
+	ret &= t_arpt_found(t, addr[2], t_arpt_ether(addr[2]));
+	/* it comes back without what we knew about it before */
+	if ((ae = arpt_insert(t, addr[0], 1100)) == NULL)
+		return (0);
+	ret &= t_compare_ul(addr[0], ae->addr);
+	ret &= t_compare_ul(ARPE_LIVE, arpe_state(ae));
+	ret &= t_compare_ul(0, ae->nreq);
+	ret &= t_compare_ul(3, arpt_count(t));
+	ret &= t_arpt_found(t, addr[0], 0);
+	/* and expires again on its own schedule */
+	ret &= t_compare_i(0, arpt_expire(t, 1501, ~0U));
+	ret &= t_compare_ul(3, t_arpt_ngone);
+	ret &= t_arpt_found(t, addr[0], 0);
+	ret &= t_compare_i(0, arpt_expire(t, 2101, ~0U));
+	ret &= t_compare_ul(4, t_arpt_ngone);
+	ret &= t_compare_ul(0, arpt_count(t));
+	arpt_destroy(t);
+	return (ret);
+}
+
+/*
+ * The table grows as it fills up, keeping every live entry and dropping
+ * the dead ones.
+ */
+static int
+t_arpt_rebuild(char **desc CRYB_UNUSED, void *arg CRYB_UNUSED)
+{
+	unsigned long nfreed;
+	uint32_t addr;
+	unsigned int k;
+	size_t mem;
+	arpe copy;
+	arpt *t;
+	int ret;
+
+	t_arpt_ngone = 0;
+	if ((t = arpt_new(0, 1000, t_arpt_gone, NULL)) == NULL)
+		return (0);
+	mem = arpt_memory(t);
+	ret = 1;
+	/* the first half will have expired by the time the rest arrive */
+	for (k = 0; k < T_ARPT_MANY / 2; ++k)
+		ret &= t_arpt_insert(t, 0x0a000000 + k, 0);
+	ret &= t_compare_i(0, arpt_expire(t, 1001, ~0U));
+	ret &= t_compare_ul(T_ARPT_MANY / 2, t_arpt_ngone);
+	for (k = T_ARPT_MANY / 2; k < T_ARPT_MANY; ++k)
+		ret &= t_arpt_insert(t, 0x0a000000 + k, 1001);
+	ret &= t_compare_ul(T_ARPT_MANY / 2, arpt_count(t));
+	for (k = 0; k < T_ARPT_MANY / 2; ++k) {
+		addr = 0x0a000000 + k;
+		ret &= t_compare_i(-1, arpt_lookup(t, addr, &copy));
+	}
+	for (k = T_ARPT_MANY / 2; k < T_ARPT_MANY; ++k) {
+		addr = 0x0a000000 + k;
+		ret &= t_arpt_found(t, addr, t_arpt_ether(addr));
+	}
+	/*
+	 * The old arrays are no longer needed, but each call only moves
+	 * the epoch on once, and they are only freed after two.
+	 */
+	for (nfreed = 0, k = 0; k < 3; ++k)
+		nfreed += arpt_reclaim(t);
+	if (nfreed == 0) {
+		t_printv("nothing to reclaim\n");
+		ret = 0;
+	}
+	if (arpt_memory(t) <= mem) {
+		t_printv("table did not grow\n");
+		ret = 0;
+	}
+	arpt_destroy(t);
+	ret &= t_compare_ul(T_ARPT_MANY, t_arpt_ngone);
+	return (ret);
+}
+
+/*
+ * An entry's request count is cleared once it goes stale, and the entry
+ * is removed once it expires, unless it is seen again in the meantime.
+ */
+static int
+t_arpt_expire(char **desc CRYB_UNUSED, void *arg CRYB_UNUSED)
+{
+	arpe copy, *ae;
+	arpt *t;
+	int ret;
+
+	t_arpt_ngone = 0;
+	if ((t = arpt_new(T_ARPT_STALE, T_ARPT_TTL, t_arpt_gone,
+	    NULL)) == NULL)
+		return (0);
+	ret = 1;
+	if ((ae = arpt_insert(t, 0x0a000001, 1000)) == NULL)
+		return (0);
+	arpe_set_nreq(ae, 2);
+	if ((ae = arpt_insert(t, 0x0a000002, 1000)) == NULL)
+		return (0);
+	arpe_set_nreq(ae, 2);
+	ret &= t_compare_i(0, arpt_expire(t, 1000 + T_ARPT_STALE - 1, ~0U));
+	ret &= t_compare_i(0, arpt_lookup(t, 0x0a000001, &copy));
+	ret &= t_compare_ul(2, copy.nreq);
+	/* seen again once stale, before the timer has caught up */
+	if ((ae = arpt_insert(t, 0x0a000002, 1000 + T_ARPT_STALE)) == NULL)
+		return (0);
+	ret &= t_compare_ul(0, ae->nreq);
+	ret &= t_compare_i(0, arpt_expire(t, 1000 + T_ARPT_STALE, ~0U));
+	ret &= t_compare_i(0, arpt_lookup(t, 0x0a000001, &copy));
+	ret &= t_compare_ul(0, copy.nreq);
+	ret &= t_compare_ul(2, arpt_count(t));
+	/* only the one seen at the start expires */
+	ret &= t_compare_i(0, arpt_expire(t, 1000 + T_ARPT_TTL, ~0U));
+	ret &= t_compare_ul(2, arpt_count(t));
+	ret &= t_compare_i(0, arpt_expire(t, 1000 + T_ARPT_TTL + 1, ~0U));
+	ret &= t_compare_ul(1, arpt_count(t));
+	ret &= t_compare_ul(1, t_arpt_ngone);
+	ret &= t_compare_i(-1, arpt_lookup(t, 0x0a000001, &copy));
+	ret &= t_compare_i(0, arpt_lookup(t, 0x0a000002, &copy));
+	ret &= t_compare_i(0, arpt_expire(t,
+	    1000 + T_ARPT_STALE + T_ARPT_TTL + 1, ~0U));
+	ret &= t_compare_ul(0, arpt_count(t));
+	ret &= t_compare_ul(2, t_arpt_ngone);
+	arpt_destroy(t);
+	return (ret);
+}
+
+/*
+ * Expiry with a limited amount of work per run gets there in the end.
+ */
+static int
+t_arpt_expire_limited(char **desc CRYB_UNUSED, void *arg CRYB_UNUSED)
+{
+	unsigned int k, nruns;
+	arpt *t;
+	int ret;
+
+	t_arpt_ngone = 0;
+	if ((t = arpt_new(0, 1000, t_arpt_gone, NULL)) == NULL)
+		return (0);
+	ret = 1;
+	for (k = 0; k < 100; ++k)
+		ret &= t_arpt_insert(t, 0x0a000000 + k, k);
+	for (nruns = 1; arpt_expire(t, 2000, 10) != 0; ++nruns)
+		/* nothing */ ;
+	if (nruns < 10) {
+		t_printv("only %u runs\n", nruns);
+		ret = 0;
+	}
+	ret &= t_compare_ul(100, t_arpt_ngone);
+	ret &= t_compare_ul(0, arpt_count(t));
+	arpt_destroy(t);
+	return (ret);
+}
+
+static int
+t_prepare(int argc CRYB_UNUSED, char *argv[] CRYB_UNUSED)
+{
+
+	ft_log_level = FT_LOG_LEVEL_ERROR;
+	t_add_test(t_arpt_collide, NULL, "collisions");
+	t_add_test(t_arpt_reinsert, NULL, "expire and reinsert");
+	t_add_test(t_arpt_rebuild, NULL, "rebuild");
+	t_add_test(t_arpt_expire, NULL, "stale and expired");
+	t_add_test(t_arpt_expire_limited, NULL, "limited work");
+	return (0);
+}
+
+int
+main(int argc, char *argv[])
+{
+
+	t_main(t_prepare, NULL, argc, argv);
+}
@@ -0,0 +1,291 @@
+/*-
+ * Copyright (c) 2016-2018 The University of Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <ft/endian.h>
+#include <ft/ip4.h>
+
+#include <cryb/test.h>
+
+static int
+t_compare_cksum(uint16_t e, uint16_t r)
+{
+
+	if (e != r) {
+		t_printv("expected 0x%04x\n"
+		    "received 0x%04x\n", e, r);
+		return (0);
+	}
+	return (1);
+}
+
+/*
+ * Reference implementation: one big-endian word at a time.
+ */
+static uint16_t
+t_ip4_cksum_ref(uint16_t isum, const uint8_t *p, size_t len)
+{
+	uint32_t sum;
+
+	for (sum = isum; len > 1; len -= 2, p += 2)
+		sum += p[0] << 8 | p[1];
+	if (len)
+		sum += p[0] << 8;
+	while (sum > 0xffff)
+		sum -= 0xffff;
+	return (sum);
+}
+
+#define T_CKSUM_BUFLEN	65536
+static uint8_t t_buf[T_CKSUM_BUFLEN + 8];
+
+static uint32_t t_seed = 0x18110902;
+
+static uint32_t
+t_random(void)
+{
+
+	/* xorshift32 */
+	t_seed ^= t_seed << 13;
+	t_seed ^= t_seed >> 17;
+	t_seed ^= t_seed << 5;
+	return (t_seed);
+}
+
+static struct t_ip4_cksum_data_case {
+	const char		*desc;
+	int			 fill;		/* -1 for random */
+	size_t			 maxlen;
+} t_ip4_cksum_data_cases[] = {
+	{
+		.desc	 = "random data",
+		.fill	 = -1,
+		.maxlen	 = 1600,
+	},
+	{
+		.desc	 = "all zeroes",
+		.fill	 = 0x00,
+		.maxlen	 = 1600,
+	},
+	{
+		.desc	 = "all ones",
+		.fill	 = 0xff,
+		.maxlen	 = 1600,
+	},
+};
+
+/*
+ * Compare ip4_cksum() with the reference implementation for every
+ * length up to the maximum, at every alignment, with and without an
+ * initial sum.
+ */
+static int
+t_ip4_cksum_data(char **desc CRYB_UNUSED, void *arg)
+{
+	struct t_ip4_cksum_data_case *t = arg;
+	uint16_t e, isum, r;
+	size_t len, off;
+
+	for (off = 0; off < 8; ++off) {
+		for (len = 0; len < t->maxlen + 8; ++len)
+			t_buf[len] = t->fill < 0 ? (uint8_t)t_random() : t->fill;
+		for (len = 0; len <= t->maxlen; ++len) {
+			isum = len % 2 ? t_random() : 0;
+			e = t_ip4_cksum_ref(isum, t_buf + off, len);
+			r = ip4_cksum(isum, t_buf + off, len);
+			if (e != r) {
+				t_printv("length %zu offset %zu\n", len, off);
+				return (t_compare_cksum(e, r));
+			}
+		}
+	}
+	return (1);
+}
+
+/*
+ * A buffer far larger than any packet.
+ */
+static int
+t_ip4_cksum_large(char **desc CRYB_UNUSED, void *arg CRYB_UNUSED)
+{
+	size_t len;
+
+	for (len = 0; len < T_CKSUM_BUFLEN; ++len)
+		t_buf[len] = t_random();
+	return (t_compare_cksum(t_ip4_cksum_ref(0, t_buf, T_CKSUM_BUFLEN),
+	    ip4_cksum(0, t_buf, T_CKSUM_BUFLEN)));
+}
+
+/*
+ * Worked example from RFC 1624 section 4.
+ */
+static int
+t_ip4_cksum_rfc1624(char **desc CRYB_UNUSED, void *arg CRYB_UNUSED)
+{
+
+	return (t_compare_cksum(0x0000,
+	    ip4_cksum_update(0xdd2f, 0x5555, 0x3285)));
+}
+
+static struct t_ip4_cksum_case {
+	const char		*desc;
+	uint8_t			 data[20];
+	size_t			 off;		/* offset of changed word */
+	size_t			 size;		/* size of changed word */
+	uint32_t		 to;		/* new value */
+} t_ip4_cksum_cases[] = {
+	{
+		.desc	 = "ttl and proto",
+		.data	 = {
+			0x45, 0x00, 0x00, 0x28, 0x00, 0x00, 0x00, 0x00,
+			0x40, 0x06, 0x00, 0x00, 0xac, 0x10, 0x20, 0x40,
+			0x0a, 0x00, 0x00, 0x01,
+		},
+		.off	 = 8,
+		.size	 = 2,
+		.to	 = 0x3f11,
+	},
+	{
+		.desc	 = "source address",
+		.data	 = {
+			0x45, 0x00, 0x00, 0x28, 0x00, 0x00, 0x00, 0x00,
+			0x40, 0x06, 0x00, 0x00, 0xac, 0x10, 0x20, 0x40,
+			0x0a, 0x00, 0x00, 0x01,
+		},
+		.off	 = 12,
+		.size	 = 4,
+		.to	 = 0xc0a80101,
+	},
+	{
+		.desc	 = "zero to address",
+		.data	 = {
+			0x45, 0x00, 0x00, 0x28, 0x00, 0x00, 0x00, 0x00,
+			0x40, 0x06, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+			0x00, 0x00, 0x00, 0x00,
+		},
+		.off	 = 16,
+		.size	 = 4,
+		.to	 = 0xffffffff,
+	},
+	{
+		.desc	 = "address to zero",
+		.data	 = {
+			0x45, 0x00, 0x00, 0x28, 0x00, 0x00, 0x00, 0x00,
+			0x40, 0x06, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff,
+			0x0a, 0x00, 0x00, 0x01,
+		},
+		.off	 = 12,
+		.size	 = 4,
+		.to	 = 0x00000000,
+	},
+	{
+		.desc	 = "no change",
+		.data	 = {
+			0x45, 0x00, 0x00, 0x54, 0x12, 0x34, 0x40, 0x00,
+			0x40, 0x01, 0x00, 0x00, 0x7f, 0x00, 0x00, 0x01,
+			0x7f, 0x00, 0x00, 0x01,
+		},
+		.off	 = 4,
+		.size	 = 2,
+		.to	 = 0x1234,
+	},
+	{
+		.desc	 = "echo request to reply",
+		.data	 = {
+			0x08, 0x00, 0x00, 0x00, 0x1f, 0x2e, 0x00, 0x01,
+			0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+			0x69, 0x6a, 0x6b, 0x6c,
+		},
+		.off	 = 0,
+		.size	 = 2,
+		.to	 = 0x0000,
+	},
+};
+
+/*
+ * Change a word in a header, update the checksum incrementally, and
+ * compare the result with a checksum computed from scratch.
+ */
+static int
+t_ip4_cksum_update(char **desc CRYB_UNUSED, void *arg)
+{
+	struct t_ip4_cksum_case *t = arg;
+	uint8_t data[sizeof t->data];
+	uint16_t e, r, w;
+	uint32_t q;
+
+	memcpy(data, t->data, sizeof data);
+	r = ~ip4_cksum(0, data, sizeof data);
+	if (t->size == 2) {
+		memcpy(&w, data + t->off, sizeof w);
+		r = ip4_cksum_update(r, be16toh(w), t->to);
+		w = htobe16(t->to);
+		memcpy(data + t->off, &w, sizeof w);
+	} else {
+		memcpy(&q, data + t->off, sizeof q);
+		r = ip4_cksum_update32(r, be32toh(q), t->to);
+		q = htobe32(t->to);
+		memcpy(data + t->off, &q, sizeof q);
+	}
+	e = ~ip4_cksum(0, data, sizeof data);
+	return (t_compare_cksum(e, r));
+}
+
+static int
+t_prepare(int argc CRYB_UNUSED, char *argv[] CRYB_UNUSED)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof t_ip4_cksum_data_cases /
+	    sizeof t_ip4_cksum_data_cases[0]; ++i)
+		t_add_test(t_ip4_cksum_data, &t_ip4_cksum_data_cases[i],
+		    "%s", t_ip4_cksum_data_cases[i].desc);
+	t_add_test(t_ip4_cksum_large, NULL, "large buffer");
+	t_add_test(t_ip4_cksum_rfc1624, NULL, "RFC 1624 example");
+	for (i = 0; i < sizeof t_ip4_cksum_cases /
+	    sizeof t_ip4_cksum_cases[0]; ++i)
+		t_add_test(t_ip4_cksum_update, &t_ip4_cksum_cases[i],
+		    "%s", t_ip4_cksum_cases[i].desc);
+	return (0);
+}
+
+int
+main(int argc, char *argv[])
+{
+
+	t_main(t_prepare, NULL, argc, argv);
+}
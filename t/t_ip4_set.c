@@ -40,6 +40,9 @@
 
 #include "t_ip4.h"
 
+/* maximum number of addresses checked per case */
+#define T_IP4S_MAXADDR	32
+
 static struct t_ip4s_case {
 	const char		*desc;
 	const char		*insert;
@@ -47,6 +50,7 @@ static struct t_ip4s_case {
 	unsigned long		 count;
 	const char		*present;
 	const char		*absent;
+	const char		*ranges;
 } t_ip4s_cases[] = {
 	{
 		.desc		 = "empty",
@@ -57,6 +61,7 @@ static struct t_ip4s_case {
 		.insert		 = "0.0.0.0/0",
 		.count		 = (1UL << 32),
 		.present	 = "0.0.0.0,127.255.255.255,128.0.0.0,255.255.255.255",
+		.ranges		 = "0.0.0.0-255.255.255.255",
 	},
 	{
 		.desc		 = "half full",
@@ -64,6 +69,7 @@ static struct t_ip4s_case {
 		.count		 = (1UL << 31),
 		.present	 = "0.0.0.0,127.255.255.255",
 		.absent		 = "128.0.0.0,255.255.255.255",
+		.ranges		 = "0.0.0.0-127.255.255.255",
 	},
 	{
 		.desc		 = "half empty",
@@ -72,6 +78,7 @@ static struct t_ip4s_case {
 		.count		 = (1UL << 31),
 		.present	 = "0.0.0.0,127.255.255.255",
 		.absent		 = "128.0.0.0,255.255.255.255",
+		.ranges		 = "0.0.0.0-127.255.255.255",
 	},
 	{
 		.desc		 = "single insertion",
@@ -79,6 +86,7 @@ static struct t_ip4s_case {
 		.count		 = 1,
 		.present	 = "172.16.23.42",
 		.absent		 = "0.0.0.0,172.16.23.41,172.16.23.43,255.255.255.255",
+		.ranges		 = "172.16.23.42",
 	},
 	{
 		.desc		 = "single removal",
@@ -87,6 +95,8 @@ static struct t_ip4s_case {
 		.count		 = (1UL << 32) - 1,
 		.present	 = "0.0.0.0,172.16.23.41,172.16.23.43,255.255.255.255",
 		.absent		 = "172.16.23.42",
+		.ranges		 = "0.0.0.0-172.16.23.41,"
+					"172.16.23.43-255.255.255.255",
 	},
 	{
 		.desc		 = "complete removal",
@@ -101,6 +111,7 @@ static struct t_ip4s_case {
 		.count		 = 254,
 		.present	 = "172.16.23.2-172.16.23.255",
 		.absent		 = "172.16.23.0,172.16.23.1",
+		.ranges		 = "172.16.23.2-172.16.23.255",
 	},
 	{
 		.desc		 = "right removal",
@@ -109,6 +120,7 @@ static struct t_ip4s_case {
 		.count		 = 254,
 		.present	 = "172.16.23.0-172.16.23.253",
 		.absent		 = "172.16.23.254,172.16.23.255",
+		.ranges		 = "172.16.23.0-172.16.23.253",
 	},
 	{
 		.desc		 = "partial removal from leaf",
@@ -118,6 +130,8 @@ static struct t_ip4s_case {
 		.present	 = "172.16.16.0-172.16.22.255,"
 					"172.16.24.0-172.16.31.255",
 		.absent		 = "172.16.23.0-172.16.23.255",
+		.ranges		 = "172.16.16.0-172.16.22.255,"
+					"172.16.24.0-172.16.31.255",
 	},
 	{
 		.desc		 = "unaligned insertion",
@@ -125,6 +139,7 @@ static struct t_ip4s_case {
 		.count		 = (1UL << 17),
 		.present	 = "172.16.0.0,172.17.255.255",
 		.absent		 = "0.0.0.0,172.15.255.255,172.18.0.0,255.255.255.255",
+		.ranges		 = "172.16.0.0-172.17.255.255",
 	},
 	{
 		.desc		 = "unaligned removal",
@@ -133,24 +148,29 @@ static struct t_ip4s_case {
 		.count		 = (1UL << 32) - (1UL << 17),
 		.present	 = "0.0.0.0,172.15.255.255,172.18.0.0,255.255.255.255",
 		.absent		 = "172.16.0.0,172.17.255.255",
+		.ranges		 = "0.0.0.0-172.15.255.255,"
+					"172.18.0.0-255.255.255.255",
 	},
 	{
 		.desc		 = "insert into full",
 		.insert		 = "0.0.0.0/0,172.16.0.1/32",
 		.count		 = (1UL << 32),
 		.present	 = "172.16.0.1",
+		.ranges		 = "0.0.0.0-255.255.255.255",
 	},
 	{
 		.desc		 = "insert duplicate",
 		.insert		 = "172.16.0.0/24,172.16.0.1/32",
 		.count		 = (1UL << 8),
 		.present	 = "172.16.0.0,172.16.0.255",
+		.ranges		 = "172.16.0.0/24",
 	},
 	{
 		.desc		 = "aggregate",
 		.insert		 = "172.16.0.0/25,172.16.0.128/25",
 		.count		 = (1UL << 8),
 		.present	 = "172.16.0.0,172.16.0.255",
+		.ranges		 = "172.16.0.0/24",
 	},
 };
 
@@ -158,6 +178,11 @@ static int
 t_ip4s(char **desc CRYB_UNUSED, void *arg)
 {
 	struct t_ip4s_case *t = arg;
+	uint32_t addr[T_IP4S_MAXADDR];
+	uint32_t rfirst[T_IP4S_MAXADDR], rlast[T_IP4S_MAXADDR];
+	int exp[T_IP4S_MAXADDR], res[T_IP4S_MAXADDR];
+	unsigned int k, naddr;
+	unsigned long nranges;
 	ip4_addr first, last;
 	const char *p, *q;
 	ip4s_node *n;
@@ -180,18 +205,45 @@ t_ip4s(char **desc CRYB_UNUSED, void *arg)
 			return (-1);
 	}
 	ret &= t_compare_ul(t->count, ip4s_count(n));
+	naddr = 0;
 	for (p = q = t->present; q != NULL && *q != '\0'; p = q + 1) {
 		q = ip4_parse_range(p, &first, &last);
 		ft_assert(q != NULL && (*q == '\0' || *q == ','));
 		ret &= t_ip4s_present(n, &first);
 		ret &= t_ip4s_present(n, &last);
+		ft_assert(naddr + 2 <= T_IP4S_MAXADDR);
+		addr[naddr] = be32toh(first.q);
+		exp[naddr++] = 1;
+		addr[naddr] = be32toh(last.q);
+		exp[naddr++] = 1;
 	}
 	for (p = q = t->absent; q != NULL && *q != '\0'; p = q + 1) {
 		q = ip4_parse_range(p, &first, &last);
 		ft_assert(q != NULL && (*q == '\0' || *q == ','));
 		ret &= t_ip4s_absent(n, &first);
 		ret &= t_ip4s_absent(n, &last);
+		ft_assert(naddr + 2 <= T_IP4S_MAXADDR);
+		addr[naddr] = be32toh(first.q);
+		exp[naddr++] = 0;
+		addr[naddr] = be32toh(last.q);
+		exp[naddr++] = 0;
+	}
+	/* the batch lookup must agree */
+	ip4s_lookup_batch(n, addr, res, naddr);
+	for (k = 0; k < naddr; ++k)
+		ret &= t_compare_i(exp[k], res[k]);
+	/* and so must the list of ranges */
+	nranges = ip4s_ranges(n, rfirst, rlast, T_IP4S_MAXADDR);
+	k = 0;
+	for (p = q = t->ranges; q != NULL && *q != '\0'; p = q + 1, ++k) {
+		q = ip4_parse_range(p, &first, &last);
+		ft_assert(q != NULL && (*q == '\0' || *q == ','));
+		if (k < nranges) {
+			ret &= t_compare_ul(be32toh(first.q), rfirst[k]);
+			ret &= t_compare_ul(be32toh(last.q), rlast[k]);
+		}
 	}
+	ret &= t_compare_ul(k, nranges);
 	if (!ret && t_verbose)
 		ip4s_fprint(stderr, n);
 	ip4s_destroy(n);
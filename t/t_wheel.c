@@ -0,0 +1,275 @@
+/*-
+ * Copyright (c) 2018 The University of Oslo
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <cryb/test.h>
+
+#include <ft/wheel.h>
+
+/* most timers in a case */
+#define T_WHEEL_MAXTIMERS	4096
+
+static struct t_wheel_case {
+	const char		*desc;
+	uint64_t		 start;		/* clock at first run */
+	uint64_t		 spread;	/* timers due within this */
+	uint64_t		 step;		/* clock advance per run */
+	unsigned int		 ntimers;
+	unsigned int		 max;		/* work per run */
+	unsigned int		 rearm;		/* times each timer fires */
+} t_wheel_cases[] = {
+	{
+		.desc		 = "empty",
+		.start		 = 1000,
+		.spread		 = 1000,
+		.step		 = 100,
+	},
+	{
+		.desc		 = "one",
+		.start		 = 1000,
+		.spread		 = 1000,
+		.step		 = 1,
+		.ntimers	 = 1,
+	},
+	{
+		.desc		 = "same time",
+		.start		 = 1000,
+		.spread		 = 1,
+		.step		 = 1,
+		.ntimers	 = 1000,
+	},
+	{
+		.desc		 = "one level",
+		.start		 = 0,
+		.spread		 = 64,
+		.step		 = 1,
+		.ntimers	 = 256,
+	},
+	{
+		.desc		 = "five minutes",
+		.start		 = 1600000000000ULL,
+		.spread		 = 300000,
+		.step		 = 997,
+		.ntimers	 = T_WHEEL_MAXTIMERS,
+	},
+	{
+		.desc		 = "five minutes, one big step",
+		.start		 = 1600000000000ULL,
+		.spread		 = 300000,
+		.step		 = 300000,
+		.ntimers	 = T_WHEEL_MAXTIMERS,
+	},
+	{
+		.desc		 = "five minutes, limited work",
+		.start		 = 1600000000000ULL,
+		.spread		 = 300000,
+		.step		 = 30000,
+		.ntimers	 = T_WHEEL_MAXTIMERS,
+		.max		 = 16,
+	},
+	{
+		.desc		 = "five minutes, rearmed",
+		.start		 = 1600000000000ULL,
+		.spread		 = 300000,
+		.step		 = 1000,
+		.ntimers	 = T_WHEEL_MAXTIMERS,
+		.max		 = 64,
+		.rearm		 = 3,
+	},
+	{
+		.desc		 = "end of time",
+		.start		 = UINT64_MAX - 100000,
+		.spread		 = 100000,
+		.step		 = 4999,
+		.ntimers	 = 1000,
+	},
+};
+
+struct t_wheel_state {
+	const struct t_wheel_case *t;
+	ft_wheel		*w;
+	uint64_t		 when[T_WHEEL_MAXTIMERS];
+	unsigned int		 nfired[T_WHEEL_MAXTIMERS];
+	int			 ret;
+};
+
+static struct t_wheel_state t_ws;
+
+static int
+t_compare_time(uint64_t expected, uint64_t received)
+{
+
+	if (expected == received)
+		return (1);
+	t_printv("expected %llu\n", (unsigned long long)expected);
+	t_printv("received %llu\n", (unsigned long long)received);
+	return (0);
+}
+
+static void
+t_wheel_fire(uint64_t now, uint64_t when, uint32_t key, void *arg)
+{
+	struct t_wheel_state *ws = arg;
+
+	if (key >= ws->t->ntimers) {
+		t_printv("unknown timer %u\n", key);
+		ws->ret = 0;
+		return;
+	}
+	if (when != ws->when[key] || when > now) {
+		t_printv("timer %u due at %llu fired at %llu\n", key,
+		    (unsigned long long)ws->when[key],
+		    (unsigned long long)now);
+		ws->ret = 0;
+	}
+	/* rearmed timers are due again a little later */
+	if (++ws->nfired[key] < ws->t->rearm) {
+		ws->when[key] = when + 1 + ws->t->spread / 10;
+		if (ft_wheel_add(ws->w, ws->when[key], key) != 0)
+			ws->ret = 0;
+	}
+}
+
+static int
+t_wheel(char **desc CRYB_UNUSED, void *arg)
+{
+	struct t_wheel_state *ws = &t_ws;
+	const struct t_wheel_case *t = arg;
+	unsigned int i, k, nfire;
+	uint32_t seed;
+	uint64_t now, end;
+
+	ws->t = t;
+	ws->ret = 1;
+	nfire = t->rearm > 0 ? t->rearm : 1;
+	if ((ws->w = ft_wheel_new()) == NULL)
+		return (0);
+	for (seed = 1, i = 0; i < t->ntimers; ++i) {
+		seed = seed * 1103515245 + 12345;
+		ws->when[i] = t->start + seed % t->spread;
+		ws->nfired[i] = 0;
+		if (ft_wheel_add(ws->w, ws->when[i], i) != 0)
+			return (0);
+	}
+	ws->ret &= t_compare_ul(t->ntimers, ft_wheel_count(ws->w));
+	end = t->start + (t->spread - 1) + (t->spread / 10 + 1) * (nfire - 1);
+	if (end < t->start)
+		end = UINT64_MAX;
+	for (now = t->start; ; now += t->step) {
+		if (now > end || now < t->start)
+			now = end;
+		k = 0;
+		while (ft_wheel_run(ws->w, now, t->max ? t->max : ~0U,
+		    t_wheel_fire, ws) != 0)
+			k++;
+		if (t->max == 0 && k > 0) {
+			t_printv("unlimited run stopped early\n");
+			ws->ret = 0;
+		}
+		ws->ret &= t_compare_time(now, ft_wheel_now(ws->w));
+		/* everything due by now has fired, nothing else has */
+		for (i = 0; i < t->ntimers; ++i) {
+			if ((ws->nfired[i] < nfire && ws->when[i] <= now) ||
+			    ws->nfired[i] > nfire) {
+				t_printv("timer %u due at %llu fired %u times"
+				    " by %llu\n", i,
+				    (unsigned long long)ws->when[i],
+				    ws->nfired[i], (unsigned long long)now);
+				ws->ret = 0;
+				break;
+			}
+		}
+		if (now == end)
+			break;
+	}
+	for (i = 0; i < t->ntimers; ++i)
+		ws->ret &= t_compare_ul(nfire, ws->nfired[i]);
+	ws->ret &= t_compare_ul(0, ft_wheel_count(ws->w));
+	ft_wheel_destroy(ws->w);
+	return (ws->ret);
+}
+
+/*
+ * The clock does not run backward, and a timer added in the past fires
+ * on the next run.
+ */
+static int
+t_wheel_past(char **desc CRYB_UNUSED, void *arg CRYB_UNUSED)
+{
+	struct t_wheel_state *ws = &t_ws;
+	static const struct t_wheel_case t = { .ntimers = 2 };
+	int ret;
+
+	ws->t = &t;
+	ws->ret = 1;
+	ws->nfired[0] = ws->nfired[1] = 0;
+	if ((ws->w = ft_wheel_new()) == NULL)
+		return (0);
+	ws->when[0] = 5000;
+	ret = t_compare_i(0, ft_wheel_add(ws->w, ws->when[0], 0));
+	ret &= t_compare_i(0, ft_wheel_run(ws->w, 10000, ~0U,
+	    t_wheel_fire, ws));
+	ret &= t_compare_i(0, ft_wheel_run(ws->w, 2000, ~0U,
+	    t_wheel_fire, ws));
+	ret &= t_compare_time(10000, ft_wheel_now(ws->w));
+	ws->when[1] = 3000;
+	ret &= t_compare_i(0, ft_wheel_add(ws->w, ws->when[1], 1));
+	ret &= t_compare_ul(0, ws->nfired[1]);
+	ret &= t_compare_i(0, ft_wheel_run(ws->w, 2000, ~0U,
+	    t_wheel_fire, ws));
+	ret &= t_compare_ul(1, ws->nfired[0]);
+	ret &= t_compare_ul(1, ws->nfired[1]);
+	ft_wheel_destroy(ws->w);
+	return (ret & ws->ret);
+}
+
+static int
+t_prepare(int argc CRYB_UNUSED, char *argv[] CRYB_UNUSED)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof t_wheel_cases / sizeof t_wheel_cases[0]; ++i)
+		t_add_test(t_wheel, &t_wheel_cases[i],
+		    "%s", t_wheel_cases[i].desc);
+	t_add_test(t_wheel_past, NULL, "clock does not run backward");
+	return (0);
+}
+
+int
+main(int argc, char *argv[])
+{
+
+	t_main(t_prepare, NULL, argc, argv);
+}